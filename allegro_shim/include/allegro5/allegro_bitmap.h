@@ -23,6 +23,8 @@ extern "C" {
 #define ALLEGRO_NO_PRELOADING      512
 #define ALLEGRO_HAMT               1024
 #define ALLEGRO_FORCE_INTEGER_SCALE 2048
+#define ALLEGRO_ATLAS_BITMAP       4096
+#define ALLEGRO_CONVERT_BITMAP     8192
 
 #define ALLEGRO_FLIP_HORIZONTAL    1
 #define ALLEGRO_FLIP_VERTICAL      2
@@ -50,8 +52,32 @@ extern "C" {
 #define ALLEGRO_PIXEL_FORMAT_ABGR_F32             20
 #define ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE        21
 
+#define ALLEGRO_LOCK_READWRITE     0
+#define ALLEGRO_LOCK_READONLY      1
+#define ALLEGRO_LOCK_WRITEONLY     2
+
 typedef struct ALLEGRO_BITMAP ALLEGRO_BITMAP;
 
+/* One entry for al_draw_bitmap_instances: the source region (sx, sy, sw, sh)
+ * is drawn with its pivot (cx, cy) at (dx, dy), scaled and then rotated by
+ * angle radians around the pivot. */
+typedef struct ALLEGRO_BITMAP_INSTANCE {
+    float sx, sy, sw, sh;
+    float cx, cy;
+    float dx, dy;
+    float xscale, yscale;
+    float angle;
+    ALLEGRO_COLOR tint;
+    int flags;
+} ALLEGRO_BITMAP_INSTANCE;
+
+typedef struct ALLEGRO_LOCKED_REGION {
+    void* data;
+    int format;
+    int pitch;
+    int pixel_size;
+} ALLEGRO_LOCKED_REGION;
+
 ALLEGRO_BITMAP* al_create_bitmap(int w, int h);
 void al_destroy_bitmap(ALLEGRO_BITMAP* bitmap);
 int al_get_bitmap_width(ALLEGRO_BITMAP* bitmap);
@@ -66,7 +92,13 @@ void al_set_new_bitmap_format(int format);
 int al_get_new_bitmap_format(void);
 bool al_is_compatible_bitmap(ALLEGRO_BITMAP* bitmap);
 ALLEGRO_BITMAP* al_clone_bitmap(ALLEGRO_BITMAP* bitmap);
+ALLEGRO_BITMAP* al_create_sub_bitmap(ALLEGRO_BITMAP* parent, int x, int y, int w, int h);
+bool al_is_sub_bitmap(ALLEGRO_BITMAP* bitmap);
+ALLEGRO_BITMAP* al_get_parent_bitmap(ALLEGRO_BITMAP* bitmap);
+int al_get_bitmap_x(ALLEGRO_BITMAP* bitmap);
+int al_get_bitmap_y(ALLEGRO_BITMAP* bitmap);
 void al_convert_bitmap(ALLEGRO_BITMAP* bitmap);
+void al_convert_memory_bitmaps(void);
 ALLEGRO_BITMAP* al_get_backbuffer(ALLEGRO_DISPLAY* display);
 void al_set_target_backbuffer(ALLEGRO_DISPLAY* display);
 
@@ -75,11 +107,24 @@ void al_draw_bitmap_region(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw,
 void al_draw_scaled_bitmap(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw, float sh, float dx, float dy, float dw, float dh, int flags);
 void al_draw_tinted_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float dx, float dy, int flags);
 void al_draw_tinted_scaled_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, float dw, float dh, int flags);
+void al_draw_tinted_bitmap_region(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, int flags);
+void al_draw_rotated_bitmap(ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy, float angle, int flags);
+void al_draw_scaled_rotated_bitmap(ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy, float xscale, float yscale, float angle, int flags);
+void al_draw_tinted_rotated_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float cx, float cy, float dx, float dy, float angle, int flags);
+void al_draw_tinted_scaled_rotated_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float cx, float cy, float dx, float dy, float xscale, float yscale, float angle, int flags);
+void al_draw_tinted_scaled_rotated_bitmap_region(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw, float sh, ALLEGRO_COLOR tint, float cx, float cy, float dx, float dy, float xscale, float yscale, float angle, int flags);
+void al_draw_bitmap_instances(ALLEGRO_BITMAP* bitmap, const ALLEGRO_BITMAP_INSTANCE* instances, int count);
 
 void al_put_pixel(float x, float y, ALLEGRO_COLOR color);
 void al_put_blended_pixel(float x, float y, ALLEGRO_COLOR color);
 void al_get_pixel(ALLEGRO_BITMAP* bitmap, float x, float y, ALLEGRO_COLOR* color);
 
+ALLEGRO_LOCKED_REGION* al_lock_bitmap(ALLEGRO_BITMAP* bitmap, int format, int flags);
+ALLEGRO_LOCKED_REGION* al_lock_bitmap_region(ALLEGRO_BITMAP* bitmap, int x, int y, int width, int height, int format, int flags);
+void al_unlock_bitmap(ALLEGRO_BITMAP* bitmap);
+bool al_is_bitmap_locked(ALLEGRO_BITMAP* bitmap);
+int al_get_pixel_size(int format);
+
 void al_set_clipping_rectangle(float x, float y, float w, float h);
 void al_get_clipping_rectangle(float* x, float* y, float* w, float* h);
 void al_reset_clipping_rectangle(void);
@@ -20,6 +20,8 @@ extern "C" {
 #define ALLEGRO_DEST_COLOR                  5
 #define ALLEGRO_INVERSE_SRC_COLOR          6
 #define ALLEGRO_INVERSE_DEST_COLOR         7
+/* Not supported: SDL has no constant blend colour, and blenders using
+ * these factors are ignored. */
 #define ALLEGRO_CONST_COLOR                8
 #define ALLEGRO_INVERSE_CONST_COLOR        9
 
@@ -21,9 +21,20 @@ extern "C" {
 #define ALLEGRO_MAXIMIZED        128
 
 typedef struct ALLEGRO_DISPLAY ALLEGRO_DISPLAY;
+typedef struct ALLEGRO_EVENT_SOURCE ALLEGRO_EVENT_SOURCE;
+
+typedef struct ALLEGRO_RENDER_STATE_STATS {
+    uint64_t issued;
+    uint64_t elided_draw_color;
+    uint64_t elided_blend_mode;
+    uint64_t elided_render_target;
+    uint64_t elided_clip_rect;
+    uint64_t elided_texture_mod;
+} ALLEGRO_RENDER_STATE_STATS;
 
 ALLEGRO_DISPLAY* al_create_display(int w, int h);
 void al_destroy_display(ALLEGRO_DISPLAY* display);
+ALLEGRO_EVENT_SOURCE* al_get_display_event_source(ALLEGRO_DISPLAY* display);
 ALLEGRO_DISPLAY* al_get_current_display(void);
 void al_set_current_display(ALLEGRO_DISPLAY* display);
 int al_get_display_width(ALLEGRO_DISPLAY* display);
@@ -54,6 +65,9 @@ int al_get_display_adapter(ALLEGRO_DISPLAY* display);
 void al_hold_bitmap_drawing(bool hold);
 bool al_is_bitmap_drawing_held(void);
 
+void al_get_render_state_stats(ALLEGRO_DISPLAY* display, ALLEGRO_RENDER_STATE_STATS* stats);
+void al_reset_render_state_stats(ALLEGRO_DISPLAY* display);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,18 +9,42 @@
 extern "C" {
 #endif
 
+enum ALLEGRO_LINE_JOIN {
+    ALLEGRO_LINE_JOIN_NONE,
+    ALLEGRO_LINE_JOIN_BEVEL,
+    ALLEGRO_LINE_JOIN_ROUND,
+    ALLEGRO_LINE_JOIN_MITER
+};
+
+enum ALLEGRO_LINE_CAP {
+    ALLEGRO_LINE_CAP_NONE,
+    ALLEGRO_LINE_CAP_SQUARE,
+    ALLEGRO_LINE_CAP_ROUND,
+    ALLEGRO_LINE_CAP_TRIANGLE,
+    ALLEGRO_LINE_CAP_CLOSED
+};
+
 void al_draw_filled_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color);
 void al_draw_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, float thickness);
+void al_draw_filled_rounded_rectangle(float x1, float y1, float x2, float y2, float rx, float ry, ALLEGRO_COLOR color);
+void al_draw_rounded_rectangle(float x1, float y1, float x2, float y2, float rx, float ry, ALLEGRO_COLOR color, float thickness);
 void al_draw_line(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, float thickness);
+void al_draw_filled_circle(float cx, float cy, float r, ALLEGRO_COLOR color);
 void al_draw_circle(float cx, float cy, float r, ALLEGRO_COLOR color, float thickness);
 void al_draw_filled_ellipse(float cx, float cy, float rx, float ry, ALLEGRO_COLOR color);
 void al_draw_ellipse(float cx, float cy, float rx, float ry, ALLEGRO_COLOR color, float thickness);
 void al_draw_arc(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color, float thickness);
+void al_draw_filled_pieslice(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color);
+void al_draw_pieslice(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color, float thickness);
 void al_draw_triangle(float x1, float y1, float x2, float y2, float x3, float y3, ALLEGRO_COLOR color, float thickness);
 void al_draw_filled_triangle(float x1, float y1, float x2, float y2, float x3, float y3, ALLEGRO_COLOR color);
 void al_draw_polygon(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color, float thickness);
 void al_draw_filled_polygon(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color);
+void al_draw_filled_polygon_with_holes(const float* vertices, const int* vertex_counts, ALLEGRO_COLOR color);
+bool al_triangulate_polygon(const float* vertices, size_t vertex_stride, const int* vertex_counts,
+                            void (*emit_triangle)(int, int, int, void*), void* userdata);
 void al_draw_polyline(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color, float thickness, bool closed);
+void al_draw_polyline_ex(const float* vertices, int vertex_stride, int vertex_count, int join_style, int cap_style, ALLEGRO_COLOR color, float thickness, float miter_limit);
 
 void al_draw_pixel(float x, float y, ALLEGRO_COLOR color);
 
@@ -8,47 +8,62 @@
 extern "C" {
 #endif
 
-#define ALLEGRO_EVENT_ANY                      0
-#define ALLEGRO_EVENT_JOYSTICK                 1
-#define ALLEGRO_EVENT_KEYBOARD                 2
-#define ALLEGRO_EVENT_MOUSE                    3
-#define ALLEGRO_EVENT_TIMER                    4
-#define ALLEGRO_EVENT_DISPLAY                  5
-
+/* Event types carry Allegro's own values, so every type is distinct and
+ * events from different sources can share one queue. */
 #define ALLEGRO_EVENT_JOYSTICK_AXIS            1
-#define ALLEGRO_EVENT_JOYSTICK_BUTTON_UP       2
-#define ALLEGRO_EVENT_JOYSTICK_BUTTON_DOWN     3
-#define ALLEGRO_EVENT_JOYSTICK_CONFIGURATION  4
-
-#define ALLEGRO_EVENT_KEY_DOWN                 1
-#define ALLEGRO_EVENT_KEY_UP                   2
-#define ALLEGRO_EVENT_KEY_CHAR                 3
-
-#define ALLEGRO_EVENT_MOUSE_AXES               1
-#define ALLEGRO_EVENT_MOUSE_BUTTON_DOWN        2
-#define ALLEGRO_EVENT_MOUSE_BUTTON_UP          3
-#define ALLEGRO_EVENT_MOUSE_ENTER_DISPLAY    4
-#define ALLEGRO_EVENT_MOUSE_LEAVE_DISPLAY     5
-#define ALLEGRO_EVENT_MOUSE_WARPED             6
-
-#define ALLEGRO_EVENT_TIMER                    1
-
-#define ALLEGRO_EVENT_DISPLAY_EXPOSE           1
-#define ALLEGRO_EVENT_DISPLAY_RESIZE           2
-#define ALLEGRO_EVENT_DISPLAY_CLOSE            3
-#define ALLEGRO_EVENT_DISPLAY_FOCUS_LOST      4
-#define ALLEGRO_EVENT_DISPLAY_FOCUS_GAINED     5
-#define ALLEGRO_EVENT_DISPLAY_SWITCH_OUT       6
-#define ALLEGRO_EVENT_DISPLAY_SWITCH_IN        7
+#define ALLEGRO_EVENT_JOYSTICK_BUTTON_DOWN     2
+#define ALLEGRO_EVENT_JOYSTICK_BUTTON_UP       3
+#define ALLEGRO_EVENT_JOYSTICK_CONFIGURATION   4
+
+#define ALLEGRO_EVENT_KEY_DOWN                 10
+#define ALLEGRO_EVENT_KEY_CHAR                 11
+#define ALLEGRO_EVENT_KEY_UP                   12
+
+#define ALLEGRO_EVENT_MOUSE_AXES               20
+#define ALLEGRO_EVENT_MOUSE_BUTTON_DOWN        21
+#define ALLEGRO_EVENT_MOUSE_BUTTON_UP          22
+#define ALLEGRO_EVENT_MOUSE_ENTER_DISPLAY      23
+#define ALLEGRO_EVENT_MOUSE_LEAVE_DISPLAY      24
+#define ALLEGRO_EVENT_MOUSE_WARPED             25
+
+#define ALLEGRO_EVENT_TIMER                    30
+
+#define ALLEGRO_EVENT_DISPLAY_EXPOSE           40
+#define ALLEGRO_EVENT_DISPLAY_RESIZE           41
+#define ALLEGRO_EVENT_DISPLAY_CLOSE            42
+#define ALLEGRO_EVENT_DISPLAY_LOST             43
+#define ALLEGRO_EVENT_DISPLAY_FOUND            44
+#define ALLEGRO_EVENT_DISPLAY_SWITCH_IN        45
+#define ALLEGRO_EVENT_DISPLAY_SWITCH_OUT       46
+#define ALLEGRO_EVENT_DISPLAY_ORIENTATION      47
+
+/* Focus changes are Allegro's display switch events. */
+#define ALLEGRO_EVENT_DISPLAY_FOCUS_GAINED     ALLEGRO_EVENT_DISPLAY_SWITCH_IN
+#define ALLEGRO_EVENT_DISPLAY_FOCUS_LOST       ALLEGRO_EVENT_DISPLAY_SWITCH_OUT
+
+#define ALLEGRO_GET_EVENT_TYPE(a, b, c, d)     (((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+#define ALLEGRO_EVENT_TYPE_IS_USER(t)          ((t) >= 512)
 
 typedef struct ALLEGRO_EVENT_SOURCE {
-    int dummy;
+    union {
+        int __pad[32];
+        void* __align;
+    } __internal;
 } ALLEGRO_EVENT_SOURCE;
 
 typedef struct ALLEGRO_EVENT_QUEUE ALLEGRO_EVENT_QUEUE;
 
+typedef struct ALLEGRO_USER_EVENT {
+    struct ALLEGRO_USER_EVENT_DESCRIPTOR* __internal__descr;
+    intptr_t data1;
+    intptr_t data2;
+    intptr_t data3;
+    intptr_t data4;
+} ALLEGRO_USER_EVENT;
+
 typedef struct ALLEGRO_EVENT {
     int type;
+    ALLEGRO_EVENT_SOURCE* source;
     ALLEGRO_DISPLAY* display;
     double timestamp;
     union {
@@ -86,11 +101,14 @@ typedef struct ALLEGRO_EVENT {
             int width;
             int height;
         } display_expose;
+        ALLEGRO_USER_EVENT user;
     };
 } ALLEGRO_EVENT;
 
 void al_init_event_queue(ALLEGRO_EVENT_QUEUE* queue);
+ALLEGRO_EVENT_QUEUE* al_create_event_queue(void);
 void al_destroy_event_queue(ALLEGRO_EVENT_QUEUE* queue);
+bool al_set_event_queue_capacity(ALLEGRO_EVENT_QUEUE* queue, int max_events);
 bool al_is_event_queue_empty(ALLEGRO_EVENT_QUEUE* queue);
 bool al_get_next_event(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event);
 bool al_peek_event(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event);
@@ -106,6 +124,18 @@ void al_unregister_event_source(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT_SOURCE
 void al_init_event_source(ALLEGRO_EVENT_SOURCE* source);
 void al_destroy_event_source(ALLEGRO_EVENT_SOURCE* source);
 
+void al_init_user_event_source(ALLEGRO_EVENT_SOURCE* source);
+void al_destroy_user_event_source(ALLEGRO_EVENT_SOURCE* source);
+bool al_emit_user_event(ALLEGRO_EVENT_SOURCE* source, ALLEGRO_EVENT* event,
+                        void (*dtor)(ALLEGRO_USER_EVENT* event));
+void al_unref_user_event(ALLEGRO_USER_EVENT* event);
+
+/* Only the main thread, the one that created the display, pumps SDL; the
+ * pump thread just translates the events it hands over. Both calls fail
+ * anywhere but the main thread. */
+bool al_start_event_pump_thread(void);
+void al_stop_event_pump_thread(void);
+
 #ifdef __cplusplus
 }
 #endif
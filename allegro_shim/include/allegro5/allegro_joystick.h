@@ -39,7 +39,8 @@ const char* al_get_joystick_axis_name(ALLEGRO_JOYSTICK* joystick, int stick, int
 int al_get_joystick_num_buttons(ALLEGRO_JOYSTICK* joystick);
 const char* al_get_joystick_button_name(ALLEGRO_JOYSTICK* joystick, int button);
 void al_get_joystick_state(ALLEGRO_JOYSTICK* joystick, ALLEGRO_JOYSTICK_STATE* ret_state);
-void* al_get_joystick_event_source(void);
+typedef struct ALLEGRO_EVENT_SOURCE ALLEGRO_EVENT_SOURCE;
+ALLEGRO_EVENT_SOURCE* al_get_joystick_event_source(void);
 
 int install_joystick(void);
 int remove_joystick(void);
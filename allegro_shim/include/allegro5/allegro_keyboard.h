@@ -137,7 +137,8 @@ bool al_key_down(const ALLEGRO_KEYBOARD_STATE* state, int keycode);
 const char* al_keycode_to_name(int keycode);
 bool al_can_set_keyboard_leds(void);
 bool al_set_keyboard_leds(int leds);
-void* al_get_keyboard_event_source(void);
+typedef struct ALLEGRO_EVENT_SOURCE ALLEGRO_EVENT_SOURCE;
+ALLEGRO_EVENT_SOURCE* al_get_keyboard_event_source(void);
 
 #ifdef __cplusplus
 }
@@ -36,7 +36,8 @@ typedef struct ALLEGRO_MOUSE_STATE {
 bool al_install_mouse(void);
 void al_uninstall_mouse(void);
 bool al_is_mouse_installed(void);
-void* al_get_mouse_event_source(void);
+typedef struct ALLEGRO_EVENT_SOURCE ALLEGRO_EVENT_SOURCE;
+ALLEGRO_EVENT_SOURCE* al_get_mouse_event_source(void);
 void al_get_mouse_state(ALLEGRO_MOUSE_STATE* ret_state);
 bool al_mouse_button_down(const ALLEGRO_MOUSE_STATE* state, int button);
 int al_get_mouse_state_axis(const ALLEGRO_MOUSE_STATE* state, int axis);
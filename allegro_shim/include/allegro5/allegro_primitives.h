@@ -0,0 +1,130 @@
+#ifndef ALLEGRO_PRIMITIVES_H
+#define ALLEGRO_PRIMITIVES_H
+
+#include "allegro_base.h"
+#include "allegro_color.h"
+#include "allegro_bitmap.h"
+#include "allegro_draw.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ALLEGRO_PRIMITIVES_VERSION ALLEGRO_VERSION_INT
+
+#define ALLEGRO_VERTEX_CACHE_SIZE 256
+#define ALLEGRO_PRIM_QUALITY      10
+
+typedef enum ALLEGRO_PRIM_TYPE {
+    ALLEGRO_PRIM_LINE_LIST,
+    ALLEGRO_PRIM_LINE_STRIP,
+    ALLEGRO_PRIM_LINE_LOOP,
+    ALLEGRO_PRIM_TRIANGLE_LIST,
+    ALLEGRO_PRIM_TRIANGLE_STRIP,
+    ALLEGRO_PRIM_TRIANGLE_FAN,
+    ALLEGRO_PRIM_POINT_LIST,
+    ALLEGRO_PRIM_NUM_TYPES
+} ALLEGRO_PRIM_TYPE;
+
+enum ALLEGRO_PRIM_ATTR {
+    ALLEGRO_PRIM_POSITION = 1,
+    ALLEGRO_PRIM_COLOR_ATTR,
+    ALLEGRO_PRIM_TEX_COORD,
+    ALLEGRO_PRIM_TEX_COORD_PIXEL,
+    ALLEGRO_PRIM_USER_ATTR,
+    ALLEGRO_PRIM_ATTR_NUM = ALLEGRO_PRIM_USER_ATTR + 10
+};
+
+typedef enum ALLEGRO_PRIM_STORAGE {
+    ALLEGRO_PRIM_FLOAT_2,
+    ALLEGRO_PRIM_FLOAT_3,
+    ALLEGRO_PRIM_SHORT_2,
+    ALLEGRO_PRIM_FLOAT_1,
+    ALLEGRO_PRIM_FLOAT_4,
+    ALLEGRO_PRIM_UBYTE_4,
+    ALLEGRO_PRIM_SHORT_4,
+    ALLEGRO_PRIM_NORMALIZED_UBYTE_4,
+    ALLEGRO_PRIM_NORMALIZED_SHORT_2,
+    ALLEGRO_PRIM_NORMALIZED_SHORT_4,
+    ALLEGRO_PRIM_NORMALIZED_USHORT_2,
+    ALLEGRO_PRIM_NORMALIZED_USHORT_4,
+    ALLEGRO_PRIM_HALF_FLOAT_2,
+    ALLEGRO_PRIM_HALF_FLOAT_4
+} ALLEGRO_PRIM_STORAGE;
+
+/* A colour element stored as ALLEGRO_PRIM_UBYTE_4 or
+ * ALLEGRO_PRIM_NORMALIZED_UBYTE_4 is read as four r, g, b, a bytes and
+ * handed to SDL as is; any other storage is an ALLEGRO_COLOR. */
+typedef struct ALLEGRO_VERTEX_ELEMENT {
+    int attribute;
+    int storage;
+    int offset;
+} ALLEGRO_VERTEX_ELEMENT;
+
+typedef enum ALLEGRO_PRIM_BUFFER_FLAGS {
+    ALLEGRO_PRIM_BUFFER_STREAM    = 0x01,
+    ALLEGRO_PRIM_BUFFER_STATIC    = 0x02,
+    ALLEGRO_PRIM_BUFFER_DYNAMIC   = 0x04,
+    ALLEGRO_PRIM_BUFFER_READWRITE = 0x08
+} ALLEGRO_PRIM_BUFFER_FLAGS;
+
+typedef struct ALLEGRO_VERTEX_DECL ALLEGRO_VERTEX_DECL;
+typedef struct ALLEGRO_VERTEX_BUFFER ALLEGRO_VERTEX_BUFFER;
+typedef struct ALLEGRO_INDEX_BUFFER ALLEGRO_INDEX_BUFFER;
+
+typedef struct ALLEGRO_VERTEX {
+    float x, y, z;
+    float u, v;
+    ALLEGRO_COLOR color;
+} ALLEGRO_VERTEX;
+
+bool al_init_primitives_addon(void);
+bool al_is_primitives_addon_initialized(void);
+void al_shutdown_primitives_addon(void);
+uint32_t al_get_allegro_primitives_version(void);
+
+ALLEGRO_VERTEX_DECL* al_create_vertex_decl(const ALLEGRO_VERTEX_ELEMENT* elements, int stride);
+void al_destroy_vertex_decl(ALLEGRO_VERTEX_DECL* decl);
+
+void al_calculate_arc(float* dest, int stride, float cx, float cy, float rx, float ry,
+                      float start_theta, float delta_theta, float thickness, int num_points);
+void al_calculate_spline(float* dest, int stride, const float points[8], float thickness,
+                         int num_segments);
+void al_calculate_ribbon(float* dest, int dest_stride, const float* points, int points_stride,
+                         float thickness, int num_segments);
+
+void al_draw_elliptical_arc(float cx, float cy, float rx, float ry, float start_theta, float delta_theta,
+                            ALLEGRO_COLOR color, float thickness);
+void al_draw_spline(float points[8], ALLEGRO_COLOR color, float thickness);
+void al_draw_ribbon(const float* points, int points_stride, ALLEGRO_COLOR color, float thickness,
+                    int num_segments);
+
+int al_draw_prim(const void* vtxs, const ALLEGRO_VERTEX_DECL* decl, ALLEGRO_BITMAP* texture,
+                 int start, int end, int type);
+int al_draw_indexed_prim(const void* vtxs, const ALLEGRO_VERTEX_DECL* decl, ALLEGRO_BITMAP* texture,
+                         const int* indices, int num_vtx, int type);
+
+ALLEGRO_VERTEX_BUFFER* al_create_vertex_buffer(ALLEGRO_VERTEX_DECL* decl, const void* initial_data,
+                                               int num_vertices, int flags);
+void al_destroy_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer);
+void* al_lock_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer, int offset, int length, int flags);
+void al_unlock_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer);
+int al_get_vertex_buffer_size(ALLEGRO_VERTEX_BUFFER* buffer);
+
+ALLEGRO_INDEX_BUFFER* al_create_index_buffer(int index_size, const void* initial_data,
+                                             int num_indices, int flags);
+void al_destroy_index_buffer(ALLEGRO_INDEX_BUFFER* buffer);
+void* al_lock_index_buffer(ALLEGRO_INDEX_BUFFER* buffer, int offset, int length, int flags);
+void al_unlock_index_buffer(ALLEGRO_INDEX_BUFFER* buffer);
+int al_get_index_buffer_size(ALLEGRO_INDEX_BUFFER* buffer);
+
+int al_draw_vertex_buffer(ALLEGRO_VERTEX_BUFFER* vertex_buffer, ALLEGRO_BITMAP* texture,
+                          int start, int end, int type);
+int al_draw_indexed_buffer(ALLEGRO_VERTEX_BUFFER* vertex_buffer, ALLEGRO_BITMAP* texture,
+                           ALLEGRO_INDEX_BUFFER* index_buffer, int start, int end, int type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,6 +5,7 @@
 #include <SDL2/SDL_render.h>
 #include "allegro5/allegro_display.h"
 #include "allegro5/allegro_color.h"
+#include "allegro5/allegro_events.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,12 +13,28 @@ extern "C" {
 
 struct ALLEGRO_DISPLAY {
     SDL_Window* window;
+    Uint32 window_id;
     SDL_Renderer* renderer;
     void* backbuffer;
     int width;
     int height;
     int flags;
     int refresh_rate;
+
+    Uint8 draw_r, draw_g, draw_b, draw_a;
+    bool draw_color_valid;
+    SDL_BlendMode blend_mode;
+    bool blend_mode_valid;
+    SDL_Texture* render_target;
+    bool render_target_valid;
+    SDL_Rect viewport;
+    bool viewport_enabled;
+    bool viewport_valid;
+    SDL_Rect clip_rect;
+    bool clip_enabled;
+    bool clip_valid;
+    ALLEGRO_RENDER_STATE_STATS state_stats;
+    ALLEGRO_EVENT_SOURCE event_source;
 };
 
 extern ALLEGRO_DISPLAY* _al_get_current_display(void);
@@ -10,6 +10,7 @@
 #include <allegro5/allegro_color.h>
 #include <allegro5/allegro_bitmap.h>
 #include <allegro5/allegro_draw.h>
+#include <allegro5/allegro_primitives.h>
 #include <allegro5/allegro_state.h>
 #include <allegro5/allegro_transform.h>
 #include <allegro5/allegro_blender.h>
@@ -26,13 +27,28 @@
 #include <allegro5/internal/allegro_config.h>
 #include <allegro5/internal/allegro_display.h>
 #include <allegro5/internal/allegro_joystick.h>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
 #include <cstring>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include <vector>
 
 static ALLEGRO_DISPLAY* _current_display = nullptr;
+
+/* Every live display, so SDL events can be routed by window ID. The pump
+ * thread reads the list, so it is guarded by a spinlock. */
+static std::vector<ALLEGRO_DISPLAY*> _displays;
+static SDL_SpinLock _displays_lock = 0;
+
+/* SDL only lets the thread that set up video pump OS events, so this is
+ * the only thread that calls SDL_PumpEvents or waits in SDL_WaitEvent: the
+ * one that created the last display or, before any, the first event
+ * queue. */
+static SDL_threadID _event_main_thread = 0;
 static int _new_display_flags = 0;
 static int _new_display_refresh_rate = 60;
 static const char* _new_window_title = "Allegro SDL2 Shim";
@@ -40,16 +56,64 @@ static int _new_window_x = -1;
 static int _new_window_y = -1;
 static int _new_display_adapter = 0;
 
+struct AtlasPage;
+
 struct ALLEGRO_BITMAP {
     SDL_Texture* texture;
     SDL_Surface* surface;
     int width;
     int height;
     int format;
+    int requested_format;
     int flags;
     bool is_backbuffer;
+    Uint8 mod_r, mod_g, mod_b, mod_a;
+    SDL_BlendMode blend_mode;
+    bool blend_mode_valid;
+    ALLEGRO_BITMAP* parent;
+    int xofs;
+    int yofs;
+    ALLEGRO_BITMAP* sub_parent;
+    int sub_x;
+    int sub_y;
+    AtlasPage* atlas_page;
+    SDL_Texture* lock_texture;
+    bool locked;
+    int lock_flags;
+    SDL_Rect lock_rect;
+    int lock_format;
+    void* lock_buffer;
+    bool lock_staged;
+    ALLEGRO_LOCKED_REGION locked_region;
+    SDL_Surface* shadow;
+    Uint8* shadow_tiles;
+    int shadow_tiles_x;
+    int shadow_tiles_y;
+    int shadow_dirty_tiles;
+    size_t bitmap_index;
+    std::vector<ALLEGRO_BITMAP*> views;
+    size_t view_index;
+};
+
+struct SkylineNode {
+    int x;
+    int y;
+    int w;
+};
+
+struct AtlasPage {
+    ALLEGRO_BITMAP* bitmap;
+    int requested_format;
+    std::vector<SkylineNode> skyline;
+    int live_bitmaps;
 };
 
+static const int ATLAS_PAGE_SIZE = 1024;
+static const int ATLAS_MAX_BITMAP_SIZE = 128;
+static const int ATLAS_PADDING = 1;
+static std::vector<AtlasPage*> _atlas_pages;
+static std::vector<ALLEGRO_BITMAP*> _bitmaps;
+
 static ALLEGRO_BITMAP* _target_bitmap = nullptr;
 static int _new_bitmap_flags = ALLEGRO_VIDEO_BITMAP;
 static int _new_bitmap_format = ALLEGRO_PIXEL_FORMAT_ARGB_8888;
@@ -60,1804 +124,8580 @@ static float _clip_w = 0;
 static float _clip_h = 0;
 static bool _clipping_initialized = false;
 
-static bool _keyboard_installed = false;
-static Uint8 _key[512] = {0};
-static unsigned int _key_down_bits[(ALLEGRO_KEY_MAX + 31) / 32] = {0};
-
-static bool _mouse_installed = false;
-static int _mouse_x = 0;
-static int _mouse_y = 0;
-static int _mouse_z = 0;
-static int _mouse_w = 0;
-static int _mouse_buttons = 0;
-static unsigned int _mouse_num_buttons = 3;
-static unsigned int _mouse_num_axes = 2;
+static void _reset_render_state_cache(ALLEGRO_DISPLAY* display)
+{
+    display->draw_color_valid = false;
+    display->blend_mode_valid = false;
+    display->render_target_valid = false;
+    display->viewport_valid = false;
+    display->clip_valid = false;
+}
 
-static bool _joystick_installed = false;
-static std::vector<ALLEGRO_JOYSTICK*> _joysticks;
+static void _cache_set_draw_color(ALLEGRO_DISPLAY* display, Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+{
+    if (display->draw_color_valid && display->draw_r == r && display->draw_g == g &&
+        display->draw_b == b && display->draw_a == a) {
+        display->state_stats.elided_draw_color++;
+        return;
+    }
+    SDL_SetRenderDrawColor(display->renderer, r, g, b, a);
+    display->draw_r = r;
+    display->draw_g = g;
+    display->draw_b = b;
+    display->draw_a = a;
+    display->draw_color_valid = true;
+    display->state_stats.issued++;
+}
 
-static bool _audio_installed = false;
-static int _audio_reserved_channels = 0;
-static ALLEGRO_MIXER* _default_mixer = nullptr;
+static void _cache_set_blend_mode(ALLEGRO_DISPLAY* display, SDL_BlendMode mode)
+{
+    if (display->blend_mode_valid && display->blend_mode == mode) {
+        display->state_stats.elided_blend_mode++;
+        return;
+    }
+    if (SDL_SetRenderDrawBlendMode(display->renderer, mode) != 0) {
+        SDL_SetRenderDrawBlendMode(display->renderer, SDL_BLENDMODE_BLEND);
+    }
+    display->blend_mode = mode;
+    display->blend_mode_valid = true;
+    display->state_stats.issued++;
+}
 
-struct AllegroSampleInstance {
-    Mix_Chunk* chunk;
-    int channel;
-    bool is_playing;
-    ALLEGRO_PLAYMODE loop;
-    float gain;
-    float pan;
-    float speed;
-    unsigned int position;
-    ALLEGRO_SAMPLE* sample;
-};
+static void _cache_set_render_target(ALLEGRO_DISPLAY* display, SDL_Texture* texture)
+{
+    if (display->render_target_valid && display->render_target == texture) {
+        display->state_stats.elided_render_target++;
+        return;
+    }
+    SDL_SetRenderTarget(display->renderer, texture);
+    display->render_target = texture;
+    display->render_target_valid = true;
+    display->viewport_enabled = false;
+    display->viewport_valid = true;
+    display->clip_valid = false;
+    display->state_stats.issued++;
+}
 
-struct AllegroAudioStream {
-    Mix_Music* music;
-    bool is_playing;
-    ALLEGRO_PLAYMODE loop;
-    float gain;
-    float pan;
-    float speed;
-    unsigned int frequency;
-    ALLEGRO_AUDIO_DEPTH depth;
-    ALLEGRO_CHANNEL_CONF channels;
-    unsigned int buffer_samples;
-    size_t buffer_count;
-};
+static void _cache_set_viewport(ALLEGRO_DISPLAY* display, const SDL_Rect* rect)
+{
+    if (display->viewport_valid) {
+        if (!rect && !display->viewport_enabled) {
+            return;
+        }
+        if (rect && display->viewport_enabled &&
+            rect->x == display->viewport.x && rect->y == display->viewport.y &&
+            rect->w == display->viewport.w && rect->h == display->viewport.h) {
+            return;
+        }
+    }
+    SDL_RenderSetViewport(display->renderer, rect);
+    display->viewport_enabled = rect != nullptr;
+    if (rect) {
+        display->viewport = *rect;
+    }
+    display->viewport_valid = true;
+    display->clip_valid = false;
+    display->state_stats.issued++;
+}
 
-struct MixerWrapper {
-    int frequency;
-    ALLEGRO_AUDIO_DEPTH depth;
-    ALLEGRO_CHANNEL_CONF channels;
-    ALLEGRO_MIXER_QUALITY quality;
-    ALLEGRO_SAMPLE_INSTANCE* attached_sample_instance;
-    ALLEGRO_AUDIO_STREAM* attached_audio_stream;
-};
+static void _cache_set_clip_rect(ALLEGRO_DISPLAY* display, const SDL_Rect* rect)
+{
+    if (display->clip_valid) {
+        if (!rect && !display->clip_enabled) {
+            display->state_stats.elided_clip_rect++;
+            return;
+        }
+        if (rect && display->clip_enabled &&
+            rect->x == display->clip_rect.x && rect->y == display->clip_rect.y &&
+            rect->w == display->clip_rect.w && rect->h == display->clip_rect.h) {
+            display->state_stats.elided_clip_rect++;
+            return;
+        }
+    }
+    SDL_RenderSetClipRect(display->renderer, rect);
+    display->clip_enabled = rect != nullptr;
+    if (rect) {
+        display->clip_rect = *rect;
+    }
+    display->clip_valid = true;
+    display->state_stats.issued++;
+}
 
-ALLEGRO_DISPLAY* al_create_display(int w, int h)
+static void _cache_set_texture_mod(ALLEGRO_BITMAP* bitmap, Uint8 r, Uint8 g, Uint8 b, Uint8 a)
 {
-    ALLEGRO_DISPLAY* display = new ALLEGRO_DISPLAY;
-    if (!display) {
-        return nullptr;
+    if (bitmap->parent) {
+        bitmap = bitmap->parent;
     }
     
-    Uint32 window_flags = SDL_WINDOW_SHOWN;
-    
-    if (_new_display_flags & ALLEGRO_FULLSCREEN) {
-        window_flags |= SDL_WINDOW_FULLSCREEN;
-    } else if (_new_display_flags & ALLEGRO_FULLSCREEN_WINDOW) {
-        window_flags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
+    if (bitmap->mod_r != r || bitmap->mod_g != g || bitmap->mod_b != b) {
+        SDL_SetTextureColorMod(bitmap->texture, r, g, b);
+        bitmap->mod_r = r;
+        bitmap->mod_g = g;
+        bitmap->mod_b = b;
+        if (_current_display) {
+            _current_display->state_stats.issued++;
+        }
+    } else if (_current_display) {
+        _current_display->state_stats.elided_texture_mod++;
     }
     
-    if (_new_display_flags & ALLEGRO_RESIZABLE) {
-        window_flags |= SDL_WINDOW_RESIZABLE;
+    if (bitmap->mod_a != a) {
+        SDL_SetTextureAlphaMod(bitmap->texture, a);
+        bitmap->mod_a = a;
+        if (_current_display) {
+            _current_display->state_stats.issued++;
+        }
+    } else if (_current_display) {
+        _current_display->state_stats.elided_texture_mod++;
     }
-    
-    if (_new_display_flags & ALLEGRO_FRAMELESS) {
-        window_flags |= SDL_WINDOW_BORDERLESS;
+}
+
+static void _apply_target_bitmap(ALLEGRO_DISPLAY* display, ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap || !bitmap->texture) {
+        _cache_set_render_target(display, nullptr);
+        _cache_set_viewport(display, nullptr);
+        return;
     }
     
-    if (_new_window_x >= 0 && _new_window_y >= 0) {
-        display->window = SDL_CreateWindow(
-            _new_window_title,
-            _new_window_x, _new_window_y,
-            w, h,
-            window_flags
-        );
+    _cache_set_render_target(display, bitmap->texture);
+    
+    if (bitmap->parent) {
+        SDL_Rect viewport = {bitmap->xofs, bitmap->yofs, bitmap->width, bitmap->height};
+        _cache_set_viewport(display, &viewport);
     } else {
-        display->window = SDL_CreateWindow(
-            _new_window_title,
-            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-            w, h,
-            window_flags
-        );
+        _cache_set_viewport(display, nullptr);
     }
+}
+
+/* Per-thread scratch arena for temporaries that only live for one call.
+ * Allocation bumps a pointer through a chain of blocks; a ScratchScope
+ * rewinds everything allocated inside it, and when the outermost scope ends
+ * a chain that had to grow is coalesced into one block big enough for the
+ * whole call, so steady-state drawing does no heap allocation at all. */
+static const size_t SCRATCH_MIN_BLOCK = 64 * 1024;
+
+struct ScratchBlock {
+    char* data;
+    size_t size;
+    size_t used;
+};
+
+struct ScratchArena {
+    std::vector<ScratchBlock> blocks;
+    size_t current;
+    int depth;
     
-    if (!display->window) {
-        delete display;
-        return nullptr;
+    ScratchArena() : current(0), depth(0) {}
+    ~ScratchArena()
+    {
+        for (size_t i = 0; i < blocks.size(); i++) {
+            free(blocks[i].data);
+        }
     }
+};
+
+static thread_local ScratchArena _scratch;
+
+static void* _scratch_alloc(size_t bytes)
+{
+    ScratchArena& arena = _scratch;
+    bytes = (bytes + 15) & ~static_cast<size_t>(15);
     
-    display->renderer = SDL_CreateRenderer(
-        display->window,
-        -1,
-        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
-    );
-    
-    if (!display->renderer) {
-        SDL_DestroyWindow(display->window);
-        delete display;
-        return nullptr;
+    for (; arena.current < arena.blocks.size(); arena.current++) {
+        ScratchBlock& block = arena.blocks[arena.current];
+        if (block.used + bytes <= block.size) {
+            void* p = block.data + block.used;
+            block.used += bytes;
+            return p;
+        }
     }
     
-    display->width = w;
-    display->height = h;
-    display->flags = _new_display_flags;
-    display->refresh_rate = _new_display_refresh_rate;
-    display->backbuffer = nullptr;
-    
-    _current_display = display;
+    size_t size = SCRATCH_MIN_BLOCK;
+    if (!arena.blocks.empty()) {
+        size = arena.blocks.back().size * 2;
+    }
+    while (size < bytes) {
+        size *= 2;
+    }
     
-    return display;
+    ScratchBlock block = {static_cast<char*>(malloc(size)), size, bytes};
+    if (!block.data) {
+        return nullptr;
+    }
+    arena.blocks.push_back(block);
+    arena.current = arena.blocks.size() - 1;
+    return block.data;
 }
 
-void al_destroy_display(ALLEGRO_DISPLAY* display)
+template <typename T>
+static T* _scratch_array(size_t count)
 {
-    if (!display) {
-        return;
-    }
+    return static_cast<T*>(_scratch_alloc(count * sizeof(T)));
+}
+
+struct ScratchScope {
+    size_t block;
+    size_t used;
     
-    if (display->renderer) {
-        SDL_DestroyRenderer(display->renderer);
+    ScratchScope()
+    {
+        ScratchArena& arena = _scratch;
+        arena.depth++;
+        block = arena.current;
+        used = block < arena.blocks.size() ? arena.blocks[block].used : 0;
     }
     
-    if (display->window) {
-        SDL_DestroyWindow(display->window);
+    ~ScratchScope()
+    {
+        ScratchArena& arena = _scratch;
+        for (size_t i = block; i < arena.blocks.size(); i++) {
+            arena.blocks[i].used = (i == block) ? used : 0;
+        }
+        arena.current = block;
+        
+        if (--arena.depth == 0 && arena.blocks.size() > 1) {
+            size_t total = 0;
+            for (size_t i = 0; i < arena.blocks.size(); i++) {
+                total += arena.blocks[i].size;
+                free(arena.blocks[i].data);
+            }
+            arena.blocks.clear();
+            arena.current = 0;
+            ScratchBlock merged = {static_cast<char*>(malloc(total)), total, 0};
+            if (merged.data) {
+                arena.blocks.push_back(merged);
+            }
+        }
     }
-    
-    if (_current_display == display) {
-        _current_display = nullptr;
+};
+
+/* Pixel format conversion. Each ALLEGRO_PIXEL_FORMAT_* is one row of a
+ * table. Rows are decoded to ARGB8888 and encoded back from it, so every pair
+ * of formats converts through that pivot in small chunks that stay in cache.
+ * All packed 16- and 32-bit layouts share one SIMD kernel driven by the
+ * table's shifts and bit widths. Large images are split by rows across
+ * worker threads. */
+enum PixelLayout {
+    PIXEL_LAYOUT_NONE,
+    PIXEL_LAYOUT_PACKED,
+    PIXEL_LAYOUT_PACKED24,
+    PIXEL_LAYOUT_FLOAT
+};
+
+struct PixelFormatInfo {
+    int layout;
+    int bytes;
+    Uint32 sdl_format;
+    int shift[4];
+    int bits[4];
+};
+
+/* Channels in shift/bits are ordered a, r, g, b. */
+static const PixelFormatInfo _pixel_formats[] = {
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    {PIXEL_LAYOUT_NONE, 0, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+    /* ARGB_8888 */ {PIXEL_LAYOUT_PACKED, 4, SDL_PIXELFORMAT_ARGB8888, {24, 16, 8, 0}, {8, 8, 8, 8}},
+    /* RGBA_8888 */ {PIXEL_LAYOUT_PACKED, 4, SDL_PIXELFORMAT_RGBA8888, {0, 24, 16, 8}, {8, 8, 8, 8}},
+    /* ABGR_8888 */ {PIXEL_LAYOUT_PACKED, 4, SDL_PIXELFORMAT_ABGR8888, {24, 0, 8, 16}, {8, 8, 8, 8}},
+    /* BGRA_8888 */ {PIXEL_LAYOUT_PACKED, 4, SDL_PIXELFORMAT_BGRA8888, {0, 8, 16, 24}, {8, 8, 8, 8}},
+    /* RGB_888 */ {PIXEL_LAYOUT_PACKED24, 3, SDL_PIXELFORMAT_BGR24, {0, 16, 8, 0}, {0, 8, 8, 8}},
+    /* BGR_888 */ {PIXEL_LAYOUT_PACKED24, 3, SDL_PIXELFORMAT_RGB24, {0, 0, 8, 16}, {0, 8, 8, 8}},
+    /* RGB_565 */ {PIXEL_LAYOUT_PACKED, 2, SDL_PIXELFORMAT_RGB565, {0, 11, 5, 0}, {0, 5, 6, 5}},
+    /* RGBA_5551 */ {PIXEL_LAYOUT_PACKED, 2, SDL_PIXELFORMAT_RGBA5551, {0, 11, 6, 1}, {1, 5, 5, 5}},
+    /* ARGB_1555 */ {PIXEL_LAYOUT_PACKED, 2, SDL_PIXELFORMAT_ARGB1555, {15, 10, 5, 0}, {1, 5, 5, 5}},
+    /* ABGR_F32 */ {PIXEL_LAYOUT_FLOAT, 16, SDL_PIXELFORMAT_UNKNOWN, {0, 0, 0, 0}, {0, 0, 0, 0}},
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    /* ABGR_8888_LE */ {PIXEL_LAYOUT_PACKED, 4, SDL_PIXELFORMAT_RGBA32, {0, 24, 16, 8}, {8, 8, 8, 8}}
+#else
+    /* ABGR_8888_LE */ {PIXEL_LAYOUT_PACKED, 4, SDL_PIXELFORMAT_RGBA32, {24, 0, 8, 16}, {8, 8, 8, 8}}
+#endif
+};
+
+static const int PIXEL_FORMAT_COUNT = sizeof(_pixel_formats) / sizeof(_pixel_formats[0]);
+
+static const PixelFormatInfo* _get_pixel_format_info(int format)
+{
+    if (format < 0 || format >= PIXEL_FORMAT_COUNT ||
+        _pixel_formats[format].layout == PIXEL_LAYOUT_NONE) {
+        return nullptr;
     }
-    
-    delete display;
+    return &_pixel_formats[format];
 }
 
-ALLEGRO_DISPLAY* al_get_current_display(void)
+static Uint32 _allegro_to_sdl_format(int format)
 {
-    return _current_display;
+    const PixelFormatInfo* info = _get_pixel_format_info(format);
+    return info ? info->sdl_format : static_cast<Uint32>(SDL_PIXELFORMAT_UNKNOWN);
 }
 
-void al_set_current_display(ALLEGRO_DISPLAY* display)
+static int _sdl_to_allegro_format(Uint32 format)
 {
-    _current_display = display;
+    for (int f = 0; f < PIXEL_FORMAT_COUNT; f++) {
+        if (_pixel_formats[f].layout != PIXEL_LAYOUT_NONE && _pixel_formats[f].sdl_format == format) {
+            return f;
+        }
+    }
+    return ALLEGRO_PIXEL_FORMAT_ANY;
 }
 
-int al_get_display_width(ALLEGRO_DISPLAY* display)
+static inline Uint32 _expand_channel(Uint32 v, int bits)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    if (!display) {
-        return 0;
+    switch (bits) {
+        case 0: return 255;
+        case 1: return v ? 255 : 0;
+        case 8: return v;
+        default: return (v << (8 - bits)) | (v >> (2 * bits - 8));
     }
-    return display->width;
 }
 
-int al_get_display_height(ALLEGRO_DISPLAY* display)
+static inline Uint32 _decode_packed(Uint32 p, const PixelFormatInfo* f)
 {
-    if (!display) {
-        display = _current_display;
+    Uint32 out = 0;
+    for (int c = 0; c < 4; c++) {
+        Uint32 v = f->bits[c] ? (p >> f->shift[c]) & ((1u << f->bits[c]) - 1) : 0;
+        out |= _expand_channel(v, f->bits[c]) << (24 - 8 * c);
     }
-    if (!display) {
-        return 0;
-    }
-    return display->height;
+    return out;
 }
 
-int al_get_display_flags(ALLEGRO_DISPLAY* display)
+static inline Uint32 _encode_packed(Uint32 argb, const PixelFormatInfo* f)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    if (!display) {
-        return 0;
-    }
-    
-    int flags = display->flags;
-    Uint32 sdl_flags = SDL_GetWindowFlags(display->window);
-    
-    if (sdl_flags & SDL_WINDOW_FULLSCREEN) {
-        flags |= ALLEGRO_FULLSCREEN;
-    } else if (sdl_flags & SDL_WINDOW_FULLSCREEN_DESKTOP) {
-        flags |= ALLEGRO_FULLSCREEN_WINDOW;
-    }
-    
-    if (sdl_flags & SDL_WINDOW_RESIZABLE) {
-        flags |= ALLEGRO_RESIZABLE;
-    }
-    
-    if (sdl_flags & SDL_WINDOW_BORDERLESS) {
-        flags |= ALLEGRO_FRAMELESS;
-    }
-    
-    if (sdl_flags & SDL_WINDOW_MINIMIZED) {
-        flags |= ALLEGRO_MINIMIZED;
+    Uint32 out = 0;
+    for (int c = 0; c < 4; c++) {
+        if (f->bits[c]) {
+            out |= (((argb >> (24 - 8 * c)) & 0xFF) >> (8 - f->bits[c])) << f->shift[c];
+        }
     }
+    return out;
+}
+
+static inline Uint8 _float_to_channel(float v)
+{
+    v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+    return static_cast<Uint8>(v * 255.0f + 0.5f);
+}
+
+static void _decode_row(const Uint8* src, const PixelFormatInfo* f, Uint32* dst, int n)
+{
+    int i = 0;
     
-    if (sdl_flags & SDL_WINDOW_MAXIMIZED) {
-        flags |= ALLEGRO_MAXIMIZED;
+    if (f->layout == PIXEL_LAYOUT_PACKED) {
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= n; i += 4) {
+            __m128i p = f->bytes == 4
+                ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4))
+                : _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i * 2)), zero);
+            __m128i out = zero;
+            for (int c = 0; c < 4; c++) {
+                int bits = f->bits[c];
+                __m128i e;
+                if (bits == 0) {
+                    e = _mm_set1_epi32(255);
+                } else {
+                    __m128i v = _mm_and_si128(_mm_srl_epi32(p, _mm_cvtsi32_si128(f->shift[c])),
+                                              _mm_set1_epi32((1 << bits) - 1));
+                    if (bits == 8) {
+                        e = v;
+                    } else if (bits == 1) {
+                        e = _mm_sub_epi32(_mm_slli_epi32(v, 8), v);
+                    } else {
+                        e = _mm_or_si128(_mm_sll_epi32(v, _mm_cvtsi32_si128(8 - bits)),
+                                         _mm_srl_epi32(v, _mm_cvtsi32_si128(2 * bits - 8)));
+                    }
+                }
+                out = _mm_or_si128(out, _mm_sll_epi32(e, _mm_cvtsi32_si128(24 - 8 * c)));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+        }
+#endif
+        for (; i < n; i++) {
+            Uint32 p = f->bytes == 4 ? reinterpret_cast<const Uint32*>(src)[i]
+                                     : reinterpret_cast<const Uint16*>(src)[i];
+            dst[i] = _decode_packed(p, f);
+        }
+    } else if (f->layout == PIXEL_LAYOUT_PACKED24) {
+        for (; i < n; i++) {
+            const Uint8* p = src + i * 3;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            Uint32 v = (p[0] << 16) | (p[1] << 8) | p[2];
+#else
+            Uint32 v = p[0] | (p[1] << 8) | (p[2] << 16);
+#endif
+            dst[i] = _decode_packed(v, f);
+        }
+    } else {
+        const float* p = reinterpret_cast<const float*>(src);
+        for (; i < n; i++, p += 4) {
+            dst[i] = (static_cast<Uint32>(_float_to_channel(p[3])) << 24) |
+                     (static_cast<Uint32>(_float_to_channel(p[0])) << 16) |
+                     (static_cast<Uint32>(_float_to_channel(p[1])) << 8) |
+                     _float_to_channel(p[2]);
+        }
     }
-    
-    return flags;
 }
 
-bool al_set_display_flag(ALLEGRO_DISPLAY* display, int flag, bool onoff)
+static void _encode_row(const Uint32* src, const PixelFormatInfo* f, Uint8* dst, int n)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    if (!display) {
-        return false;
-    }
+    int i = 0;
     
-    switch (flag) {
-        case ALLEGRO_FULLSCREEN:
-            SDL_SetWindowFullscreen(display->window, 
-                onoff ? SDL_WINDOW_FULLSCREEN : 0);
-            break;
-        case ALLEGRO_FULLSCREEN_WINDOW:
-            SDL_SetWindowFullscreen(display->window, 
-                onoff ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
-            break;
-        case ALLEGRO_RESIZABLE:
-            SDL_SetWindowResizable(display->window, 
-                onoff ? SDL_TRUE : SDL_FALSE);
-            break;
-        case ALLEGRO_MINIMIZED:
-            if (onoff) {
-                SDL_MinimizeWindow(display->window);
+    if (f->layout == PIXEL_LAYOUT_PACKED) {
+#if defined(__SSE2__)
+        const __m128i mask = _mm_set1_epi32(0xFF);
+        for (; i + 4 <= n; i += 4) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i out = _mm_setzero_si128();
+            for (int c = 0; c < 4; c++) {
+                if (!f->bits[c]) {
+                    continue;
+                }
+                __m128i v = _mm_and_si128(_mm_srl_epi32(p, _mm_cvtsi32_si128(24 - 8 * c)), mask);
+                v = _mm_srl_epi32(v, _mm_cvtsi32_si128(8 - f->bits[c]));
+                out = _mm_or_si128(out, _mm_sll_epi32(v, _mm_cvtsi32_si128(f->shift[c])));
+            }
+            if (f->bytes == 4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), out);
             } else {
-                SDL_RestoreWindow(display->window);
+                /* Sign-extend the low halves so the saturating pack keeps all 16 bits. */
+                out = _mm_srai_epi32(_mm_slli_epi32(out, 16), 16);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i * 2), _mm_packs_epi32(out, out));
             }
-            break;
-        case ALLEGRO_MAXIMIZED:
-            if (onoff) {
-                SDL_MaximizeWindow(display->window);
+        }
+#endif
+        for (; i < n; i++) {
+            Uint32 p = _encode_packed(src[i], f);
+            if (f->bytes == 4) {
+                reinterpret_cast<Uint32*>(dst)[i] = p;
             } else {
-                SDL_RestoreWindow(display->window);
+                reinterpret_cast<Uint16*>(dst)[i] = static_cast<Uint16>(p);
             }
-            break;
-        default:
-            return false;
+        }
+    } else if (f->layout == PIXEL_LAYOUT_PACKED24) {
+        for (; i < n; i++) {
+            Uint32 v = _encode_packed(src[i], f);
+            Uint8* p = dst + i * 3;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            p[0] = (v >> 16) & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = v & 0xFF;
+#else
+            p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = (v >> 16) & 0xFF;
+#endif
+        }
+    } else {
+        const float inv = 1.0f / 255.0f;
+        float* p = reinterpret_cast<float*>(dst);
+        for (; i < n; i++, p += 4) {
+            p[0] = ((src[i] >> 16) & 0xFF) * inv;
+            p[1] = ((src[i] >> 8) & 0xFF) * inv;
+            p[2] = (src[i] & 0xFF) * inv;
+            p[3] = (src[i] >> 24) * inv;
+        }
     }
+}
+
+struct PixelConvertJob {
+    const Uint8* src;
+    const PixelFormatInfo* src_info;
+    int src_pitch;
+    Uint8* dst;
+    const PixelFormatInfo* dst_info;
+    int dst_pitch;
+    int width;
+    int y1;
+    int y2;
+};
+
+static const int CONVERT_CHUNK = 256;
+static const int CONVERT_PIXELS_PER_THREAD = 1 << 16;
+static const int CONVERT_MAX_THREADS = 8;
+
+static void _convert_rows(const PixelConvertJob* job)
+{
+    const PixelFormatInfo* argb = &_pixel_formats[ALLEGRO_PIXEL_FORMAT_ARGB_8888];
+    Uint32 chunk[CONVERT_CHUNK];
     
-    if (onoff) {
-        display->flags |= flag;
-    } else {
-        display->flags &= ~flag;
+    for (int y = job->y1; y < job->y2; y++) {
+        const Uint8* src = job->src + y * job->src_pitch;
+        Uint8* dst = job->dst + y * job->dst_pitch;
+        
+        if (job->src_info == job->dst_info) {
+            memcpy(dst, src, static_cast<size_t>(job->width) * job->src_info->bytes);
+        } else if (job->src_info == argb) {
+            _encode_row(reinterpret_cast<const Uint32*>(src), job->dst_info, dst, job->width);
+        } else if (job->dst_info == argb) {
+            _decode_row(src, job->src_info, reinterpret_cast<Uint32*>(dst), job->width);
+        } else {
+            for (int x = 0; x < job->width; x += CONVERT_CHUNK) {
+                int n = SDL_min(CONVERT_CHUNK, job->width - x);
+                _decode_row(src + x * job->src_info->bytes, job->src_info, chunk, n);
+                _encode_row(chunk, job->dst_info, dst + x * job->dst_info->bytes, n);
+            }
+        }
+    }
+}
+
+static int SDLCALL _convert_worker(void* data)
+{
+    _convert_rows(static_cast<const PixelConvertJob*>(data));
+    return 0;
+}
+
+/* Converts a width x height block between two concrete Allegro pixel
+ * formats using up to max_threads threads. Returns false if either format
+ * has no table entry. */
+static bool _convert_pixels_threaded(const void* src, int src_format, int src_pitch,
+                                     void* dst, int dst_format, int dst_pitch,
+                                     int width, int height, int max_threads)
+{
+    const PixelFormatInfo* src_info = _get_pixel_format_info(src_format);
+    const PixelFormatInfo* dst_info = _get_pixel_format_info(dst_format);
+    if (!src_info || !dst_info) {
+        return false;
+    }
+    if (width <= 0 || height <= 0) {
+        return true;
     }
     
+    int threads = static_cast<int>((static_cast<Sint64>(width) * height) / CONVERT_PIXELS_PER_THREAD);
+    threads = SDL_min(threads, SDL_min(SDL_GetCPUCount(), SDL_min(max_threads, CONVERT_MAX_THREADS)));
+    threads = SDL_max(1, SDL_min(threads, height));
+    
+    PixelConvertJob jobs[CONVERT_MAX_THREADS];
+    SDL_Thread* workers[CONVERT_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        PixelConvertJob& job = jobs[i];
+        job.src = static_cast<const Uint8*>(src);
+        job.src_info = src_info;
+        job.src_pitch = src_pitch;
+        job.dst = static_cast<Uint8*>(dst);
+        job.dst_info = dst_info;
+        job.dst_pitch = dst_pitch;
+        job.width = width;
+        job.y1 = static_cast<int>(static_cast<Sint64>(height) * i / threads);
+        job.y2 = static_cast<int>(static_cast<Sint64>(height) * (i + 1) / threads);
+        workers[i] = nullptr;
+    }
+    
+    for (int i = 1; i < threads; i++) {
+        workers[i] = SDL_CreateThread(_convert_worker, "al_convert", &jobs[i]);
+        if (!workers[i]) {
+            _convert_rows(&jobs[i]);
+        }
+    }
+    _convert_rows(&jobs[0]);
+    for (int i = 1; i < threads; i++) {
+        if (workers[i]) {
+            SDL_WaitThread(workers[i], nullptr);
+        }
+    }
     return true;
 }
 
-void al_set_window_title(ALLEGRO_DISPLAY* display, const char* title)
+static bool _convert_pixels(const void* src, int src_format, int src_pitch,
+                            void* dst, int dst_format, int dst_pitch,
+                            int width, int height)
 {
-    if (!display) {
-        display = _current_display;
+    return _convert_pixels_threaded(src, src_format, src_pitch, dst, dst_format, dst_pitch,
+                                    width, height, CONVERT_MAX_THREADS);
+}
+
+static Uint32 _decode_pixel(const void* src, int format)
+{
+    Uint32 argb = 0;
+    const PixelFormatInfo* info = _get_pixel_format_info(format);
+    if (info) {
+        _decode_row(static_cast<const Uint8*>(src), info, &argb, 1);
     }
-    if (!display || !display->window) {
-        return;
+    return argb;
+}
+
+/* Video bitmaps that are read back from get a CPU shadow copy, created on
+ * the first al_get_pixel. Its state is tracked per tile: STALE tiles have
+ * been drawn to on the GPU since they were last read back, DIRTY tiles were
+ * written on the CPU and must be uploaded before the GPU touches the texture
+ * again. */
+enum {
+    SHADOW_TILE_CLEAN,
+    SHADOW_TILE_STALE,
+    SHADOW_TILE_DIRTY
+};
+
+static const int SHADOW_TILE_SIZE = 64;
+
+static Uint32 _surface_get_pixel(SDL_Surface* surface, int x, int y)
+{
+    const Uint8* p = static_cast<const Uint8*>(surface->pixels) +
+                     y * surface->pitch + x * surface->format->BytesPerPixel;
+    switch (surface->format->BytesPerPixel) {
+        case 1: return *p;
+        case 2: return *reinterpret_cast<const Uint16*>(p);
+        case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            return (p[0] << 16) | (p[1] << 8) | p[2];
+#else
+            return p[0] | (p[1] << 8) | (p[2] << 16);
+#endif
+        default: return *reinterpret_cast<const Uint32*>(p);
+    }
+}
+
+static void _surface_put_pixel(SDL_Surface* surface, int x, int y, Uint32 pixel)
+{
+    Uint8* p = static_cast<Uint8*>(surface->pixels) +
+               y * surface->pitch + x * surface->format->BytesPerPixel;
+    switch (surface->format->BytesPerPixel) {
+        case 1: *p = static_cast<Uint8>(pixel); break;
+        case 2: *reinterpret_cast<Uint16*>(p) = static_cast<Uint16>(pixel); break;
+        case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            p[0] = (pixel >> 16) & 0xFF; p[1] = (pixel >> 8) & 0xFF; p[2] = pixel & 0xFF;
+#else
+            p[0] = pixel & 0xFF; p[1] = (pixel >> 8) & 0xFF; p[2] = (pixel >> 16) & 0xFF;
+#endif
+            break;
+        default: *reinterpret_cast<Uint32*>(p) = pixel; break;
     }
-    SDL_SetWindowTitle(display->window, title);
 }
 
-bool al_resize_display(ALLEGRO_DISPLAY* display, int width, int height)
+static bool _ensure_shadow(ALLEGRO_BITMAP* root)
 {
-    if (!display) {
-        display = _current_display;
+    if (root->shadow) {
+        return true;
     }
-    if (!display) {
+    
+    Uint32 format;
+    if (SDL_QueryTexture(root->texture, &format, nullptr, nullptr, nullptr) != 0) {
+        return false;
+    }
+    root->shadow = SDL_CreateRGBSurfaceWithFormat(0, root->width, root->height,
+                                                  SDL_BITSPERPIXEL(format), format);
+    if (!root->shadow) {
         return false;
     }
     
-    SDL_SetWindowSize(display->window, width, height);
-    display->width = width;
-    display->height = height;
-    
+    root->shadow_tiles_x = (root->width + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+    root->shadow_tiles_y = (root->height + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+    int count = root->shadow_tiles_x * root->shadow_tiles_y;
+    root->shadow_tiles = new Uint8[count];
+    memset(root->shadow_tiles, SHADOW_TILE_STALE, count);
+    root->shadow_dirty_tiles = 0;
     return true;
 }
 
-bool al_acknowledge_resize(ALLEGRO_DISPLAY* display)
+static void _shadow_tile_rect(ALLEGRO_BITMAP* root, int tx, int ty, SDL_Rect* rect)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    if (!display) {
-        return false;
+    rect->x = tx * SHADOW_TILE_SIZE;
+    rect->y = ty * SHADOW_TILE_SIZE;
+    rect->w = SDL_min(SHADOW_TILE_SIZE, root->width - rect->x);
+    rect->h = SDL_min(SHADOW_TILE_SIZE, root->height - rect->y);
+}
+
+static void _upload_shadow(ALLEGRO_BITMAP* bitmap)
+{
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    if (!root->shadow || root->shadow_dirty_tiles == 0) {
+        return;
     }
     
-    int w, h;
-    SDL_GetWindowSize(display->window, &w, &h);
-    display->width = w;
-    display->height = h;
-    
-    return true;
+    int bpp = root->shadow->format->BytesPerPixel;
+    for (int ty = 0; ty < root->shadow_tiles_y; ty++) {
+        for (int tx = 0; tx < root->shadow_tiles_x; tx++) {
+            Uint8* state = &root->shadow_tiles[ty * root->shadow_tiles_x + tx];
+            if (*state != SHADOW_TILE_DIRTY) {
+                continue;
+            }
+            SDL_Rect rect;
+            _shadow_tile_rect(root, tx, ty, &rect);
+            const Uint8* pixels = static_cast<const Uint8*>(root->shadow->pixels) +
+                                  rect.y * root->shadow->pitch + rect.x * bpp;
+            SDL_UpdateTexture(root->texture, &rect, pixels, root->shadow->pitch);
+            *state = SHADOW_TILE_CLEAN;
+        }
+    }
+    root->shadow_dirty_tiles = 0;
 }
 
-void al_set_window_position(ALLEGRO_DISPLAY* display, int x, int y)
+static void _mark_shadow_stale(ALLEGRO_BITMAP* root, const SDL_Rect* rect)
 {
-    if (!display) {
-        display = _current_display;
+    if (!root->shadow) {
+        return;
     }
-    if (!display || !display->window) {
+    
+    int x1 = SDL_max(rect->x, 0);
+    int y1 = SDL_max(rect->y, 0);
+    int x2 = SDL_min(rect->x + rect->w, root->width);
+    int y2 = SDL_min(rect->y + rect->h, root->height);
+    if (x2 <= x1 || y2 <= y1) {
         return;
     }
-    SDL_SetWindowPosition(display->window, x, y);
+    
+    for (int ty = y1 / SHADOW_TILE_SIZE; ty <= (y2 - 1) / SHADOW_TILE_SIZE; ty++) {
+        for (int tx = x1 / SHADOW_TILE_SIZE; tx <= (x2 - 1) / SHADOW_TILE_SIZE; tx++) {
+            root->shadow_tiles[ty * root->shadow_tiles_x + tx] = SHADOW_TILE_STALE;
+        }
+    }
 }
 
-void al_get_window_position(ALLEGRO_DISPLAY* display, int* x, int* y)
+/* The clip in force before _begin_texture_access, when the cache knows it. */
+struct TextureAccess {
+    bool clip_known;
+    bool clip_enabled;
+    SDL_Rect clip_rect;
+};
+
+/* Points the renderer at the whole of root's texture with no viewport and
+ * no clip, so readbacks and uploads work in root-texture coordinates even
+ * when root is already the target through a sub-bitmap or atlas viewport
+ * or with a clipping rectangle set. */
+static void _begin_texture_access(ALLEGRO_BITMAP* root, TextureAccess* access)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    if (!display || !display->window) {
-        if (x) *x = 0;
-        if (y) *y = 0;
-        return;
+    access->clip_known = _current_display->clip_valid;
+    access->clip_enabled = _current_display->clip_enabled;
+    access->clip_rect = _current_display->clip_rect;
+    _cache_set_render_target(_current_display, root->texture);
+    _cache_set_viewport(_current_display, nullptr);
+    _cache_set_clip_rect(_current_display, nullptr);
+}
+
+static void _end_texture_access(const TextureAccess* access)
+{
+    _apply_target_bitmap(_current_display, _target_bitmap);
+    if (access->clip_known) {
+        _cache_set_clip_rect(_current_display, access->clip_enabled ? &access->clip_rect : nullptr);
     }
-    SDL_GetWindowPosition(display->window, x, y);
 }
 
-void al_flip_display(void)
+/* Reads every stale tile touching rect back from the GPU, one
+ * SDL_RenderReadPixels per tile. */
+static void _read_shadow_tiles(ALLEGRO_BITMAP* root, const SDL_Rect* rect)
 {
-    if (_current_display && _current_display->renderer) {
-        SDL_RenderPresent(_current_display->renderer);
+    TextureAccess access;
+    int bpp = root->shadow->format->BytesPerPixel;
+    bool read = false;
+    
+    for (int ty = rect->y / SHADOW_TILE_SIZE; ty <= (rect->y + rect->h - 1) / SHADOW_TILE_SIZE; ty++) {
+        for (int tx = rect->x / SHADOW_TILE_SIZE; tx <= (rect->x + rect->w - 1) / SHADOW_TILE_SIZE; tx++) {
+            Uint8* state = &root->shadow_tiles[ty * root->shadow_tiles_x + tx];
+            if (*state != SHADOW_TILE_STALE) {
+                continue;
+            }
+            if (!read) {
+                _begin_texture_access(root, &access);
+                read = true;
+            }
+            SDL_Rect tile;
+            _shadow_tile_rect(root, tx, ty, &tile);
+            Uint8* pixels = static_cast<Uint8*>(root->shadow->pixels) +
+                            tile.y * root->shadow->pitch + tile.x * bpp;
+            SDL_RenderReadPixels(_current_display->renderer, &tile,
+                                 root->shadow->format->format, pixels, root->shadow->pitch);
+            *state = SHADOW_TILE_CLEAN;
+        }
+    }
+    
+    if (read) {
+        _end_texture_access(&access);
     }
 }
 
-void al_clear_to_color(ALLEGRO_COLOR color)
+/* Called before the GPU draws into the current target. bounds is in target
+ * coordinates; nullptr means the whole target. */
+static void _begin_target_draw(const SDL_FRect* bounds)
 {
-    if (!_current_display || !_current_display->renderer) {
+    if (!_target_bitmap) {
+        return;
+    }
+    ALLEGRO_BITMAP* root = _target_bitmap->parent ? _target_bitmap->parent : _target_bitmap;
+    if (!root->shadow) {
         return;
     }
     
-    SDL_SetRenderDrawColor(
-        _current_display->renderer,
-        (Uint8)(color.r * 255),
-        (Uint8)(color.g * 255),
-        (Uint8)(color.b * 255),
-        (Uint8)(color.a * 255)
-    );
-    SDL_RenderClear(_current_display->renderer);
+    _upload_shadow(root);
+    
+    SDL_Rect rect = {_target_bitmap->xofs, _target_bitmap->yofs,
+                     _target_bitmap->width, _target_bitmap->height};
+    if (bounds) {
+        int x1 = SDL_max(static_cast<int>(floorf(bounds->x)), 0);
+        int y1 = SDL_max(static_cast<int>(floorf(bounds->y)), 0);
+        int x2 = SDL_min(static_cast<int>(ceilf(bounds->x + bounds->w)) + 1, _target_bitmap->width);
+        int y2 = SDL_min(static_cast<int>(ceilf(bounds->y + bounds->h)) + 1, _target_bitmap->height);
+        rect.x += x1;
+        rect.y += y1;
+        rect.w = x2 - x1;
+        rect.h = y2 - y1;
+    }
+    _mark_shadow_stale(root, &rect);
 }
 
-void al_set_new_display_flags(int flags)
+static bool _target_has_shadow(void)
 {
-    _new_display_flags = flags;
+    if (!_target_bitmap) {
+        return false;
+    }
+    ALLEGRO_BITMAP* root = _target_bitmap->parent ? _target_bitmap->parent : _target_bitmap;
+    return root->shadow != nullptr;
 }
 
-int al_get_new_display_flags(void)
+static int _blender_op = ALLEGRO_ADD;
+static int _blender_src = ALLEGRO_ALPHA;
+static int _blender_dst = ALLEGRO_INVERSE_ALPHA;
+static int _blender_alpha_op = ALLEGRO_ADD;
+static int _blender_alpha_src = ALLEGRO_ALPHA;
+static int _blender_alpha_dst = ALLEGRO_INVERSE_ALPHA;
+
+struct BlendModeCacheEntry {
+    int op, src, dst;
+    int alpha_op, alpha_src, alpha_dst;
+    SDL_BlendMode mode;
+};
+
+static const int BLEND_MODE_CACHE_SIZE = 16;
+static BlendModeCacheEntry _blend_mode_cache[BLEND_MODE_CACHE_SIZE];
+static int _blend_mode_cache_count = 0;
+static int _blend_mode_cache_next = 0;
+static SDL_BlendMode _blender_mode = SDL_BLENDMODE_BLEND;
+static bool _blender_mode_valid = false;
+
+static SDL_BlendFactor _allegro_to_sdl_blend_factor(int factor)
 {
-    return _new_display_flags;
+    switch (factor) {
+        case ALLEGRO_ZERO:               return SDL_BLENDFACTOR_ZERO;
+        case ALLEGRO_ONE:                return SDL_BLENDFACTOR_ONE;
+        case ALLEGRO_ALPHA:              return SDL_BLENDFACTOR_SRC_ALPHA;
+        case ALLEGRO_INVERSE_ALPHA:      return SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA;
+        case ALLEGRO_SRC_COLOR:          return SDL_BLENDFACTOR_SRC_COLOR;
+        case ALLEGRO_DEST_COLOR:         return SDL_BLENDFACTOR_DST_COLOR;
+        case ALLEGRO_INVERSE_SRC_COLOR:  return SDL_BLENDFACTOR_ONE_MINUS_SRC_COLOR;
+        case ALLEGRO_INVERSE_DEST_COLOR: return SDL_BLENDFACTOR_ONE_MINUS_DST_COLOR;
+        default:                         return SDL_BLENDFACTOR_ONE;
+    }
 }
 
-void al_set_new_display_refresh_rate(int refresh_rate)
+static SDL_BlendOperation _allegro_to_sdl_blend_op(int op)
 {
-    _new_display_refresh_rate = refresh_rate;
+    switch (op) {
+        case ALLEGRO_SUB:
+        case ALLEGRO_SRC_MINUS_DEST:     return SDL_BLENDOPERATION_SUBTRACT;
+        case ALLEGRO_DEST_MINUS_SRC:     return SDL_BLENDOPERATION_REV_SUBTRACT;
+        default:                         return SDL_BLENDOPERATION_ADD;
+    }
 }
 
-int al_get_new_display_refresh_rate(void)
+/* SDL has no constant blend colour, so blenders using one are refused
+ * rather than approximated. */
+static bool _blend_factor_supported(int factor)
 {
-    return _new_display_refresh_rate;
+    return factor >= ALLEGRO_ZERO && factor <= ALLEGRO_INVERSE_DEST_COLOR;
 }
 
-void al_set_new_window_title(const char* title)
+struct StandardBlender {
+    int op, src, dst;
+    int alpha_op, alpha_src, alpha_dst;
+    SDL_BlendMode mode;
+};
+
+/* Blenders every SDL renderer supports, tried before composing a custom
+ * mode. Colours and textures in the shim carry straight alpha, so Allegro's
+ * premultiplied default (ONE, INVERSE_ALPHA) and additive (ONE, ONE)
+ * blenders are taken to mean SDL's straight-alpha BLEND and ADD modes, and
+ * the shim's own default, ALPHA/INVERSE_ALPHA for both colour and alpha,
+ * means BLEND as well. The software rasterizer blends these with the
+ * factors of the SDL mode, in _sdl_mode_blenders, so memory and video
+ * targets agree. */
+static const StandardBlender _standard_blenders[] = {
+    {ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA, ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA,
+     SDL_BLENDMODE_BLEND},
+    {ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA, ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA,
+     SDL_BLENDMODE_BLEND},
+    {ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA, ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA,
+     SDL_BLENDMODE_BLEND},
+    {ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO, ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO,
+     SDL_BLENDMODE_NONE},
+    {ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ONE, ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ONE,
+     SDL_BLENDMODE_ADD},
+    {ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_ONE, ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ONE,
+     SDL_BLENDMODE_ADD},
+    {ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_SRC_COLOR, ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ONE,
+     SDL_BLENDMODE_MOD},
+    {ALLEGRO_ADD, ALLEGRO_DEST_COLOR, ALLEGRO_ZERO, ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ONE,
+     SDL_BLENDMODE_MOD},
+};
+
+/* What each SDL mode computes, as Allegro factors. */
+static const StandardBlender _sdl_mode_blenders[] = {
+    {ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA, ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA,
+     SDL_BLENDMODE_BLEND},
+    {ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO, ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO,
+     SDL_BLENDMODE_NONE},
+    {ALLEGRO_ADD, ALLEGRO_ALPHA, ALLEGRO_ONE, ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ONE,
+     SDL_BLENDMODE_ADD},
+    {ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_SRC_COLOR, ALLEGRO_ADD, ALLEGRO_ZERO, ALLEGRO_ONE,
+     SDL_BLENDMODE_MOD},
+};
+
+static const StandardBlender* _find_standard_blender(int op, int src, int dst,
+                                                     int alpha_op, int alpha_src, int alpha_dst)
 {
-    _new_window_title = title;
+    for (size_t i = 0; i < sizeof(_standard_blenders) / sizeof(_standard_blenders[0]); i++) {
+        const StandardBlender& b = _standard_blenders[i];
+        if (b.op == op && b.src == src && b.dst == dst &&
+            b.alpha_op == alpha_op && b.alpha_src == alpha_src && b.alpha_dst == alpha_dst) {
+            return &b;
+        }
+    }
+    return nullptr;
 }
 
-const char* al_get_new_window_title(void)
+static SDL_BlendMode _compose_blend_mode(int op, int src, int dst, int alpha_op, int alpha_src, int alpha_dst)
 {
-    return _new_window_title;
+    const StandardBlender* standard = _find_standard_blender(op, src, dst, alpha_op, alpha_src, alpha_dst);
+    if (standard) {
+        return standard->mode;
+    }
+    
+    return SDL_ComposeCustomBlendMode(_allegro_to_sdl_blend_factor(src), _allegro_to_sdl_blend_factor(dst),
+                                      _allegro_to_sdl_blend_op(op),
+                                      _allegro_to_sdl_blend_factor(alpha_src),
+                                      _allegro_to_sdl_blend_factor(alpha_dst),
+                                      _allegro_to_sdl_blend_op(alpha_op));
 }
 
-void al_set_new_window_position(int x, int y)
+static SDL_BlendMode _get_blender_mode(void)
 {
-    _new_window_x = x;
-    _new_window_y = y;
+    if (_blender_mode_valid) {
+        return _blender_mode;
+    }
+    
+    for (int i = 0; i < _blend_mode_cache_count; i++) {
+        const BlendModeCacheEntry& e = _blend_mode_cache[i];
+        if (e.op == _blender_op && e.src == _blender_src && e.dst == _blender_dst &&
+            e.alpha_op == _blender_alpha_op && e.alpha_src == _blender_alpha_src &&
+            e.alpha_dst == _blender_alpha_dst) {
+            _blender_mode = e.mode;
+            _blender_mode_valid = true;
+            return _blender_mode;
+        }
+    }
+    
+    BlendModeCacheEntry& e = _blend_mode_cache[_blend_mode_cache_next];
+    e.op = _blender_op;
+    e.src = _blender_src;
+    e.dst = _blender_dst;
+    e.alpha_op = _blender_alpha_op;
+    e.alpha_src = _blender_alpha_src;
+    e.alpha_dst = _blender_alpha_dst;
+    e.mode = _compose_blend_mode(_blender_op, _blender_src, _blender_dst,
+                                 _blender_alpha_op, _blender_alpha_src, _blender_alpha_dst);
+    _blend_mode_cache_next = (_blend_mode_cache_next + 1) % BLEND_MODE_CACHE_SIZE;
+    if (_blend_mode_cache_count < BLEND_MODE_CACHE_SIZE) {
+        _blend_mode_cache_count++;
+    }
+    
+    _blender_mode = e.mode;
+    _blender_mode_valid = true;
+    return _blender_mode;
+}
+
+/* The blender the software rasterizer uses: the current one, or for a
+ * standard blender the factors of the SDL mode it stands for. */
+static StandardBlender _soft_blender;
+static bool _soft_blender_valid = false;
+
+static const StandardBlender* _get_soft_blender(void)
+{
+    if (_soft_blender_valid) {
+        return &_soft_blender;
+    }
+    
+    _soft_blender.op = _blender_op;
+    _soft_blender.src = _blender_src;
+    _soft_blender.dst = _blender_dst;
+    _soft_blender.alpha_op = _blender_alpha_op;
+    _soft_blender.alpha_src = _blender_alpha_src;
+    _soft_blender.alpha_dst = _blender_alpha_dst;
+    _soft_blender.mode = SDL_BLENDMODE_INVALID;
+    const StandardBlender* standard = _find_standard_blender(_blender_op, _blender_src, _blender_dst,
+                                                             _blender_alpha_op, _blender_alpha_src,
+                                                             _blender_alpha_dst);
+    for (size_t i = 0; standard && i < sizeof(_sdl_mode_blenders) / sizeof(_sdl_mode_blenders[0]); i++) {
+        if (_sdl_mode_blenders[i].mode == standard->mode) {
+            _soft_blender = _sdl_mode_blenders[i];
+            break;
+        }
+    }
+    _soft_blender_valid = true;
+    return &_soft_blender;
 }
 
-void al_get_new_window_position(int* x, int* y)
+static void _cache_set_texture_blend_mode(ALLEGRO_BITMAP* bitmap, SDL_BlendMode mode)
 {
-    if (x) *x = _new_window_x;
-    if (y) *y = _new_window_y;
+    if (bitmap->parent) {
+        bitmap = bitmap->parent;
+    }
+    
+    if (bitmap->blend_mode_valid && bitmap->blend_mode == mode) {
+        if (_current_display) {
+            _current_display->state_stats.elided_blend_mode++;
+        }
+        return;
+    }
+    if (SDL_SetTextureBlendMode(bitmap->texture, mode) != 0) {
+        SDL_SetTextureBlendMode(bitmap->texture, SDL_BLENDMODE_BLEND);
+    }
+    bitmap->blend_mode = mode;
+    bitmap->blend_mode_valid = true;
+    if (_current_display) {
+        _current_display->state_stats.issued++;
+    }
 }
 
-void al_set_new_display_adapter(int adapter)
+static void _apply_render_blender(void)
 {
-    _new_display_adapter = adapter;
+    _cache_set_blend_mode(_current_display, _get_blender_mode());
 }
 
-int al_get_new_display_adapter(void)
+/* Software rasterizer for memory bitmap targets. Every draw is reduced to
+ * convex polygons, lines and points in target coordinates. Each covered row
+ * is gathered into a span of ARGB8888 source pixels, tinted, and blended into
+ * the target surface by a span kernel chosen from the current blender. */
+struct SoftTarget {
+    SDL_Surface* surface;
+    int xofs;
+    int yofs;
+    int x1, y1, x2, y2;
+};
+
+enum SoftBlendKind {
+    SOFT_BLEND_COPY,
+    SOFT_BLEND_OVER,
+    SOFT_BLEND_GENERIC
+};
+
+static std::vector<Uint32> _soft_row;
+
+static bool _get_soft_target(SoftTarget* target)
 {
-    return _new_display_adapter;
+    if (!_target_bitmap) {
+        return false;
+    }
+    ALLEGRO_BITMAP* root = _target_bitmap->parent ? _target_bitmap->parent : _target_bitmap;
+    if (root->texture || !root->surface || root->surface->format->format != SDL_PIXELFORMAT_ARGB8888) {
+        return false;
+    }
+    
+    target->surface = root->surface;
+    target->xofs = _target_bitmap->xofs;
+    target->yofs = _target_bitmap->yofs;
+    target->x1 = 0;
+    target->y1 = 0;
+    target->x2 = _target_bitmap->width;
+    target->y2 = _target_bitmap->height;
+    
+    if (_clipping_initialized) {
+        target->x1 = SDL_max(target->x1, static_cast<int>(_clip_x));
+        target->y1 = SDL_max(target->y1, static_cast<int>(_clip_y));
+        target->x2 = SDL_min(target->x2, static_cast<int>(_clip_x + _clip_w));
+        target->y2 = SDL_min(target->y2, static_cast<int>(_clip_y + _clip_h));
+    }
+    return true;
 }
 
-int al_get_display_adapter(ALLEGRO_DISPLAY* display)
+static bool _is_soft_target(void)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    return _new_display_adapter;
+    SoftTarget target;
+    return _get_soft_target(&target);
 }
 
-static bool _bitmap_drawing_held = false;
+static inline Uint32* _soft_pixel_ptr(const SoftTarget* target, int x, int y)
+{
+    return reinterpret_cast<Uint32*>(static_cast<Uint8*>(target->surface->pixels) +
+                                     (y + target->yofs) * target->surface->pitch) + x + target->xofs;
+}
 
-void al_hold_bitmap_drawing(bool hold)
+static inline Uint32 _soft_pack(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
 {
-    _bitmap_drawing_held = hold;
+    return (static_cast<Uint32>(a) << 24) | (static_cast<Uint32>(r) << 16) |
+           (static_cast<Uint32>(g) << 8) | b;
 }
 
-bool al_is_bitmap_drawing_held(void)
+static inline Uint32 _soft_color(ALLEGRO_COLOR color)
 {
-    return _bitmap_drawing_held;
+    return _soft_pack(static_cast<Uint8>(color.r * 255), static_cast<Uint8>(color.g * 255),
+                      static_cast<Uint8>(color.b * 255), static_cast<Uint8>(color.a * 255));
 }
 
-ALLEGRO_COLOR al_map_rgb(uint8_t r, uint8_t g, uint8_t b)
+static inline Uint32 _soft_div255(Uint32 v)
 {
-    ALLEGRO_COLOR color;
-    color.r = r / 255.0f;
-    color.g = g / 255.0f;
-    color.b = b / 255.0f;
-    color.a = 1.0f;
-    return color;
+    v += 128;
+    return (v + (v >> 8)) >> 8;
 }
 
-ALLEGRO_COLOR al_map_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+static SoftBlendKind _soft_blend_kind(void)
 {
-    ALLEGRO_COLOR color;
-    color.r = r / 255.0f;
-    color.g = g / 255.0f;
-    color.b = b / 255.0f;
-    color.a = a / 255.0f;
-    return color;
+    const StandardBlender* b = _get_soft_blender();
+    if (b->mode == SDL_BLENDMODE_NONE) {
+        return SOFT_BLEND_COPY;
+    }
+    if (b->mode == SDL_BLENDMODE_BLEND) {
+        return SOFT_BLEND_OVER;
+    }
+    return SOFT_BLEND_GENERIC;
 }
 
-ALLEGRO_COLOR al_map_rgb_f(float r, float g, float b)
+/* The AVX2 span kernels carry a per-function target attribute and are
+ * picked at run time, so capable CPUs use them without the whole shim
+ * being built with -mavx2. */
+#if defined(__SSE2__) && defined(__GNUC__)
+#define SOFT_AVX2_DISPATCH
+static bool _cpu_has_avx2(void)
 {
-    ALLEGRO_COLOR color;
-    color.r = r;
-    color.g = g;
-    color.b = b;
-    color.a = 1.0f;
-    return color;
+    static const bool has_avx2 = SDL_HasAVX2() == SDL_TRUE;
+    return has_avx2;
 }
+#endif
 
-ALLEGRO_COLOR al_map_rgba_f(float r, float g, float b, float a)
+#if defined(SOFT_AVX2_DISPATCH)
+/* AVX2 half of _soft_modulate_span; returns how many pixels it did. */
+__attribute__((target("avx2")))
+static int _soft_modulate_span_avx2(Uint32* row, int n, Uint32 tint)
 {
-    ALLEGRO_COLOR color;
-    color.r = r;
-    color.g = g;
-    color.b = b;
-    color.a = a;
-    return color;
+    int i = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i t = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(tint)), zero);
+    const __m256i bias = _mm256_set1_epi16(128);
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(p, zero), t), bias);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(p, zero), t), bias);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_packus_epi16(lo, hi));
+    }
+    return i;
 }
+#endif
 
-ALLEGRO_COLOR al_premul_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+/* Multiplies every pixel of row by tint, channel-wise. */
+static void _soft_modulate_span(Uint32* row, int n, Uint32 tint)
 {
-    float alpha = a / 255.0f;
-    ALLEGRO_COLOR color;
-    color.r = (r / 255.0f) * alpha;
-    color.g = (g / 255.0f) * alpha;
-    color.b = (b / 255.0f) * alpha;
-    color.a = alpha;
-    return color;
+    if (tint == 0xFFFFFFFF) {
+        return;
+    }
+    
+    int i = 0;
+#if defined(SOFT_AVX2_DISPATCH)
+    if (_cpu_has_avx2()) {
+        i = _soft_modulate_span_avx2(row, n, tint);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i t = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(tint)), zero);
+        const __m128i bias = _mm_set1_epi16(128);
+        for (; i + 4 <= n; i += 4) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), t), bias);
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), t), bias);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        Uint32 p = row[i];
+        Uint32 r = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            r |= _soft_div255(((p >> shift) & 0xFF) * ((tint >> shift) & 0xFF)) << shift;
+        }
+        row[i] = r;
+    }
 }
 
-ALLEGRO_COLOR al_premul_rgba_f(float r, float g, float b, float a)
+static float _soft_factor(int factor, float s, float sa, float d)
 {
-    ALLEGRO_COLOR color;
-    color.r = r * a;
-    color.g = g * a;
-    color.b = b * a;
-    color.a = a;
-    return color;
+    switch (factor) {
+        case ALLEGRO_ZERO:               return 0.0f;
+        case ALLEGRO_ALPHA:              return sa;
+        case ALLEGRO_INVERSE_ALPHA:      return 1.0f - sa;
+        case ALLEGRO_SRC_COLOR:          return s;
+        case ALLEGRO_DEST_COLOR:         return d;
+        case ALLEGRO_INVERSE_SRC_COLOR:  return 1.0f - s;
+        case ALLEGRO_INVERSE_DEST_COLOR: return 1.0f - d;
+        default:                         return 1.0f;
+    }
 }
 
-void al_unmap_rgb(ALLEGRO_COLOR color, uint8_t* r, uint8_t* g, uint8_t* b)
+static float _soft_blend_channel(int op, int src_factor, int dst_factor,
+                                 float s, float sa, float d)
 {
-    if (r) *r = (uint8_t)(color.r * 255);
-    if (g) *g = (uint8_t)(color.g * 255);
-    if (b) *b = (uint8_t)(color.b * 255);
+    float fs = s * _soft_factor(src_factor, s, sa, d);
+    float fd = d * _soft_factor(dst_factor, s, sa, d);
+    float r;
+    switch (op) {
+        case ALLEGRO_SUB:
+        case ALLEGRO_SRC_MINUS_DEST: r = fs - fd; break;
+        case ALLEGRO_DEST_MINUS_SRC: r = fd - fs; break;
+        default:                     r = fs + fd; break;
+    }
+    return r < 0.0f ? 0.0f : (r > 1.0f ? 1.0f : r);
 }
 
-void al_unmap_rgba(ALLEGRO_COLOR color, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+static void _soft_blend_generic(Uint32* dst, const Uint32* src, int n)
 {
-    if (r) *r = (uint8_t)(color.r * 255);
-    if (g) *g = (uint8_t)(color.g * 255);
-    if (b) *b = (uint8_t)(color.b * 255);
-    if (a) *a = (uint8_t)(color.a * 255);
+    const StandardBlender* blender = _get_soft_blender();
+    const float inv = 1.0f / 255.0f;
+    for (int i = 0; i < n; i++) {
+        Uint32 s = src[i];
+        Uint32 d = dst[i];
+        float sa = (s >> 24) * inv, sr = ((s >> 16) & 0xFF) * inv;
+        float sg = ((s >> 8) & 0xFF) * inv, sb = (s & 0xFF) * inv;
+        float da = (d >> 24) * inv, dr = ((d >> 16) & 0xFF) * inv;
+        float dg = ((d >> 8) & 0xFF) * inv, db = (d & 0xFF) * inv;
+        
+        float r = _soft_blend_channel(blender->op, blender->src, blender->dst, sr, sa, dr);
+        float g = _soft_blend_channel(blender->op, blender->src, blender->dst, sg, sa, dg);
+        float b = _soft_blend_channel(blender->op, blender->src, blender->dst, sb, sa, db);
+        float a = _soft_blend_channel(blender->alpha_op, blender->alpha_src, blender->alpha_dst,
+                                      sa, sa, da);
+        dst[i] = _soft_pack(static_cast<Uint8>(r * 255 + 0.5f), static_cast<Uint8>(g * 255 + 0.5f),
+                            static_cast<Uint8>(b * 255 + 0.5f), static_cast<Uint8>(a * 255 + 0.5f));
+    }
+}
+
+#if defined(SOFT_AVX2_DISPATCH)
+/* AVX2 half of _soft_blend_over; returns how many pixels it did. */
+__attribute__((target("avx2")))
+static int _soft_blend_over_avx2(Uint32* dst, const Uint32* src, int n)
+{
+    int i = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i bias = _mm256_set1_epi16(128);
+    const __m256i alpha_lane = _mm256_set1_epi64x(static_cast<long long>(0xFFFF000000000000ULL));
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i res[2];
+        for (int h = 0; h < 2; h++) {
+            __m256i s16 = h ? _mm256_unpackhi_epi8(s, zero) : _mm256_unpacklo_epi8(s, zero);
+            __m256i d16 = h ? _mm256_unpackhi_epi8(d, zero) : _mm256_unpacklo_epi8(d, zero);
+            __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xFF), 0xFF);
+            __m256i f = _mm256_or_si256(_mm256_andnot_si256(alpha_lane, a), _mm256_and_si256(alpha_lane, c255));
+            __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d16, _mm256_sub_epi16(c255, a)), bias);
+            t = _mm256_add_epi16(t, _mm256_mullo_epi16(s16, f));
+            res[h] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(res[0], res[1]));
+    }
+    return i;
+}
+#endif
+
+/* SDL_BLENDMODE_BLEND: dst = src * a + dst * (1 - a) for colour and
+ * dst = a + dst * (1 - a) for alpha. */
+static void _soft_blend_over(Uint32* dst, const Uint32* src, int n)
+{
+    int i = 0;
+#if defined(SOFT_AVX2_DISPATCH)
+    if (_cpu_has_avx2()) {
+        i = _soft_blend_over_avx2(dst, src, n);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i c255 = _mm_set1_epi16(255);
+        const __m128i bias = _mm_set1_epi16(128);
+        const __m128i alpha_lane = _mm_set1_epi64x(static_cast<long long>(0xFFFF000000000000ULL));
+        for (; i + 4 <= n; i += 4) {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+            __m128i res[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i s16 = h ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+                __m128i d16 = h ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+                __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xFF), 0xFF);
+                __m128i f = _mm_or_si128(_mm_andnot_si128(alpha_lane, a), _mm_and_si128(alpha_lane, c255));
+                __m128i t = _mm_add_epi16(_mm_mullo_epi16(d16, _mm_sub_epi16(c255, a)), bias);
+                t = _mm_add_epi16(t, _mm_mullo_epi16(s16, f));
+                res[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(res[0], res[1]));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        Uint32 s = src[i];
+        Uint32 d = dst[i];
+        Uint32 a = s >> 24;
+        Uint32 r = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            Uint32 sc = (s >> shift) & 0xFF;
+            Uint32 dc = (d >> shift) & 0xFF;
+            Uint32 f = shift == 24 ? 255 : a;
+            r |= _soft_div255(sc * f + dc * (255 - a)) << shift;
+        }
+        dst[i] = r;
+    }
 }
 
-void al_unmap_rgb_f(ALLEGRO_COLOR color, float* r, float* g, float* b)
+static void _soft_blend_span(Uint32* dst, const Uint32* src, int n, SoftBlendKind kind)
 {
-    if (r) *r = color.r;
-    if (g) *g = color.g;
-    if (b) *b = color.b;
+    switch (kind) {
+        case SOFT_BLEND_COPY:
+            memcpy(dst, src, n * sizeof(Uint32));
+            break;
+        case SOFT_BLEND_OVER:
+            _soft_blend_over(dst, src, n);
+            break;
+        default:
+            _soft_blend_generic(dst, src, n);
+            break;
+    }
 }
 
-void al_unmap_rgba_f(ALLEGRO_COLOR color, float* r, float* g, float* b, float* a)
+static Uint32* _soft_scratch(int n)
 {
-    if (r) *r = color.r;
-    if (g) *g = color.g;
-    if (b) *b = color.b;
-    if (a) *a = color.a;
+    if (_soft_row.size() < static_cast<size_t>(n)) {
+        _soft_row.resize(n);
+    }
+    return _soft_row.data();
 }
 
-struct ColorNameEntry {
-    const char* name;
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-};
+static void _soft_fill_span(const SoftTarget* target, int x1, int x2, int y, Uint32 color, SoftBlendKind kind)
+{
+    int n = x2 - x1;
+    Uint32* dst = _soft_pixel_ptr(target, x1, y);
+    if (kind == SOFT_BLEND_COPY) {
+        for (int i = 0; i < n; i++) {
+            dst[i] = color;
+        }
+        return;
+    }
+    Uint32* row = _soft_scratch(n);
+    for (int i = 0; i < n; i++) {
+        row[i] = color;
+    }
+    _soft_blend_span(dst, row, n, kind);
+}
 
-static const ColorNameEntry _color_names[] = {
-    {"black", 0, 0, 0},
-    {"white", 255, 255, 255},
-    {"red", 255, 0, 0},
-    {"green", 0, 255, 0},
-    {"blue", 0, 0, 255},
-    {"yellow", 255, 255, 0},
-    {"cyan", 0, 255, 255},
-    {"magenta", 255, 0, 255},
-    {"aqua", 0, 255, 255},
-    {"azure", 0, 127, 255},
-    {"beige", 245, 245, 220},
-    {"bisque", 255, 228, 196},
-    {"blanchedalmond", 255, 235, 205},
-    {"blueviolet", 138, 43, 226},
-    {"brown", 165, 42, 42},
-    {"burlywood", 222, 184, 135},
-    {"cadetblue", 95, 158, 160},
-    {"chartreuse", 127, 255, 0},
-    {"chocolate", 210, 105, 30},
-    {"coral", 255, 127, 80},
-    {"cornflowerblue", 100, 149, 237},
-    {"cornsilk", 255, 248, 220},
-    {"crimson", 220, 20, 60},
-    {"darkblue", 0, 0, 139},
-    {"darkcyan", 0, 139, 139},
-    {"darkgoldenrod", 184, 134, 11},
-    {"darkgray", 169, 169, 169},
-    {"darkgreen", 0, 100, 0},
-    {"darkkhaki", 189, 183, 107},
-    {"darkmagenta", 139, 0, 139},
-    {"darkolivegreen", 85, 107, 47},
-    {"darkorange", 255, 140, 0},
-    {"darkorchid", 153, 50, 204},
-    {"darkred", 139, 0, 0},
-    {"darksalmon", 233, 150, 122},
-    {"darkseagreen", 143, 188, 143},
-    {"darkslateblue", 72, 61, 139},
-    {"darkslategray", 47, 79, 79},
-    {"darkturquoise", 0, 206, 209},
-    {"darkviolet", 148, 0, 211},
-    {"deeppink", 255, 20, 147},
-    {"deepskyblue", 0, 191, 255},
-    {"dimgray", 105, 105, 105},
-    {"dodgerblue", 30, 144, 255},
-    {"firebrick", 178, 34, 34},
-    {"floralwhite", 255, 250, 240},
-    {"forestgreen", 34, 139, 34},
-    {"fuchsia", 255, 0, 255},
-    {"gainsboro", 220, 220, 220},
-    {"ghostwhite", 248, 248, 255},
-    {"gold", 255, 215, 0},
-    {"goldenrod", 218, 165, 32},
-    {"gray", 128, 128, 128},
-    {"greenyellow", 173, 255, 47},
-    {"honeydew", 240, 255, 240},
-    {"hotpink", 255, 105, 180},
-    {"indianred", 205, 92, 92},
-    {"indigo", 75, 0, 130},
-    {"ivory", 255, 255, 240},
-    {"khaki", 240, 230, 140},
-    {"lavender", 230, 230, 250},
-    {"lavenderblush", 255, 240, 245},
-    {"lawngreen", 124, 252, 0},
-    {"lemonchiffon", 255, 250, 205},
-    {"lightblue", 173, 216, 230},
-    {"lightcoral", 240, 128, 128},
-    {"lightcyan", 224, 255, 255},
-    {"lightgoldenrodyellow", 250, 250, 210},
-    {"lightgray", 211, 211, 211},
-    {"lightgreen", 144, 238, 144},
-    {"lightpink", 255, 182, 193},
-    {"lightsalmon", 255, 160, 122},
-    {"lightseagreen", 32, 178, 170},
-    {"lightskyblue", 135, 206, 250},
-    {"lightslategray", 119, 136, 153},
-    {"lightsteelblue", 176, 196, 222},
-    {"lightyellow", 255, 255, 224},
-    {"lime", 0, 255, 0},
-    {"limegreen", 50, 205, 50},
-    {"linen", 250, 240, 230},
-    {"maroon", 128, 0, 0},
-    {"mediumaquamarine", 102, 205, 170},
-    {"mediumblue", 0, 0, 205},
-    {"mediumorchid", 186, 85, 211},
-    {"mediumpurple", 147, 112, 219},
-    {"mediumseagreen", 60, 179, 113},
-    {"mediumslateblue", 123, 104, 238},
-    {"mediumspringgreen", 0, 250, 154},
-    {"mediumturquoise", 72, 209, 204},
-    {"mediumvioletred", 199, 21, 133},
-    {"midnightblue", 25, 25, 112},
-    {"mintcream", 245, 255, 250},
-    {"mistyrose", 255, 228, 225},
-    {"moccasin", 255, 228, 181},
-    {"navajowhite", 255, 222, 173},
-    {"navy", 0, 0, 128},
-    {"oldlace", 253, 245, 230},
-    {"olive", 128, 128, 0},
-    {"olivedrab", 107, 142, 35},
-    {"orange", 255, 165, 0},
-    {"orangered", 255, 69, 0},
-    {"orchid", 218, 112, 214},
-    {"palegoldenrod", 238, 232, 170},
-    {"palegreen", 152, 251, 152},
-    {"paleturquoise", 175, 238, 238},
-    {"palevioletred", 219, 112, 147},
-    {"papayawhip", 255, 239, 213},
-    {"peachpuff", 255, 218, 185},
-    {"peru", 205, 133, 63},
-    {"pink", 255, 192, 203},
-    {"plum", 221, 160, 221},
-    {"powderblue", 176, 224, 230},
-    {"purple", 128, 0, 128},
-    {"rosybrown", 188, 143, 143},
-    {"royalblue", 65, 105, 225},
-    {"saddlebrown", 139, 69, 19},
-    {"salmon", 250, 128, 114},
-    {"sandybrown", 244, 164, 96},
-    {"seagreen", 46, 139, 87},
-    {"seashell", 255, 245, 238},
-    {"sienna", 160, 82, 45},
-    {"silver", 192, 192, 192},
-    {"skyblue", 135, 206, 235},
-    {"slateblue", 106, 90, 205},
-    {"slategray", 112, 128, 144},
-    {"snow", 255, 250, 250},
-    {"springgreen", 0, 255, 127},
-    {"steelblue", 70, 130, 180},
-    {"tan", 210, 180, 140},
-    {"teal", 0, 128, 128},
-    {"thistle", 216, 191, 216},
-    {"tomato", 255, 99, 71},
-    {"turquoise", 64, 224, 208},
-    {"violet", 238, 130, 238},
-    {"wheat", 245, 222, 179},
-    {"whitesmoke", 245, 245, 245},
-    {"yellowgreen", 154, 205, 50},
-};
+static void _soft_clear(const SoftTarget* target, Uint32 color)
+{
+    for (int y = target->y1; y < target->y2; y++) {
+        if (target->x2 > target->x1) {
+            _soft_fill_span(target, target->x1, target->x2, y, color, SOFT_BLEND_COPY);
+        }
+    }
+}
 
-bool al_color_name_to_rgb(const char* name, ALLEGRO_COLOR* color)
+static void _soft_put_pixel(const SoftTarget* target, float x, float y, Uint32 color, bool blend)
 {
-    if (!name || !color) {
-        return false;
+    int px = static_cast<int>(floorf(x));
+    int py = static_cast<int>(floorf(y));
+    if (px < target->x1 || py < target->y1 || px >= target->x2 || py >= target->y2) {
+        return;
     }
+    _soft_fill_span(target, px, px + 1, py, color, blend ? _soft_blend_kind() : SOFT_BLEND_COPY);
+}
 
-    for (const auto& entry : _color_names) {
-        if (strcasecmp(name, entry.name) == 0) {
-            color->r = entry.r / 255.0f;
-            color->g = entry.g / 255.0f;
-            color->b = entry.b / 255.0f;
-            color->a = 1.0f;
-            return true;
+static void _soft_draw_line(const SoftTarget* target, float x1, float y1, float x2, float y2, Uint32 color)
+{
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    int steps = static_cast<int>(ceilf(SDL_max(fabsf(dx), fabsf(dy))));
+    SoftBlendKind kind = _soft_blend_kind();
+    
+    for (int i = 0; i <= steps; i++) {
+        float t = steps ? static_cast<float>(i) / steps : 0.0f;
+        int px = static_cast<int>(floorf(x1 + dx * t));
+        int py = static_cast<int>(floorf(y1 + dy * t));
+        if (px >= target->x1 && py >= target->y1 && px < target->x2 && py < target->y2) {
+            _soft_fill_span(target, px, px + 1, py, color, kind);
+        }
+    }
+}
+
+static inline Uint32 _soft_color_of(const SDL_Color& c)
+{
+    return _soft_pack(c.r, c.g, c.b, c.a);
+}
+
+/* Rasterizes a convex polygon. A pixel is covered when its centre lies in
+ * [left, right) of the row's edge crossings, so polygons sharing an edge
+ * never touch a pixel twice. Texture coordinates and colours are linear over
+ * the polygon, so they are evaluated from the plane through the first three
+ * vertices; texture sampling is nearest-neighbour. */
+static void _soft_fill_convex(const SoftTarget* target, const SDL_Vertex* v, int n, SDL_Surface* texture)
+{
+    float ymin = v[0].position.y;
+    float ymax = ymin;
+    for (int i = 1; i < n; i++) {
+        ymin = SDL_min(ymin, v[i].position.y);
+        ymax = SDL_max(ymax, v[i].position.y);
+    }
+    int row1 = SDL_max(target->y1, static_cast<int>(ceilf(ymin - 0.5f)));
+    int row2 = SDL_min(target->y2, static_cast<int>(ceilf(ymax - 0.5f)));
+    if (row1 >= row2) {
+        return;
+    }
+    
+    float ex1 = v[1].position.x - v[0].position.x;
+    float ey1 = v[1].position.y - v[0].position.y;
+    float ex2 = v[2].position.x - v[0].position.x;
+    float ey2 = v[2].position.y - v[0].position.y;
+    float det = ex1 * ey2 - ex2 * ey1;
+    if (fabsf(det) < 1e-12f) {
+        return;
+    }
+    float inv_det = 1.0f / det;
+    
+    /* attr[k] = base + ddx * (x - x0) + ddy * (y - y0) for u, v, r, g, b, a */
+    float base[6], ddx[6], ddy[6];
+    for (int k = 0; k < 6; k++) {
+        float a[3];
+        for (int j = 0; j < 3; j++) {
+            switch (k) {
+                case 0: a[j] = v[j].tex_coord.x; break;
+                case 1: a[j] = v[j].tex_coord.y; break;
+                case 2: a[j] = v[j].color.r; break;
+                case 3: a[j] = v[j].color.g; break;
+                case 4: a[j] = v[j].color.b; break;
+                default: a[j] = v[j].color.a; break;
+            }
+        }
+        float d1 = a[1] - a[0];
+        float d2 = a[2] - a[0];
+        base[k] = a[0];
+        ddx[k] = (d1 * ey2 - d2 * ey1) * inv_det;
+        ddy[k] = (d2 * ex1 - d1 * ex2) * inv_det;
+    }
+    
+    bool flat = true;
+    for (int i = 1; i < n; i++) {
+        if (memcmp(&v[i].color, &v[0].color, sizeof(SDL_Color)) != 0) {
+            flat = false;
+            break;
+        }
+    }
+    Uint32 flat_color = _soft_color_of(v[0].color);
+    SoftBlendKind kind = _soft_blend_kind();
+    bool argb = texture && texture->format->format == SDL_PIXELFORMAT_ARGB8888;
+    int texture_format = texture ? _sdl_to_allegro_format(texture->format->format) : ALLEGRO_PIXEL_FORMAT_ANY;
+    
+    for (int y = row1; y < row2; y++) {
+        float cy = y + 0.5f;
+        float left = 1e30f;
+        float right = -1e30f;
+        for (int i = 0; i < n; i++) {
+            const SDL_FPoint& a = v[i].position;
+            const SDL_FPoint& b = v[(i + 1) % n].position;
+            if ((a.y <= cy && cy < b.y) || (b.y <= cy && cy < a.y)) {
+                float x = a.x + (cy - a.y) * (b.x - a.x) / (b.y - a.y);
+                left = SDL_min(left, x);
+                right = SDL_max(right, x);
+            }
+        }
+        int x1 = SDL_max(target->x1, static_cast<int>(ceilf(left - 0.5f)));
+        int x2 = SDL_min(target->x2, static_cast<int>(ceilf(right - 0.5f)));
+        if (x1 >= x2) {
+            continue;
+        }
+        
+        int count = x2 - x1;
+        Uint32* row = _soft_scratch(count);
+        float px = x1 + 0.5f - v[0].position.x;
+        float py = cy - v[0].position.y;
+        
+        if (texture) {
+            float u = (base[0] + ddx[0] * px + ddy[0] * py) * texture->w;
+            float t = (base[1] + ddx[1] * px + ddy[1] * py) * texture->h;
+            float du = ddx[0] * texture->w;
+            float dt = ddx[1] * texture->h;
+            for (int i = 0; i < count; i++, u += du, t += dt) {
+                int tx = SDL_max(0, SDL_min(texture->w - 1, static_cast<int>(floorf(u))));
+                int ty = SDL_max(0, SDL_min(texture->h - 1, static_cast<int>(floorf(t))));
+                if (argb) {
+                    row[i] = reinterpret_cast<const Uint32*>(
+                        static_cast<const Uint8*>(texture->pixels) + ty * texture->pitch)[tx];
+                } else if (texture_format != ALLEGRO_PIXEL_FORMAT_ANY) {
+                    row[i] = _decode_pixel(static_cast<const Uint8*>(texture->pixels) + ty * texture->pitch +
+                                           tx * texture->format->BytesPerPixel, texture_format);
+                } else {
+                    Uint8 r, g, b, a;
+                    SDL_GetRGBA(_surface_get_pixel(texture, tx, ty), texture->format, &r, &g, &b, &a);
+                    row[i] = _soft_pack(r, g, b, a);
+                }
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                row[i] = 0xFFFFFFFF;
+            }
+        }
+        
+        if (flat) {
+            _soft_modulate_span(row, count, flat_color);
+        } else {
+            float c[4];
+            for (int k = 0; k < 4; k++) {
+                c[k] = base[k + 2] + ddx[k + 2] * px + ddy[k + 2] * py;
+            }
+            for (int i = 0; i < count; i++) {
+                Uint32 tint = _soft_pack(
+                    static_cast<Uint8>(SDL_max(0.0f, SDL_min(255.0f, c[0] + ddx[2] * i))),
+                    static_cast<Uint8>(SDL_max(0.0f, SDL_min(255.0f, c[1] + ddx[3] * i))),
+                    static_cast<Uint8>(SDL_max(0.0f, SDL_min(255.0f, c[2] + ddx[4] * i))),
+                    static_cast<Uint8>(SDL_max(0.0f, SDL_min(255.0f, c[3] + ddx[5] * i))));
+                _soft_modulate_span(&row[i], 1, tint);
+            }
+        }
+        
+        _soft_blend_span(_soft_pixel_ptr(target, x1, y), row, count, kind);
+    }
+}
+
+static void _soft_draw_triangles(const SoftTarget* target, const SDL_Vertex* verts, int num_verts,
+                                 const int* indices, int num_indices, SDL_Surface* texture)
+{
+    int count = indices ? num_indices : num_verts;
+    for (int i = 0; i + 2 < count; i += 3) {
+        SDL_Vertex tri[3];
+        for (int j = 0; j < 3; j++) {
+            tri[j] = verts[indices ? indices[i + j] : i + j];
+        }
+        _soft_fill_convex(target, tri, 3, texture);
+    }
+}
+
+/* Pixels the software rasterizer can sample from: the surface of a memory
+ * bitmap, or the fully read-back CPU shadow of a video bitmap. */
+static SDL_Surface* _soft_source_surface(ALLEGRO_BITMAP* bitmap)
+{
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    if (root->surface) {
+        return root->surface;
+    }
+    if (!root->texture || !_current_display || !_current_display->renderer || !_ensure_shadow(root)) {
+        return nullptr;
+    }
+    SDL_Rect rect = {0, 0, root->width, root->height};
+    _read_shadow_tiles(root, &rect);
+    return root->shadow;
+}
+
+enum TransformKind {
+    TRANSFORM_IDENTITY,
+    TRANSFORM_TRANSLATE,
+    TRANSFORM_SCALE,
+    TRANSFORM_AFFINE
+};
+
+static ALLEGRO_TRANSFORM _current_transform = {{
+    1.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 1.0f, 0.0f,
+    0.0f, 0.0f, 0.0f, 1.0f
+}};
+static bool _transform_initialized = false;
+static TransformKind _transform_kind = TRANSFORM_IDENTITY;
+static Uint32 _transform_generation = 1;
+
+static TransformKind _classify_transform(const ALLEGRO_TRANSFORM* trans)
+{
+    const float* m = trans->m;
+    
+    if (m[3] != 0.0f || m[7] != 0.0f || m[15] != 1.0f) {
+        return TRANSFORM_AFFINE;
+    }
+    if (m[1] != 0.0f || m[4] != 0.0f) {
+        return TRANSFORM_AFFINE;
+    }
+    if (m[0] != 1.0f || m[5] != 1.0f) {
+        return TRANSFORM_SCALE;
+    }
+    if (m[12] != 0.0f || m[13] != 0.0f) {
+        return TRANSFORM_TRANSLATE;
+    }
+    return TRANSFORM_IDENTITY;
+}
+
+/* Transforms with a perspective row. The kind says only "affine" for
+ * these, so the few paths that care check the row themselves. */
+static bool _transform_is_projective(void)
+{
+    const float* m = _current_transform.m;
+    return _transform_kind == TRANSFORM_AFFINE &&
+           (m[3] != 0.0f || m[7] != 0.0f || m[15] != 1.0f);
+}
+
+static void _transform_point(float* x, float* y)
+{
+    const float* m = _current_transform.m;
+    
+    switch (_transform_kind) {
+        case TRANSFORM_IDENTITY:
+            break;
+        case TRANSFORM_TRANSLATE:
+            *x += m[12];
+            *y += m[13];
+            break;
+        case TRANSFORM_SCALE:
+            *x = *x * m[0] + m[12];
+            *y = *y * m[5] + m[13];
+            break;
+        default:
+            al_transform_coordinates(&_current_transform, x, y);
+            break;
+    }
+}
+
+/* Draws whose transformed bounds miss the visible part of the target are
+ * rejected before any vertex is generated or SDL is called. The visible
+ * part is the target size intersected with the clipping rectangle, grown by
+ * a pixel so that edge rasterization rules never drop a covered pixel. */
+static const float CULL_MARGIN = 1.0f;
+
+static bool _visible_rect(float* x1, float* y1, float* x2, float* y2)
+{
+    int w, h;
+    if (_target_bitmap) {
+        w = _target_bitmap->width;
+        h = _target_bitmap->height;
+    } else if (_current_display) {
+        w = _current_display->width;
+        h = _current_display->height;
+    } else {
+        return false;
+    }
+    
+    *x1 = 0;
+    *y1 = 0;
+    *x2 = static_cast<float>(w);
+    *y2 = static_cast<float>(h);
+    if (_clipping_initialized) {
+        *x1 = SDL_max(*x1, _clip_x);
+        *y1 = SDL_max(*y1, _clip_y);
+        *x2 = SDL_min(*x2, _clip_x + _clip_w);
+        *y2 = SDL_min(*y2, _clip_y + _clip_h);
+    }
+    return true;
+}
+
+/* True when the box of already transformed points misses the target. */
+static bool _cull_bounds(float x1, float y1, float x2, float y2)
+{
+    float vx1, vy1, vx2, vy2;
+    if (!_visible_rect(&vx1, &vy1, &vx2, &vy2)) {
+        return false;
+    }
+    if (vx2 <= vx1 || vy2 <= vy1) {
+        return true;
+    }
+    return x2 < vx1 - CULL_MARGIN || y2 < vy1 - CULL_MARGIN ||
+           x1 > vx2 + CULL_MARGIN || y1 > vy2 + CULL_MARGIN;
+}
+
+/* True when the untransformed box (x1, y1)-(x2, y2), grown by pad on each
+ * side, misses the target once the current transform is applied. Projective
+ * transforms can fold points through infinity, so they are never culled. */
+static bool _cull_rect(float x1, float y1, float x2, float y2, float pad)
+{
+    if (x2 < x1) {
+        float t = x1; x1 = x2; x2 = t;
+    }
+    if (y2 < y1) {
+        float t = y1; y1 = y2; y2 = t;
+    }
+    x1 -= pad;
+    y1 -= pad;
+    x2 += pad;
+    y2 += pad;
+    
+    if (_transform_kind != TRANSFORM_AFFINE) {
+        _transform_point(&x1, &y1);
+        _transform_point(&x2, &y2);
+        return _cull_bounds(SDL_min(x1, x2), SDL_min(y1, y2), SDL_max(x1, x2), SDL_max(y1, y2));
+    }
+    
+    if (_transform_is_projective()) {
+        return false;
+    }
+    
+    /* The transformed box is centred on the transformed centre, with half
+     * extents given by the absolute values of the linear part. */
+    float cx = (x1 + x2) * 0.5f;
+    float cy = (y1 + y2) * 0.5f;
+    float hw = (x2 - x1) * 0.5f;
+    float hh = (y2 - y1) * 0.5f;
+    const float* m = _current_transform.m;
+    float tx = m[0] * cx + m[4] * cy + m[12];
+    float ty = m[1] * cx + m[5] * cy + m[13];
+    float ex = fabsf(m[0]) * hw + fabsf(m[4]) * hh;
+    float ey = fabsf(m[1]) * hw + fabsf(m[5]) * hh;
+    return _cull_bounds(tx - ex, ty - ey, tx + ex, ty + ey);
+}
+
+/* Culls a strided point list by its bounding box. */
+static bool _cull_points(const float* vertices, int stride, int count, float pad)
+{
+    if (!vertices || count <= 0) {
+        return false;
+    }
+    
+    const char* p = reinterpret_cast<const char*>(vertices);
+    const float* v = reinterpret_cast<const float*>(p);
+    float x1 = v[0], y1 = v[1], x2 = v[0], y2 = v[1];
+    for (int i = 1; i < count; i++) {
+        v = reinterpret_cast<const float*>(p + static_cast<ptrdiff_t>(stride) * i);
+        x1 = SDL_min(x1, v[0]);
+        y1 = SDL_min(y1, v[1]);
+        x2 = SDL_max(x2, v[0]);
+        y2 = SDL_max(y2, v[1]);
+    }
+    return _cull_rect(x1, y1, x2, y2, pad);
+}
+
+/* Culls a quad whose corners are already transformed. */
+static bool _cull_quad(const SDL_Vertex quad[4])
+{
+    if (_transform_is_projective()) {
+        return false;
+    }
+    
+    float x1 = quad[0].position.x, y1 = quad[0].position.y;
+    float x2 = x1, y2 = y1;
+    for (int i = 1; i < 4; i++) {
+        x1 = SDL_min(x1, quad[i].position.x);
+        y1 = SDL_min(y1, quad[i].position.y);
+        x2 = SDL_max(x2, quad[i].position.x);
+        y2 = SDL_max(y2, quad[i].position.y);
+    }
+    return _cull_bounds(x1, y1, x2, y2);
+}
+
+static bool _bitmap_drawing_held = false;
+static ALLEGRO_BITMAP* _batch_bitmap = nullptr;
+static std::vector<SDL_Vertex> _batch_vertices;
+static std::vector<int> _batch_indices;
+
+static void _flush_bitmap_batch(void)
+{
+    if (_batch_indices.empty()) {
+        _batch_bitmap = nullptr;
+        return;
+    }
+    
+    SoftTarget soft;
+    if (_get_soft_target(&soft)) {
+        SDL_Surface* source = _soft_source_surface(_batch_bitmap);
+        if (source) {
+            _soft_draw_triangles(&soft, _batch_vertices.data(), static_cast<int>(_batch_vertices.size()),
+                                 _batch_indices.data(), static_cast<int>(_batch_indices.size()), source);
+        }
+    } else if (_current_display && _current_display->renderer) {
+        _upload_shadow(_batch_bitmap);
+        if (_target_has_shadow()) {
+            SDL_FRect bounds = {0, 0, 0, 0};
+            float x1 = _batch_vertices[0].position.x, x2 = x1;
+            float y1 = _batch_vertices[0].position.y, y2 = y1;
+            for (size_t i = 1; i < _batch_vertices.size(); i++) {
+                x1 = SDL_min(x1, _batch_vertices[i].position.x);
+                x2 = SDL_max(x2, _batch_vertices[i].position.x);
+                y1 = SDL_min(y1, _batch_vertices[i].position.y);
+                y2 = SDL_max(y2, _batch_vertices[i].position.y);
+            }
+            bounds.x = x1;
+            bounds.y = y1;
+            bounds.w = x2 - x1;
+            bounds.h = y2 - y1;
+            _begin_target_draw(&bounds);
+        }
+        _cache_set_texture_mod(_batch_bitmap, 255, 255, 255, 255);
+        _cache_set_texture_blend_mode(_batch_bitmap, _get_blender_mode());
+        SDL_RenderGeometry(_current_display->renderer, _batch_bitmap->texture,
+                           _batch_vertices.data(), static_cast<int>(_batch_vertices.size()),
+                           _batch_indices.data(), static_cast<int>(_batch_indices.size()));
+    }
+    
+    _batch_vertices.clear();
+    _batch_indices.clear();
+    _batch_bitmap = nullptr;
+}
+
+static void _make_bitmap_quad(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint,
+                              float sx, float sy, float sw, float sh,
+                              float dx, float dy, float dw, float dh, int flags,
+                              SDL_Vertex quad[4])
+{
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    
+    sx += bitmap->xofs;
+    sy += bitmap->yofs;
+    
+    float u0 = sx / root->width;
+    float v0 = sy / root->height;
+    float u1 = (sx + sw) / root->width;
+    float v1 = (sy + sh) / root->height;
+    
+    if (flags & ALLEGRO_FLIP_HORIZONTAL) {
+        float t = u0; u0 = u1; u1 = t;
+    }
+    if (flags & ALLEGRO_FLIP_VERTICAL) {
+        float t = v0; v0 = v1; v1 = t;
+    }
+    
+    SDL_Color c = {
+        static_cast<Uint8>(tint.r * 255),
+        static_cast<Uint8>(tint.g * 255),
+        static_cast<Uint8>(tint.b * 255),
+        static_cast<Uint8>(tint.a * 255)
+    };
+    
+    const float xs[4] = {dx, dx + dw, dx + dw, dx};
+    const float ys[4] = {dy, dy, dy + dh, dy + dh};
+    const float us[4] = {u0, u1, u1, u0};
+    const float vs[4] = {v0, v0, v1, v1};
+    
+    for (int i = 0; i < 4; i++) {
+        quad[i].position.x = xs[i];
+        quad[i].position.y = ys[i];
+        _transform_point(&quad[i].position.x, &quad[i].position.y);
+        quad[i].color = c;
+        quad[i].tex_coord.x = us[i];
+        quad[i].tex_coord.y = vs[i];
+    }
+}
+
+static void _batch_bitmap_quad(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint,
+                               float sx, float sy, float sw, float sh,
+                               float dx, float dy, float dw, float dh, int flags)
+{
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    if (_batch_bitmap != root) {
+        _flush_bitmap_batch();
+        _batch_bitmap = root;
+    }
+    
+    int base = static_cast<int>(_batch_vertices.size());
+    SDL_Vertex quad[4];
+    _make_bitmap_quad(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags, quad);
+    _batch_vertices.insert(_batch_vertices.end(), quad, quad + 4);
+    
+    const int idx[6] = {base, base + 1, base + 2, base, base + 2, base + 3};
+    _batch_indices.insert(_batch_indices.end(), idx, idx + 6);
+}
+
+/* Memory bitmaps drawn onto a video target go through a temporary texture.
+ * This is slow, as it is in Allegro; convert the bitmap to avoid it. */
+static void _draw_memory_quads(ALLEGRO_BITMAP* root, const SDL_Vertex* verts, int num_vertices,
+                               const int* indices, int num_indices)
+{
+    if (!root->surface || num_indices <= 0) {
+        return;
+    }
+    
+    SDL_Texture* texture = SDL_CreateTextureFromSurface(_current_display->renderer, root->surface);
+    if (!texture) {
+        return;
+    }
+    
+    _flush_bitmap_batch();
+    _begin_target_draw(nullptr);
+    if (SDL_SetTextureBlendMode(texture, _get_blender_mode()) != 0) {
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    }
+    SDL_RenderGeometry(_current_display->renderer, texture, verts, num_vertices, indices, num_indices);
+    SDL_DestroyTexture(texture);
+}
+
+static void _draw_memory_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint,
+                                float sx, float sy, float sw, float sh,
+                                float dx, float dy, float dw, float dh, int flags)
+{
+    SDL_Vertex quad[4];
+    const int idx[6] = {0, 1, 2, 0, 2, 3};
+    _make_bitmap_quad(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags, quad);
+    _draw_memory_quads(bitmap->parent ? bitmap->parent : bitmap, quad, 4, idx, 6);
+}
+
+/* Writes the four corner positions of one instance. The local corners are
+ * pushed through the instance rotation/scale composed with the current
+ * transform, so each corner costs two multiply-adds per axis. */
+static void _instance_corners(const ALLEGRO_BITMAP_INSTANCE* inst, SDL_Vertex* out)
+{
+    const float* m = _current_transform.m;
+    float c = 1.0f;
+    float s = 0.0f;
+    if (inst->angle != 0.0f) {
+        c = cosf(inst->angle);
+        s = sinf(inst->angle);
+    }
+    
+    float lx0 = -inst->cx * inst->xscale;
+    float lx1 = (inst->sw - inst->cx) * inst->xscale;
+    float ly0 = -inst->cy * inst->yscale;
+    float ly1 = (inst->sh - inst->cy) * inst->yscale;
+    
+    bool projective = _transform_is_projective();
+    float a, b, cc, d, e, f;
+    if (projective) {
+        a = c; b = s; cc = -s; d = c; e = inst->dx; f = inst->dy;
+    } else {
+        a = m[0] * c + m[4] * s;
+        b = m[1] * c + m[5] * s;
+        cc = m[4] * c - m[0] * s;
+        d = m[5] * c - m[1] * s;
+        e = m[0] * inst->dx + m[4] * inst->dy + m[12];
+        f = m[1] * inst->dx + m[5] * inst->dy + m[13];
+    }
+    
+    float xs[4];
+    float ys[4];
+#if defined(__SSE2__)
+    __m128 lx = _mm_setr_ps(lx0, lx1, lx1, lx0);
+    __m128 ly = _mm_setr_ps(ly0, ly0, ly1, ly1);
+    __m128 vx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, _mm_set1_ps(a)),
+                                      _mm_mul_ps(ly, _mm_set1_ps(cc))), _mm_set1_ps(e));
+    __m128 vy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, _mm_set1_ps(b)),
+                                      _mm_mul_ps(ly, _mm_set1_ps(d))), _mm_set1_ps(f));
+    _mm_storeu_ps(xs, vx);
+    _mm_storeu_ps(ys, vy);
+#else
+    const float lxs[4] = {lx0, lx1, lx1, lx0};
+    const float lys[4] = {ly0, ly0, ly1, ly1};
+    for (int i = 0; i < 4; i++) {
+        xs[i] = lxs[i] * a + lys[i] * cc + e;
+        ys[i] = lxs[i] * b + lys[i] * d + f;
+    }
+#endif
+    
+    for (int i = 0; i < 4; i++) {
+        out[i].position.x = xs[i];
+        out[i].position.y = ys[i];
+        if (projective) {
+            al_transform_coordinates(&_current_transform, &out[i].position.x, &out[i].position.y);
+        }
+    }
+}
+
+/* Builds the culled quads for count instances into verts and indices,
+ * numbering vertices from base, and returns how many were kept. */
+static int _build_instance_quads(ALLEGRO_BITMAP* bitmap, const ALLEGRO_BITMAP_INSTANCE* instances,
+                                 int count, SDL_Vertex* verts, int* indices, int base)
+{
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    const float inv_w = 1.0f / root->width;
+    const float inv_h = 1.0f / root->height;
+    
+    int drawn = 0;
+    for (int i = 0; i < count; i++) {
+        const ALLEGRO_BITMAP_INSTANCE* inst = &instances[i];
+        SDL_Vertex* quad = verts + drawn * 4;
+        
+        _instance_corners(inst, quad);
+        if (_cull_quad(quad)) {
+            continue;
+        }
+        
+        float u0 = (inst->sx + bitmap->xofs) * inv_w;
+        float v0 = (inst->sy + bitmap->yofs) * inv_h;
+        float u1 = u0 + inst->sw * inv_w;
+        float v1 = v0 + inst->sh * inv_h;
+        if (inst->flags & ALLEGRO_FLIP_HORIZONTAL) {
+            float t = u0; u0 = u1; u1 = t;
+        }
+        if (inst->flags & ALLEGRO_FLIP_VERTICAL) {
+            float t = v0; v0 = v1; v1 = t;
+        }
+        
+        SDL_Color c = {
+            static_cast<Uint8>(inst->tint.r * 255),
+            static_cast<Uint8>(inst->tint.g * 255),
+            static_cast<Uint8>(inst->tint.b * 255),
+            static_cast<Uint8>(inst->tint.a * 255)
+        };
+        quad[0].color = c; quad[0].tex_coord.x = u0; quad[0].tex_coord.y = v0;
+        quad[1].color = c; quad[1].tex_coord.x = u1; quad[1].tex_coord.y = v0;
+        quad[2].color = c; quad[2].tex_coord.x = u1; quad[2].tex_coord.y = v1;
+        quad[3].color = c; quad[3].tex_coord.x = u0; quad[3].tex_coord.y = v1;
+        
+        int v = base + drawn * 4;
+        int* idx = indices + drawn * 6;
+        idx[0] = v; idx[1] = v + 1; idx[2] = v + 2;
+        idx[3] = v; idx[4] = v + 2; idx[5] = v + 3;
+        drawn++;
+    }
+    return drawn;
+}
+
+void al_draw_bitmap_instances(ALLEGRO_BITMAP* bitmap, const ALLEGRO_BITMAP_INSTANCE* instances, int count)
+{
+    if (!bitmap || !instances || count <= 0) {
+        return;
+    }
+    
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    bool soft = _is_soft_target();
+    if (!soft && (!_current_display || !_current_display->renderer)) {
+        return;
+    }
+    
+    /* A memory bitmap on a video target cannot join the batch, whose
+     * texture is the bitmap's own; it is drawn at once from a temporary
+     * one. */
+    if (!soft && !root->texture) {
+        ScratchScope scope;
+        SDL_Vertex* verts = _scratch_array<SDL_Vertex>(static_cast<size_t>(count) * 4);
+        int* indices = _scratch_array<int>(static_cast<size_t>(count) * 6);
+        if (!verts || !indices) {
+            return;
+        }
+        int drawn = _build_instance_quads(bitmap, instances, count, verts, indices, 0);
+        _draw_memory_quads(root, verts, drawn * 4, indices, drawn * 6);
+        return;
+    }
+    
+    if (_batch_bitmap != root) {
+        _flush_bitmap_batch();
+        _batch_bitmap = root;
+    }
+    
+    size_t first = _batch_vertices.size();
+    size_t first_index = _batch_indices.size();
+    _batch_vertices.resize(first + static_cast<size_t>(count) * 4);
+    _batch_indices.resize(first_index + static_cast<size_t>(count) * 6);
+    int drawn = _build_instance_quads(bitmap, instances, count, &_batch_vertices[first],
+                                      &_batch_indices[first_index], static_cast<int>(first));
+    _batch_vertices.resize(first + static_cast<size_t>(drawn) * 4);
+    _batch_indices.resize(first_index + static_cast<size_t>(drawn) * 6);
+    
+    if (!_bitmap_drawing_held) {
+        _flush_bitmap_batch();
+    }
+}
+
+static bool _keyboard_installed = false;
+static ALLEGRO_EVENT_SOURCE _keyboard_event_source;
+static Uint8 _key[512] = {0};
+static unsigned int _key_down_bits[(ALLEGRO_KEY_MAX + 31) / 32] = {0};
+
+static bool _mouse_installed = false;
+static ALLEGRO_EVENT_SOURCE _mouse_event_source;
+static int _mouse_x = 0;
+static int _mouse_y = 0;
+static int _mouse_z = 0;
+static int _mouse_w = 0;
+static int _mouse_buttons = 0;
+static unsigned int _mouse_num_buttons = 3;
+static unsigned int _mouse_num_axes = 2;
+
+static bool _joystick_installed = false;
+static ALLEGRO_EVENT_SOURCE _joystick_event_source;
+static std::vector<ALLEGRO_JOYSTICK*> _joysticks;
+
+static bool _audio_installed = false;
+static int _audio_reserved_channels = 0;
+static ALLEGRO_MIXER* _default_mixer = nullptr;
+
+struct AllegroSampleInstance {
+    Mix_Chunk* chunk;
+    int channel;
+    bool is_playing;
+    ALLEGRO_PLAYMODE loop;
+    float gain;
+    float pan;
+    float speed;
+    unsigned int position;
+    ALLEGRO_SAMPLE* sample;
+};
+
+struct AllegroAudioStream {
+    Mix_Music* music;
+    bool is_playing;
+    ALLEGRO_PLAYMODE loop;
+    float gain;
+    float pan;
+    float speed;
+    unsigned int frequency;
+    ALLEGRO_AUDIO_DEPTH depth;
+    ALLEGRO_CHANNEL_CONF channels;
+    unsigned int buffer_samples;
+    size_t buffer_count;
+};
+
+struct MixerWrapper {
+    int frequency;
+    ALLEGRO_AUDIO_DEPTH depth;
+    ALLEGRO_CHANNEL_CONF channels;
+    ALLEGRO_MIXER_QUALITY quality;
+    ALLEGRO_SAMPLE_INSTANCE* attached_sample_instance;
+    ALLEGRO_AUDIO_STREAM* attached_audio_stream;
+};
+
+ALLEGRO_DISPLAY* al_create_display(int w, int h)
+{
+    ALLEGRO_DISPLAY* display = new ALLEGRO_DISPLAY;
+    if (!display) {
+        return nullptr;
+    }
+    
+    Uint32 window_flags = SDL_WINDOW_SHOWN;
+    
+    if (_new_display_flags & ALLEGRO_FULLSCREEN) {
+        window_flags |= SDL_WINDOW_FULLSCREEN;
+    } else if (_new_display_flags & ALLEGRO_FULLSCREEN_WINDOW) {
+        window_flags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
+    }
+    
+    if (_new_display_flags & ALLEGRO_RESIZABLE) {
+        window_flags |= SDL_WINDOW_RESIZABLE;
+    }
+    
+    if (_new_display_flags & ALLEGRO_FRAMELESS) {
+        window_flags |= SDL_WINDOW_BORDERLESS;
+    }
+    
+    if (_new_window_x >= 0 && _new_window_y >= 0) {
+        display->window = SDL_CreateWindow(
+            _new_window_title,
+            _new_window_x, _new_window_y,
+            w, h,
+            window_flags
+        );
+    } else {
+        display->window = SDL_CreateWindow(
+            _new_window_title,
+            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            w, h,
+            window_flags
+        );
+    }
+    
+    if (!display->window) {
+        delete display;
+        return nullptr;
+    }
+    
+    display->renderer = SDL_CreateRenderer(
+        display->window,
+        -1,
+        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
+    );
+    
+    if (!display->renderer) {
+        SDL_DestroyWindow(display->window);
+        delete display;
+        return nullptr;
+    }
+    
+    display->window_id = SDL_GetWindowID(display->window);
+    display->width = w;
+    display->height = h;
+    display->flags = _new_display_flags;
+    display->refresh_rate = _new_display_refresh_rate;
+    display->backbuffer = nullptr;
+    memset(&display->state_stats, 0, sizeof(display->state_stats));
+    _reset_render_state_cache(display);
+    al_init_event_source(&display->event_source);
+    SDL_AtomicLock(&_displays_lock);
+    _displays.push_back(display);
+    SDL_AtomicUnlock(&_displays_lock);
+    _event_main_thread = SDL_ThreadID();
+    
+    _current_display = display;
+    al_convert_memory_bitmaps();
+    
+    return display;
+}
+
+void al_destroy_display(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        return;
+    }
+    
+    SDL_AtomicLock(&_displays_lock);
+    for (size_t i = 0; i < _displays.size(); i++) {
+        if (_displays[i] == display) {
+            _displays[i] = _displays.back();
+            _displays.pop_back();
+            break;
+        }
+    }
+    SDL_AtomicUnlock(&_displays_lock);
+    
+    if (_current_display == display) {
+        _batch_vertices.clear();
+        _batch_indices.clear();
+        _batch_bitmap = nullptr;
+    }
+    
+    if (display->renderer) {
+        SDL_DestroyRenderer(display->renderer);
+    }
+    
+    if (display->window) {
+        SDL_DestroyWindow(display->window);
+    }
+    
+    if (_current_display == display) {
+        _current_display = nullptr;
+    }
+    
+    al_destroy_event_source(&display->event_source);
+    delete display;
+}
+
+ALLEGRO_DISPLAY* al_get_current_display(void)
+{
+    return _current_display;
+}
+
+ALLEGRO_EVENT_SOURCE* al_get_display_event_source(ALLEGRO_DISPLAY* display)
+{
+    return display ? &display->event_source : nullptr;
+}
+
+void al_set_current_display(ALLEGRO_DISPLAY* display)
+{
+    if (display != _current_display) {
+        _flush_bitmap_batch();
+    }
+    _current_display = display;
+}
+
+int al_get_display_width(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return 0;
+    }
+    return display->width;
+}
+
+int al_get_display_height(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return 0;
+    }
+    return display->height;
+}
+
+int al_get_display_flags(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return 0;
+    }
+    
+    int flags = display->flags;
+    Uint32 sdl_flags = SDL_GetWindowFlags(display->window);
+    
+    if (sdl_flags & SDL_WINDOW_FULLSCREEN) {
+        flags |= ALLEGRO_FULLSCREEN;
+    } else if (sdl_flags & SDL_WINDOW_FULLSCREEN_DESKTOP) {
+        flags |= ALLEGRO_FULLSCREEN_WINDOW;
+    }
+    
+    if (sdl_flags & SDL_WINDOW_RESIZABLE) {
+        flags |= ALLEGRO_RESIZABLE;
+    }
+    
+    if (sdl_flags & SDL_WINDOW_BORDERLESS) {
+        flags |= ALLEGRO_FRAMELESS;
+    }
+    
+    if (sdl_flags & SDL_WINDOW_MINIMIZED) {
+        flags |= ALLEGRO_MINIMIZED;
+    }
+    
+    if (sdl_flags & SDL_WINDOW_MAXIMIZED) {
+        flags |= ALLEGRO_MAXIMIZED;
+    }
+    
+    return flags;
+}
+
+bool al_set_display_flag(ALLEGRO_DISPLAY* display, int flag, bool onoff)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return false;
+    }
+    
+    switch (flag) {
+        case ALLEGRO_FULLSCREEN:
+            SDL_SetWindowFullscreen(display->window, 
+                onoff ? SDL_WINDOW_FULLSCREEN : 0);
+            break;
+        case ALLEGRO_FULLSCREEN_WINDOW:
+            SDL_SetWindowFullscreen(display->window, 
+                onoff ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+            break;
+        case ALLEGRO_RESIZABLE:
+            SDL_SetWindowResizable(display->window, 
+                onoff ? SDL_TRUE : SDL_FALSE);
+            break;
+        case ALLEGRO_MINIMIZED:
+            if (onoff) {
+                SDL_MinimizeWindow(display->window);
+            } else {
+                SDL_RestoreWindow(display->window);
+            }
+            break;
+        case ALLEGRO_MAXIMIZED:
+            if (onoff) {
+                SDL_MaximizeWindow(display->window);
+            } else {
+                SDL_RestoreWindow(display->window);
+            }
+            break;
+        default:
+            return false;
+    }
+    
+    if (onoff) {
+        display->flags |= flag;
+    } else {
+        display->flags &= ~flag;
+    }
+    
+    return true;
+}
+
+void al_set_window_title(ALLEGRO_DISPLAY* display, const char* title)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display || !display->window) {
+        return;
+    }
+    SDL_SetWindowTitle(display->window, title);
+}
+
+bool al_resize_display(ALLEGRO_DISPLAY* display, int width, int height)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return false;
+    }
+    
+    SDL_SetWindowSize(display->window, width, height);
+    display->width = width;
+    display->height = height;
+    
+    return true;
+}
+
+bool al_acknowledge_resize(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return false;
+    }
+    
+    int w, h;
+    SDL_GetWindowSize(display->window, &w, &h);
+    display->width = w;
+    display->height = h;
+    
+    return true;
+}
+
+void al_set_window_position(ALLEGRO_DISPLAY* display, int x, int y)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display || !display->window) {
+        return;
+    }
+    SDL_SetWindowPosition(display->window, x, y);
+}
+
+void al_get_window_position(ALLEGRO_DISPLAY* display, int* x, int* y)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display || !display->window) {
+        if (x) *x = 0;
+        if (y) *y = 0;
+        return;
+    }
+    SDL_GetWindowPosition(display->window, x, y);
+}
+
+void al_flip_display(void)
+{
+    _flush_bitmap_batch();
+    
+    if (_current_display && _current_display->renderer) {
+        SDL_RenderPresent(_current_display->renderer);
+    }
+}
+
+void al_clear_to_color(ALLEGRO_COLOR color)
+{
+    SoftTarget soft;
+    if (_get_soft_target(&soft)) {
+        _flush_bitmap_batch();
+        _soft_clear(&soft, _soft_color(color));
+        return;
+    }
+    
+    if (!_current_display || !_current_display->renderer) {
+        return;
+    }
+    
+    _flush_bitmap_batch();
+    _begin_target_draw(nullptr);
+    
+    _cache_set_draw_color(
+        _current_display,
+        (Uint8)(color.r * 255),
+        (Uint8)(color.g * 255),
+        (Uint8)(color.b * 255),
+        (Uint8)(color.a * 255)
+    );
+    
+    if (_target_bitmap && _target_bitmap->parent) {
+        SDL_Rect rect = {0, 0, _target_bitmap->width, _target_bitmap->height};
+        _cache_set_blend_mode(_current_display, SDL_BLENDMODE_NONE);
+        SDL_RenderFillRect(_current_display->renderer, &rect);
+        return;
+    }
+    
+    SDL_RenderClear(_current_display->renderer);
+}
+
+void al_set_new_display_flags(int flags)
+{
+    _new_display_flags = flags;
+}
+
+int al_get_new_display_flags(void)
+{
+    return _new_display_flags;
+}
+
+void al_set_new_display_refresh_rate(int refresh_rate)
+{
+    _new_display_refresh_rate = refresh_rate;
+}
+
+int al_get_new_display_refresh_rate(void)
+{
+    return _new_display_refresh_rate;
+}
+
+void al_set_new_window_title(const char* title)
+{
+    _new_window_title = title;
+}
+
+const char* al_get_new_window_title(void)
+{
+    return _new_window_title;
+}
+
+void al_set_new_window_position(int x, int y)
+{
+    _new_window_x = x;
+    _new_window_y = y;
+}
+
+void al_get_new_window_position(int* x, int* y)
+{
+    if (x) *x = _new_window_x;
+    if (y) *y = _new_window_y;
+}
+
+void al_set_new_display_adapter(int adapter)
+{
+    _new_display_adapter = adapter;
+}
+
+int al_get_new_display_adapter(void)
+{
+    return _new_display_adapter;
+}
+
+int al_get_display_adapter(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    return _new_display_adapter;
+}
+
+void al_hold_bitmap_drawing(bool hold)
+{
+    if (!hold) {
+        _flush_bitmap_batch();
+    }
+    _bitmap_drawing_held = hold;
+}
+
+bool al_is_bitmap_drawing_held(void)
+{
+    return _bitmap_drawing_held;
+}
+
+void al_get_render_state_stats(ALLEGRO_DISPLAY* display, ALLEGRO_RENDER_STATE_STATS* stats)
+{
+    if (!stats) {
+        return;
+    }
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = display->state_stats;
+}
+
+void al_reset_render_state_stats(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return;
+    }
+    memset(&display->state_stats, 0, sizeof(display->state_stats));
+}
+
+ALLEGRO_COLOR al_map_rgb(uint8_t r, uint8_t g, uint8_t b)
+{
+    ALLEGRO_COLOR color;
+    color.r = r / 255.0f;
+    color.g = g / 255.0f;
+    color.b = b / 255.0f;
+    color.a = 1.0f;
+    return color;
+}
+
+ALLEGRO_COLOR al_map_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    ALLEGRO_COLOR color;
+    color.r = r / 255.0f;
+    color.g = g / 255.0f;
+    color.b = b / 255.0f;
+    color.a = a / 255.0f;
+    return color;
+}
+
+ALLEGRO_COLOR al_map_rgb_f(float r, float g, float b)
+{
+    ALLEGRO_COLOR color;
+    color.r = r;
+    color.g = g;
+    color.b = b;
+    color.a = 1.0f;
+    return color;
+}
+
+ALLEGRO_COLOR al_map_rgba_f(float r, float g, float b, float a)
+{
+    ALLEGRO_COLOR color;
+    color.r = r;
+    color.g = g;
+    color.b = b;
+    color.a = a;
+    return color;
+}
+
+ALLEGRO_COLOR al_premul_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    float alpha = a / 255.0f;
+    ALLEGRO_COLOR color;
+    color.r = (r / 255.0f) * alpha;
+    color.g = (g / 255.0f) * alpha;
+    color.b = (b / 255.0f) * alpha;
+    color.a = alpha;
+    return color;
+}
+
+ALLEGRO_COLOR al_premul_rgba_f(float r, float g, float b, float a)
+{
+    ALLEGRO_COLOR color;
+    color.r = r * a;
+    color.g = g * a;
+    color.b = b * a;
+    color.a = a;
+    return color;
+}
+
+void al_unmap_rgb(ALLEGRO_COLOR color, uint8_t* r, uint8_t* g, uint8_t* b)
+{
+    if (r) *r = (uint8_t)(color.r * 255);
+    if (g) *g = (uint8_t)(color.g * 255);
+    if (b) *b = (uint8_t)(color.b * 255);
+}
+
+void al_unmap_rgba(ALLEGRO_COLOR color, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+{
+    if (r) *r = (uint8_t)(color.r * 255);
+    if (g) *g = (uint8_t)(color.g * 255);
+    if (b) *b = (uint8_t)(color.b * 255);
+    if (a) *a = (uint8_t)(color.a * 255);
+}
+
+void al_unmap_rgb_f(ALLEGRO_COLOR color, float* r, float* g, float* b)
+{
+    if (r) *r = color.r;
+    if (g) *g = color.g;
+    if (b) *b = color.b;
+}
+
+void al_unmap_rgba_f(ALLEGRO_COLOR color, float* r, float* g, float* b, float* a)
+{
+    if (r) *r = color.r;
+    if (g) *g = color.g;
+    if (b) *b = color.b;
+    if (a) *a = color.a;
+}
+
+struct ColorNameEntry {
+    const char* name;
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+static const ColorNameEntry _color_names[] = {
+    {"black", 0, 0, 0},
+    {"white", 255, 255, 255},
+    {"red", 255, 0, 0},
+    {"green", 0, 255, 0},
+    {"blue", 0, 0, 255},
+    {"yellow", 255, 255, 0},
+    {"cyan", 0, 255, 255},
+    {"magenta", 255, 0, 255},
+    {"aqua", 0, 255, 255},
+    {"azure", 0, 127, 255},
+    {"beige", 245, 245, 220},
+    {"bisque", 255, 228, 196},
+    {"blanchedalmond", 255, 235, 205},
+    {"blueviolet", 138, 43, 226},
+    {"brown", 165, 42, 42},
+    {"burlywood", 222, 184, 135},
+    {"cadetblue", 95, 158, 160},
+    {"chartreuse", 127, 255, 0},
+    {"chocolate", 210, 105, 30},
+    {"coral", 255, 127, 80},
+    {"cornflowerblue", 100, 149, 237},
+    {"cornsilk", 255, 248, 220},
+    {"crimson", 220, 20, 60},
+    {"darkblue", 0, 0, 139},
+    {"darkcyan", 0, 139, 139},
+    {"darkgoldenrod", 184, 134, 11},
+    {"darkgray", 169, 169, 169},
+    {"darkgreen", 0, 100, 0},
+    {"darkkhaki", 189, 183, 107},
+    {"darkmagenta", 139, 0, 139},
+    {"darkolivegreen", 85, 107, 47},
+    {"darkorange", 255, 140, 0},
+    {"darkorchid", 153, 50, 204},
+    {"darkred", 139, 0, 0},
+    {"darksalmon", 233, 150, 122},
+    {"darkseagreen", 143, 188, 143},
+    {"darkslateblue", 72, 61, 139},
+    {"darkslategray", 47, 79, 79},
+    {"darkturquoise", 0, 206, 209},
+    {"darkviolet", 148, 0, 211},
+    {"deeppink", 255, 20, 147},
+    {"deepskyblue", 0, 191, 255},
+    {"dimgray", 105, 105, 105},
+    {"dodgerblue", 30, 144, 255},
+    {"firebrick", 178, 34, 34},
+    {"floralwhite", 255, 250, 240},
+    {"forestgreen", 34, 139, 34},
+    {"fuchsia", 255, 0, 255},
+    {"gainsboro", 220, 220, 220},
+    {"ghostwhite", 248, 248, 255},
+    {"gold", 255, 215, 0},
+    {"goldenrod", 218, 165, 32},
+    {"gray", 128, 128, 128},
+    {"greenyellow", 173, 255, 47},
+    {"honeydew", 240, 255, 240},
+    {"hotpink", 255, 105, 180},
+    {"indianred", 205, 92, 92},
+    {"indigo", 75, 0, 130},
+    {"ivory", 255, 255, 240},
+    {"khaki", 240, 230, 140},
+    {"lavender", 230, 230, 250},
+    {"lavenderblush", 255, 240, 245},
+    {"lawngreen", 124, 252, 0},
+    {"lemonchiffon", 255, 250, 205},
+    {"lightblue", 173, 216, 230},
+    {"lightcoral", 240, 128, 128},
+    {"lightcyan", 224, 255, 255},
+    {"lightgoldenrodyellow", 250, 250, 210},
+    {"lightgray", 211, 211, 211},
+    {"lightgreen", 144, 238, 144},
+    {"lightpink", 255, 182, 193},
+    {"lightsalmon", 255, 160, 122},
+    {"lightseagreen", 32, 178, 170},
+    {"lightskyblue", 135, 206, 250},
+    {"lightslategray", 119, 136, 153},
+    {"lightsteelblue", 176, 196, 222},
+    {"lightyellow", 255, 255, 224},
+    {"lime", 0, 255, 0},
+    {"limegreen", 50, 205, 50},
+    {"linen", 250, 240, 230},
+    {"maroon", 128, 0, 0},
+    {"mediumaquamarine", 102, 205, 170},
+    {"mediumblue", 0, 0, 205},
+    {"mediumorchid", 186, 85, 211},
+    {"mediumpurple", 147, 112, 219},
+    {"mediumseagreen", 60, 179, 113},
+    {"mediumslateblue", 123, 104, 238},
+    {"mediumspringgreen", 0, 250, 154},
+    {"mediumturquoise", 72, 209, 204},
+    {"mediumvioletred", 199, 21, 133},
+    {"midnightblue", 25, 25, 112},
+    {"mintcream", 245, 255, 250},
+    {"mistyrose", 255, 228, 225},
+    {"moccasin", 255, 228, 181},
+    {"navajowhite", 255, 222, 173},
+    {"navy", 0, 0, 128},
+    {"oldlace", 253, 245, 230},
+    {"olive", 128, 128, 0},
+    {"olivedrab", 107, 142, 35},
+    {"orange", 255, 165, 0},
+    {"orangered", 255, 69, 0},
+    {"orchid", 218, 112, 214},
+    {"palegoldenrod", 238, 232, 170},
+    {"palegreen", 152, 251, 152},
+    {"paleturquoise", 175, 238, 238},
+    {"palevioletred", 219, 112, 147},
+    {"papayawhip", 255, 239, 213},
+    {"peachpuff", 255, 218, 185},
+    {"peru", 205, 133, 63},
+    {"pink", 255, 192, 203},
+    {"plum", 221, 160, 221},
+    {"powderblue", 176, 224, 230},
+    {"purple", 128, 0, 128},
+    {"rosybrown", 188, 143, 143},
+    {"royalblue", 65, 105, 225},
+    {"saddlebrown", 139, 69, 19},
+    {"salmon", 250, 128, 114},
+    {"sandybrown", 244, 164, 96},
+    {"seagreen", 46, 139, 87},
+    {"seashell", 255, 245, 238},
+    {"sienna", 160, 82, 45},
+    {"silver", 192, 192, 192},
+    {"skyblue", 135, 206, 235},
+    {"slateblue", 106, 90, 205},
+    {"slategray", 112, 128, 144},
+    {"snow", 255, 250, 250},
+    {"springgreen", 0, 255, 127},
+    {"steelblue", 70, 130, 180},
+    {"tan", 210, 180, 140},
+    {"teal", 0, 128, 128},
+    {"thistle", 216, 191, 216},
+    {"tomato", 255, 99, 71},
+    {"turquoise", 64, 224, 208},
+    {"violet", 238, 130, 238},
+    {"wheat", 245, 222, 179},
+    {"whitesmoke", 245, 245, 245},
+    {"yellowgreen", 154, 205, 50},
+};
+
+bool al_color_name_to_rgb(const char* name, ALLEGRO_COLOR* color)
+{
+    if (!name || !color) {
+        return false;
+    }
+
+    for (const auto& entry : _color_names) {
+        if (strcasecmp(name, entry.name) == 0) {
+            color->r = entry.r / 255.0f;
+            color->g = entry.g / 255.0f;
+            color->b = entry.b / 255.0f;
+            color->a = 1.0f;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static ALLEGRO_BITMAP* _new_bitmap_handle(int w, int h, int format, int flags)
+{
+    ALLEGRO_BITMAP* bitmap = new ALLEGRO_BITMAP;
+    if (!bitmap) {
+        return nullptr;
+    }
+    
+    bitmap->width = w;
+    bitmap->height = h;
+    bitmap->format = format;
+    bitmap->requested_format = _new_bitmap_format;
+    bitmap->flags = flags;
+    bitmap->is_backbuffer = false;
+    bitmap->surface = nullptr;
+    bitmap->texture = nullptr;
+    bitmap->mod_r = bitmap->mod_g = bitmap->mod_b = bitmap->mod_a = 255;
+    bitmap->blend_mode_valid = false;
+    bitmap->parent = nullptr;
+    bitmap->xofs = 0;
+    bitmap->yofs = 0;
+    bitmap->sub_parent = nullptr;
+    bitmap->sub_x = 0;
+    bitmap->sub_y = 0;
+    bitmap->atlas_page = nullptr;
+    bitmap->lock_texture = nullptr;
+    bitmap->locked = false;
+    bitmap->lock_buffer = nullptr;
+    bitmap->lock_staged = false;
+    bitmap->shadow = nullptr;
+    bitmap->shadow_tiles = nullptr;
+    bitmap->shadow_tiles_x = 0;
+    bitmap->shadow_tiles_y = 0;
+    bitmap->shadow_dirty_tiles = 0;
+    bitmap->view_index = 0;
+    
+    bitmap->bitmap_index = _bitmaps.size();
+    _bitmaps.push_back(bitmap);
+    return bitmap;
+}
+
+/* Sub-bitmaps and atlas members are listed on their root, each remembering
+ * its slot there and in _bitmaps, so both lists are updated in constant
+ * time and residency changes only visit the root's own views. */
+static void _attach_bitmap_view(ALLEGRO_BITMAP* root, ALLEGRO_BITMAP* view)
+{
+    view->parent = root;
+    view->view_index = root->views.size();
+    root->views.push_back(view);
+}
+
+/* view_index of a view whose root was destroyed before it. */
+static const size_t ORPHANED_VIEW = static_cast<size_t>(-1);
+
+static void _detach_bitmap_view(ALLEGRO_BITMAP* view)
+{
+    if (view->view_index == ORPHANED_VIEW) {
+        return;
+    }
+    std::vector<ALLEGRO_BITMAP*>& views = view->parent->views;
+    views[view->view_index] = views.back();
+    views[view->view_index]->view_index = view->view_index;
+    views.pop_back();
+}
+
+static void _forget_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    _bitmaps[bitmap->bitmap_index] = _bitmaps.back();
+    _bitmaps[bitmap->bitmap_index]->bitmap_index = bitmap->bitmap_index;
+    _bitmaps.pop_back();
+}
+
+/* The concrete format each ALLEGRO_PIXEL_FORMAT_ANY_* request starts from
+ * before it is matched against what the renderer supports. */
+static int _concrete_pixel_format(int format)
+{
+    switch (format) {
+        case ALLEGRO_PIXEL_FORMAT_ANY_NO_ALPHA:
+        case ALLEGRO_PIXEL_FORMAT_ANY_24_NO_ALPHA:
+            return ALLEGRO_PIXEL_FORMAT_RGB_888;
+        case ALLEGRO_PIXEL_FORMAT_ANY_15_NO_ALPHA:
+        case ALLEGRO_PIXEL_FORMAT_ANY_16_NO_ALPHA:
+            return ALLEGRO_PIXEL_FORMAT_RGB_565;
+        case ALLEGRO_PIXEL_FORMAT_ANY_15_WITH_ALPHA:
+        case ALLEGRO_PIXEL_FORMAT_ANY_16_WITH_ALPHA:
+            return ALLEGRO_PIXEL_FORMAT_ARGB_1555;
+        case ALLEGRO_PIXEL_FORMAT_ABGR_F32:
+            return ALLEGRO_PIXEL_FORMAT_ABGR_8888;
+        default:
+            if (_get_pixel_format_info(format)) {
+                return format;
+            }
+            return ALLEGRO_PIXEL_FORMAT_ARGB_8888;
+    }
+}
+
+/* Lower is closer. Missing alpha or colour precision costs far more than
+ * extra bytes per pixel, and among sufficient formats the smallest wins. */
+static int _pixel_format_distance(int requested, int candidate)
+{
+    if (requested == candidate) {
+        return 0;
+    }
+    
+    const PixelFormatInfo* want = _get_pixel_format_info(requested);
+    const PixelFormatInfo* have = _get_pixel_format_info(candidate);
+    int distance = 1 + have->bytes * 10;
+    
+    if (want->bits[0] && !have->bits[0]) {
+        distance += 10000;
+    } else if (!want->bits[0] && have->bits[0]) {
+        distance += 1;
+    }
+    for (int c = 1; c < 4; c++) {
+        if (have->bits[c] < want->bits[c]) {
+            distance += 1000 * (want->bits[c] - have->bits[c]);
+        }
+    }
+    return distance;
+}
+
+static int _choose_texture_format(int requested)
+{
+    requested = _concrete_pixel_format(requested);
+    
+    SDL_RendererInfo info;
+    if (!_current_display || !_current_display->renderer ||
+        SDL_GetRendererInfo(_current_display->renderer, &info) != 0 ||
+        info.num_texture_formats == 0) {
+        return ALLEGRO_PIXEL_FORMAT_ARGB_8888;
+    }
+    
+    int best = ALLEGRO_PIXEL_FORMAT_ANY;
+    int best_distance = 0;
+    for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+        int candidate = _sdl_to_allegro_format(info.texture_formats[i]);
+        if (candidate == ALLEGRO_PIXEL_FORMAT_ANY) {
+            continue;
+        }
+        int distance = _pixel_format_distance(requested, candidate);
+        if (best == ALLEGRO_PIXEL_FORMAT_ANY || distance < best_distance) {
+            best = candidate;
+            best_distance = distance;
+        }
+    }
+    
+    return best != ALLEGRO_PIXEL_FORMAT_ANY ? best : ALLEGRO_PIXEL_FORMAT_ARGB_8888;
+}
+
+static ALLEGRO_BITMAP* _create_bitmap(int w, int h, int flags)
+{
+    ALLEGRO_BITMAP* bitmap = _new_bitmap_handle(w, h, ALLEGRO_PIXEL_FORMAT_ARGB_8888, flags);
+    if (!bitmap) {
+        return nullptr;
+    }
+    
+    if (!(flags & ALLEGRO_MEMORY_BITMAP) && _current_display && _current_display->renderer) {
+        int format = _choose_texture_format(bitmap->requested_format);
+        bitmap->texture = SDL_CreateTexture(
+            _current_display->renderer,
+            _allegro_to_sdl_format(format),
+            SDL_TEXTUREACCESS_TARGET,
+            w, h
+        );
+        if (bitmap->texture) {
+            bitmap->format = format;
+        }
+    }
+    
+    if (!bitmap->texture) {
+        bitmap->surface = SDL_CreateRGBSurface(
+            0, w, h, 32,
+            0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000
+        );
+        bitmap->flags = (flags & ~ALLEGRO_VIDEO_BITMAP) | ALLEGRO_MEMORY_BITMAP;
+        if (!(flags & ALLEGRO_MEMORY_BITMAP)) {
+            bitmap->flags |= ALLEGRO_CONVERT_BITMAP;
+        }
+    }
+    
+    return bitmap;
+}
+
+static bool _skyline_fit(const AtlasPage* page, size_t index, int w, int h, int* y_out)
+{
+    int x = page->skyline[index].x;
+    if (x + w > ATLAS_PAGE_SIZE) {
+        return false;
+    }
+    
+    int y = page->skyline[index].y;
+    int width_left = w;
+    while (width_left > 0) {
+        if (index >= page->skyline.size()) {
+            return false;
+        }
+        if (page->skyline[index].y > y) {
+            y = page->skyline[index].y;
+        }
+        if (y + h > ATLAS_PAGE_SIZE) {
+            return false;
+        }
+        width_left -= page->skyline[index].w;
+        index++;
+    }
+    
+    *y_out = y;
+    return true;
+}
+
+static bool _skyline_insert(AtlasPage* page, int w, int h, int* x_out, int* y_out)
+{
+    int best_bottom = ATLAS_PAGE_SIZE + 1;
+    int best_width = ATLAS_PAGE_SIZE + 1;
+    int best_y = 0;
+    size_t best_index = page->skyline.size();
+    
+    for (size_t i = 0; i < page->skyline.size(); i++) {
+        int y;
+        if (!_skyline_fit(page, i, w, h, &y)) {
+            continue;
+        }
+        if (y + h < best_bottom || (y + h == best_bottom && page->skyline[i].w < best_width)) {
+            best_bottom = y + h;
+            best_width = page->skyline[i].w;
+            best_y = y;
+            best_index = i;
+        }
+    }
+    
+    if (best_index == page->skyline.size()) {
+        return false;
+    }
+    
+    SkylineNode node = {page->skyline[best_index].x, best_y + h, w};
+    page->skyline.insert(page->skyline.begin() + best_index, node);
+    
+    for (size_t i = best_index + 1; i < page->skyline.size(); ) {
+        const SkylineNode& prev = page->skyline[i - 1];
+        int overlap = prev.x + prev.w - page->skyline[i].x;
+        if (overlap <= 0) {
+            break;
+        }
+        page->skyline[i].x += overlap;
+        page->skyline[i].w -= overlap;
+        if (page->skyline[i].w > 0) {
+            break;
+        }
+        page->skyline.erase(page->skyline.begin() + i);
+    }
+    
+    for (size_t i = 0; i + 1 < page->skyline.size(); ) {
+        if (page->skyline[i].y == page->skyline[i + 1].y) {
+            page->skyline[i].w += page->skyline[i + 1].w;
+            page->skyline.erase(page->skyline.begin() + i + 1);
+        } else {
+            i++;
+        }
+    }
+    
+    *x_out = node.x;
+    *y_out = best_y;
+    return true;
+}
+
+static AtlasPage* _create_atlas_page(int flags)
+{
+    ALLEGRO_BITMAP* page_bitmap = _create_bitmap(ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE,
+                                                 flags & ~ALLEGRO_ATLAS_BITMAP);
+    if (!page_bitmap) {
+        return nullptr;
+    }
+    if (!page_bitmap->texture) {
+        al_destroy_bitmap(page_bitmap);
+        return nullptr;
+    }
+    
+    _flush_bitmap_batch();
+    _apply_target_bitmap(_current_display, page_bitmap);
+    _cache_set_draw_color(_current_display, 0, 0, 0, 0);
+    SDL_RenderClear(_current_display->renderer);
+    _apply_target_bitmap(_current_display, _target_bitmap);
+    
+    AtlasPage* page = new AtlasPage;
+    page->bitmap = page_bitmap;
+    page->requested_format = _new_bitmap_format;
+    page->live_bitmaps = 0;
+    SkylineNode root = {0, 0, ATLAS_PAGE_SIZE};
+    page->skyline.push_back(root);
+    _atlas_pages.push_back(page);
+    
+    return page;
+}
+
+static ALLEGRO_BITMAP* _create_atlas_bitmap(int w, int h, int flags)
+{
+    int pw = w + ATLAS_PADDING;
+    int ph = h + ATLAS_PADDING;
+    int x = 0;
+    int y = 0;
+    AtlasPage* page = nullptr;
+    
+    for (size_t i = 0; i < _atlas_pages.size(); i++) {
+        AtlasPage* candidate = _atlas_pages[i];
+        if (candidate->requested_format != _new_bitmap_format ||
+            candidate->bitmap->flags != (flags & ~ALLEGRO_ATLAS_BITMAP)) {
+            continue;
+        }
+        if (_skyline_insert(candidate, pw, ph, &x, &y)) {
+            page = candidate;
+            break;
+        }
+    }
+    
+    if (!page) {
+        page = _create_atlas_page(flags);
+        if (!page || !_skyline_insert(page, pw, ph, &x, &y)) {
+            return nullptr;
+        }
+    }
+    
+    ALLEGRO_BITMAP* bitmap = _new_bitmap_handle(w, h, page->bitmap->format, flags);
+    if (!bitmap) {
+        return nullptr;
+    }
+    
+    bitmap->texture = page->bitmap->texture;
+    _attach_bitmap_view(page->bitmap, bitmap);
+    bitmap->xofs = x;
+    bitmap->yofs = y;
+    bitmap->atlas_page = page;
+    page->live_bitmaps++;
+    
+    return bitmap;
+}
+
+static void _release_atlas_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    AtlasPage* page = bitmap->atlas_page;
+    if (--page->live_bitmaps > 0) {
+        return;
+    }
+    
+    for (auto it = _atlas_pages.begin(); it != _atlas_pages.end(); ++it) {
+        if (*it == page) {
+            _atlas_pages.erase(it);
+            break;
+        }
+    }
+    
+    al_destroy_bitmap(page->bitmap);
+    delete page;
+}
+
+ALLEGRO_BITMAP* al_create_bitmap(int w, int h)
+{
+    if ((_new_bitmap_flags & ALLEGRO_ATLAS_BITMAP) &&
+        !(_new_bitmap_flags & ALLEGRO_MEMORY_BITMAP) &&
+        _current_display && _current_display->renderer &&
+        w > 0 && h > 0 && w <= ATLAS_MAX_BITMAP_SIZE && h <= ATLAS_MAX_BITMAP_SIZE) {
+        ALLEGRO_BITMAP* bitmap = _create_atlas_bitmap(w, h, _new_bitmap_flags);
+        if (bitmap) {
+            return bitmap;
+        }
+    }
+    
+    return _create_bitmap(w, h, _new_bitmap_flags);
+}
+
+void al_destroy_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return;
+    }
+    
+    if (bitmap == _batch_bitmap) {
+        _flush_bitmap_batch();
+    }
+    
+    if (bitmap->locked) {
+        al_unlock_bitmap(bitmap);
+    }
+    
+    _forget_bitmap(bitmap);
+    if (bitmap->parent) {
+        _detach_bitmap_view(bitmap);
+    }
+    
+    if (bitmap->atlas_page) {
+        _release_atlas_bitmap(bitmap);
+        delete bitmap;
+        return;
+    }
+    
+    if (bitmap->parent) {
+        delete bitmap;
+        return;
+    }
+    
+    for (size_t i = 0; i < bitmap->views.size(); i++) {
+        bitmap->views[i]->view_index = ORPHANED_VIEW;
+    }
+    
+    if (bitmap->lock_texture) {
+        SDL_DestroyTexture(bitmap->lock_texture);
+    }
+    
+    if (bitmap->shadow) {
+        SDL_FreeSurface(bitmap->shadow);
+        delete[] bitmap->shadow_tiles;
+    }
+    
+    if (_current_display && bitmap->texture &&
+        _current_display->render_target == bitmap->texture) {
+        _current_display->render_target_valid = false;
+    }
+    
+    if (bitmap->texture) {
+        SDL_DestroyTexture(bitmap->texture);
+    }
+    
+    if (bitmap->surface) {
+        SDL_FreeSurface(bitmap->surface);
+    }
+    
+    delete bitmap;
+}
+
+int al_get_bitmap_width(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return 0;
+    }
+    return bitmap->width;
+}
+
+int al_get_bitmap_height(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return 0;
+    }
+    return bitmap->height;
+}
+
+int al_get_bitmap_format(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return 0;
+    }
+    return bitmap->format;
+}
+
+int al_get_bitmap_flags(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return 0;
+    }
+    return bitmap->flags;
+}
+
+void al_set_target_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    _flush_bitmap_batch();
+    _target_bitmap = bitmap;
+    
+    if (!_current_display || !_current_display->renderer) {
+        return;
+    }
+    
+    _apply_target_bitmap(_current_display, bitmap);
+}
+
+ALLEGRO_BITMAP* al_get_target_bitmap(void)
+{
+    return _target_bitmap;
+}
+
+void al_set_new_bitmap_flags(int flags)
+{
+    _new_bitmap_flags = flags;
+}
+
+int al_get_new_bitmap_flags(void)
+{
+    return _new_bitmap_flags;
+}
+
+void al_set_new_bitmap_format(int format)
+{
+    _new_bitmap_format = format;
+}
+
+int al_get_new_bitmap_format(void)
+{
+    return _new_bitmap_format;
+}
+
+bool al_is_compatible_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap || !_current_display) {
+        return false;
+    }
+    
+    return (bitmap->flags & _new_bitmap_flags) != 0 &&
+           bitmap->format == _choose_texture_format(_new_bitmap_format);
+}
+
+ALLEGRO_BITMAP* al_clone_bitmap(ALLEGRO_BITMAP* source)
+{
+    if (!source) {
+        return nullptr;
+    }
+    
+    ALLEGRO_BITMAP* bitmap = al_create_bitmap(source->width, source->height);
+    if (!bitmap) {
+        return nullptr;
+    }
+    
+    if (source->texture && bitmap->texture && _current_display && _current_display->renderer) {
+        _flush_bitmap_batch();
+        _upload_shadow(source);
+        _apply_target_bitmap(_current_display, bitmap);
+        _cache_set_texture_mod(source, 255, 255, 255, 255);
+        _cache_set_texture_blend_mode(source, SDL_BLENDMODE_NONE);
+        SDL_Rect src_rect = {source->xofs, source->yofs, source->width, source->height};
+        SDL_RenderCopy(_current_display->renderer, source->texture, &src_rect, nullptr);
+        _apply_target_bitmap(_current_display, _target_bitmap);
+    } else if (source->surface && bitmap->surface) {
+        SDL_Rect src_rect = {source->xofs, source->yofs, source->width, source->height};
+        SDL_BlitSurface(source->surface, &src_rect, bitmap->surface, nullptr);
+    }
+    
+    return bitmap;
+}
+
+ALLEGRO_BITMAP* al_create_sub_bitmap(ALLEGRO_BITMAP* parent, int x, int y, int w, int h)
+{
+    if (!parent || w <= 0 || h <= 0) {
+        return nullptr;
+    }
+    
+    ALLEGRO_BITMAP* bitmap = _new_bitmap_handle(w, h, parent->format, parent->flags & ~ALLEGRO_ATLAS_BITMAP);
+    if (!bitmap) {
+        return nullptr;
+    }
+    
+    bitmap->sub_parent = parent->sub_parent ? parent->sub_parent : parent;
+    bitmap->sub_x = parent->sub_x + x;
+    bitmap->sub_y = parent->sub_y + y;
+    
+    if (parent->parent) {
+        x += parent->xofs;
+        y += parent->yofs;
+        parent = parent->parent;
+    }
+    
+    bitmap->texture = parent->texture;
+    bitmap->surface = parent->surface;
+    bitmap->requested_format = parent->requested_format;
+    _attach_bitmap_view(parent, bitmap);
+    bitmap->xofs = x;
+    bitmap->yofs = y;
+    
+    return bitmap;
+}
+
+bool al_is_sub_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    return bitmap && bitmap->sub_parent;
+}
+
+ALLEGRO_BITMAP* al_get_parent_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return nullptr;
+    }
+    return bitmap->sub_parent;
+}
+
+int al_get_bitmap_x(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return 0;
+    }
+    return bitmap->sub_x;
+}
+
+int al_get_bitmap_y(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return 0;
+    }
+    return bitmap->sub_y;
+}
+
+ALLEGRO_BITMAP* al_get_backbuffer(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    if (!display) {
+        return nullptr;
+    }
+    
+    if (!display->backbuffer) {
+        display->backbuffer = al_create_bitmap(display->width, display->height);
+        if (display->backbuffer) {
+            static ALLEGRO_BITMAP* backbuffer_bitmap = static_cast<ALLEGRO_BITMAP*>(display->backbuffer);
+            backbuffer_bitmap->is_backbuffer = true;
+        }
+    }
+    
+    return static_cast<ALLEGRO_BITMAP*>(display->backbuffer);
+}
+
+void al_set_target_backbuffer(ALLEGRO_DISPLAY* display)
+{
+    if (!display) {
+        display = _current_display;
+    }
+    
+    _flush_bitmap_batch();
+    _target_bitmap = nullptr;
+    
+    if (display && display->renderer) {
+        _apply_target_bitmap(display, nullptr);
+    }
+}
+
+static void _draw_tinted_bitmap_region(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint,
+                                       float sx, float sy, float sw, float sh,
+                                       float dx, float dy, float dw, float dh, int flags)
+{
+    if (!bitmap || _cull_rect(dx, dy, dx + dw, dy + dh, 0)) {
+        return;
+    }
+    
+    SoftTarget soft;
+    if (_get_soft_target(&soft)) {
+        _flush_bitmap_batch();
+        SDL_Surface* source = _soft_source_surface(bitmap);
+        if (source) {
+            SDL_Vertex quad[4];
+            _make_bitmap_quad(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags, quad);
+            _soft_fill_convex(&soft, quad, 4, source);
+        }
+        return;
+    }
+    
+    if (!_current_display || !_current_display->renderer) {
+        return;
+    }
+    
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    if (!root->texture) {
+        _draw_memory_bitmap(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags);
+        return;
+    }
+    
+    if (_bitmap_drawing_held) {
+        _batch_bitmap_quad(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags);
+        return;
+    }
+    
+    _upload_shadow(bitmap);
+    
+    if (_transform_kind == TRANSFORM_AFFINE) {
+        SDL_Vertex quad[4];
+        const int idx[6] = {0, 1, 2, 0, 2, 3};
+        _make_bitmap_quad(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags, quad);
+        if (_target_has_shadow()) {
+            float x1 = SDL_min(SDL_min(quad[0].position.x, quad[1].position.x),
+                               SDL_min(quad[2].position.x, quad[3].position.x));
+            float y1 = SDL_min(SDL_min(quad[0].position.y, quad[1].position.y),
+                               SDL_min(quad[2].position.y, quad[3].position.y));
+            float x2 = SDL_max(SDL_max(quad[0].position.x, quad[1].position.x),
+                               SDL_max(quad[2].position.x, quad[3].position.x));
+            float y2 = SDL_max(SDL_max(quad[0].position.y, quad[1].position.y),
+                               SDL_max(quad[2].position.y, quad[3].position.y));
+            SDL_FRect bounds = {x1, y1, x2 - x1, y2 - y1};
+            _begin_target_draw(&bounds);
+        }
+        _cache_set_texture_mod(bitmap, 255, 255, 255, 255);
+        _cache_set_texture_blend_mode(bitmap, _get_blender_mode());
+        SDL_RenderGeometry(_current_display->renderer, bitmap->texture, quad, 4, idx, 6);
+        return;
+    }
+    
+    SDL_Rect src_rect = {static_cast<int>(sx) + bitmap->xofs, static_cast<int>(sy) + bitmap->yofs, 
+                         static_cast<int>(sw), static_cast<int>(sh)};
+    
+    SDL_RendererFlip flip = SDL_FLIP_NONE;
+    if (flags & ALLEGRO_FLIP_HORIZONTAL) {
+        flip = static_cast<SDL_RendererFlip>(flip | SDL_FLIP_HORIZONTAL);
+    }
+    if (flags & ALLEGRO_FLIP_VERTICAL) {
+        flip = static_cast<SDL_RendererFlip>(flip | SDL_FLIP_VERTICAL);
+    }
+    
+    float x1 = dx;
+    float y1 = dy;
+    float x2 = dx + dw;
+    float y2 = dy + dh;
+    _transform_point(&x1, &y1);
+    _transform_point(&x2, &y2);
+    if (x2 < x1) {
+        float t = x1; x1 = x2; x2 = t;
+        flip = static_cast<SDL_RendererFlip>(flip ^ SDL_FLIP_HORIZONTAL);
+    }
+    if (y2 < y1) {
+        float t = y1; y1 = y2; y2 = t;
+        flip = static_cast<SDL_RendererFlip>(flip ^ SDL_FLIP_VERTICAL);
+    }
+    SDL_FRect dst_rect = {x1, y1, x2 - x1, y2 - y1};
+    _begin_target_draw(&dst_rect);
+    
+    _cache_set_texture_mod(bitmap,
+        static_cast<Uint8>(tint.r * 255),
+        static_cast<Uint8>(tint.g * 255),
+        static_cast<Uint8>(tint.b * 255),
+        static_cast<Uint8>(tint.a * 255));
+    _cache_set_texture_blend_mode(bitmap, _get_blender_mode());
+    
+    SDL_RenderCopyExF(_current_display->renderer, bitmap->texture, 
+                      &src_rect, &dst_rect, 0, nullptr, flip);
+}
+
+void al_draw_bitmap(ALLEGRO_BITMAP* bitmap, float dx, float dy, int flags)
+{
+    al_draw_bitmap_region(bitmap, 0, 0, 
+        static_cast<float>(al_get_bitmap_width(bitmap)),
+        static_cast<float>(al_get_bitmap_height(bitmap)),
+        dx, dy, flags);
+}
+
+void al_draw_bitmap_region(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw, float sh, float dx, float dy, int flags)
+{
+    _draw_tinted_bitmap_region(bitmap, al_map_rgba_f(1, 1, 1, 1),
+                               sx, sy, sw, sh, dx, dy, sw, sh, flags);
+}
+
+void al_draw_scaled_bitmap(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw, float sh, 
+                          float dx, float dy, float dw, float dh, int flags)
+{
+    _draw_tinted_bitmap_region(bitmap, al_map_rgba_f(1, 1, 1, 1),
+                               sx, sy, sw, sh, dx, dy, dw, dh, flags);
+}
+
+void al_draw_tinted_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float dx, float dy, int flags)
+{
+    if (!bitmap) {
+        return;
+    }
+    
+    _draw_tinted_bitmap_region(bitmap, tint,
+                               0, 0, static_cast<float>(bitmap->width), static_cast<float>(bitmap->height),
+                               dx, dy, static_cast<float>(bitmap->width), static_cast<float>(bitmap->height),
+                               flags);
+}
+
+void al_draw_tinted_scaled_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, 
+                                  float sx, float sy, float sw, float sh, 
+                                  float dx, float dy, float dw, float dh, int flags)
+{
+    _draw_tinted_bitmap_region(bitmap, tint, sx, sy, sw, sh, dx, dy, dw, dh, flags);
+}
+
+void al_draw_tinted_bitmap_region(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint,
+                                  float sx, float sy, float sw, float sh, float dx, float dy, int flags)
+{
+    _draw_tinted_bitmap_region(bitmap, tint, sx, sy, sw, sh, dx, dy, sw, sh, flags);
+}
+
+/* Rotated draws are single instances, so they share the instance path's
+ * corner generation and culling. */
+void al_draw_tinted_scaled_rotated_bitmap_region(ALLEGRO_BITMAP* bitmap,
+                                                 float sx, float sy, float sw, float sh,
+                                                 ALLEGRO_COLOR tint, float cx, float cy,
+                                                 float dx, float dy, float xscale, float yscale,
+                                                 float angle, int flags)
+{
+    ALLEGRO_BITMAP_INSTANCE inst;
+    inst.sx = sx;
+    inst.sy = sy;
+    inst.sw = sw;
+    inst.sh = sh;
+    inst.cx = cx;
+    inst.cy = cy;
+    inst.dx = dx;
+    inst.dy = dy;
+    inst.xscale = xscale;
+    inst.yscale = yscale;
+    inst.angle = angle;
+    inst.tint = tint;
+    inst.flags = flags;
+    al_draw_bitmap_instances(bitmap, &inst, 1);
+}
+
+void al_draw_tinted_scaled_rotated_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float cx, float cy,
+                                          float dx, float dy, float xscale, float yscale,
+                                          float angle, int flags)
+{
+    if (!bitmap) {
+        return;
+    }
+    al_draw_tinted_scaled_rotated_bitmap_region(bitmap, 0, 0,
+        static_cast<float>(bitmap->width), static_cast<float>(bitmap->height),
+        tint, cx, cy, dx, dy, xscale, yscale, angle, flags);
+}
+
+void al_draw_tinted_rotated_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float cx, float cy,
+                                   float dx, float dy, float angle, int flags)
+{
+    al_draw_tinted_scaled_rotated_bitmap(bitmap, tint, cx, cy, dx, dy, 1, 1, angle, flags);
+}
+
+void al_draw_scaled_rotated_bitmap(ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy,
+                                   float xscale, float yscale, float angle, int flags)
+{
+    al_draw_tinted_scaled_rotated_bitmap(bitmap, al_map_rgba_f(1, 1, 1, 1),
+                                         cx, cy, dx, dy, xscale, yscale, angle, flags);
+}
+
+void al_draw_rotated_bitmap(ALLEGRO_BITMAP* bitmap, float cx, float cy, float dx, float dy,
+                            float angle, int flags)
+{
+    al_draw_tinted_scaled_rotated_bitmap(bitmap, al_map_rgba_f(1, 1, 1, 1),
+                                         cx, cy, dx, dy, 1, 1, angle, flags);
+}
+
+/* Writes a pixel into the target's CPU shadow instead of issuing a GPU
+ * point. The covering tile is read back first if it is stale and is then
+ * marked for upload. */
+static bool _put_shadow_pixel(float x, float y, ALLEGRO_COLOR color)
+{
+    if (!_target_has_shadow()) {
+        return false;
+    }
+    
+    _transform_point(&x, &y);
+    int px = static_cast<int>(floorf(x));
+    int py = static_cast<int>(floorf(y));
+    if (px < 0 || py < 0 || px >= _target_bitmap->width || py >= _target_bitmap->height) {
+        return true;
+    }
+    if (_clipping_initialized &&
+        (px < _clip_x || py < _clip_y || px >= _clip_x + _clip_w || py >= _clip_y + _clip_h)) {
+        return true;
+    }
+    
+    ALLEGRO_BITMAP* root = _target_bitmap->parent ? _target_bitmap->parent : _target_bitmap;
+    px += _target_bitmap->xofs;
+    py += _target_bitmap->yofs;
+    
+    SDL_Rect rect = {px, py, 1, 1};
+    _read_shadow_tiles(root, &rect);
+    
+    _surface_put_pixel(root->shadow, px, py, SDL_MapRGBA(root->shadow->format,
+        static_cast<Uint8>(color.r * 255),
+        static_cast<Uint8>(color.g * 255),
+        static_cast<Uint8>(color.b * 255),
+        static_cast<Uint8>(color.a * 255)));
+    
+    Uint8* state = &root->shadow_tiles[(py / SHADOW_TILE_SIZE) * root->shadow_tiles_x + px / SHADOW_TILE_SIZE];
+    if (*state != SHADOW_TILE_DIRTY) {
+        *state = SHADOW_TILE_DIRTY;
+        root->shadow_dirty_tiles++;
+    }
+    return true;
+}
+
+void al_put_pixel(float x, float y, ALLEGRO_COLOR color)
+{
+    SoftTarget soft;
+    if (_get_soft_target(&soft)) {
+        _flush_bitmap_batch();
+        _transform_point(&x, &y);
+        _soft_put_pixel(&soft, x, y, _soft_color(color), false);
+        return;
+    }
+    
+    if (!_current_display || !_current_display->renderer) {
+        return;
+    }
+    
+    _flush_bitmap_batch();
+    if (_put_shadow_pixel(x, y, color)) {
+        return;
+    }
+    _apply_render_blender();
+    
+    _cache_set_draw_color(
+        _current_display,
+        static_cast<Uint8>(color.r * 255),
+        static_cast<Uint8>(color.g * 255),
+        static_cast<Uint8>(color.b * 255),
+        static_cast<Uint8>(color.a * 255)
+    );
+    _transform_point(&x, &y);
+    SDL_RenderDrawPointF(_current_display->renderer, x, y);
+}
+
+void al_put_blended_pixel(float x, float y, ALLEGRO_COLOR color)
+{
+    SoftTarget soft;
+    if (_get_soft_target(&soft)) {
+        _flush_bitmap_batch();
+        _transform_point(&x, &y);
+        _soft_put_pixel(&soft, x, y, _soft_color(color), true);
+        return;
+    }
+    
+    al_put_pixel(x, y, color);
+}
+
+void al_get_pixel(ALLEGRO_BITMAP* bitmap, float x, float y, ALLEGRO_COLOR* color)
+{
+    if (!color) {
+        return;
+    }
+    
+    color->r = 0;
+    color->g = 0;
+    color->b = 0;
+    color->a = 1;
+    
+    if (!bitmap) {
+        return;
+    }
+    
+    int px = static_cast<int>(x);
+    int py = static_cast<int>(y);
+    
+    if (px < 0 || px >= bitmap->width || py < 0 || py >= bitmap->height) {
+        return;
+    }
+    
+    px += bitmap->xofs;
+    py += bitmap->yofs;
+    
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    SDL_Surface* surface = root->surface;
+    
+    if (!surface) {
+        if (!root->texture || !_current_display || !_current_display->renderer) {
+            return;
+        }
+        _flush_bitmap_batch();
+        if (!_ensure_shadow(root)) {
+            return;
+        }
+        SDL_Rect rect = {px, py, 1, 1};
+        _read_shadow_tiles(root, &rect);
+        surface = root->shadow;
+    }
+    
+    Uint8 r, g, b, a;
+    int format = _sdl_to_allegro_format(surface->format->format);
+    if (format != ALLEGRO_PIXEL_FORMAT_ANY) {
+        Uint32 argb = _decode_pixel(static_cast<const Uint8*>(surface->pixels) + py * surface->pitch +
+                                    px * surface->format->BytesPerPixel, format);
+        a = argb >> 24;
+        r = (argb >> 16) & 0xFF;
+        g = (argb >> 8) & 0xFF;
+        b = argb & 0xFF;
+    } else {
+        SDL_GetRGBA(_surface_get_pixel(surface, px, py), surface->format, &r, &g, &b, &a);
+    }
+    
+    color->r = r / 255.0f;
+    color->g = g / 255.0f;
+    color->b = b / 255.0f;
+    color->a = a / 255.0f;
+}
+
+static Uint32 _bitmap_sdl_format(ALLEGRO_BITMAP* bitmap)
+{
+    if (bitmap->surface) {
+        return bitmap->surface->format->format;
+    }
+    Uint32 format = SDL_PIXELFORMAT_UNKNOWN;
+    if (bitmap->texture) {
+        SDL_QueryTexture(bitmap->texture, &format, nullptr, nullptr, nullptr);
+    }
+    return format;
+}
+
+int al_get_pixel_size(int format)
+{
+    const PixelFormatInfo* info = _get_pixel_format_info(format);
+    return info ? info->bytes : 0;
+}
+
+/* Locked video bitmaps are written through a streaming texture owned by the
+ * root bitmap. Only the locked rectangle of it is mapped, so unlocking
+ * uploads just that rectangle, which is then copied into the real texture on
+ * the GPU. */
+static SDL_Texture* _get_lock_texture(ALLEGRO_BITMAP* root, Uint32 format)
+{
+    if (root->lock_texture) {
+        Uint32 lock_format;
+        SDL_QueryTexture(root->lock_texture, &lock_format, nullptr, nullptr, nullptr);
+        if (lock_format == format) {
+            return root->lock_texture;
+        }
+        SDL_DestroyTexture(root->lock_texture);
+    }
+    
+    root->lock_texture = SDL_CreateTexture(_current_display->renderer, format,
+                                           SDL_TEXTUREACCESS_STREAMING,
+                                           root->width, root->height);
+    if (root->lock_texture) {
+        SDL_SetTextureBlendMode(root->lock_texture, SDL_BLENDMODE_NONE);
+    }
+    return root->lock_texture;
+}
+
+/* rect is in root-texture coordinates, whatever the current target. */
+static bool _read_texture_rect(ALLEGRO_BITMAP* root, const SDL_Rect* rect,
+                               Uint32 format, void* pixels, int pitch)
+{
+    TextureAccess access;
+    _begin_texture_access(root, &access);
+    int result = SDL_RenderReadPixels(_current_display->renderer, rect, format, pixels, pitch);
+    _end_texture_access(&access);
+    return result == 0;
+}
+
+ALLEGRO_LOCKED_REGION* al_lock_bitmap_region(ALLEGRO_BITMAP* bitmap, int x, int y,
+                                             int width, int height, int format, int flags)
+{
+    if (!bitmap || bitmap->locked || width <= 0 || height <= 0) {
+        return nullptr;
+    }
+    if (x < 0 || y < 0 || x + width > bitmap->width || y + height > bitmap->height) {
+        return nullptr;
+    }
+    
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    Uint32 native_sdl_format = _bitmap_sdl_format(root);
+    int native_format = _sdl_to_allegro_format(native_sdl_format);
+    if (native_format == ALLEGRO_PIXEL_FORMAT_ANY) {
+        return nullptr;
+    }
+    
+    int lock_format = native_format;
+    if (format > ALLEGRO_PIXEL_FORMAT_ANY_32_WITH_ALPHA) {
+        if (!_get_pixel_format_info(format)) {
+            return nullptr;
+        }
+        lock_format = format;
+    }
+    
+    SDL_Rect rect = {x + bitmap->xofs, y + bitmap->yofs, width, height};
+    int pixel_size = al_get_pixel_size(lock_format);
+    int native_size = al_get_pixel_size(native_format);
+    bool readable = (flags != ALLEGRO_LOCK_WRITEONLY);
+    bool writable = (flags != ALLEGRO_LOCK_READONLY);
+    void* data = nullptr;
+    int pitch = 0;
+    
+    if (root->surface) {
+        if (lock_format == native_format) {
+            pitch = root->surface->pitch;
+            data = static_cast<Uint8*>(root->surface->pixels) +
+                   rect.y * pitch + rect.x * pixel_size;
+        } else {
+            pitch = width * pixel_size;
+            bitmap->lock_buffer = malloc(static_cast<size_t>(pitch) * height);
+            if (!bitmap->lock_buffer) {
+                return nullptr;
+            }
+            if (readable) {
+                const Uint8* src = static_cast<const Uint8*>(root->surface->pixels) +
+                                   rect.y * root->surface->pitch + rect.x * native_size;
+                _convert_pixels(src, native_format, root->surface->pitch,
+                                bitmap->lock_buffer, lock_format, pitch, width, height);
+            }
+            data = bitmap->lock_buffer;
+        }
+    } else {
+        if (!_current_display || !_current_display->renderer) {
+            return nullptr;
+        }
+        _flush_bitmap_batch();
+        _upload_shadow(root);
+        
+        if (writable && lock_format == native_format) {
+            SDL_Texture* staging = _get_lock_texture(root, native_sdl_format);
+            if (!staging || SDL_LockTexture(staging, &rect, &data, &pitch) != 0) {
+                return nullptr;
+            }
+            if (readable) {
+                _read_texture_rect(root, &rect, native_sdl_format, data, pitch);
+            }
+            bitmap->lock_staged = true;
+        } else {
+            pitch = width * pixel_size;
+            bitmap->lock_buffer = malloc(static_cast<size_t>(pitch) * height);
+            if (!bitmap->lock_buffer) {
+                return nullptr;
+            }
+            if (readable && lock_format == native_format) {
+                _read_texture_rect(root, &rect, native_sdl_format, bitmap->lock_buffer, pitch);
+            } else if (readable) {
+                std::vector<Uint8> native(static_cast<size_t>(width) * height * native_size);
+                _read_texture_rect(root, &rect, native_sdl_format, native.data(), width * native_size);
+                _convert_pixels(native.data(), native_format, width * native_size,
+                                bitmap->lock_buffer, lock_format, pitch, width, height);
+            }
+            data = bitmap->lock_buffer;
+        }
+    }
+    
+    bitmap->locked = true;
+    bitmap->lock_flags = flags;
+    bitmap->lock_rect = rect;
+    bitmap->lock_format = lock_format;
+    bitmap->locked_region.data = data;
+    bitmap->locked_region.format = lock_format;
+    bitmap->locked_region.pitch = pitch;
+    bitmap->locked_region.pixel_size = pixel_size;
+    
+    return &bitmap->locked_region;
+}
+
+ALLEGRO_LOCKED_REGION* al_lock_bitmap(ALLEGRO_BITMAP* bitmap, int format, int flags)
+{
+    if (!bitmap) {
+        return nullptr;
+    }
+    return al_lock_bitmap_region(bitmap, 0, 0, bitmap->width, bitmap->height, format, flags);
+}
+
+void al_unlock_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap || !bitmap->locked) {
+        return;
+    }
+    
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    const SDL_Rect* rect = &bitmap->lock_rect;
+    bool writable = (bitmap->lock_flags != ALLEGRO_LOCK_READONLY);
+    
+    if (root->surface) {
+        if (bitmap->lock_buffer && writable) {
+            int native_format = _sdl_to_allegro_format(root->surface->format->format);
+            Uint8* dst = static_cast<Uint8*>(root->surface->pixels) +
+                         rect->y * root->surface->pitch + rect->x * al_get_pixel_size(native_format);
+            _convert_pixels(bitmap->lock_buffer, bitmap->lock_format, bitmap->locked_region.pitch,
+                            dst, native_format, root->surface->pitch, rect->w, rect->h);
+        }
+    } else if (writable && _current_display && _current_display->renderer) {
+        SDL_Texture* staging = bitmap->lock_staged ? root->lock_texture : nullptr;
+        if (bitmap->lock_buffer) {
+            Uint32 native_sdl_format = _bitmap_sdl_format(root);
+            void* pixels;
+            int pitch;
+            staging = _get_lock_texture(root, native_sdl_format);
+            if (staging && SDL_LockTexture(staging, rect, &pixels, &pitch) == 0) {
+                _convert_pixels(bitmap->lock_buffer, bitmap->lock_format, bitmap->locked_region.pitch,
+                                pixels, _sdl_to_allegro_format(native_sdl_format), pitch, rect->w, rect->h);
+            } else {
+                staging = nullptr;
+            }
+        }
+        if (staging) {
+            TextureAccess access;
+            SDL_UnlockTexture(staging);
+            _begin_texture_access(root, &access);
+            SDL_RenderCopy(_current_display->renderer, staging, rect, rect);
+            _end_texture_access(&access);
+            _mark_shadow_stale(root, rect);
+        }
+    }
+    
+    free(bitmap->lock_buffer);
+    bitmap->lock_buffer = nullptr;
+    bitmap->lock_staged = false;
+    bitmap->locked = false;
+}
+
+bool al_is_bitmap_locked(ALLEGRO_BITMAP* bitmap)
+{
+    return bitmap && bitmap->locked;
+}
+
+/* Residency migration. A root bitmap moves between an ARGB8888 surface and
+ * a renderer texture, and every sub-bitmap viewing it is patched to match.
+ * Atlas pages and their members, bitmaps with a locked view, the current
+ * target and the backbuffer keep the residency they have. */
+static bool _can_convert_bitmap(ALLEGRO_BITMAP* root)
+{
+    if (root->parent || root->locked || root->is_backbuffer) {
+        return false;
+    }
+    if (_target_bitmap && (_target_bitmap == root || _target_bitmap->parent == root)) {
+        return false;
+    }
+    for (size_t i = 0; i < root->views.size(); i++) {
+        if (root->views[i]->locked) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < _atlas_pages.size(); i++) {
+        if (_atlas_pages[i]->bitmap == root) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _retarget_bitmap_views(ALLEGRO_BITMAP* root)
+{
+    root->mod_r = root->mod_g = root->mod_b = root->mod_a = 255;
+    root->blend_mode_valid = false;
+    for (size_t i = 0; i < root->views.size(); i++) {
+        ALLEGRO_BITMAP* bitmap = root->views[i];
+        bitmap->texture = root->texture;
+        bitmap->surface = root->surface;
+        bitmap->format = root->format;
+        bitmap->flags = root->flags;
+        bitmap->mod_r = bitmap->mod_g = bitmap->mod_b = bitmap->mod_a = 255;
+        bitmap->blend_mode_valid = false;
+    }
+}
+
+static bool _download_bitmap(ALLEGRO_BITMAP* root)
+{
+    int native_format = _sdl_to_allegro_format(_bitmap_sdl_format(root));
+    int native_pitch = root->width * al_get_pixel_size(native_format);
+    if (native_pitch <= 0) {
+        return false;
+    }
+    
+    SDL_Surface* surface = SDL_CreateRGBSurface(
+        0, root->width, root->height, 32,
+        0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000
+    );
+    void* pixels = malloc(static_cast<size_t>(native_pitch) * root->height);
+    if (!surface || !pixels) {
+        free(pixels);
+        if (surface) {
+            SDL_FreeSurface(surface);
+        }
+        return false;
+    }
+    
+    _upload_shadow(root);
+    SDL_Rect rect = {0, 0, root->width, root->height};
+    if (!_read_texture_rect(root, &rect, _bitmap_sdl_format(root), pixels, native_pitch) ||
+        !_convert_pixels(pixels, native_format, native_pitch, surface->pixels,
+                         ALLEGRO_PIXEL_FORMAT_ARGB_8888, surface->pitch,
+                         root->width, root->height)) {
+        free(pixels);
+        SDL_FreeSurface(surface);
+        return false;
+    }
+    free(pixels);
+    
+    if (root->lock_texture) {
+        SDL_DestroyTexture(root->lock_texture);
+        root->lock_texture = nullptr;
+    }
+    if (root->shadow) {
+        SDL_FreeSurface(root->shadow);
+        delete[] root->shadow_tiles;
+        root->shadow = nullptr;
+        root->shadow_tiles = nullptr;
+        root->shadow_dirty_tiles = 0;
+    }
+    if (_current_display->render_target == root->texture) {
+        _current_display->render_target_valid = false;
+    }
+    SDL_DestroyTexture(root->texture);
+    
+    root->texture = nullptr;
+    root->surface = surface;
+    root->format = ALLEGRO_PIXEL_FORMAT_ARGB_8888;
+    root->flags = (root->flags & ~ALLEGRO_VIDEO_BITMAP) | ALLEGRO_MEMORY_BITMAP;
+    return true;
+}
+
+/* Pixels of a memory bitmap already converted to the texture format it is
+ * about to be uploaded into. */
+struct BitmapUpload {
+    ALLEGRO_BITMAP* root;
+    int format;
+    int pitch;
+    void* pixels;
+};
+
+static bool _prepare_upload(ALLEGRO_BITMAP* root, BitmapUpload* upload)
+{
+    upload->root = root;
+    upload->format = _choose_texture_format(root->requested_format);
+    upload->pitch = root->width * al_get_pixel_size(upload->format);
+    upload->pixels = malloc(static_cast<size_t>(upload->pitch) * root->height);
+    return upload->pixels != nullptr;
+}
+
+static bool _convert_upload(const BitmapUpload* upload, int max_threads)
+{
+    SDL_Surface* surface = upload->root->surface;
+    return _convert_pixels_threaded(surface->pixels, _sdl_to_allegro_format(surface->format->format),
+                                    surface->pitch, upload->pixels, upload->format, upload->pitch,
+                                    upload->root->width, upload->root->height, max_threads);
+}
+
+/* Texture creation and uploads stay on the thread that owns the renderer. */
+static bool _finish_upload(const BitmapUpload* upload)
+{
+    ALLEGRO_BITMAP* root = upload->root;
+    SDL_Texture* texture = SDL_CreateTexture(_current_display->renderer,
+                                             _allegro_to_sdl_format(upload->format),
+                                             SDL_TEXTUREACCESS_TARGET,
+                                             root->width, root->height);
+    if (!texture) {
+        return false;
+    }
+    if (SDL_UpdateTexture(texture, nullptr, upload->pixels, upload->pitch) != 0) {
+        SDL_DestroyTexture(texture);
+        return false;
+    }
+    
+    SDL_FreeSurface(root->surface);
+    root->surface = nullptr;
+    root->texture = texture;
+    root->format = upload->format;
+    root->flags = (root->flags & ~(ALLEGRO_MEMORY_BITMAP | ALLEGRO_CONVERT_BITMAP)) |
+                  ALLEGRO_VIDEO_BITMAP;
+    return true;
+}
+
+void al_convert_bitmap(ALLEGRO_BITMAP* bitmap)
+{
+    if (!bitmap) {
+        return;
+    }
+    
+    ALLEGRO_BITMAP* root = bitmap->parent ? bitmap->parent : bitmap;
+    if (!_can_convert_bitmap(root)) {
+        return;
+    }
+    
+    bool has_renderer = _current_display && _current_display->renderer;
+    bool want_video = has_renderer && !(_new_bitmap_flags & ALLEGRO_MEMORY_BITMAP);
+    _flush_bitmap_batch();
+    
+    if (root->texture && !want_video) {
+        if (has_renderer && _download_bitmap(root)) {
+            _retarget_bitmap_views(root);
+        }
+    } else if (root->surface && want_video) {
+        BitmapUpload upload;
+        bool uploaded = _prepare_upload(root, &upload) &&
+                        _convert_upload(&upload, CONVERT_MAX_THREADS) &&
+                        _finish_upload(&upload);
+        free(upload.pixels);
+        if (uploaded) {
+            _retarget_bitmap_views(root);
+        }
+    } else if (root->surface && !want_video) {
+        root->flags &= ~ALLEGRO_CONVERT_BITMAP;
+        _retarget_bitmap_views(root);
+    }
+}
+
+struct ConvertQueue {
+    BitmapUpload* uploads;
+    int* converted;
+    int count;
+    SDL_atomic_t next;
+};
+
+static int SDLCALL _convert_upload_worker(void* data)
+{
+    ConvertQueue* queue = static_cast<ConvertQueue*>(data);
+    for (;;) {
+        int i = SDL_AtomicAdd(&queue->next, 1);
+        if (i >= queue->count) {
+            return 0;
+        }
+        queue->converted[i] = _convert_upload(&queue->uploads[i], 1);
+    }
+}
+
+/* Every bitmap that fell back to memory because no display existed yet is
+ * converted to the texture format on a pool of workers, one bitmap per task,
+ * and the finished pixels are then uploaded in order on this thread. */
+void al_convert_memory_bitmaps(void)
+{
+    if (!_current_display || !_current_display->renderer) {
+        return;
+    }
+    _flush_bitmap_batch();
+    
+    std::vector<BitmapUpload> uploads;
+    for (size_t i = 0; i < _bitmaps.size(); i++) {
+        ALLEGRO_BITMAP* root = _bitmaps[i];
+        if (!root->surface || !(root->flags & ALLEGRO_CONVERT_BITMAP) || !_can_convert_bitmap(root)) {
+            continue;
+        }
+        BitmapUpload upload;
+        if (_prepare_upload(root, &upload)) {
+            uploads.push_back(upload);
+        }
+    }
+    if (uploads.empty()) {
+        return;
+    }
+    
+    std::vector<int> converted(uploads.size(), 0);
+    ConvertQueue queue;
+    queue.uploads = &uploads[0];
+    queue.converted = &converted[0];
+    queue.count = static_cast<int>(uploads.size());
+    SDL_AtomicSet(&queue.next, 0);
+    
+    int threads = SDL_max(1, SDL_min(queue.count, SDL_min(SDL_GetCPUCount(), CONVERT_MAX_THREADS)));
+    SDL_Thread* workers[CONVERT_MAX_THREADS];
+    for (int i = 1; i < threads; i++) {
+        workers[i] = SDL_CreateThread(_convert_upload_worker, "al_convert", &queue);
+    }
+    _convert_upload_worker(&queue);
+    for (int i = 1; i < threads; i++) {
+        if (workers[i]) {
+            SDL_WaitThread(workers[i], nullptr);
+        }
+    }
+    
+    for (size_t i = 0; i < uploads.size(); i++) {
+        if (converted[i] && _finish_upload(&uploads[i])) {
+            _retarget_bitmap_views(uploads[i].root);
+        }
+        free(uploads[i].pixels);
+    }
+}
+
+void al_set_clipping_rectangle(float x, float y, float w, float h)
+{
+    _clip_x = x;
+    _clip_y = y;
+    _clip_w = w;
+    _clip_h = h;
+    _clipping_initialized = true;
+    
+    if (_current_display && _current_display->renderer) {
+        _flush_bitmap_batch();
+        SDL_Rect rect = {static_cast<int>(x), static_cast<int>(y), 
+                         static_cast<int>(w), static_cast<int>(h)};
+        _cache_set_clip_rect(_current_display, &rect);
+    }
+}
+
+void al_get_clipping_rectangle(float* x, float* y, float* w, float* h)
+{
+    if (!_clipping_initialized) {
+        if (_current_display) {
+            if (x) *x = 0;
+            if (y) *y = 0;
+            if (w) *w = _current_display->width;
+            if (h) *h = _current_display->height;
+        } else {
+            if (x) *x = 0;
+            if (y) *y = 0;
+            if (w) *w = 0;
+            if (h) *h = 0;
+        }
+        return;
+    }
+    
+    if (x) *x = _clip_x;
+    if (y) *y = _clip_y;
+    if (w) *w = _clip_w;
+    if (h) *h = _clip_h;
+}
+
+void al_reset_clipping_rectangle(void)
+{
+    _clipping_initialized = false;
+    
+    if (_current_display && _current_display->renderer) {
+        _flush_bitmap_batch();
+        _cache_set_clip_rect(_current_display, nullptr);
+    }
+}
+
+static Uint32 _render_color = 0xFFFFFFFF;
+
+/* The soft target is resolved once per primitive by _can_draw, which every
+ * drawing entry point calls first; the helpers below reuse it rather than
+ * looking the target up again for each line or batch. */
+static SoftTarget _draw_soft;
+static bool _draw_is_soft = false;
+
+static bool _can_draw(void)
+{
+    _draw_is_soft = _get_soft_target(&_draw_soft);
+    return _draw_is_soft || (_current_display && _current_display->renderer);
+}
+
+static void _set_render_color(ALLEGRO_COLOR color)
+{
+    _render_color = _soft_color(color);
+    _flush_bitmap_batch();
+    if (_draw_is_soft || !_current_display || !_current_display->renderer) {
+        return;
+    }
+    _begin_target_draw(nullptr);
+    _apply_render_blender();
+    _cache_set_draw_color(
+        _current_display,
+        static_cast<Uint8>(color.r * 255),
+        static_cast<Uint8>(color.g * 255),
+        static_cast<Uint8>(color.b * 255),
+        static_cast<Uint8>(color.a * 255)
+    );
+}
+
+static SDL_Color _to_sdl_color(ALLEGRO_COLOR color)
+{
+    SDL_Color c = {
+        static_cast<Uint8>(color.r * 255),
+        static_cast<Uint8>(color.g * 255),
+        static_cast<Uint8>(color.b * 255),
+        static_cast<Uint8>(color.a * 255)
+    };
+    return c;
+}
+
+static void _draw_transformed_line(float x1, float y1, float x2, float y2)
+{
+    _transform_point(&x1, &y1);
+    _transform_point(&x2, &y2);
+    
+    if (_draw_is_soft) {
+        _soft_draw_line(&_draw_soft, x1, y1, x2, y2, _render_color);
+        return;
+    }
+    SDL_RenderDrawLineF(_current_display->renderer, x1, y1, x2, y2);
+}
+
+/* Transforms a connected point list in place and draws it as one polyline. */
+static void _draw_transformed_lines(SDL_FPoint* points, int count)
+{
+    for (int i = 0; i < count; i++) {
+        _transform_point(&points[i].x, &points[i].y);
+    }
+    
+    if (_draw_is_soft) {
+        for (int i = 1; i < count; i++) {
+            _soft_draw_line(&_draw_soft, points[i - 1].x, points[i - 1].y,
+                            points[i].x, points[i].y, _render_color);
+        }
+        return;
+    }
+    SDL_RenderDrawLinesF(_current_display->renderer, points, count);
+}
+
+/* Maps an axis-aligned rectangle through the current transform. Returns
+ * false when the transform rotates or shears, in which case the caller has
+ * to fall back to drawing the four corners as geometry. */
+static bool _transform_rect(float x1, float y1, float x2, float y2, SDL_FRect* out)
+{
+    if (_transform_kind == TRANSFORM_AFFINE) {
+        return false;
+    }
+    _transform_point(&x1, &y1);
+    _transform_point(&x2, &y2);
+    if (x2 < x1) {
+        float t = x1; x1 = x2; x2 = t;
+    }
+    if (y2 < y1) {
+        float t = y1; y1 = y2; y2 = t;
+    }
+    out->x = x1;
+    out->y = y1;
+    out->w = x2 - x1;
+    out->h = y2 - y1;
+    return true;
+}
+
+static void _draw_transformed_triangles(SDL_Vertex* verts, int num_verts,
+                                        const int* indices, int num_indices)
+{
+    for (int i = 0; i < num_verts; i++) {
+        _transform_point(&verts[i].position.x, &verts[i].position.y);
+    }
+    
+    if (_draw_is_soft) {
+        _soft_draw_triangles(&_draw_soft, verts, num_verts, indices, num_indices, nullptr);
+        return;
+    }
+    SDL_RenderGeometry(_current_display->renderer, nullptr, verts, num_verts, indices, num_indices);
+}
+
+static void _fill_transformed_rect(const SDL_FRect* rect)
+{
+    if (_draw_is_soft) {
+        SDL_Color c = {
+            static_cast<Uint8>((_render_color >> 16) & 0xFF),
+            static_cast<Uint8>((_render_color >> 8) & 0xFF),
+            static_cast<Uint8>(_render_color & 0xFF),
+            static_cast<Uint8>(_render_color >> 24)
+        };
+        SDL_Vertex quad[4] = {
+            {{rect->x, rect->y}, c, {0, 0}},
+            {{rect->x + rect->w, rect->y}, c, {0, 0}},
+            {{rect->x + rect->w, rect->y + rect->h}, c, {0, 0}},
+            {{rect->x, rect->y + rect->h}, c, {0, 0}}
+        };
+        _soft_fill_convex(&_draw_soft, quad, 4, nullptr);
+        return;
+    }
+    SDL_RenderFillRectF(_current_display->renderer, rect);
+}
+
+/* Curved outlines are tessellated so that no chord strays more than
+ * ARC_TOLERANCE pixels from the true curve after the current transform.
+ * Every curve is evaluated by the al_calculate_* helpers below, which write
+ * straight into strided destination buffers and evaluate four points per
+ * step when SSE2 is available. */
+static const float ARC_TOLERANCE = 0.25f;
+static const int ARC_MIN_SEGMENTS = 8;
+static const int ARC_MAX_SEGMENTS = 1024;
+
+static std::vector<SDL_FPoint> _outline_points;
+
+static float _transform_scale(void)
+{
+    if (_transform_kind == TRANSFORM_IDENTITY || _transform_kind == TRANSFORM_TRANSLATE) {
+        return 1.0f;
+    }
+    const float* m = _current_transform.m;
+    float sx = sqrtf(m[0] * m[0] + m[1] * m[1]);
+    float sy = sqrtf(m[4] * m[4] + m[5] * m[5]);
+    return SDL_max(sx, sy);
+}
+
+/* Segments needed to sweep angle radians of a curve with the given radius. */
+static int _arc_segments(float radius, float angle)
+{
+    radius *= _transform_scale();
+    float step = 2.0f;
+    if (radius > ARC_TOLERANCE) {
+        step = 2.0f * acosf(1.0f - ARC_TOLERANCE / radius);
+    }
+    float segments = ceilf(fabsf(angle) / SDL_max(step, 1e-4f));
+    return SDL_max(1, static_cast<int>(SDL_min(segments, static_cast<float>(ARC_MAX_SEGMENTS))));
+}
+
+/* Segments needed to flatten a cubic Bezier curve, from Wang's bound on
+ * the control polygon's second differences. */
+static int _spline_segments(const float* points)
+{
+    float dx = fabsf(points[0] - 2 * points[2] + points[4]);
+    float dy = fabsf(points[1] - 2 * points[3] + points[5]);
+    float ex = fabsf(points[2] - 2 * points[4] + points[6]);
+    float ey = fabsf(points[3] - 2 * points[5] + points[7]);
+    float bend = sqrtf(SDL_max(dx * dx + dy * dy, ex * ex + ey * ey)) * _transform_scale();
+    float segments = ceilf(sqrtf(0.75f * bend / ARC_TOLERANCE));
+    return SDL_max(1, static_cast<int>(SDL_min(segments, static_cast<float>(ARC_MAX_SEGMENTS))));
+}
+
+static inline float* _strided_point(float* dest, int stride, int index)
+{
+    return reinterpret_cast<float*>(reinterpret_cast<char*>(dest) + static_cast<ptrdiff_t>(stride) * index);
+}
+
+static inline const float* _strided_point(const float* src, int stride, int index)
+{
+    return reinterpret_cast<const float*>(reinterpret_cast<const char*>(src) + static_cast<ptrdiff_t>(stride) * index);
+}
+
+/* Stores point i, or the outer and inner pair of point i when thick. */
+static inline void _store_curve_point(float* dest, int stride, int i, bool thick,
+                                      float ox, float oy, float ix, float iy)
+{
+    if (thick) {
+        float* p = _strided_point(dest, stride, 2 * i);
+        p[0] = ox;
+        p[1] = oy;
+        p = _strided_point(dest, stride, 2 * i + 1);
+        p[0] = ix;
+        p[1] = iy;
+    } else {
+        float* p = _strided_point(dest, stride, i);
+        p[0] = ox;
+        p[1] = oy;
+    }
+}
+
+/* Points are produced by incremental rotation; the SSE2 path keeps four
+ * consecutive angles in flight and rotates all of them by four steps at
+ * once, so the only trigonometry is in the setup. */
+void al_calculate_arc(float* dest, int stride, float cx, float cy, float rx, float ry,
+                      float start_theta, float delta_theta, float thickness, int num_points)
+{
+    if (!dest || num_points <= 0) {
+        return;
+    }
+    
+    bool thick = thickness > 0;
+    float half = thick ? thickness * 0.5f : 0.0f;
+    float orx = rx + half;
+    float ory = ry + half;
+    float irx = rx - half;
+    float iry = ry - half;
+    float step = num_points > 1 ? delta_theta / (num_points - 1) : 0.0f;
+    int i = 0;
+    
+#if defined(__SSE2__)
+    if (num_points >= 8) {
+        __m128 c = _mm_setr_ps(cosf(start_theta), cosf(start_theta + step),
+                               cosf(start_theta + 2 * step), cosf(start_theta + 3 * step));
+        __m128 s = _mm_setr_ps(sinf(start_theta), sinf(start_theta + step),
+                               sinf(start_theta + 2 * step), sinf(start_theta + 3 * step));
+        const __m128 rc = _mm_set1_ps(cosf(4 * step));
+        const __m128 rs = _mm_set1_ps(sinf(4 * step));
+        const __m128 vcx = _mm_set1_ps(cx);
+        const __m128 vcy = _mm_set1_ps(cy);
+        const __m128 vorx = _mm_set1_ps(orx);
+        const __m128 vory = _mm_set1_ps(ory);
+        const __m128 virx = _mm_set1_ps(irx);
+        const __m128 viry = _mm_set1_ps(iry);
+        
+        for (; i + 4 <= num_points; i += 4) {
+            float ox[4], oy[4], ix[4], iy[4];
+            _mm_storeu_ps(ox, _mm_add_ps(vcx, _mm_mul_ps(vorx, c)));
+            _mm_storeu_ps(oy, _mm_add_ps(vcy, _mm_mul_ps(vory, s)));
+            _mm_storeu_ps(ix, _mm_add_ps(vcx, _mm_mul_ps(virx, c)));
+            _mm_storeu_ps(iy, _mm_add_ps(vcy, _mm_mul_ps(viry, s)));
+            for (int k = 0; k < 4; k++) {
+                _store_curve_point(dest, stride, i + k, thick, ox[k], oy[k], ix[k], iy[k]);
+            }
+            
+            __m128 nc = _mm_sub_ps(_mm_mul_ps(c, rc), _mm_mul_ps(s, rs));
+            s = _mm_add_ps(_mm_mul_ps(c, rs), _mm_mul_ps(s, rc));
+            c = nc;
+        }
+    }
+#endif
+    
+    float angle = start_theta + step * i;
+    float c = cosf(angle);
+    float s = sinf(angle);
+    float rc = cosf(step);
+    float rs = sinf(step);
+    for (; i < num_points; i++) {
+        _store_curve_point(dest, stride, i, thick,
+                           cx + orx * c, cy + ory * s, cx + irx * c, cy + iry * s);
+        float nc = c * rc - s * rs;
+        s = c * rs + s * rc;
+        c = nc;
+    }
+}
+
+/* Offsets a polyline by half the thickness on either side, mitering each
+ * interior point. Safe to run in place when points is dest read at twice
+ * dest_stride, which is how al_calculate_spline widens its output: every
+ * point is read before the pair that overwrites it is stored. */
+void al_calculate_ribbon(float* dest, int dest_stride, const float* points, int points_stride,
+                         float thickness, int num_segments)
+{
+    if (!dest || !points || num_segments <= 0) {
+        return;
+    }
+    
+    const float* src;
+    
+    if (thickness <= 0) {
+        for (int i = 0; i < num_segments; i++) {
+            src = _strided_point(points, points_stride, i);
+            float x = src[0];
+            float y = src[1];
+            float* p = _strided_point(dest, dest_stride, i);
+            p[0] = x;
+            p[1] = y;
+        }
+        return;
+    }
+    
+    float half = thickness * 0.5f;
+    float cur_x = points[0];
+    float cur_y = points[1];
+    float next_x = cur_x;
+    float next_y = cur_y;
+    if (num_segments > 1) {
+        src = _strided_point(points, points_stride, 1);
+        next_x = src[0];
+        next_y = src[1];
+    }
+    float prev_dx = 0;
+    float prev_dy = 0;
+    
+    for (int i = 0; i < num_segments; i++) {
+        float dx = 0;
+        float dy = 0;
+        if (i + 1 < num_segments) {
+            dx = next_x - cur_x;
+            dy = next_y - cur_y;
+            float len = sqrtf(dx * dx + dy * dy);
+            if (len > 1e-6f) {
+                dx /= len;
+                dy /= len;
+            } else {
+                dx = prev_dx;
+                dy = prev_dy;
+            }
+        }
+        if (i == 0) {
+            prev_dx = dx;
+            prev_dy = dy;
+        } else if (i + 1 == num_segments) {
+            dx = prev_dx;
+            dy = prev_dy;
+        }
+        
+        /* The miter runs along the bisector of the two segment normals and
+         * is lengthened by 1/cos of the half-turn, capped at four times. */
+        float tx = prev_dx + dx;
+        float ty = prev_dy + dy;
+        float tlen = sqrtf(tx * tx + ty * ty);
+        float nx, ny, scale;
+        if (tlen > 1e-3f) {
+            nx = -ty / tlen;
+            ny = tx / tlen;
+            scale = half / SDL_max(tlen * 0.5f, 0.25f);
+        } else {
+            nx = -dy;
+            ny = dx;
+            scale = half;
+        }
+        
+        float x = cur_x;
+        float y = cur_y;
+        prev_dx = dx;
+        prev_dy = dy;
+        cur_x = next_x;
+        cur_y = next_y;
+        if (i + 2 < num_segments) {
+            src = _strided_point(points, points_stride, i + 2);
+            next_x = src[0];
+            next_y = src[1];
+        }
+        
+        _store_curve_point(dest, dest_stride, i, true,
+                           x + nx * scale, y + ny * scale, x - nx * scale, y - ny * scale);
+    }
+}
+
+/* Evaluates the curve in power form by Horner's rule at each parameter
+ * rather than by forward differencing, so points carry no accumulated
+ * error and four of them can be computed at once. */
+void al_calculate_spline(float* dest, int stride, const float points[8], float thickness,
+                         int num_segments)
+{
+    if (!dest || !points || num_segments <= 0) {
+        return;
+    }
+    
+    bool thick = thickness > 0;
+    int out_stride = thick ? 2 * stride : stride;
+    
+    float ax = -points[0] + 3 * points[2] - 3 * points[4] + points[6];
+    float ay = -points[1] + 3 * points[3] - 3 * points[5] + points[7];
+    float bx = 3 * points[0] - 6 * points[2] + 3 * points[4];
+    float by = 3 * points[1] - 6 * points[3] + 3 * points[5];
+    float cx = 3 * (points[2] - points[0]);
+    float cy = 3 * (points[3] - points[1]);
+    float dx = points[0];
+    float dy = points[1];
+    float dt = num_segments > 1 ? 1.0f / (num_segments - 1) : 0.0f;
+    int i = 0;
+    
+#if defined(__SSE2__)
+    const __m128 vax = _mm_set1_ps(ax);
+    const __m128 vay = _mm_set1_ps(ay);
+    const __m128 vbx = _mm_set1_ps(bx);
+    const __m128 vby = _mm_set1_ps(by);
+    const __m128 vcx = _mm_set1_ps(cx);
+    const __m128 vcy = _mm_set1_ps(cy);
+    const __m128 vdx = _mm_set1_ps(dx);
+    const __m128 vdy = _mm_set1_ps(dy);
+    const __m128 vdt = _mm_set1_ps(dt);
+    __m128 vi = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 four = _mm_set1_ps(4);
+    
+    for (; i + 4 <= num_segments; i += 4) {
+        __m128 t = _mm_mul_ps(vi, vdt);
+        __m128 x = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vax, t), vbx), t), vcx), t), vdx);
+        __m128 y = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vay, t), vby), t), vcy), t), vdy);
+        float xs[4], ys[4];
+        _mm_storeu_ps(xs, x);
+        _mm_storeu_ps(ys, y);
+        for (int k = 0; k < 4; k++) {
+            float* p = _strided_point(dest, out_stride, i + k);
+            p[0] = xs[k];
+            p[1] = ys[k];
+        }
+        vi = _mm_add_ps(vi, four);
+    }
+#endif
+    
+    for (; i < num_segments; i++) {
+        float t = i * dt;
+        float* p = _strided_point(dest, out_stride, i);
+        p[0] = ((ax * t + bx) * t + cx) * t + dx;
+        p[1] = ((ay * t + by) * t + cy) * t + dy;
+    }
+    
+    if (thick) {
+        al_calculate_ribbon(dest, stride, dest, out_stride, thickness, num_segments);
+    }
+}
+
+/* Segment count for a whole ellipse, a multiple of four so that rounded
+ * rectangle corners get equal quarters. */
+static int _ellipse_segments(float rx, float ry)
+{
+    int segments = _arc_segments(SDL_max(rx, ry), 6.28318531f);
+    return SDL_max(ARC_MIN_SEGMENTS, (segments + 3) & ~3);
+}
+
+/* Builds a closed ellipse outline into _outline_points and returns its
+ * point count, the last point repeating the first. */
+static int _build_ellipse(float cx, float cy, float rx, float ry)
+{
+    int segments = _ellipse_segments(rx, ry);
+    _outline_points.resize(segments + 1);
+    al_calculate_arc(&_outline_points[0].x, sizeof(SDL_FPoint), cx, cy, rx, ry,
+                     0, 6.28318531f, 0, segments + 1);
+    _outline_points[segments] = _outline_points[0];
+    return segments + 1;
+}
+
+/* Builds an open arc outline into _outline_points and returns its point
+ * count. */
+static int _build_arc(float cx, float cy, float rx, float ry, float start, float delta)
+{
+    int segments = _arc_segments(SDL_max(rx, ry), delta);
+    _outline_points.resize(segments + 1);
+    al_calculate_arc(&_outline_points[0].x, sizeof(SDL_FPoint), cx, cy, rx, ry,
+                     start, delta, 0, segments + 1);
+    return segments + 1;
+}
+
+/* Builds a closed rounded rectangle outline into _outline_points, one
+ * quarter arc per corner, and returns its point count. */
+static int _build_rounded_rect(float x1, float y1, float x2, float y2, float rx, float ry)
+{
+    int quarter = _ellipse_segments(rx, ry) / 4;
+    const float corners[4][2] = {
+        {x2 - rx, y2 - ry}, {x1 + rx, y2 - ry}, {x1 + rx, y1 + ry}, {x2 - rx, y1 + ry}
+    };
+    
+    _outline_points.resize(4 * (quarter + 1) + 1);
+    SDL_FPoint* out = &_outline_points[0];
+    for (int c = 0; c < 4; c++) {
+        al_calculate_arc(&out->x, sizeof(SDL_FPoint), corners[c][0], corners[c][1], rx, ry,
+                         1.57079633f * c, 1.57079633f, 0, quarter + 1);
+        out += quarter + 1;
+    }
+    *out = _outline_points[0];
+    return 4 * (quarter + 1) + 1;
+}
+
+/* Fills the fan spanned by a center point and a rim point list with one
+ * geometry call. */
+static void _fill_transformed_fan(float cx, float cy, const SDL_FPoint* rim, int count,
+                                  ALLEGRO_COLOR color)
+{
+    if (count < 2) {
+        return;
+    }
+    
+    ScratchScope scope;
+    SDL_Vertex* verts = _scratch_array<SDL_Vertex>(count + 1);
+    int* indices = _scratch_array<int>(3 * (count - 1));
+    if (!verts || !indices) {
+        return;
+    }
+    
+    SDL_Color c = _to_sdl_color(color);
+    verts[0].position.x = cx;
+    verts[0].position.y = cy;
+    for (int i = 0; i < count; i++) {
+        verts[i + 1].position = rim[i];
+    }
+    for (int i = 0; i <= count; i++) {
+        verts[i].color = c;
+        verts[i].tex_coord.x = 0;
+        verts[i].tex_coord.y = 0;
+    }
+    
+    for (int i = 1; i < count; i++) {
+        indices[3 * i - 3] = 0;
+        indices[3 * i - 2] = i;
+        indices[3 * i - 1] = i + 1;
+    }
+    
+    _draw_transformed_triangles(verts, count + 1, indices, 3 * (count - 1));
+}
+
+static bool _clamp_rounded_rect(float* x1, float* y1, float* x2, float* y2, float* rx, float* ry)
+{
+    if (*x2 < *x1) {
+        float t = *x1; *x1 = *x2; *x2 = t;
+    }
+    if (*y2 < *y1) {
+        float t = *y1; *y1 = *y2; *y2 = t;
+    }
+    *rx = SDL_min(*rx, (*x2 - *x1) * 0.5f);
+    *ry = SDL_min(*ry, (*y2 - *y1) * 0.5f);
+    return *rx > 0 && *ry > 0;
+}
+
+/* Thick outlines. Every segment becomes a quad offset by half the
+ * thickness along its normal. At each corner the two quads meet at the
+ * intersection of their inner offset lines, joins fill the wedge between
+ * them on the outer side and caps extend open ends, so no pixel is covered
+ * twice and translucent strokes blend evenly. The whole outline is collected
+ * into one vertex/index list in the scratch arena and submitted as a single
+ * geometry call. Thickness is in untransformed units, like every other
+ * primitive coordinate. */
+static const float STROKE_MITER_LIMIT = 4.0f;
+
+/* How far a stroke can reach past its centerline, for culling. */
+static float _stroke_pad(float thickness, float miter_limit)
+{
+    return thickness > 0 ? thickness * 0.5f * SDL_max(miter_limit, 1.0f) : 0.0f;
+}
+
+struct StrokeBuffer {
+    SDL_Vertex* vertices;
+    int* indices;
+    int vertex_count;
+    int index_count;
+    SDL_Color color;
+};
+
+/* Vertices on the left (+normal) and right (-normal) side of a corner, at
+ * the end of the incoming segment and at the start of the outgoing one. */
+struct StrokeCorner {
+    int left_in;
+    int right_in;
+    int left_out;
+    int right_out;
+};
+
+static int _stroke_vertex(StrokeBuffer& s, float x, float y)
+{
+    SDL_Vertex v = {{x, y}, s.color, {0, 0}};
+    s.vertices[s.vertex_count] = v;
+    return s.vertex_count++;
+}
+
+static void _stroke_triangle(StrokeBuffer& s, int a, int b, int c)
+{
+    s.indices[s.index_count++] = a;
+    s.indices[s.index_count++] = b;
+    s.indices[s.index_count++] = c;
+}
+
+/* Fans from hub over the arc of radius h around p that runs from vertex
+ * first at angle start through sweep radians to vertex last. The points in
+ * between come from al_calculate_arc, like every other curve. */
+static void _stroke_fan(StrokeBuffer& s, int hub, int first, int last, const SDL_FPoint& p,
+                        float h, float start, float sweep)
+{
+    int segments = _arc_segments(h, sweep);
+    float step = sweep / segments;
+    int inner = s.vertex_count;
+    SDL_Vertex* v = s.vertices + inner;
+    al_calculate_arc(&v->position.x, sizeof(SDL_Vertex), p.x, p.y, h, h,
+                     start + step, step * (segments - 2), 0, segments - 1);
+    for (int i = 0; i < segments - 1; i++) {
+        v[i].color = s.color;
+        v[i].tex_coord.x = 0;
+        v[i].tex_coord.y = 0;
+    }
+    s.vertex_count += segments - 1;
+    
+    int prev = first;
+    for (int i = 0; i < segments - 1; i++) {
+        _stroke_triangle(s, hub, prev, inner + i);
+        prev = inner + i;
+    }
+    _stroke_triangle(s, hub, prev, last);
+}
+
+/* d0 and d1 are the unit directions of the segments meeting at p, and
+ * room is how far the inner intersection may retreat along either of them
+ * before it would run into the neighbouring corner. */
+static StrokeCorner _stroke_join(StrokeBuffer& s, const SDL_FPoint& p, const SDL_FPoint& d0,
+                                 const SDL_FPoint& d1, float h, float room, int join,
+                                 float miter_limit)
+{
+    StrokeCorner corner;
+    float cross = d0.x * d1.y - d0.y * d1.x;
+    float dot = d0.x * d1.x + d0.y * d1.y;
+    if (fabsf(cross) < 1e-6f && dot > 0) {
+        corner.left_in = corner.left_out = _stroke_vertex(s, p.x - d0.y * h, p.y + d0.x * h);
+        corner.right_in = corner.right_out = _stroke_vertex(s, p.x + d0.y * h, p.y - d0.x * h);
+        return corner;
+    }
+    
+    float side = cross > 0 ? -1.0f : 1.0f;
+    SDL_FPoint n0 = {-d0.y * side, d0.x * side};
+    SDL_FPoint n1 = {-d1.y * side, d1.x * side};
+    int a = _stroke_vertex(s, p.x + n0.x * h, p.y + n0.y * h);
+    int b = _stroke_vertex(s, p.x + n1.x * h, p.y + n1.y * h);
+    int inner_in;
+    int inner_out;
+    int hub;
+    
+    /* The inner offset lines cross h * tan(theta / 2) back along each
+     * segment, which is h * |cross| / (1 + dot). Corners too sharp for the
+     * segments around them keep separate inner ends and fan from p, which
+     * overlaps but cannot fold the quads over. */
+    if (1.0f + dot > 1e-6f && h * fabsf(cross) <= room * (1.0f + dot)) {
+        float k = h / (1.0f + dot);
+        hub = _stroke_vertex(s, p.x - (n0.x + n1.x) * k, p.y - (n0.y + n1.y) * k);
+        inner_in = inner_out = hub;
+    }
+    else {
+        inner_in = _stroke_vertex(s, p.x - n0.x * h, p.y - n0.y * h);
+        inner_out = _stroke_vertex(s, p.x - n1.x * h, p.y - n1.y * h);
+        hub = _stroke_vertex(s, p.x, p.y);
+    }
+    
+    if (side > 0) {
+        corner.left_in = a;
+        corner.left_out = b;
+        corner.right_in = inner_in;
+        corner.right_out = inner_out;
+    }
+    else {
+        corner.left_in = inner_in;
+        corner.left_out = inner_out;
+        corner.right_in = a;
+        corner.right_out = b;
+    }
+    
+    switch (join) {
+        case ALLEGRO_LINE_JOIN_NONE:
+            break;
+        case ALLEGRO_LINE_JOIN_ROUND:
+            _stroke_fan(s, hub, a, b, p, h, atan2f(n0.y, n0.x),
+                        atan2f(n0.x * n1.y - n0.y * n1.x, dot));
+            break;
+        case ALLEGRO_LINE_JOIN_MITER:
+            /* The miter reaches 1 / cos(theta / 2) half-thicknesses out,
+             * and cos^2(theta / 2) = (1 + dot) / 2. */
+            if ((1.0f + dot) * 0.5f * miter_limit * miter_limit > 1.0f) {
+                float k = h / (1.0f + dot);
+                int m = _stroke_vertex(s, p.x + (n0.x + n1.x) * k, p.y + (n0.y + n1.y) * k);
+                _stroke_triangle(s, hub, a, m);
+                _stroke_triangle(s, hub, m, b);
+                break;
+            }
+            _stroke_triangle(s, hub, a, b);
+            break;
+        default:
+            _stroke_triangle(s, hub, a, b);
+            break;
+    }
+    return corner;
+}
+
+/* d points away from the line; a and b are the stroke's edge vertices at
+ * p, on the +normal and -normal side of d. */
+static void _stroke_cap(StrokeBuffer& s, const SDL_FPoint& p, const SDL_FPoint& d, float h,
+                        int a, int b, int cap)
+{
+    SDL_FPoint n = {-d.y, d.x};
+    
+    switch (cap) {
+        case ALLEGRO_LINE_CAP_SQUARE: {
+            int c = _stroke_vertex(s, p.x + (d.x - n.x) * h, p.y + (d.y - n.y) * h);
+            int e = _stroke_vertex(s, p.x + (d.x + n.x) * h, p.y + (d.y + n.y) * h);
+            _stroke_triangle(s, a, b, c);
+            _stroke_triangle(s, a, c, e);
+            break;
+        }
+        case ALLEGRO_LINE_CAP_TRIANGLE: {
+            int c = _stroke_vertex(s, p.x + d.x * h, p.y + d.y * h);
+            _stroke_triangle(s, a, b, c);
+            break;
+        }
+        case ALLEGRO_LINE_CAP_ROUND: {
+            int hub = _stroke_vertex(s, p.x, p.y);
+            _stroke_fan(s, hub, a, b, p, h, atan2f(n.y, n.x), -3.14159265f);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void _stroke_polyline(const SDL_FPoint* points, int count, bool closed,
+                             int join, int cap, float thickness, float miter_limit,
+                             ALLEGRO_COLOR color)
+{
+    ScratchScope scope;
+    SDL_FPoint* p = _scratch_array<SDL_FPoint>(count);
+    if (!p) {
+        return;
+    }
+    
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (n == 0 || p[n - 1].x != points[i].x || p[n - 1].y != points[i].y) {
+            p[n++] = points[i];
+        }
+    }
+    if (cap == ALLEGRO_LINE_CAP_CLOSED) {
+        closed = true;
+    }
+    if (closed && n > 2 && p[n - 1].x == p[0].x && p[n - 1].y == p[0].y) {
+        n--;
+    }
+    
+    if (n < 2) {
+        return;
+    }
+    if (n < 3) {
+        closed = false;
+    }
+    
+    int segments = closed ? n : n - 1;
+    float h = thickness * 0.5f;
+    
+    /* Each corner adds at most five vertices, a miter point or the inside
+     * of a fan, and a fan's worth of triangles; caps add a hub and a fan. */
+    int fan = _arc_segments(h, 3.14159265f);
+    int per_corner = SDL_max(2, fan);
+    StrokeBuffer s;
+    s.vertices = _scratch_array<SDL_Vertex>(n * (5 + per_corner) + 2 * (1 + per_corner));
+    s.indices = _scratch_array<int>(6 * segments + 3 * per_corner * (n + 2));
+    SDL_FPoint* dirs = _scratch_array<SDL_FPoint>(segments);
+    float* lengths = _scratch_array<float>(segments);
+    StrokeCorner* corners = _scratch_array<StrokeCorner>(n);
+    if (!s.vertices || !s.indices || !dirs || !lengths || !corners) {
+        return;
+    }
+    s.vertex_count = 0;
+    s.index_count = 0;
+    s.color = _to_sdl_color(color);
+    
+    for (int i = 0; i < segments; i++) {
+        const SDL_FPoint& q = p[(i + 1) % n];
+        float dx = q.x - p[i].x;
+        float dy = q.y - p[i].y;
+        lengths[i] = sqrtf(dx * dx + dy * dy);
+        dirs[i].x = dx / lengths[i];
+        dirs[i].y = dy / lengths[i];
+    }
+    
+    /* Open ends stop square; their vertices are shared with the caps. */
+    if (!closed) {
+        const SDL_FPoint& d0 = dirs[0];
+        const SDL_FPoint& d1 = dirs[segments - 1];
+        corners[0].left_out = _stroke_vertex(s, p[0].x - d0.y * h, p[0].y + d0.x * h);
+        corners[0].right_out = _stroke_vertex(s, p[0].x + d0.y * h, p[0].y - d0.x * h);
+        corners[n - 1].left_in = _stroke_vertex(s, p[n - 1].x - d1.y * h, p[n - 1].y + d1.x * h);
+        corners[n - 1].right_in = _stroke_vertex(s, p[n - 1].x + d1.y * h, p[n - 1].y - d1.x * h);
+    }
+    
+    /* Half of each segment belongs to the corner at either end. */
+    for (int i = closed ? 0 : 1; i < (closed ? n : n - 1); i++) {
+        int prev = (i + segments - 1) % segments;
+        float room = 0.5f * SDL_min(lengths[prev], lengths[i]);
+        corners[i] = _stroke_join(s, p[i], dirs[prev], dirs[i], h, room, join, miter_limit);
+    }
+    
+    for (int i = 0; i < segments; i++) {
+        const StrokeCorner& a = corners[i];
+        const StrokeCorner& b = corners[(i + 1) % n];
+        _stroke_triangle(s, a.left_out, a.right_out, b.right_in);
+        _stroke_triangle(s, a.left_out, b.right_in, b.left_in);
+    }
+    
+    if (!closed) {
+        SDL_FPoint back = {-dirs[0].x, -dirs[0].y};
+        _stroke_cap(s, p[0], back, h, corners[0].right_out, corners[0].left_out, cap);
+        _stroke_cap(s, p[n - 1], dirs[segments - 1], h, corners[n - 1].left_in,
+                    corners[n - 1].right_in, cap);
+    }
+    
+    _draw_transformed_triangles(s.vertices, s.vertex_count, s.indices, s.index_count);
+}
+
+/* Draws _outline_points[0, count) as one hairline polyline when thickness
+ * is not positive and as one mitered stroke otherwise. Closed outlines must
+ * not repeat their first point. */
+static void _draw_outline(int count, bool closed, float thickness, ALLEGRO_COLOR color)
+{
+    if (count < 2) {
+        return;
+    }
+    if (thickness > 0) {
+        _stroke_polyline(&_outline_points[0], count, closed, ALLEGRO_LINE_JOIN_MITER,
+                         ALLEGRO_LINE_CAP_NONE, thickness, STROKE_MITER_LIMIT, color);
+        return;
+    }
+    if (closed) {
+        _outline_points.resize(count + 1);
+        _outline_points[count] = _outline_points[0];
+        count++;
+    }
+    _draw_transformed_lines(&_outline_points[0], count);
+}
+
+/* Copies a strided user vertex array into _outline_points. */
+static void _gather_outline(const float* vertices, int vertex_count, int stride)
+{
+    _outline_points.resize(vertex_count);
+    for (int i = 0; i < vertex_count; i++) {
+        const float* v = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + i * stride);
+        _outline_points[i].x = v[0];
+        _outline_points[i].y = v[1];
+    }
+}
+
+/* Polygon triangulation by ear clipping over a circular linked list of
+ * vertices. Holes are first bridged into the outer ring at their leftmost
+ * vertex. For larger polygons the vertices are also threaded in z-order
+ * (Morton) sequence, so the point-in-ear test only visits vertices whose
+ * curve index falls inside the candidate ear's bounding box; this keeps the
+ * clipping close to O(n log n) instead of O(n^2). Rings that still resist
+ * clipping are cured of local self-intersections and finally split along a
+ * valid diagonal. All nodes live in the scratch arena. */
+static const int TRIANGULATE_HASH_THRESHOLD = 80;
+
+struct EarNode {
+    int i;
+    float x;
+    float y;
+    Uint32 z;
+    EarNode* prev;
+    EarNode* next;
+    EarNode* prev_z;
+    EarNode* next_z;
+    bool steiner;
+};
+
+struct EarContext {
+    float min_x;
+    float min_y;
+    float inv_size;
+    int* out;
+    int count;
+};
+
+static EarNode* _ear_insert(int i, float x, float y, EarNode* last)
+{
+    EarNode* p = _scratch_array<EarNode>(1);
+    if (!p) {
+        return last;
+    }
+    p->i = i;
+    p->x = x;
+    p->y = y;
+    p->z = 0;
+    p->prev_z = nullptr;
+    p->next_z = nullptr;
+    p->steiner = false;
+    if (!last) {
+        p->prev = p;
+        p->next = p;
+    } else {
+        p->next = last->next;
+        p->prev = last;
+        last->next->prev = p;
+        last->next = p;
+    }
+    return p;
+}
+
+static void _ear_remove(EarNode* p)
+{
+    p->next->prev = p->prev;
+    p->prev->next = p->next;
+    if (p->prev_z) {
+        p->prev_z->next_z = p->next_z;
+    }
+    if (p->next_z) {
+        p->next_z->prev_z = p->prev_z;
+    }
+}
+
+static float _ear_area(const EarNode* p, const EarNode* q, const EarNode* r)
+{
+    return (q->y - p->y) * (r->x - q->x) - (q->x - p->x) * (r->y - q->y);
+}
+
+static bool _ear_equals(const EarNode* a, const EarNode* b)
+{
+    return a->x == b->x && a->y == b->y;
+}
+
+static bool _point_in_triangle(float ax, float ay, float bx, float by, float cx, float cy,
+                               float px, float py)
+{
+    return (cx - px) * (ay - py) >= (ax - px) * (cy - py) &&
+           (ax - px) * (by - py) >= (bx - px) * (ay - py) &&
+           (bx - px) * (cy - py) >= (cx - px) * (by - py);
+}
+
+static int _ear_sign(float v)
+{
+    return v > 0 ? 1 : (v < 0 ? -1 : 0);
+}
+
+static bool _ear_on_segment(const EarNode* p, const EarNode* q, const EarNode* r)
+{
+    return q->x <= SDL_max(p->x, r->x) && q->x >= SDL_min(p->x, r->x) &&
+           q->y <= SDL_max(p->y, r->y) && q->y >= SDL_min(p->y, r->y);
+}
+
+static bool _ear_intersects(const EarNode* p1, const EarNode* q1, const EarNode* p2, const EarNode* q2)
+{
+    int o1 = _ear_sign(_ear_area(p1, q1, p2));
+    int o2 = _ear_sign(_ear_area(p1, q1, q2));
+    int o3 = _ear_sign(_ear_area(p2, q2, p1));
+    int o4 = _ear_sign(_ear_area(p2, q2, q1));
+    
+    if (o1 != o2 && o3 != o4) {
+        return true;
+    }
+    return (o1 == 0 && _ear_on_segment(p1, p2, q1)) ||
+           (o2 == 0 && _ear_on_segment(p1, q2, q1)) ||
+           (o3 == 0 && _ear_on_segment(p2, p1, q2)) ||
+           (o4 == 0 && _ear_on_segment(p2, q1, q2));
+}
+
+static bool _ear_intersects_polygon(const EarNode* a, const EarNode* b)
+{
+    const EarNode* p = a;
+    do {
+        if (p->i != a->i && p->next->i != a->i && p->i != b->i && p->next->i != b->i &&
+            _ear_intersects(p, p->next, a, b)) {
+            return true;
+        }
+        p = p->next;
+    } while (p != a);
+    return false;
+}
+
+static bool _ear_locally_inside(const EarNode* a, const EarNode* b)
+{
+    if (_ear_area(a->prev, a, a->next) < 0) {
+        return _ear_area(a, b, a->next) >= 0 && _ear_area(a, a->prev, b) >= 0;
+    }
+    return _ear_area(a, b, a->prev) < 0 || _ear_area(a, a->next, b) < 0;
+}
+
+static bool _ear_middle_inside(const EarNode* a, const EarNode* b)
+{
+    const EarNode* p = a;
+    bool inside = false;
+    float px = (a->x + b->x) * 0.5f;
+    float py = (a->y + b->y) * 0.5f;
+    do {
+        if ((p->y > py) != (p->next->y > py) && p->next->y != p->y &&
+            px < (p->next->x - p->x) * (py - p->y) / (p->next->y - p->y) + p->x) {
+            inside = !inside;
+        }
+        p = p->next;
+    } while (p != a);
+    return inside;
+}
+
+static bool _ear_valid_diagonal(const EarNode* a, const EarNode* b)
+{
+    if (a->next->i == b->i || a->prev->i == b->i || _ear_intersects_polygon(a, b)) {
+        return false;
+    }
+    if (_ear_locally_inside(a, b) && _ear_locally_inside(b, a) && _ear_middle_inside(a, b) &&
+        (_ear_area(a->prev, a, b->prev) != 0 || _ear_area(a, b->prev, b) != 0)) {
+        return true;
+    }
+    return _ear_equals(a, b) && _ear_area(a->prev, a, a->next) > 0 &&
+           _ear_area(b->prev, b, b->next) > 0;
+}
+
+/* Links a to b with two new nodes so that the ring splits in two; returns
+ * the copy of b, which sits on the second ring. */
+static EarNode* _ear_split(EarNode* a, EarNode* b)
+{
+    EarNode* a2 = _scratch_array<EarNode>(1);
+    EarNode* b2 = _scratch_array<EarNode>(1);
+    if (!a2 || !b2) {
+        return nullptr;
+    }
+    *a2 = *a;
+    *b2 = *b;
+    a2->prev_z = a2->next_z = nullptr;
+    b2->prev_z = b2->next_z = nullptr;
+    
+    EarNode* an = a->next;
+    EarNode* bp = b->prev;
+    a->next = b;
+    b->prev = a;
+    a2->next = an;
+    an->prev = a2;
+    b2->next = a2;
+    a2->prev = b2;
+    bp->next = b2;
+    b2->prev = bp;
+    return b2;
+}
+
+/* Drops duplicate and collinear vertices between start and end. */
+static EarNode* _ear_filter(EarNode* start, EarNode* end)
+{
+    if (!start) {
+        return start;
+    }
+    if (!end) {
+        end = start;
+    }
+    
+    EarNode* p = start;
+    bool again;
+    do {
+        again = false;
+        if (!p->steiner && (_ear_equals(p, p->next) || _ear_area(p->prev, p, p->next) == 0)) {
+            _ear_remove(p);
+            p = end = p->prev;
+            if (p == p->next) {
+                break;
+            }
+            again = true;
+        } else {
+            p = p->next;
+        }
+    } while (again || p != end);
+    return end;
+}
+
+/* Builds a ring from vertices [start, end) of xy, in the winding that
+ * clockwise asks for. */
+static EarNode* _ear_ring(const float* xy, int start, int end, bool clockwise)
+{
+    float sum = 0;
+    for (int i = start, j = end - 1; i < end; j = i++) {
+        sum += (xy[2 * j] - xy[2 * i]) * (xy[2 * i + 1] + xy[2 * j + 1]);
+    }
+    
+    EarNode* last = nullptr;
+    if (clockwise == (sum > 0)) {
+        for (int i = start; i < end; i++) {
+            last = _ear_insert(i, xy[2 * i], xy[2 * i + 1], last);
+        }
+    } else {
+        for (int i = end - 1; i >= start; i--) {
+            last = _ear_insert(i, xy[2 * i], xy[2 * i + 1], last);
+        }
+    }
+    
+    if (last && _ear_equals(last, last->next)) {
+        EarNode* next = last->next;
+        _ear_remove(last);
+        last = next;
+    }
+    return last;
+}
+
+static Uint32 _ear_z_order(float fx, float fy, const EarContext* ctx)
+{
+    Uint32 x = static_cast<Uint32>((fx - ctx->min_x) * ctx->inv_size);
+    Uint32 y = static_cast<Uint32>((fy - ctx->min_y) * ctx->inv_size);
+    
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    y = (y | (y << 8)) & 0x00FF00FF;
+    y = (y | (y << 4)) & 0x0F0F0F0F;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+    return x | (y << 1);
+}
+
+/* Bottom-up merge sort of the z-order list. */
+static EarNode* _ear_sort_z(EarNode* list)
+{
+    int in_size = 1;
+    int merges;
+    do {
+        EarNode* p = list;
+        EarNode* tail = nullptr;
+        list = nullptr;
+        merges = 0;
+        
+        while (p) {
+            merges++;
+            EarNode* q = p;
+            int p_size = 0;
+            for (int i = 0; i < in_size && q; i++) {
+                p_size++;
+                q = q->next_z;
+            }
+            int q_size = in_size;
+            
+            while (p_size > 0 || (q_size > 0 && q)) {
+                EarNode* e;
+                if (p_size != 0 && (q_size == 0 || !q || p->z <= q->z)) {
+                    e = p;
+                    p = p->next_z;
+                    p_size--;
+                } else {
+                    e = q;
+                    q = q->next_z;
+                    q_size--;
+                }
+                if (tail) {
+                    tail->next_z = e;
+                } else {
+                    list = e;
+                }
+                e->prev_z = tail;
+                tail = e;
+            }
+            p = q;
+        }
+        tail->next_z = nullptr;
+        in_size *= 2;
+    } while (merges > 1);
+    return list;
+}
+
+static void _ear_index_curve(EarNode* start, const EarContext* ctx)
+{
+    EarNode* p = start;
+    do {
+        if (p->z == 0) {
+            p->z = _ear_z_order(p->x, p->y, ctx);
+        }
+        p->prev_z = p->prev;
+        p->next_z = p->next;
+        p = p->next;
+    } while (p != start);
+    
+    p->prev_z->next_z = nullptr;
+    p->prev_z = nullptr;
+    _ear_sort_z(p);
+}
+
+static bool _ear_blocks(const EarNode* p, const EarNode* a, const EarNode* b, const EarNode* c,
+                        float x0, float y0, float x1, float y1)
+{
+    return p->x >= x0 && p->x <= x1 && p->y >= y0 && p->y <= y1 && p != a && p != c &&
+           _point_in_triangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y) &&
+           _ear_area(p->prev, p, p->next) >= 0;
+}
+
+static bool _ear_is_ear(const EarNode* ear, const EarContext* ctx)
+{
+    const EarNode* a = ear->prev;
+    const EarNode* b = ear;
+    const EarNode* c = ear->next;
+    if (_ear_area(a, b, c) >= 0) {
+        return false;
+    }
+    
+    float x0 = SDL_min(a->x, SDL_min(b->x, c->x));
+    float y0 = SDL_min(a->y, SDL_min(b->y, c->y));
+    float x1 = SDL_max(a->x, SDL_max(b->x, c->x));
+    float y1 = SDL_max(a->y, SDL_max(b->y, c->y));
+    
+    if (ctx->inv_size == 0) {
+        for (const EarNode* p = c->next; p != a; p = p->next) {
+            if (_ear_blocks(p, a, b, c, x0, y0, x1, y1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    Uint32 min_z = _ear_z_order(x0, y0, ctx);
+    Uint32 max_z = _ear_z_order(x1, y1, ctx);
+    const EarNode* p = ear->prev_z;
+    const EarNode* n = ear->next_z;
+    
+    while (p && p->z >= min_z && n && n->z <= max_z) {
+        if (_ear_blocks(p, a, b, c, x0, y0, x1, y1) || _ear_blocks(n, a, b, c, x0, y0, x1, y1)) {
+            return false;
+        }
+        p = p->prev_z;
+        n = n->next_z;
+    }
+    for (; p && p->z >= min_z; p = p->prev_z) {
+        if (_ear_blocks(p, a, b, c, x0, y0, x1, y1)) {
+            return false;
+        }
+    }
+    for (; n && n->z <= max_z; n = n->next_z) {
+        if (_ear_blocks(n, a, b, c, x0, y0, x1, y1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _ear_emit(EarContext* ctx, const EarNode* a, const EarNode* b, const EarNode* c)
+{
+    ctx->out[ctx->count++] = a->i;
+    ctx->out[ctx->count++] = b->i;
+    ctx->out[ctx->count++] = c->i;
+}
+
+static EarNode* _ear_cure_intersections(EarNode* start, EarContext* ctx)
+{
+    EarNode* p = start;
+    do {
+        EarNode* a = p->prev;
+        EarNode* b = p->next->next;
+        if (!_ear_equals(a, b) && _ear_intersects(a, p, p->next, b) &&
+            _ear_locally_inside(a, b) && _ear_locally_inside(b, a)) {
+            _ear_emit(ctx, a, p, b);
+            _ear_remove(p);
+            _ear_remove(p->next);
+            p = start = b;
+        }
+        p = p->next;
+    } while (p != start);
+    return _ear_filter(p, nullptr);
+}
+
+static void _ear_clip(EarNode* ear, EarContext* ctx, int pass);
+
+static void _ear_split_clip(EarNode* start, EarContext* ctx)
+{
+    EarNode* a = start;
+    do {
+        for (EarNode* b = a->next->next; b != a->prev; b = b->next) {
+            if (a->i != b->i && _ear_valid_diagonal(a, b)) {
+                EarNode* c = _ear_split(a, b);
+                if (!c) {
+                    return;
+                }
+                a = _ear_filter(a, a->next);
+                c = _ear_filter(c, c->next);
+                _ear_clip(a, ctx, 0);
+                _ear_clip(c, ctx, 0);
+                return;
+            }
+        }
+        a = a->next;
+    } while (a != start);
+}
+
+static void _ear_clip(EarNode* ear, EarContext* ctx, int pass)
+{
+    if (!ear) {
+        return;
+    }
+    if (pass == 0 && ctx->inv_size != 0) {
+        _ear_index_curve(ear, ctx);
+    }
+    
+    EarNode* stop = ear;
+    while (ear->prev != ear->next) {
+        EarNode* prev = ear->prev;
+        EarNode* next = ear->next;
+        
+        if (_ear_is_ear(ear, ctx)) {
+            _ear_emit(ctx, prev, ear, next);
+            _ear_remove(ear);
+            ear = next->next;
+            stop = next->next;
+            continue;
+        }
+        
+        ear = next;
+        if (ear == stop) {
+            if (pass == 0) {
+                _ear_clip(_ear_filter(ear, nullptr), ctx, 1);
+            } else if (pass == 1) {
+                _ear_clip(_ear_cure_intersections(_ear_filter(ear, nullptr), ctx), ctx, 2);
+            } else {
+                _ear_split_clip(ear, ctx);
+            }
+            break;
+        }
+    }
+}
+
+static EarNode* _ear_leftmost(EarNode* start)
+{
+    EarNode* p = start;
+    EarNode* leftmost = start;
+    do {
+        if (p->x < leftmost->x || (p->x == leftmost->x && p->y < leftmost->y)) {
+            leftmost = p;
+        }
+        p = p->next;
+    } while (p != start);
+    return leftmost;
+}
+
+static bool _ear_sector_contains(const EarNode* m, const EarNode* p)
+{
+    return _ear_area(m->prev, m, p->prev) < 0 && _ear_area(p->next, m, m->next) < 0;
+}
+
+/* Finds the outer vertex the hole's leftmost vertex can see by casting a ray
+ * to the left. */
+static EarNode* _ear_hole_bridge(const EarNode* hole, EarNode* outer)
+{
+    EarNode* p = outer;
+    EarNode* m = nullptr;
+    float hx = hole->x;
+    float hy = hole->y;
+    float qx = -INFINITY;
+    
+    do {
+        if (hy <= p->y && hy >= p->next->y && p->next->y != p->y) {
+            float x = p->x + (hy - p->y) * (p->next->x - p->x) / (p->next->y - p->y);
+            if (x <= hx && x > qx) {
+                qx = x;
+                m = p->x < p->next->x ? p : p->next;
+                if (x == hx) {
+                    return m;
+                }
+            }
+        }
+        p = p->next;
+    } while (p != outer);
+    
+    if (!m) {
+        return nullptr;
+    }
+    
+    EarNode* stop = m;
+    float mx = m->x;
+    float my = m->y;
+    float tan_min = INFINITY;
+    p = m;
+    do {
+        if (hx >= p->x && p->x >= mx && hx != p->x &&
+            _point_in_triangle(hy < my ? hx : qx, hy, mx, my, hy < my ? qx : hx, hy, p->x, p->y)) {
+            float tan = fabsf(hy - p->y) / (hx - p->x);
+            if (_ear_locally_inside(p, hole) &&
+                (tan < tan_min || (tan == tan_min &&
+                                   (p->x > m->x || (p->x == m->x && _ear_sector_contains(m, p)))))) {
+                m = p;
+                tan_min = tan;
+            }
+        }
+        p = p->next;
+    } while (p != stop);
+    return m;
+}
+
+/* Triangulates the rings of xy (pairs of floats) whose vertex counts are
+ * given by counts[0, rings); the first ring is the outline and the rest are
+ * holes. Writes vertex index triples to out, which must have room for
+ * 3 * (vertices + 2 * holes) entries, and returns the number of indices
+ * written. Must run inside a ScratchScope. */
+static int _triangulate(const float* xy, const int* counts, int rings, int* out)
+{
+    int total = 0;
+    for (int r = 0; r < rings; r++) {
+        total += counts[r];
+    }
+    
+    EarContext ctx = {0, 0, 0, out, 0};
+    EarNode* outer = _ear_ring(xy, 0, counts[0], true);
+    if (!outer || outer->next == outer->prev) {
+        return 0;
+    }
+    
+    if (rings > 1) {
+        EarNode** holes = _scratch_array<EarNode*>(rings - 1);
+        int num_holes = 0;
+        int start = counts[0];
+        for (int r = 1; r < rings; r++) {
+            EarNode* list = _ear_ring(xy, start, start + counts[r], false);
+            start += counts[r];
+            if (!list) {
+                continue;
+            }
+            if (list == list->next) {
+                list->steiner = true;
+            }
+            holes[num_holes++] = _ear_leftmost(list);
+        }
+        
+        for (int i = 1; i < num_holes; i++) {
+            EarNode* hole = holes[i];
+            int j = i;
+            for (; j > 0 && holes[j - 1]->x > hole->x; j--) {
+                holes[j] = holes[j - 1];
+            }
+            holes[j] = hole;
+        }
+        
+        for (int i = 0; i < num_holes; i++) {
+            EarNode* bridge = _ear_hole_bridge(holes[i], outer);
+            if (!bridge) {
+                continue;
+            }
+            EarNode* reverse = _ear_split(bridge, holes[i]);
+            if (!reverse) {
+                break;
+            }
+            _ear_filter(reverse, reverse->next);
+            outer = _ear_filter(bridge, bridge->next);
+        }
+    }
+    
+    if (total > TRIANGULATE_HASH_THRESHOLD) {
+        float min_x = xy[0];
+        float min_y = xy[1];
+        float max_x = min_x;
+        float max_y = min_y;
+        for (int i = 1; i < counts[0]; i++) {
+            min_x = SDL_min(min_x, xy[2 * i]);
+            min_y = SDL_min(min_y, xy[2 * i + 1]);
+            max_x = SDL_max(max_x, xy[2 * i]);
+            max_y = SDL_max(max_y, xy[2 * i + 1]);
+        }
+        float size = SDL_max(max_x - min_x, max_y - min_y);
+        ctx.min_x = min_x;
+        ctx.min_y = min_y;
+        ctx.inv_size = size != 0 ? 32767.0f / size : 0;
+    }
+    
+    _ear_clip(outer, &ctx, 0);
+    return ctx.count;
+}
+
+/* Packs a strided vertex array into the scratch arena as float pairs. */
+static float* _scratch_pack_vertices(const float* vertices, size_t stride, int count)
+{
+    float* xy = _scratch_array<float>(2 * count);
+    if (!xy) {
+        return nullptr;
+    }
+    for (int i = 0; i < count; i++) {
+        const float* v = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + i * stride);
+        xy[2 * i] = v[0];
+        xy[2 * i + 1] = v[1];
+    }
+    return xy;
+}
+
+bool al_triangulate_polygon(const float* vertices, size_t vertex_stride, const int* vertex_counts,
+                            void (*emit_triangle)(int, int, int, void*), void* userdata)
+{
+    if (!vertices || !vertex_counts || !emit_triangle || vertex_counts[0] < 3) {
+        return false;
+    }
+    
+    int rings = 0;
+    int total = 0;
+    while (vertex_counts[rings] > 0) {
+        total += vertex_counts[rings++];
+    }
+    
+    ScratchScope scope;
+    float* xy = _scratch_pack_vertices(vertices, vertex_stride, total);
+    int* indices = _scratch_array<int>(3 * (total + 2 * rings));
+    if (!xy || !indices) {
+        return false;
+    }
+    
+    int count = _triangulate(xy, vertex_counts, rings, indices);
+    for (int i = 0; i < count; i += 3) {
+        emit_triangle(indices[i], indices[i + 1], indices[i + 2], userdata);
+    }
+    return count > 0;
+}
+
+/* Triangulates and fills a polygon given as rings of packed xy pairs with
+ * one geometry call. */
+static void _fill_polygon_rings(const float* xy, const int* counts, int rings, int total,
+                                ALLEGRO_COLOR color)
+{
+    int* indices = _scratch_array<int>(3 * (total + 2 * rings));
+    SDL_Vertex* verts = _scratch_array<SDL_Vertex>(total);
+    if (!indices || !verts) {
+        return;
+    }
+    
+    int count = _triangulate(xy, counts, rings, indices);
+    if (count == 0) {
+        return;
+    }
+    
+    SDL_Color c = _to_sdl_color(color);
+    for (int i = 0; i < total; i++) {
+        verts[i].position.x = xy[2 * i];
+        verts[i].position.y = xy[2 * i + 1];
+        verts[i].color = c;
+        verts[i].tex_coord.x = 0;
+        verts[i].tex_coord.y = 0;
+    }
+    _draw_transformed_triangles(verts, total, indices, count);
+}
+
+void al_draw_filled_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color)
+{
+    if (!_can_draw() || _cull_rect(x1, y1, x2, y2, 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    SDL_FRect rect;
+    if (_transform_rect(x1, y1, x2, y2, &rect)) {
+        _fill_transformed_rect(&rect);
+        return;
+    }
+    
+    SDL_Color c = _to_sdl_color(color);
+    SDL_Vertex verts[4] = {
+        {{x1, y1}, c, {0, 0}},
+        {{x2, y1}, c, {0, 0}},
+        {{x2, y2}, c, {0, 0}},
+        {{x1, y2}, c, {0, 0}}
+    };
+    const int indices[6] = {0, 1, 2, 0, 2, 3};
+    _draw_transformed_triangles(verts, 4, indices, 6);
+}
+
+void al_draw_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() || _cull_rect(x1, y1, x2, y2, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    SDL_FRect rect;
+    if (thickness <= 0 && !_draw_is_soft && _transform_rect(x1, y1, x2, y2, &rect)) {
+        SDL_RenderDrawRectF(_current_display->renderer, &rect);
+        return;
+    }
+    
+    _outline_points.resize(4);
+    _outline_points[0].x = x1; _outline_points[0].y = y1;
+    _outline_points[1].x = x2; _outline_points[1].y = y1;
+    _outline_points[2].x = x2; _outline_points[2].y = y2;
+    _outline_points[3].x = x1; _outline_points[3].y = y2;
+    _draw_outline(4, true, thickness, color);
+}
+
+void al_draw_line(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() || _cull_rect(x1, y1, x2, y2, _stroke_pad(thickness, 1))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    if (thickness <= 0) {
+        _draw_transformed_line(x1, y1, x2, y2);
+        return;
+    }
+    
+    SDL_FPoint points[2] = {{x1, y1}, {x2, y2}};
+    _stroke_polyline(points, 2, false, ALLEGRO_LINE_JOIN_NONE, ALLEGRO_LINE_CAP_NONE,
+                     thickness, STROKE_MITER_LIMIT, color);
+}
+
+void al_draw_circle(float cx, float cy, float r, ALLEGRO_COLOR color, float thickness)
+{
+    al_draw_ellipse(cx, cy, r, r, color, thickness);
+}
+
+void al_draw_filled_ellipse(float cx, float cy, float rx, float ry, ALLEGRO_COLOR color)
+{
+    if (!_can_draw() || rx <= 0 || ry <= 0 || _cull_rect(cx - rx, cy - ry, cx + rx, cy + ry, 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_ellipse(cx, cy, rx, ry);
+    _fill_transformed_fan(cx, cy, &_outline_points[0], count, color);
+}
+
+void al_draw_filled_circle(float cx, float cy, float r, ALLEGRO_COLOR color)
+{
+    al_draw_filled_ellipse(cx, cy, r, r, color);
+}
+
+void al_draw_ellipse(float cx, float cy, float rx, float ry, ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() || rx <= 0 || ry <= 0 ||
+        _cull_rect(cx - rx, cy - ry, cx + rx, cy + ry, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_ellipse(cx, cy, rx, ry);
+    _draw_outline(count - 1, true, thickness, color);
+}
+
+void al_draw_arc(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color, float thickness)
+{
+    al_draw_elliptical_arc(cx, cy, r, r, start_angle, delta_angle, color, thickness);
+}
+
+void al_draw_elliptical_arc(float cx, float cy, float rx, float ry, float start_theta, float delta_theta,
+                            ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() || rx <= 0 || ry <= 0 ||
+        _cull_rect(cx - rx, cy - ry, cx + rx, cy + ry, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_arc(cx, cy, rx, ry, start_theta, delta_theta);
+    _draw_outline(count, false, thickness, color);
+}
+
+void al_draw_spline(float points[8], ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() || !points ||
+        _cull_points(points, 2 * sizeof(float), 4, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _spline_segments(points) + 1;
+    _outline_points.resize(count);
+    al_calculate_spline(&_outline_points[0].x, sizeof(SDL_FPoint), points, 0, count);
+    _draw_outline(count, false, thickness, color);
+}
+
+void al_draw_ribbon(const float* points, int points_stride, ALLEGRO_COLOR color, float thickness,
+                    int num_segments)
+{
+    if (!_can_draw() || !points || num_segments < 2 ||
+        _cull_points(points, points_stride, num_segments, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    _outline_points.resize(num_segments);
+    al_calculate_ribbon(&_outline_points[0].x, sizeof(SDL_FPoint), points, points_stride, 0, num_segments);
+    _draw_outline(num_segments, false, thickness, color);
+}
+
+void al_draw_pieslice(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() || r <= 0 ||
+        _cull_rect(cx - r, cy - r, cx + r, cy + r, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_arc(cx, cy, r, r, start_angle, delta_angle);
+    SDL_FPoint center = {cx, cy};
+    _outline_points.insert(_outline_points.begin(), center);
+    _draw_outline(count + 1, true, thickness, color);
+}
+
+void al_draw_filled_pieslice(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color)
+{
+    if (!_can_draw() || r <= 0 || _cull_rect(cx - r, cy - r, cx + r, cy + r, 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_arc(cx, cy, r, r, start_angle, delta_angle);
+    _fill_transformed_fan(cx, cy, &_outline_points[0], count, color);
+}
+
+void al_draw_rounded_rectangle(float x1, float y1, float x2, float y2, float rx, float ry, ALLEGRO_COLOR color, float thickness)
+{
+    if (!_clamp_rounded_rect(&x1, &y1, &x2, &y2, &rx, &ry)) {
+        al_draw_rectangle(x1, y1, x2, y2, color, thickness);
+        return;
+    }
+    if (!_can_draw() || _cull_rect(x1, y1, x2, y2, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_rounded_rect(x1, y1, x2, y2, rx, ry);
+    _draw_outline(count - 1, true, thickness, color);
+}
+
+void al_draw_filled_rounded_rectangle(float x1, float y1, float x2, float y2, float rx, float ry, ALLEGRO_COLOR color)
+{
+    if (!_clamp_rounded_rect(&x1, &y1, &x2, &y2, &rx, &ry)) {
+        al_draw_filled_rectangle(x1, y1, x2, y2, color);
+        return;
+    }
+    if (!_can_draw() || _cull_rect(x1, y1, x2, y2, 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int count = _build_rounded_rect(x1, y1, x2, y2, rx, ry);
+    _fill_transformed_fan((x1 + x2) * 0.5f, (y1 + y2) * 0.5f, &_outline_points[0], count, color);
+}
+
+void al_draw_triangle(float x1, float y1, float x2, float y2, float x3, float y3, ALLEGRO_COLOR color, float thickness)
+{
+    if (!_can_draw() ||
+        _cull_rect(SDL_min(x1, SDL_min(x2, x3)), SDL_min(y1, SDL_min(y2, y3)),
+                   SDL_max(x1, SDL_max(x2, x3)), SDL_max(y1, SDL_max(y2, y3)),
+                   _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    _outline_points.resize(3);
+    _outline_points[0].x = x1; _outline_points[0].y = y1;
+    _outline_points[1].x = x2; _outline_points[1].y = y2;
+    _outline_points[2].x = x3; _outline_points[2].y = y3;
+    _draw_outline(3, true, thickness, color);
+}
+
+void al_draw_filled_triangle(float x1, float y1, float x2, float y2, float x3, float y3, ALLEGRO_COLOR color)
+{
+    if (!_can_draw() ||
+        _cull_rect(SDL_min(x1, SDL_min(x2, x3)), SDL_min(y1, SDL_min(y2, y3)),
+                   SDL_max(x1, SDL_max(x2, x3)), SDL_max(y1, SDL_max(y2, y3)), 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    SDL_Color c = _to_sdl_color(color);
+    SDL_Vertex verts[3] = {
+        {{x1, y1}, c, {0, 0}},
+        {{x2, y2}, c, {0, 0}},
+        {{x3, y3}, c, {0, 0}}
+    };
+    _draw_transformed_triangles(verts, 3, nullptr, 0);
+}
+
+void al_draw_polygon(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color, float thickness)
+{
+    if (!vertices || vertex_count < 3) {
+        return;
+    }
+    
+    if (!_can_draw() ||
+        _cull_points(vertices, stride, vertex_count, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    _gather_outline(vertices, vertex_count, stride);
+    _draw_outline(vertex_count, true, thickness, color);
+}
+
+void al_draw_filled_polygon(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color)
+{
+    if (!vertices || vertex_count < 3) {
+        return;
+    }
+    
+    if (!_can_draw() || _cull_points(vertices, stride, vertex_count, 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    ScratchScope scope;
+    float* xy = _scratch_pack_vertices(vertices, stride, vertex_count);
+    if (xy) {
+        _fill_polygon_rings(xy, &vertex_count, 1, vertex_count, color);
+    }
+}
+
+void al_draw_filled_polygon_with_holes(const float* vertices, const int* vertex_counts, ALLEGRO_COLOR color)
+{
+    if (!vertices || !vertex_counts || vertex_counts[0] < 3) {
+        return;
+    }
+    
+    if (!_can_draw() || _cull_points(vertices, 2 * sizeof(float), vertex_counts[0], 0)) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    int rings = 0;
+    int total = 0;
+    while (vertex_counts[rings] > 0) {
+        total += vertex_counts[rings++];
+    }
+    
+    ScratchScope scope;
+    _fill_polygon_rings(vertices, vertex_counts, rings, total, color);
+}
+
+void al_draw_polyline(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color, float thickness, bool closed)
+{
+    if (!vertices || vertex_count < 2) {
+        return;
+    }
+    
+    if (!_can_draw() ||
+        _cull_points(vertices, stride, vertex_count, _stroke_pad(thickness, STROKE_MITER_LIMIT))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    _gather_outline(vertices, vertex_count, stride);
+    _draw_outline(vertex_count, closed && vertex_count > 2, thickness, color);
+}
+
+void al_draw_polyline_ex(const float* vertices, int vertex_stride, int vertex_count, int join_style, int cap_style, ALLEGRO_COLOR color, float thickness, float miter_limit)
+{
+    if (!vertices || vertex_count < 2) {
+        return;
+    }
+    
+    if (!_can_draw() ||
+        _cull_points(vertices, vertex_stride, vertex_count, _stroke_pad(thickness, miter_limit))) {
+        return;
+    }
+    
+    _set_render_color(color);
+    
+    _gather_outline(vertices, vertex_count, vertex_stride);
+    if (thickness <= 0) {
+        _draw_outline(vertex_count, cap_style == ALLEGRO_LINE_CAP_CLOSED && vertex_count > 2,
+                      thickness, color);
+        return;
+    }
+    _stroke_polyline(&_outline_points[0], vertex_count, false, join_style, cap_style,
+                     thickness, miter_limit, color);
+}
+
+void al_draw_pixel(float x, float y, ALLEGRO_COLOR color)
+{
+    if (_cull_rect(x, y, x, y, 0)) {
+        return;
+    }
+    al_put_pixel(x, y, color);
+}
+
+/* Low-level primitives. Vertex arrays go to SDL_RenderGeometryRaw through
+ * their own strides and offsets. Only the attributes SDL cannot read in
+ * place are converted, each into its own tight array in the scratch arena:
+ * positions under a non-identity transform or in a non-float storage,
+ * ALLEGRO_COLOR colours, pixel texture coordinates and coordinates into
+ * sub-bitmaps. */
+struct ALLEGRO_VERTEX_DECL {
+    ALLEGRO_VERTEX_ELEMENT elements[ALLEGRO_PRIM_ATTR_NUM];
+    int stride;
+};
+
+struct PrimArrays {
+    const float* xy;
+    int xy_stride;
+    const SDL_Color* color;
+    int color_stride;
+    const float* uv;
+    int uv_stride;
+};
+
+static bool _primitives_initialized = false;
+static const SDL_Color _prim_white = {255, 255, 255, 255};
+static const float _prim_zero_uv[2] = {0, 0};
+
+bool al_init_primitives_addon(void)
+{
+    _primitives_initialized = true;
+    return true;
+}
+
+bool al_is_primitives_addon_initialized(void)
+{
+    return _primitives_initialized;
+}
+
+void al_shutdown_primitives_addon(void)
+{
+    _primitives_initialized = false;
+}
+
+uint32_t al_get_allegro_primitives_version(void)
+{
+    return ALLEGRO_PRIMITIVES_VERSION;
+}
+
+ALLEGRO_VERTEX_DECL* al_create_vertex_decl(const ALLEGRO_VERTEX_ELEMENT* elements, int stride)
+{
+    if (!elements || stride <= 0) {
+        return nullptr;
+    }
+    
+    ALLEGRO_VERTEX_DECL* decl = new ALLEGRO_VERTEX_DECL;
+    memset(decl->elements, 0, sizeof(decl->elements));
+    decl->stride = stride;
+    
+    for (; elements->attribute; elements++) {
+        if (elements->attribute > 0 && elements->attribute < ALLEGRO_PRIM_ATTR_NUM) {
+            decl->elements[elements->attribute] = *elements;
+        }
+    }
+    return decl;
+}
+
+void al_destroy_vertex_decl(ALLEGRO_VERTEX_DECL* decl)
+{
+    delete decl;
+}
+
+static const ALLEGRO_VERTEX_DECL* _default_vertex_decl(void)
+{
+    static ALLEGRO_VERTEX_DECL decl;
+    static bool ready = false;
+    if (!ready) {
+        memset(&decl, 0, sizeof(decl));
+        ALLEGRO_VERTEX_ELEMENT position = {ALLEGRO_PRIM_POSITION, ALLEGRO_PRIM_FLOAT_3,
+                                           static_cast<int>(offsetof(ALLEGRO_VERTEX, x))};
+        ALLEGRO_VERTEX_ELEMENT tex_coord = {ALLEGRO_PRIM_TEX_COORD_PIXEL, ALLEGRO_PRIM_FLOAT_2,
+                                            static_cast<int>(offsetof(ALLEGRO_VERTEX, u))};
+        ALLEGRO_VERTEX_ELEMENT color = {ALLEGRO_PRIM_COLOR_ATTR, 0,
+                                        static_cast<int>(offsetof(ALLEGRO_VERTEX, color))};
+        decl.elements[ALLEGRO_PRIM_POSITION] = position;
+        decl.elements[ALLEGRO_PRIM_TEX_COORD_PIXEL] = tex_coord;
+        decl.elements[ALLEGRO_PRIM_COLOR_ATTR] = color;
+        decl.stride = sizeof(ALLEGRO_VERTEX);
+        ready = true;
+    }
+    return &decl;
+}
+
+static float _half_to_float(Uint16 h)
+{
+    Uint32 sign = static_cast<Uint32>(h & 0x8000) << 16;
+    Uint32 exponent = (h >> 10) & 0x1F;
+    Uint32 mantissa = h & 0x3FF;
+    Uint32 bits;
+    
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            float f = ldexpf(static_cast<float>(mantissa), -24);
+            return sign ? -f : f;
+        }
+    } else if (exponent == 31) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/* Reads up to four components of an attribute stored as storage. */
+static void _read_prim_attr(const char* p, int storage, float out[4])
+{
+    Sint16 s[4];
+    Uint16 u[4];
+    out[0] = out[1] = out[2] = 0;
+    out[3] = 1;
+    
+    switch (storage) {
+        case ALLEGRO_PRIM_FLOAT_1:
+            memcpy(out, p, sizeof(float));
+            break;
+        case ALLEGRO_PRIM_FLOAT_2:
+            memcpy(out, p, 2 * sizeof(float));
+            break;
+        case ALLEGRO_PRIM_FLOAT_3:
+            memcpy(out, p, 3 * sizeof(float));
+            break;
+        case ALLEGRO_PRIM_FLOAT_4:
+            memcpy(out, p, 4 * sizeof(float));
+            break;
+        case ALLEGRO_PRIM_SHORT_2:
+        case ALLEGRO_PRIM_NORMALIZED_SHORT_2:
+            memcpy(s, p, 2 * sizeof(Sint16));
+            for (int i = 0; i < 2; i++) {
+                out[i] = storage == ALLEGRO_PRIM_SHORT_2 ? s[i] : s[i] / 32767.0f;
+            }
+            break;
+        case ALLEGRO_PRIM_SHORT_4:
+        case ALLEGRO_PRIM_NORMALIZED_SHORT_4:
+            memcpy(s, p, 4 * sizeof(Sint16));
+            for (int i = 0; i < 4; i++) {
+                out[i] = storage == ALLEGRO_PRIM_SHORT_4 ? s[i] : s[i] / 32767.0f;
+            }
+            break;
+        case ALLEGRO_PRIM_NORMALIZED_USHORT_2:
+        case ALLEGRO_PRIM_NORMALIZED_USHORT_4:
+            memcpy(u, p, (storage == ALLEGRO_PRIM_NORMALIZED_USHORT_2 ? 2 : 4) * sizeof(Uint16));
+            for (int i = 0; i < (storage == ALLEGRO_PRIM_NORMALIZED_USHORT_2 ? 2 : 4); i++) {
+                out[i] = u[i] / 65535.0f;
+            }
+            break;
+        case ALLEGRO_PRIM_UBYTE_4:
+        case ALLEGRO_PRIM_NORMALIZED_UBYTE_4:
+            for (int i = 0; i < 4; i++) {
+                Uint8 b = static_cast<Uint8>(p[i]);
+                out[i] = storage == ALLEGRO_PRIM_UBYTE_4 ? b : b / 255.0f;
+            }
+            break;
+        case ALLEGRO_PRIM_HALF_FLOAT_2:
+        case ALLEGRO_PRIM_HALF_FLOAT_4:
+            memcpy(u, p, (storage == ALLEGRO_PRIM_HALF_FLOAT_2 ? 2 : 4) * sizeof(Uint16));
+            for (int i = 0; i < (storage == ALLEGRO_PRIM_HALF_FLOAT_2 ? 2 : 4); i++) {
+                out[i] = _half_to_float(u[i]);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Fills arrays with pointers SDL can read for vertices [0, count) of base,
+ * converting only what has to be. Must run inside a ScratchScope. */
+static bool _prim_arrays(const char* base, const ALLEGRO_VERTEX_DECL* decl, ALLEGRO_BITMAP* texture,
+                         int count, PrimArrays* arrays)
+{
+    int stride = decl->stride;
+    float v[4];
+    
+    const ALLEGRO_VERTEX_ELEMENT& pos = decl->elements[ALLEGRO_PRIM_POSITION];
+    if (!pos.attribute) {
+        return false;
+    }
+    if ((pos.storage == ALLEGRO_PRIM_FLOAT_2 || pos.storage == ALLEGRO_PRIM_FLOAT_3) &&
+        _transform_kind == TRANSFORM_IDENTITY) {
+        arrays->xy = reinterpret_cast<const float*>(base + pos.offset);
+        arrays->xy_stride = stride;
+    } else {
+        float* xy = _scratch_array<float>(2 * count);
+        if (!xy) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            _read_prim_attr(base + i * stride + pos.offset, pos.storage, v);
+            xy[2 * i] = v[0];
+            xy[2 * i + 1] = v[1];
+            _transform_point(&xy[2 * i], &xy[2 * i + 1]);
+        }
+        arrays->xy = xy;
+        arrays->xy_stride = 2 * sizeof(float);
+    }
+    
+    const ALLEGRO_VERTEX_ELEMENT& col = decl->elements[ALLEGRO_PRIM_COLOR_ATTR];
+    if (!col.attribute) {
+        arrays->color = &_prim_white;
+        arrays->color_stride = 0;
+    } else if (col.storage == ALLEGRO_PRIM_UBYTE_4 || col.storage == ALLEGRO_PRIM_NORMALIZED_UBYTE_4) {
+        arrays->color = reinterpret_cast<const SDL_Color*>(base + col.offset);
+        arrays->color_stride = stride;
+    } else {
+        SDL_Color* colors = _scratch_array<SDL_Color>(count);
+        if (!colors) {
+            return false;
+        }
+        for (int i = 0; i < count; i++) {
+            ALLEGRO_COLOR color;
+            memcpy(&color, base + i * stride + col.offset, sizeof(color));
+            colors[i] = _to_sdl_color(color);
+        }
+        arrays->color = colors;
+        arrays->color_stride = sizeof(SDL_Color);
+    }
+    
+    arrays->uv = nullptr;
+    arrays->uv_stride = 0;
+    if (!texture) {
+        return true;
+    }
+    
+    bool pixel = decl->elements[ALLEGRO_PRIM_TEX_COORD_PIXEL].attribute != 0;
+    const ALLEGRO_VERTEX_ELEMENT& tex = decl->elements[pixel ? ALLEGRO_PRIM_TEX_COORD_PIXEL
+                                                             : ALLEGRO_PRIM_TEX_COORD];
+    ALLEGRO_BITMAP* root = texture->parent ? texture->parent : texture;
+    if (!tex.attribute) {
+        arrays->uv = _prim_zero_uv;
+    } else if (!pixel && tex.storage == ALLEGRO_PRIM_FLOAT_2 && root == texture) {
+        arrays->uv = reinterpret_cast<const float*>(base + tex.offset);
+        arrays->uv_stride = stride;
+    } else {
+        float* uv = _scratch_array<float>(2 * count);
+        if (!uv) {
+            return false;
+        }
+        float scale_u = pixel ? 1.0f : static_cast<float>(texture->width);
+        float scale_v = pixel ? 1.0f : static_cast<float>(texture->height);
+        for (int i = 0; i < count; i++) {
+            _read_prim_attr(base + i * stride + tex.offset, tex.storage, v);
+            uv[2 * i] = (v[0] * scale_u + texture->xofs) / root->width;
+            uv[2 * i + 1] = (v[1] * scale_v + texture->yofs) / root->height;
+        }
+        arrays->uv = uv;
+        arrays->uv_stride = 2 * sizeof(float);
+    }
+    return true;
+}
+
+static void _prim_position(const PrimArrays* arrays, int i, float* x, float* y)
+{
+    const float* p = reinterpret_cast<const float*>(
+        reinterpret_cast<const char*>(arrays->xy) + i * arrays->xy_stride);
+    *x = p[0];
+    *y = p[1];
+}
+
+/* Positions in the arrays are already transformed. */
+static bool _cull_prim_arrays(const PrimArrays* arrays, int count)
+{
+    float x1, y1, x2, y2;
+    _prim_position(arrays, 0, &x1, &y1);
+    x2 = x1;
+    y2 = y1;
+    for (int i = 1; i < count; i++) {
+        float x, y;
+        _prim_position(arrays, i, &x, &y);
+        x1 = SDL_min(x1, x);
+        y1 = SDL_min(y1, y);
+        x2 = SDL_max(x2, x);
+        y2 = SDL_max(y2, y);
+    }
+    return _cull_bounds(x1, y1, x2, y2);
+}
+
+static SDL_Color _prim_color(const PrimArrays* arrays, int i)
+{
+    return *reinterpret_cast<const SDL_Color*>(
+        reinterpret_cast<const char*>(arrays->color) + i * arrays->color_stride);
+}
+
+static bool _same_color(SDL_Color a, SDL_Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static void _draw_prim_points(const SoftTarget* soft, const SDL_FPoint* points, int count, SDL_Color c)
+{
+    if (soft) {
+        Uint32 packed = _soft_pack(c.r, c.g, c.b, c.a);
+        for (int i = 0; i < count; i++) {
+            _soft_put_pixel(soft, points[i].x, points[i].y, packed, true);
+        }
+        return;
+    }
+    _cache_set_draw_color(_current_display, c.r, c.g, c.b, c.a);
+    SDL_RenderDrawPointsF(_current_display->renderer, points, count);
+}
+
+/* Expands strips and fans into a triangle list of vertex numbers, mapped
+ * through indices when they are given. Returns the number of entries. */
+static int _prim_triangle_indices(int type, const int* indices, int n, int* out)
+{
+    int count = 0;
+    for (int k = 2; k < n; k++) {
+        int a = type == ALLEGRO_PRIM_TRIANGLE_FAN ? 0 : k - 2;
+        out[count++] = indices ? indices[a] : a;
+        out[count++] = indices ? indices[k - 1] : k - 1;
+        out[count++] = indices ? indices[k] : k;
+    }
+    return count;
+}
+
+/* Draws line lists, strips, loops and point lists. Runs of one colour share
+ * a single draw colour change; a uniformly coloured strip or point list is
+ * one SDL call. */
+static int _draw_prim_lines(const PrimArrays* arrays, const int* indices, int n, int type)
+{
+    int segments = 0;
+    int* pairs = nullptr;
+    if (type != ALLEGRO_PRIM_POINT_LIST) {
+        segments = type == ALLEGRO_PRIM_LINE_LIST ? n / 2 : (type == ALLEGRO_PRIM_LINE_LOOP && n > 2 ? n : n - 1);
+        if (segments <= 0) {
+            return 0;
+        }
+        pairs = _scratch_array<int>(2 * segments);
+        if (!pairs) {
+            return 0;
+        }
+        for (int s = 0; s < segments; s++) {
+            int a = type == ALLEGRO_PRIM_LINE_LIST ? 2 * s : s;
+            int b = type == ALLEGRO_PRIM_LINE_LIST ? 2 * s + 1 : (s + 1) % n;
+            pairs[2 * s] = indices ? indices[a] : a;
+            pairs[2 * s + 1] = indices ? indices[b] : b;
+        }
+    }
+    
+    bool is_soft = _draw_is_soft;
+    if (!is_soft) {
+        _begin_target_draw(nullptr);
+        _apply_render_blender();
+    }
+    
+    if (type == ALLEGRO_PRIM_POINT_LIST) {
+        SDL_FPoint* points = _scratch_array<SDL_FPoint>(n);
+        if (!points) {
+            return 0;
+        }
+        int run = 0;
+        SDL_Color run_color = _prim_color(arrays, indices ? indices[0] : 0);
+        for (int i = 0; i < n; i++) {
+            int v = indices ? indices[i] : i;
+            SDL_Color c = _prim_color(arrays, v);
+            if (!_same_color(c, run_color)) {
+                _draw_prim_points(is_soft ? &_draw_soft : nullptr, points, i - run, run_color);
+                run = i;
+                run_color = c;
+            }
+            _prim_position(arrays, v, &points[i - run].x, &points[i - run].y);
+        }
+        _draw_prim_points(is_soft ? &_draw_soft : nullptr, points, n - run, run_color);
+        return n;
+    }
+    
+    SDL_FPoint* path = _scratch_array<SDL_FPoint>(segments + 1);
+    if (!path) {
+        return 0;
+    }
+    for (int s = 0; s < segments; ) {
+        SDL_Color c = _prim_color(arrays, pairs[2 * s]);
+        int len = 0;
+        _prim_position(arrays, pairs[2 * s], &path[0].x, &path[0].y);
+        
+        /* Extend the run while segments chain end to start in one colour. */
+        int e = s;
+        do {
+            len++;
+            _prim_position(arrays, pairs[2 * e + 1], &path[len].x, &path[len].y);
+            e++;
+        } while (e < segments && pairs[2 * e] == pairs[2 * e - 1] &&
+                 _same_color(c, _prim_color(arrays, pairs[2 * e])));
+        
+        if (is_soft) {
+            Uint32 packed = _soft_pack(c.r, c.g, c.b, c.a);
+            for (int k = 0; k < len; k++) {
+                _soft_draw_line(&_draw_soft, path[k].x, path[k].y, path[k + 1].x, path[k + 1].y, packed);
+            }
+        } else {
+            _cache_set_draw_color(_current_display, c.r, c.g, c.b, c.a);
+            SDL_RenderDrawLinesF(_current_display->renderer, path, len + 1);
+        }
+        s = e;
+    }
+    return segments;
+}
+
+/* Prepares the current GPU target for a geometry call and returns the
+ * texture to draw with. A memory bitmap is uploaded into a temporary texture
+ * that the caller destroys when temporary is set. */
+static SDL_Texture* _bind_prim_texture(ALLEGRO_BITMAP* texture, bool* temporary)
+{
+    _begin_target_draw(nullptr);
+    _apply_render_blender();
+    *temporary = false;
+    if (!texture) {
+        return nullptr;
+    }
+    
+    ALLEGRO_BITMAP* root = texture->parent ? texture->parent : texture;
+    if (root->texture) {
+        _upload_shadow(texture);
+        _cache_set_texture_mod(texture, 255, 255, 255, 255);
+        _cache_set_texture_blend_mode(texture, _get_blender_mode());
+        return root->texture;
+    }
+    if (!root->surface) {
+        return nullptr;
+    }
+    
+    SDL_Texture* sdl_texture = SDL_CreateTextureFromSurface(_current_display->renderer, root->surface);
+    if (sdl_texture) {
+        if (SDL_SetTextureBlendMode(sdl_texture, _get_blender_mode()) != 0) {
+            SDL_SetTextureBlendMode(sdl_texture, SDL_BLENDMODE_BLEND);
+        }
+        *temporary = true;
+    }
+    return sdl_texture;
+}
+
+static int _draw_prim(const char* base, const ALLEGRO_VERTEX_DECL* decl, ALLEGRO_BITMAP* texture,
+                      int count, const int* indices, int n, int type)
+{
+    if (!_can_draw() || count <= 0 || n <= 0 || type < 0 || type >= ALLEGRO_PRIM_NUM_TYPES) {
+        return 0;
+    }
+    if (!decl) {
+        decl = _default_vertex_decl();
+    }
+    
+    _flush_bitmap_batch();
+    ScratchScope scope;
+    PrimArrays arrays;
+    if (!_prim_arrays(base, decl, texture, count, &arrays) || _cull_prim_arrays(&arrays, count)) {
+        return 0;
+    }
+    
+    if (type == ALLEGRO_PRIM_LINE_LIST || type == ALLEGRO_PRIM_LINE_STRIP ||
+        type == ALLEGRO_PRIM_LINE_LOOP || type == ALLEGRO_PRIM_POINT_LIST) {
+        return _draw_prim_lines(&arrays, indices, n, type);
+    }
+    
+    const int* triangles = indices;
+    int num_triangles = n - n % 3;
+    if (type != ALLEGRO_PRIM_TRIANGLE_LIST) {
+        int* expanded = _scratch_array<int>(3 * SDL_max(n - 2, 0));
+        if (!expanded) {
+            return 0;
+        }
+        num_triangles = _prim_triangle_indices(type, indices, n, expanded);
+        triangles = expanded;
+    }
+    if (num_triangles == 0) {
+        return 0;
+    }
+    
+    if (_draw_is_soft) {
+        SDL_Surface* source = texture ? _soft_source_surface(texture) : nullptr;
+        SDL_Vertex* verts = _scratch_array<SDL_Vertex>(count);
+        if ((texture && !source) || !verts) {
+            return 0;
+        }
+        for (int i = 0; i < count; i++) {
+            _prim_position(&arrays, i, &verts[i].position.x, &verts[i].position.y);
+            verts[i].color = _prim_color(&arrays, i);
+            const float* uv = arrays.uv ? reinterpret_cast<const float*>(
+                reinterpret_cast<const char*>(arrays.uv) + i * arrays.uv_stride) : _prim_zero_uv;
+            verts[i].tex_coord.x = uv[0];
+            verts[i].tex_coord.y = uv[1];
         }
+        _soft_draw_triangles(&_draw_soft, verts, count, triangles, num_triangles, source);
+        return num_triangles / 3;
     }
-
-    return false;
+    
+    bool temporary = false;
+    SDL_Texture* sdl_texture = _bind_prim_texture(texture, &temporary);
+    if (texture && !sdl_texture) {
+        return 0;
+    }
+    
+    SDL_RenderGeometryRaw(_current_display->renderer, sdl_texture,
+                          arrays.xy, arrays.xy_stride, arrays.color, arrays.color_stride,
+                          arrays.uv, arrays.uv_stride,
+                          triangles ? count : num_triangles,
+                          triangles, triangles ? num_triangles : 0, sizeof(int));
+    
+    if (temporary) {
+        SDL_DestroyTexture(sdl_texture);
+    }
+    return num_triangles / 3;
 }
 
-ALLEGRO_BITMAP* al_create_bitmap(int w, int h)
+int al_draw_prim(const void* vtxs, const ALLEGRO_VERTEX_DECL* decl, ALLEGRO_BITMAP* texture,
+                 int start, int end, int type)
 {
-    ALLEGRO_BITMAP* bitmap = new ALLEGRO_BITMAP;
-    if (!bitmap) {
-        return nullptr;
+    if (!vtxs || end <= start) {
+        return 0;
     }
-    
-    bitmap->width = w;
-    bitmap->height = h;
-    bitmap->format = _new_bitmap_format;
-    bitmap->flags = _new_bitmap_flags;
-    bitmap->is_backbuffer = false;
-    bitmap->surface = nullptr;
-    bitmap->texture = nullptr;
-    
-    if (_current_display && _current_display->renderer) {
-        bitmap->texture = SDL_CreateTexture(
-            _current_display->renderer,
-            SDL_PIXELFORMAT_ARGB8888,
-            SDL_TEXTUREACCESS_TARGET,
-            w, h
-        );
+    int stride = decl ? decl->stride : static_cast<int>(sizeof(ALLEGRO_VERTEX));
+    const char* base = static_cast<const char*>(vtxs) + static_cast<size_t>(start) * stride;
+    return _draw_prim(base, decl, texture, end - start, nullptr, end - start, type);
+}
+
+int al_draw_indexed_prim(const void* vtxs, const ALLEGRO_VERTEX_DECL* decl, ALLEGRO_BITMAP* texture,
+                         const int* indices, int num_vtx, int type)
+{
+    if (!vtxs || !indices || num_vtx <= 0) {
+        return 0;
     }
+    int max_index = 0;
+    for (int i = 0; i < num_vtx; i++) {
+        if (indices[i] < 0) {
+            return 0;
+        }
+        max_index = SDL_max(max_index, indices[i]);
+    }
+    return _draw_prim(static_cast<const char*>(vtxs), decl, texture, max_index + 1,
+                      indices, num_vtx, type);
+}
+
+/* Retained vertex and index buffers. The declared layout is kept for
+ * locking, and is converted into SDL_Vertex once at creation and again only
+ * for the range written through a lock. Texture coordinates are normalized
+ * for the bitmap last drawn with, and the transformed copy used under a
+ * non-identity transform is rebuilt only when the transform generation or the
+ * contents change. */
+struct ALLEGRO_VERTEX_BUFFER {
+    ALLEGRO_VERTEX_DECL decl;
+    char* data;
+    int size;
+    int flags;
+    bool locked;
+    int lock_offset;
+    int lock_length;
+    int lock_flags;
+    std::vector<SDL_Vertex> vertices;
+    std::vector<float> tex_coords;
+    bool pixel_tex_coords;
+    ALLEGRO_BITMAP* uv_texture;
+    int uv_key[6];
+    std::vector<SDL_Vertex> transformed;
+    Uint32 transformed_generation;
+    float bounds[4];
+    bool bounds_valid;
+};
+
+struct ALLEGRO_INDEX_BUFFER {
+    int index_size;
+    char* data;
+    int size;
+    int flags;
+    bool locked;
+    int lock_offset;
+    int lock_length;
+    int lock_flags;
+    std::vector<int> indices;
+};
+
+static void _convert_buffer_vertices(ALLEGRO_VERTEX_BUFFER* buffer, int first, int count)
+{
+    const ALLEGRO_VERTEX_DECL& decl = buffer->decl;
+    const ALLEGRO_VERTEX_ELEMENT& pos = decl.elements[ALLEGRO_PRIM_POSITION];
+    const ALLEGRO_VERTEX_ELEMENT& col = decl.elements[ALLEGRO_PRIM_COLOR_ATTR];
+    const ALLEGRO_VERTEX_ELEMENT& tex = decl.elements[buffer->pixel_tex_coords ? ALLEGRO_PRIM_TEX_COORD_PIXEL
+                                                                            : ALLEGRO_PRIM_TEX_COORD];
+    float v[4];
     
-    if (!bitmap->texture) {
-        bitmap->surface = SDL_CreateRGBSurface(
-            0, w, h, 32,
-            0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000
-        );
+    for (int i = first; i < first + count; i++) {
+        const char* p = buffer->data + static_cast<size_t>(i) * decl.stride;
+        SDL_Vertex& out = buffer->vertices[i];
+        
+        _read_prim_attr(p + pos.offset, pos.storage, v);
+        out.position.x = v[0];
+        out.position.y = v[1];
+        
+        if (!col.attribute) {
+            out.color = _prim_white;
+        } else if (col.storage == ALLEGRO_PRIM_UBYTE_4 || col.storage == ALLEGRO_PRIM_NORMALIZED_UBYTE_4) {
+            memcpy(&out.color, p + col.offset, sizeof(out.color));
+        } else {
+            ALLEGRO_COLOR color;
+            memcpy(&color, p + col.offset, sizeof(color));
+            out.color = _to_sdl_color(color);
+        }
+        
+        if (tex.attribute) {
+            _read_prim_attr(p + tex.offset, tex.storage, v);
+        } else {
+            v[0] = v[1] = 0;
+        }
+        buffer->tex_coords[2 * i] = v[0];
+        buffer->tex_coords[2 * i + 1] = v[1];
     }
     
-    return bitmap;
+    buffer->uv_texture = nullptr;
+    buffer->transformed_generation = 0;
+    buffer->bounds_valid = false;
 }
 
-void al_destroy_bitmap(ALLEGRO_BITMAP* bitmap)
+/* Normalizes the stored texture coordinates for texture, unless they
+ * already are. */
+static void _normalize_buffer_tex_coords(ALLEGRO_VERTEX_BUFFER* buffer, ALLEGRO_BITMAP* texture)
 {
-    if (!bitmap) {
+    if (!texture) {
         return;
     }
     
-    if (bitmap->texture) {
-        SDL_DestroyTexture(bitmap->texture);
+    ALLEGRO_BITMAP* root = texture->parent ? texture->parent : texture;
+    int key[6] = {texture->xofs, texture->yofs, texture->width, texture->height, root->width, root->height};
+    if (buffer->uv_texture == texture && memcmp(buffer->uv_key, key, sizeof(key)) == 0) {
+        return;
     }
     
-    if (bitmap->surface) {
-        SDL_FreeSurface(bitmap->surface);
+    float scale_u = buffer->pixel_tex_coords ? 1.0f : static_cast<float>(texture->width);
+    float scale_v = buffer->pixel_tex_coords ? 1.0f : static_cast<float>(texture->height);
+    for (int i = 0; i < buffer->size; i++) {
+        buffer->vertices[i].tex_coord.x = (buffer->tex_coords[2 * i] * scale_u + texture->xofs) / root->width;
+        buffer->vertices[i].tex_coord.y = (buffer->tex_coords[2 * i + 1] * scale_v + texture->yofs) / root->height;
     }
     
-    delete bitmap;
+    buffer->uv_texture = texture;
+    memcpy(buffer->uv_key, key, sizeof(key));
+    buffer->transformed_generation = 0;
 }
 
-int al_get_bitmap_width(ALLEGRO_BITMAP* bitmap)
+/* Culls against the untransformed bounds of the whole buffer, which are
+ * recomputed only after a lock has changed its contents. */
+static bool _cull_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer)
 {
-    if (!bitmap) {
-        return 0;
+    if (!buffer->bounds_valid) {
+        const SDL_Vertex* v = &buffer->vertices[0];
+        buffer->bounds[0] = buffer->bounds[2] = v[0].position.x;
+        buffer->bounds[1] = buffer->bounds[3] = v[0].position.y;
+        for (int i = 1; i < buffer->size; i++) {
+            buffer->bounds[0] = SDL_min(buffer->bounds[0], v[i].position.x);
+            buffer->bounds[1] = SDL_min(buffer->bounds[1], v[i].position.y);
+            buffer->bounds[2] = SDL_max(buffer->bounds[2], v[i].position.x);
+            buffer->bounds[3] = SDL_max(buffer->bounds[3], v[i].position.y);
+        }
+        buffer->bounds_valid = true;
     }
-    return bitmap->width;
+    return _cull_rect(buffer->bounds[0], buffer->bounds[1], buffer->bounds[2], buffer->bounds[3], 0);
 }
 
-int al_get_bitmap_height(ALLEGRO_BITMAP* bitmap)
+static const SDL_Vertex* _buffer_draw_vertices(ALLEGRO_VERTEX_BUFFER* buffer, ALLEGRO_BITMAP* texture)
 {
-    if (!bitmap) {
-        return 0;
+    _normalize_buffer_tex_coords(buffer, texture);
+    if (_transform_kind == TRANSFORM_IDENTITY) {
+        return &buffer->vertices[0];
     }
-    return bitmap->height;
+    
+    if (buffer->transformed_generation != _transform_generation) {
+        buffer->transformed = buffer->vertices;
+        for (size_t i = 0; i < buffer->transformed.size(); i++) {
+            _transform_point(&buffer->transformed[i].position.x, &buffer->transformed[i].position.y);
+        }
+        buffer->transformed_generation = _transform_generation;
+    }
+    return &buffer->transformed[0];
 }
 
-int al_get_bitmap_format(ALLEGRO_BITMAP* bitmap)
+/* Draws count vertices of verts (already in target coordinates) as type,
+ * through n indices when they are given. */
+static int _draw_vertex_array(const SDL_Vertex* verts, int count, const int* indices, int n,
+                              int type, ALLEGRO_BITMAP* texture)
 {
-    if (!bitmap) {
+    if (!_can_draw() || count <= 0 || n <= 0 || type < 0 || type >= ALLEGRO_PRIM_NUM_TYPES) {
         return 0;
     }
-    return bitmap->format;
-}
-
-int al_get_bitmap_flags(ALLEGRO_BITMAP* bitmap)
-{
-    if (!bitmap) {
+    
+    _flush_bitmap_batch();
+    ScratchScope scope;
+    
+    if (type == ALLEGRO_PRIM_LINE_LIST || type == ALLEGRO_PRIM_LINE_STRIP ||
+        type == ALLEGRO_PRIM_LINE_LOOP || type == ALLEGRO_PRIM_POINT_LIST) {
+        PrimArrays arrays = {
+            &verts[0].position.x, static_cast<int>(sizeof(SDL_Vertex)),
+            &verts[0].color, static_cast<int>(sizeof(SDL_Vertex)),
+            &verts[0].tex_coord.x, static_cast<int>(sizeof(SDL_Vertex))
+        };
+        return _draw_prim_lines(&arrays, indices, n, type);
+    }
+    
+    const int* triangles = indices;
+    int num_triangles = n - n % 3;
+    if (type != ALLEGRO_PRIM_TRIANGLE_LIST) {
+        int* expanded = _scratch_array<int>(3 * SDL_max(n - 2, 0));
+        if (!expanded) {
+            return 0;
+        }
+        num_triangles = _prim_triangle_indices(type, indices, n, expanded);
+        triangles = expanded;
+    }
+    if (num_triangles == 0) {
         return 0;
     }
-    return bitmap->flags;
-}
-
-void al_set_target_bitmap(ALLEGRO_BITMAP* bitmap)
-{
-    _target_bitmap = bitmap;
     
-    if (!_current_display || !_current_display->renderer) {
-        return;
+    if (_draw_is_soft) {
+        SDL_Surface* source = texture ? _soft_source_surface(texture) : nullptr;
+        if (texture && !source) {
+            return 0;
+        }
+        _soft_draw_triangles(&_draw_soft, verts, triangles ? count : num_triangles,
+                             triangles, num_triangles, source);
+        return num_triangles / 3;
     }
     
-    if (bitmap && bitmap->texture) {
-        SDL_SetRenderTarget(_current_display->renderer, bitmap->texture);
-    } else {
-        SDL_SetRenderTarget(_current_display->renderer, nullptr);
+    bool temporary = false;
+    SDL_Texture* sdl_texture = _bind_prim_texture(texture, &temporary);
+    if (texture && !sdl_texture) {
+        return 0;
+    }
+    SDL_RenderGeometry(_current_display->renderer, sdl_texture, verts,
+                       triangles ? count : num_triangles, triangles, triangles ? num_triangles : 0);
+    if (temporary) {
+        SDL_DestroyTexture(sdl_texture);
     }
+    return num_triangles / 3;
 }
 
-ALLEGRO_BITMAP* al_get_target_bitmap(void)
+ALLEGRO_VERTEX_BUFFER* al_create_vertex_buffer(ALLEGRO_VERTEX_DECL* decl, const void* initial_data,
+                                               int num_vertices, int flags)
 {
-    return _target_bitmap;
+    if (num_vertices <= 0) {
+        return nullptr;
+    }
+    if (!decl) {
+        decl = const_cast<ALLEGRO_VERTEX_DECL*>(_default_vertex_decl());
+    }
+    if (!decl->elements[ALLEGRO_PRIM_POSITION].attribute) {
+        return nullptr;
+    }
+    
+    ALLEGRO_VERTEX_BUFFER* buffer = new ALLEGRO_VERTEX_BUFFER;
+    buffer->decl = *decl;
+    buffer->size = num_vertices;
+    buffer->flags = flags;
+    buffer->data = static_cast<char*>(calloc(num_vertices, decl->stride));
+    if (!buffer->data) {
+        delete buffer;
+        return nullptr;
+    }
+    if (initial_data) {
+        memcpy(buffer->data, initial_data, static_cast<size_t>(num_vertices) * decl->stride);
+    }
+    
+    buffer->locked = false;
+    buffer->lock_offset = 0;
+    buffer->lock_length = 0;
+    buffer->lock_flags = 0;
+    buffer->vertices.resize(num_vertices);
+    buffer->tex_coords.resize(2 * num_vertices);
+    buffer->pixel_tex_coords = decl->elements[ALLEGRO_PRIM_TEX_COORD_PIXEL].attribute != 0;
+    buffer->uv_texture = nullptr;
+    memset(buffer->uv_key, 0, sizeof(buffer->uv_key));
+    buffer->transformed_generation = 0;
+    _convert_buffer_vertices(buffer, 0, num_vertices);
+    return buffer;
 }
 
-void al_set_new_bitmap_flags(int flags)
+void al_destroy_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer)
 {
-    _new_bitmap_flags = flags;
+    if (!buffer) {
+        return;
+    }
+    free(buffer->data);
+    delete buffer;
 }
 
-int al_get_new_bitmap_flags(void)
+void* al_lock_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer, int offset, int length, int flags)
 {
-    return _new_bitmap_flags;
+    if (!buffer || buffer->locked || offset < 0 || length <= 0 || offset + length > buffer->size) {
+        return nullptr;
+    }
+    buffer->locked = true;
+    buffer->lock_offset = offset;
+    buffer->lock_length = length;
+    buffer->lock_flags = flags;
+    return buffer->data + static_cast<size_t>(offset) * buffer->decl.stride;
 }
 
-void al_set_new_bitmap_format(int format)
+void al_unlock_vertex_buffer(ALLEGRO_VERTEX_BUFFER* buffer)
 {
-    _new_bitmap_format = format;
+    if (!buffer || !buffer->locked) {
+        return;
+    }
+    buffer->locked = false;
+    if (buffer->lock_flags != ALLEGRO_LOCK_READONLY) {
+        _convert_buffer_vertices(buffer, buffer->lock_offset, buffer->lock_length);
+    }
 }
 
-int al_get_new_bitmap_format(void)
+int al_get_vertex_buffer_size(ALLEGRO_VERTEX_BUFFER* buffer)
 {
-    return _new_bitmap_format;
+    return buffer ? buffer->size : 0;
 }
 
-bool al_is_compatible_bitmap(ALLEGRO_BITMAP* bitmap)
+static void _convert_buffer_indices(ALLEGRO_INDEX_BUFFER* buffer, int first, int count)
 {
-    if (!bitmap || !_current_display) {
-        return false;
+    for (int i = first; i < first + count; i++) {
+        if (buffer->index_size == 2) {
+            Uint16 index;
+            memcpy(&index, buffer->data + 2 * i, sizeof(index));
+            buffer->indices[i] = index;
+        } else {
+            memcpy(&buffer->indices[i], buffer->data + 4 * i, sizeof(int));
+        }
     }
-    
-    return (bitmap->flags & _new_bitmap_flags) != 0 &&
-           bitmap->format == _new_bitmap_format;
 }
 
-ALLEGRO_BITMAP* al_clone_bitmap(ALLEGRO_BITMAP* source)
+ALLEGRO_INDEX_BUFFER* al_create_index_buffer(int index_size, const void* initial_data,
+                                             int num_indices, int flags)
 {
-    if (!source) {
+    if ((index_size != 2 && index_size != 4) || num_indices <= 0) {
         return nullptr;
     }
     
-    ALLEGRO_BITMAP* bitmap = al_create_bitmap(source->width, source->height);
-    if (!bitmap) {
+    ALLEGRO_INDEX_BUFFER* buffer = new ALLEGRO_INDEX_BUFFER;
+    buffer->index_size = index_size;
+    buffer->size = num_indices;
+    buffer->flags = flags;
+    buffer->data = static_cast<char*>(calloc(num_indices, index_size));
+    if (!buffer->data) {
+        delete buffer;
         return nullptr;
     }
-    
-    if (source->texture && _current_display && _current_display->renderer) {
-        SDL_SetRenderTarget(_current_display->renderer, bitmap->texture);
-        SDL_RenderCopy(_current_display->renderer, source->texture, nullptr, nullptr);
-        SDL_SetRenderTarget(_current_display->renderer, nullptr);
+    if (initial_data) {
+        memcpy(buffer->data, initial_data, static_cast<size_t>(num_indices) * index_size);
     }
     
-    return bitmap;
+    buffer->locked = false;
+    buffer->lock_offset = 0;
+    buffer->lock_length = 0;
+    buffer->lock_flags = 0;
+    buffer->indices.resize(num_indices);
+    _convert_buffer_indices(buffer, 0, num_indices);
+    return buffer;
 }
 
-void al_convert_bitmap(ALLEGRO_BITMAP* bitmap)
+void al_destroy_index_buffer(ALLEGRO_INDEX_BUFFER* buffer)
 {
-    (void)bitmap;
+    if (!buffer) {
+        return;
+    }
+    free(buffer->data);
+    delete buffer;
 }
 
-ALLEGRO_BITMAP* al_get_backbuffer(ALLEGRO_DISPLAY* display)
+void* al_lock_index_buffer(ALLEGRO_INDEX_BUFFER* buffer, int offset, int length, int flags)
 {
-    if (!display) {
-        display = _current_display;
-    }
-    if (!display) {
+    if (!buffer || buffer->locked || offset < 0 || length <= 0 || offset + length > buffer->size) {
         return nullptr;
     }
-    
-    if (!display->backbuffer) {
-        display->backbuffer = al_create_bitmap(display->width, display->height);
-        if (display->backbuffer) {
-            static ALLEGRO_BITMAP* backbuffer_bitmap = static_cast<ALLEGRO_BITMAP*>(display->backbuffer);
-            backbuffer_bitmap->is_backbuffer = true;
-        }
+    buffer->locked = true;
+    buffer->lock_offset = offset;
+    buffer->lock_length = length;
+    buffer->lock_flags = flags;
+    return buffer->data + static_cast<size_t>(offset) * buffer->index_size;
+}
+
+void al_unlock_index_buffer(ALLEGRO_INDEX_BUFFER* buffer)
+{
+    if (!buffer || !buffer->locked) {
+        return;
+    }
+    buffer->locked = false;
+    if (buffer->lock_flags == ALLEGRO_LOCK_READONLY) {
+        return;
     }
     
-    return static_cast<ALLEGRO_BITMAP*>(display->backbuffer);
+    _convert_buffer_indices(buffer, buffer->lock_offset, buffer->lock_length);
 }
 
-void al_set_target_backbuffer(ALLEGRO_DISPLAY* display)
+int al_get_index_buffer_size(ALLEGRO_INDEX_BUFFER* buffer)
 {
-    if (!display) {
-        display = _current_display;
+    return buffer ? buffer->size : 0;
+}
+
+int al_draw_vertex_buffer(ALLEGRO_VERTEX_BUFFER* vertex_buffer, ALLEGRO_BITMAP* texture,
+                          int start, int end, int type)
+{
+    if (!vertex_buffer || vertex_buffer->locked || start < 0 || end > vertex_buffer->size || end <= start ||
+        _cull_vertex_buffer(vertex_buffer)) {
+        return 0;
+    }
+    const SDL_Vertex* verts = _buffer_draw_vertices(vertex_buffer, texture);
+    return _draw_vertex_array(verts + start, end - start, nullptr, end - start, type, texture);
+}
+
+int al_draw_indexed_buffer(ALLEGRO_VERTEX_BUFFER* vertex_buffer, ALLEGRO_BITMAP* texture,
+                           ALLEGRO_INDEX_BUFFER* index_buffer, int start, int end, int type)
+{
+    if (!vertex_buffer || !index_buffer || vertex_buffer->locked || index_buffer->locked ||
+        start < 0 || end > index_buffer->size || end <= start || _cull_vertex_buffer(vertex_buffer)) {
+        return 0;
     }
     
-    _target_bitmap = nullptr;
+    const int* indices = &index_buffer->indices[start];
+    for (int i = 0; i < end - start; i++) {
+        if (indices[i] < 0 || indices[i] >= vertex_buffer->size) {
+            return 0;
+        }
+    }
     
-    if (display && display->renderer) {
-        SDL_SetRenderTarget(display->renderer, nullptr);
+    const SDL_Vertex* verts = _buffer_draw_vertices(vertex_buffer, texture);
+    return _draw_vertex_array(verts, vertex_buffer->size, indices, end - start, type, texture);
+}
+
+bool al_install_keyboard(void)
+{
+    if (_keyboard_installed) {
+        return true;
     }
+    _keyboard_installed = true;
+    memset(_key, 0, sizeof(_key));
+    memset(_key_down_bits, 0, sizeof(_key_down_bits));
+    return true;
 }
 
-void al_draw_bitmap(ALLEGRO_BITMAP* bitmap, float dx, float dy, int flags)
+void al_uninstall_keyboard(void)
 {
-    al_draw_bitmap_region(bitmap, 0, 0, 
-        static_cast<float>(al_get_bitmap_width(bitmap)),
-        static_cast<float>(al_get_bitmap_height(bitmap)),
-        dx, dy, flags);
+    _keyboard_installed = false;
+    memset(_key, 0, sizeof(_key));
+    memset(_key_down_bits, 0, sizeof(_key_down_bits));
 }
 
-void al_draw_bitmap_region(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw, float sh, float dx, float dy, int flags)
+bool al_is_keyboard_installed(void)
+{
+    return _keyboard_installed;
+}
+
+void al_get_keyboard_state(ALLEGRO_KEYBOARD_STATE* ret_state)
 {
-    if (!bitmap || !_current_display || !_current_display->renderer) {
+    if (!ret_state) {
         return;
     }
     
-    SDL_Rect src_rect = {static_cast<int>(sx), static_cast<int>(sy), 
-                         static_cast<int>(sw), static_cast<int>(sh)};
-    SDL_Rect dst_rect = {static_cast<int>(dx), static_cast<int>(dy), 
-                         static_cast<int>(sw), static_cast<int>(sh)};
+    const Uint8* sdl_keyboard = SDL_GetKeyboardState(NULL);
     
-    SDL_RendererFlip flip = SDL_FLIP_NONE;
-    if (flags & ALLEGRO_FLIP_HORIZONTAL) {
-        flip = static_cast<SDL_RendererFlip>(flip | SDL_FLIP_HORIZONTAL);
-    }
-    if (flags & ALLEGRO_FLIP_VERTICAL) {
-        flip = static_cast<SDL_RendererFlip>(flip | SDL_FLIP_VERTICAL);
+    memset(ret_state->__key_down__internal__, 0, sizeof(ret_state->__key_down__internal__));
+    
+    for (int i = 0; i < SDL_NUM_SCANCODES && i < 512; i++) {
+        if (sdl_keyboard[i]) {
+            _key[i] = 1;
+            _key_down_bits[i / 32] |= (1 << (i % 32));
+        } else {
+            _key[i] = 0;
+            _key_down_bits[i / 32] &= ~(1 << (i % 32));
+        }
     }
     
-    SDL_RenderCopyEx(_current_display->renderer, bitmap->texture, 
-                     &src_rect, &dst_rect, 0, nullptr, flip);
+    memcpy(ret_state->__key_down__internal__, _key_down_bits, sizeof(_key_down_bits));
 }
 
-void al_draw_scaled_bitmap(ALLEGRO_BITMAP* bitmap, float sx, float sy, float sw, float sh, 
-                          float dx, float dy, float dw, float dh, int flags)
+bool al_key_down(const ALLEGRO_KEYBOARD_STATE* state, int keycode)
 {
-    if (!bitmap || !_current_display || !_current_display->renderer) {
-        return;
-    }
-    
-    SDL_Rect src_rect = {static_cast<int>(sx), static_cast<int>(sy), 
-                         static_cast<int>(sw), static_cast<int>(sh)};
-    SDL_Rect dst_rect = {static_cast<int>(dx), static_cast<int>(dy), 
-                         static_cast<int>(dw), static_cast<int>(dh)};
-    
-    SDL_RendererFlip flip = SDL_FLIP_NONE;
-    if (flags & ALLEGRO_FLIP_HORIZONTAL) {
-        flip = static_cast<SDL_RendererFlip>(flip | SDL_FLIP_HORIZONTAL);
-    }
-    if (flags & ALLEGRO_FLIP_VERTICAL) {
-        flip = static_cast<SDL_RendererFlip>(flip | SDL_FLIP_VERTICAL);
+    if (!state || keycode < 0 || keycode > ALLEGRO_KEY_MAX) {
+        return false;
     }
-    
-    SDL_RenderCopyEx(_current_display->renderer, bitmap->texture, 
-                     &src_rect, &dst_rect, 0, nullptr, flip);
+    return (state->__key_down__internal__[keycode / 32] & (1 << (keycode % 32))) != 0;
 }
 
-void al_draw_tinted_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, float dx, float dy, int flags)
+static const char* _keycode_names[] = {
+    "UNKNOWN", "ESCAPE", "1", "2", "3", "4", "5", "6", "7", "8",
+    "9", "0", "MINUS", "EQUALS", "BACKSPACE", "TAB", "Q", "W", "E", "R",
+    "T", "Y", "U", "I", "O", "P", "OPENBRACE", "CLOSEBRACE", "ENTER", "LCTRL",
+    "A", "S", "D", "F", "G", "H", "J", "K", "L", "SEMICOLON",
+    "QUOTE", "TILDE", "LSHIFT", "BACKSLASH", "Z", "X", "C", "V", "B", "N",
+    "M", "COMMA", "FULLSTOP", "SLASH", "RSHIFT", "PAD_ASTERISK", "LALT", "SPACE", "CAPSLOCK", "F1",
+    "F2", "F3", "F4", "F5", "F6", "F7", "F8", "F9", "F10", "NUMLOCK",
+    "SCROLLLOCK", "PAD_7", "PAD_8", "PAD_9", "PAD_MINUS", "PAD_4", "PAD_5", "PAD_6", "PAD_PLUS", "PAD_1",
+    "PAD_2", "PAD_3", "PAD_0", "PAD_DELETE", "F11", "F12", "PAD_ENTER", "RCTRL", "PAD_SLASH", "ALTGR",
+    "PAUSE", "HOME", "UP", "PGUP", "LEFT", "RIGHT", "END", "DOWN", "PGDN", "INSERT",
+    "DELETE", "LWIN", "RWIN", "MENU"
+};
+
+const char* al_keycode_to_name(int keycode)
 {
-    if (!bitmap || !_current_display || !_current_display->renderer) {
-        return;
+    if (keycode >= 0 && keycode <= ALLEGRO_KEY_MAX && keycode < (int)(sizeof(_keycode_names) / sizeof(_keycode_names[0]))) {
+        return _keycode_names[keycode];
     }
-    
-    SDL_SetTextureColorMod(bitmap->texture, 
-        static_cast<Uint8>(tint.r * 255),
-        static_cast<Uint8>(tint.g * 255),
-        static_cast<Uint8>(tint.b * 255));
-    SDL_SetTextureAlphaMod(bitmap->texture, static_cast<Uint8>(tint.a * 255));
-    
-    al_draw_bitmap(bitmap, dx, dy, flags);
-    
-    SDL_SetTextureColorMod(bitmap->texture, 255, 255, 255);
-    SDL_SetTextureAlphaMod(bitmap->texture, 255);
+    return "UNKNOWN";
 }
 
-void al_draw_tinted_scaled_bitmap(ALLEGRO_BITMAP* bitmap, ALLEGRO_COLOR tint, 
-                                  float sx, float sy, float sw, float sh, 
-                                  float dx, float dy, float dw, float dh, int flags)
+bool al_can_set_keyboard_leds(void)
 {
-    if (!bitmap || !_current_display || !_current_display->renderer) {
-        return;
-    }
-    
-    SDL_SetTextureColorMod(bitmap->texture, 
-        static_cast<Uint8>(tint.r * 255),
-        static_cast<Uint8>(tint.g * 255),
-        static_cast<Uint8>(tint.b * 255));
-    SDL_SetTextureAlphaMod(bitmap->texture, static_cast<Uint8>(tint.a * 255));
-    
-    al_draw_scaled_bitmap(bitmap, sx, sy, sw, sh, dx, dy, dw, dh, flags);
-    
-    SDL_SetTextureColorMod(bitmap->texture, 255, 255, 255);
-    SDL_SetTextureAlphaMod(bitmap->texture, 255);
+    return false;
 }
 
-void al_put_pixel(float x, float y, ALLEGRO_COLOR color)
+bool al_set_keyboard_leds(int leds)
 {
-    if (!_current_display || !_current_display->renderer) {
-        return;
-    }
-    
-    SDL_SetRenderDrawColor(
-        _current_display->renderer,
-        static_cast<Uint8>(color.r * 255),
-        static_cast<Uint8>(color.g * 255),
-        static_cast<Uint8>(color.b * 255),
-        static_cast<Uint8>(color.a * 255)
-    );
-    SDL_RenderDrawPoint(_current_display->renderer, static_cast<int>(x), static_cast<int>(y));
+    (void)leds;
+    return false;
 }
 
-void al_put_blended_pixel(float x, float y, ALLEGRO_COLOR color)
+ALLEGRO_EVENT_SOURCE* al_get_keyboard_event_source(void)
 {
-    al_put_pixel(x, y, color);
+    return _keyboard_installed ? &_keyboard_event_source : nullptr;
 }
 
-void al_get_pixel(ALLEGRO_BITMAP* bitmap, float x, float y, ALLEGRO_COLOR* color)
+void al_init_state(ALLEGRO_STATE* state, int flags)
 {
-    if (!color) {
+    if (!state) {
         return;
     }
-    
-    color->r = 0;
-    color->g = 0;
-    color->b = 0;
-    color->a = 1;
-    
-    if (!bitmap || !bitmap->surface) {
-        return;
+
+    memset(state, 0, sizeof(ALLEGRO_STATE));
+
+    if (flags & ALLEGRO_STATE_NEW_DISPLAY_FLAGS) {
+        state->new_display_flags = _new_display_flags;
     }
-    
-    int px = static_cast<int>(x);
-    int py = static_cast<int>(y);
-    
-    if (px < 0 || px >= bitmap->width || py < 0 || py >= bitmap->height) {
-        return;
+    if (flags & ALLEGRO_STATE_NEW_BITMAP_FLAGS) {
+        state->new_bitmap_flags = _new_bitmap_flags;
+    }
+    if (flags & ALLEGRO_STATE_NEW_BITMAP_FORMAT) {
+        state->new_bitmap_format = _new_bitmap_format;
+    }
+    if (flags & ALLEGRO_STATE_DISPLAY) {
+        state->current_display = _current_display;
+    }
+    if (flags & ALLEGRO_STATE_TARGET_BITMAP) {
+        state->target_bitmap = _target_bitmap;
+    }
+    if (flags & ALLEGRO_STATE_BLENDER) {
+        state->blender_op = _blender_op;
+        state->blender_src = _blender_src;
+        state->blender_dst = _blender_dst;
+        state->blender_alpha_op = _blender_alpha_op;
+        state->blender_alpha_src = _blender_alpha_src;
+        state->blender_alpha_dst = _blender_alpha_dst;
+    }
+    if (flags & ALLEGRO_STATE_TRANSFORM) {
+        memset(state->transform, 0, sizeof(state->transform));
+        state->transform[0] = 1.0f;
+        state->transform[5] = 1.0f;
+        state->transform[10] = 1.0f;
+        state->transform[15] = 1.0f;
     }
-    
-    Uint32* pixels = static_cast<Uint32*>(bitmap->surface->pixels);
-    Uint32 pixel = pixels[py * bitmap->surface->w + px];
-    
-    Uint8 r, g, b, a;
-    SDL_GetRGBA(pixel, bitmap->surface->format, &r, &g, &b, &a);
-    
-    color->r = r / 255.0f;
-    color->g = g / 255.0f;
-    color->b = b / 255.0f;
-    color->a = a / 255.0f;
 }
 
-void al_set_clipping_rectangle(float x, float y, float w, float h)
+void al_store_state(ALLEGRO_STATE* state, int flags)
 {
-    _clip_x = x;
-    _clip_y = y;
-    _clip_w = w;
-    _clip_h = h;
-    _clipping_initialized = true;
-    
-    if (_current_display && _current_display->renderer) {
-        SDL_Rect rect = {static_cast<int>(x), static_cast<int>(y), 
-                         static_cast<int>(w), static_cast<int>(h)};
-        SDL_RenderSetClipRect(_current_display->renderer, &rect);
-    }
+    al_init_state(state, flags);
 }
 
-void al_get_clipping_rectangle(float* x, float* y, float* w, float* h)
+void al_restore_state(ALLEGRO_STATE* state)
 {
-    if (!_clipping_initialized) {
-        if (_current_display) {
-            if (x) *x = 0;
-            if (y) *y = 0;
-            if (w) *w = _current_display->width;
-            if (h) *h = _current_display->height;
-        } else {
-            if (x) *x = 0;
-            if (y) *y = 0;
-            if (w) *w = 0;
-            if (h) *h = 0;
-        }
+    if (!state) {
         return;
     }
-    
-    if (x) *x = _clip_x;
-    if (y) *y = _clip_y;
-    if (w) *w = _clip_w;
-    if (h) *h = _clip_h;
-}
 
-void al_reset_clipping_rectangle(void)
-{
-    _clipping_initialized = false;
-    
-    if (_current_display && _current_display->renderer) {
-        SDL_RenderSetClipRect(_current_display->renderer, nullptr);
+    if (state->new_display_flags) {
+        _new_display_flags = state->new_display_flags;
+    }
+    if (state->new_bitmap_flags) {
+        _new_bitmap_flags = state->new_bitmap_flags;
+    }
+    if (state->new_bitmap_format) {
+        _new_bitmap_format = state->new_bitmap_format;
+    }
+    if (state->current_display) {
+        _current_display = state->current_display;
+    }
+    if (state->target_bitmap) {
+        al_set_target_bitmap(state->target_bitmap);
+    }
+    if (state->blender_op) {
+        al_set_separate_blender(state->blender_op, state->blender_src, state->blender_dst,
+                                state->blender_alpha_op, state->blender_alpha_src,
+                                state->blender_alpha_dst);
     }
 }
 
-static void _set_render_color(ALLEGRO_COLOR color)
+void al_identity_transform(ALLEGRO_TRANSFORM* trans)
 {
-    if (!_current_display || !_current_display->renderer) {
+    if (!trans) {
         return;
     }
-    SDL_SetRenderDrawColor(
-        _current_display->renderer,
-        static_cast<Uint8>(color.r * 255),
-        static_cast<Uint8>(color.g * 255),
-        static_cast<Uint8>(color.b * 255),
-        static_cast<Uint8>(color.a * 255)
-    );
+    memset(trans->m, 0, sizeof(trans->m));
+    trans->m[0] = 1.0f;
+    trans->m[5] = 1.0f;
+    trans->m[10] = 1.0f;
+    trans->m[15] = 1.0f;
 }
 
-void al_draw_filled_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color)
+void al_copy_transform(ALLEGRO_TRANSFORM* dest, const ALLEGRO_TRANSFORM* src)
 {
-    if (!_current_display || !_current_display->renderer) {
+    if (!dest || !src) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    int ix1 = static_cast<int>(x1);
-    int iy1 = static_cast<int>(y1);
-    int ix2 = static_cast<int>(x2);
-    int iy2 = static_cast<int>(y2);
-    
-    SDL_Rect rect = {ix1, iy1, ix2 - ix1, iy2 - iy1};
-    SDL_RenderFillRect(_current_display->renderer, &rect);
+    memcpy(dest->m, src->m, sizeof(dest->m));
 }
 
-void al_draw_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, float thickness)
+void al_use_transform(ALLEGRO_TRANSFORM* trans)
 {
-    if (!_current_display || !_current_display->renderer) {
+    if (!trans) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    int ix1 = static_cast<int>(x1);
-    int iy1 = static_cast<int>(y1);
-    int ix2 = static_cast<int>(x2);
-    int iy2 = static_cast<int>(y2);
-    
-    SDL_Rect rect = {ix1, iy1, ix2 - ix1, iy2 - iy1};
-    SDL_RenderDrawRect(_current_display->renderer, &rect);
+    /* Re-using the same matrix keeps the vertex buffers' transformed
+     * copies. The current transform itself may have been edited in place
+     * through al_get_current_transform, so it always counts as changed. */
+    if (_transform_initialized && trans != &_current_transform &&
+        memcmp(trans->m, _current_transform.m, sizeof(trans->m)) == 0) {
+        return;
+    }
+    al_copy_transform(&_current_transform, trans);
+    _transform_initialized = true;
+    _transform_kind = _classify_transform(&_current_transform);
+    _transform_generation++;
+    if (_transform_generation == 0) {
+        _transform_generation = 1;
+    }
 }
 
-void al_draw_line(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, float thickness)
+ALLEGRO_TRANSFORM* al_get_current_transform(void)
 {
-    if (!_current_display || !_current_display->renderer) {
-        return;
+    if (!_transform_initialized) {
+        al_identity_transform(&_current_transform);
+        _transform_initialized = true;
     }
-    
-    _set_render_color(color);
-    
-    SDL_RenderDrawLine(_current_display->renderer,
-        static_cast<int>(x1), static_cast<int>(y1),
-        static_cast<int>(x2), static_cast<int>(y2));
+    return &_current_transform;
 }
 
-void al_draw_circle(float cx, float cy, float r, ALLEGRO_COLOR color, float thickness)
+void al_invert_transform(ALLEGRO_TRANSFORM* trans)
 {
-    if (!_current_display || !_current_display->renderer || r <= 0) {
+    if (!trans) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    const int segments = static_cast<int>(r * 6.28);
-    const int steps = segments > 0 ? segments : 20;
-    
-    for (int i = 0; i < steps; i++) {
-        float angle1 = (static_cast<float>(i) / steps) * 6.28318f;
-        float angle2 = (static_cast<float>(i + 1) / steps) * 6.28318f;
-        
-        float x1 = cx + cosf(angle1) * r;
-        float y1 = cy + sinf(angle1) * r;
-        float x2 = cx + cosf(angle2) * r;
-        float y2 = cy + sinf(angle2) * r;
-        
-        SDL_RenderDrawLine(_current_display->renderer,
-            static_cast<int>(x1), static_cast<int>(y1),
-            static_cast<int>(x2), static_cast<int>(y2));
+
+    float m00 = trans->m[0], m01 = trans->m[1], m02 = trans->m[2], m03 = trans->m[3];
+    float m10 = trans->m[4], m11 = trans->m[5], m12 = trans->m[6], m13 = trans->m[7];
+    float m20 = trans->m[8], m21 = trans->m[9], m22 = trans->m[10], m23 = trans->m[11];
+    float m30 = trans->m[12], m31 = trans->m[13], m32 = trans->m[14], m33 = trans->m[15];
+
+    float det = m00 * (m11 * m22 * m33 + m12 * m23 * m31 + m13 * m21 * m32 - m13 * m22 * m31 - m12 * m21 * m33 - m11 * m23 * m32)
+              - m01 * (m10 * m22 * m33 + m12 * m23 * m30 + m13 * m20 * m32 - m13 * m22 * m30 - m12 * m20 * m33 - m10 * m23 * m32)
+              + m02 * (m10 * m21 * m33 + m11 * m23 * m30 + m13 * m20 * m31 - m13 * m21 * m30 - m11 * m20 * m33 - m10 * m23 * m31)
+              - m03 * (m10 * m21 * m32 + m11 * m22 * m30 + m12 * m20 * m31 - m12 * m21 * m30 - m11 * m20 * m32 - m10 * m22 * m31);
+
+    if (fabsf(det) < 1e-10) {
+        return;
     }
+
+    float inv_det = 1.0f / det;
+
+    trans->m[0] = (m11 * m22 * m33 + m12 * m23 * m31 + m13 * m21 * m32 - m13 * m22 * m31 - m12 * m21 * m33 - m11 * m23 * m32) * inv_det;
+    trans->m[1] = (m01 * m22 * m33 + m02 * m23 * m31 + m03 * m21 * m32 - m01 * m23 * m32 - m02 * m21 * m33 - m03 * m22 * m31) * inv_det;
+    trans->m[2] = (m01 * m12 * m33 + m02 * m13 * m31 + m03 * m11 * m32 - m01 * m13 * m32 - m02 * m11 * m33 - m03 * m12 * m31) * inv_det;
+    trans->m[3] = (m01 * m13 * m22 + m02 * m11 * m23 + m03 * m12 * m21 - m01 * m12 * m23 - m02 * m13 * m21 - m03 * m11 * m22) * inv_det;
+    trans->m[4] = (m10 * m23 * m32 + m12 * m20 * m33 + m13 * m22 * m30 - m10 * m22 * m33 - m12 * m23 * m30 - m13 * m20 * m32) * inv_det;
+    trans->m[5] = (m00 * m22 * m33 + m02 * m23 * m30 + m03 * m20 * m32 - m00 * m23 * m32 - m02 * m20 * m33 - m03 * m22 * m30) * inv_det;
+    trans->m[6] = (m00 * m13 * m32 + m02 * m10 * m33 + m03 * m12 * m30 - m00 * m12 * m33 - m02 * m13 * m30 - m03 * m10 * m32) * inv_det;
+    trans->m[7] = (m00 * m12 * m23 + m02 * m13 * m20 + m03 * m10 * m22 - m00 * m13 * m22 - m02 * m10 * m23 - m03 * m12 * m20) * inv_det;
+    trans->m[8] = (m10 * m21 * m33 + m11 * m23 * m30 + m13 * m20 * m31 - m10 * m23 * m31 - m11 * m20 * m33 - m13 * m21 * m30) * inv_det;
+    trans->m[9] = (m00 * m23 * m31 + m01 * m20 * m33 + m03 * m21 * m30 - m00 * m21 * m33 - m01 * m23 * m30 - m03 * m20 * m31) * inv_det;
+    trans->m[10] = (m00 * m11 * m33 + m01 * m13 * m30 + m03 * m10 * m31 - m00 * m13 * m31 - m01 * m10 * m33 - m03 * m11 * m30) * inv_det;
+    trans->m[11] = (m00 * m13 * m21 + m01 * m10 * m23 + m03 * m11 * m20 - m00 * m11 * m23 - m01 * m13 * m20 - m03 * m10 * m21) * inv_det;
+    trans->m[12] = (m10 * m22 * m31 + m11 * m20 * m32 + m12 * m21 * m30 - m10 * m21 * m32 - m11 * m22 * m30 - m12 * m20 * m31) * inv_det;
+    trans->m[13] = (m00 * m21 * m32 + m01 * m22 * m30 + m02 * m20 * m31 - m00 * m22 * m31 - m01 * m20 * m32 - m02 * m21 * m30) * inv_det;
+    trans->m[14] = (m00 * m12 * m31 + m01 * m10 * m32 + m02 * m11 * m30 - m00 * m11 * m32 - m01 * m12 * m30 - m02 * m10 * m31) * inv_det;
+    trans->m[15] = (m00 * m11 * m22 + m01 * m12 * m20 + m02 * m10 * m21 - m00 * m12 * m21 - m01 * m10 * m22 - m02 * m11 * m20) * inv_det;
 }
 
-void al_draw_filled_ellipse(float cx, float cy, float rx, float ry, ALLEGRO_COLOR color)
+int al_check_inverse(const ALLEGRO_TRANSFORM* trans)
 {
-    if (!_current_display || !_current_display->renderer || rx <= 0 || ry <= 0) {
-        return;
+    if (!trans) {
+        return 0;
     }
-    
-    _set_render_color(color);
-    
-    const int segments = static_cast<int>((rx + ry) * 3.14f);
-    const int steps = segments > 0 ? segments : 20;
-    
-    for (int i = 0; i < steps; i++) {
-        float angle1 = (static_cast<float>(i) / steps) * 6.28318f;
-        float angle2 = (static_cast<float>(i + 1) / steps) * 6.28318f;
-        
-        SDL_Vertex verts[3] = {
-            {cx, cy, 0, 0, 0, 0},
-            {cx + cosf(angle1) * rx, cy + sinf(angle1) * ry, 0, 0, 0, 0},
-            {cx + cosf(angle2) * rx, cy + sinf(angle2) * ry, 0, 0, 0, 0}
-        };
-        SDL_RenderGeometry(_current_display->renderer, nullptr, verts, 3, nullptr, 0);
+
+    float det = trans->m[0] * (trans->m[5] * trans->m[10] * trans->m[15] + trans->m[6] * trans->m[11] * trans->m[13] + trans->m[7] * trans->m[9] * trans->m[14]
+                           - trans->m[7] * trans->m[10] * trans->m[13] - trans->m[6] * trans->m[9] * trans->m[15] - trans->m[5] * trans->m[11] * trans->m[14])
+              - trans->m[1] * (trans->m[4] * trans->m[10] * trans->m[15] + trans->m[6] * trans->m[11] * trans->m[12] + trans->m[7] * trans->m[9] * trans->m[14]
+                           - trans->m[7] * trans->m[10] * trans->m[12] - trans->m[6] * trans->m[9] * trans->m[15] - trans->m[4] * trans->m[11] * trans->m[14])
+              + trans->m[2] * (trans->m[4] * trans->m[9] * trans->m[15] + trans->m[5] * trans->m[11] * trans->m[12] + trans->m[7] * trans->m[8] * trans->m[13]
+                           - trans->m[7] * trans->m[9] * trans->m[12] - trans->m[5] * trans->m[8] * trans->m[15] - trans->m[4] * trans->m[11] * trans->m[13])
+              - trans->m[3] * (trans->m[4] * trans->m[9] * trans->m[14] + trans->m[5] * trans->m[10] * trans->m[12] + trans->m[6] * trans->m[8] * trans->m[13]
+                           - trans->m[6] * trans->m[9] * trans->m[12] - trans->m[5] * trans->m[8] * trans->m[14] - trans->m[4] * trans->m[10] * trans->m[13]);
+
+    if (fabsf(det) < 1e-10) {
+        return 0;
     }
+
+    return 1;
 }
 
-void al_draw_ellipse(float cx, float cy, float rx, float ry, ALLEGRO_COLOR color, float thickness)
+void al_transform_coordinates(const ALLEGRO_TRANSFORM* trans, float* x, float* y)
 {
-    if (!_current_display || !_current_display->renderer || rx <= 0 || ry <= 0) {
+    if (!trans || !x || !y) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    const int segments = static_cast<int>((rx + ry) * 3.14f);
-    const int steps = segments > 0 ? segments : 20;
-    
-    for (int i = 0; i < steps; i++) {
-        float angle1 = (static_cast<float>(i) / steps) * 6.28318f;
-        float angle2 = (static_cast<float>(i + 1) / steps) * 6.28318f;
-        
-        float x1 = cx + cosf(angle1) * rx;
-        float y1 = cy + sinf(angle1) * ry;
-        float x2 = cx + cosf(angle2) * rx;
-        float y2 = cy + sinf(angle2) * ry;
-        
-        SDL_RenderDrawLine(_current_display->renderer,
-            static_cast<int>(x1), static_cast<int>(y1),
-            static_cast<int>(x2), static_cast<int>(y2));
+
+    float x_val = *x;
+    float y_val = *y;
+    float w = trans->m[3] * x_val + trans->m[7] * y_val + trans->m[15];
+
+    if (fabsf(w) < 1e-10) {
+        w = 1.0f;
     }
+
+    *x = (trans->m[0] * x_val + trans->m[4] * y_val + trans->m[12]) / w;
+    *y = (trans->m[1] * x_val + trans->m[5] * y_val + trans->m[13]) / w;
 }
 
-void al_draw_arc(float cx, float cy, float r, float start_angle, float delta_angle, ALLEGRO_COLOR color, float thickness)
+void al_compose_transform(ALLEGRO_TRANSFORM* dest, const ALLEGRO_TRANSFORM* src)
 {
-    if (!_current_display || !_current_display->renderer || r <= 0) {
+    if (!dest || !src) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    float end_angle = start_angle + delta_angle;
-    const int segments = static_cast<int>(r * fabs(delta_angle));
-    const int steps = segments > 2 ? segments : 10;
-    
-    for (int i = 0; i < steps; i++) {
-        float angle1 = start_angle + (static_cast<float>(i) / steps) * delta_angle;
-        float angle2 = start_angle + (static_cast<float>(i + 1) / steps) * delta_angle;
-        
-        float x1 = cx + cosf(angle1) * r;
-        float y1 = cy + sinf(angle1) * r;
-        float x2 = cx + cosf(angle2) * r;
-        float y2 = cy + sinf(angle2) * r;
-        
-        SDL_RenderDrawLine(_current_display->renderer,
-            static_cast<int>(x1), static_cast<int>(y1),
-            static_cast<int>(x2), static_cast<int>(y2));
+
+    ALLEGRO_TRANSFORM result;
+    const float* a = dest->m;
+    const float* b = src->m;
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            result.m[i * 4 + j] = a[i * 4 + 0] * b[0 * 4 + j] +
+                                   a[i * 4 + 1] * b[1 * 4 + j] +
+                                   a[i * 4 + 2] * b[2 * 4 + j] +
+                                   a[i * 4 + 3] * b[3 * 4 + j];
+        }
     }
-}
 
-void al_draw_triangle(float x1, float y1, float x2, float y2, float x3, float y3, ALLEGRO_COLOR color, float thickness)
-{
-    _set_render_color(color);
-    
-    SDL_RenderDrawLine(_current_display->renderer, static_cast<int>(x1), static_cast<int>(y1), static_cast<int>(x2), static_cast<int>(y2));
-    SDL_RenderDrawLine(_current_display->renderer, static_cast<int>(x2), static_cast<int>(y2), static_cast<int>(x3), static_cast<int>(y3));
-    SDL_RenderDrawLine(_current_display->renderer, static_cast<int>(x3), static_cast<int>(y3), static_cast<int>(x1), static_cast<int>(y1));
+    memcpy(dest->m, result.m, sizeof(dest->m));
 }
 
-void al_draw_filled_triangle(float x1, float y1, float x2, float y2, float x3, float y3, ALLEGRO_COLOR color)
+void al_translate_transform(ALLEGRO_TRANSFORM* trans, float x, float y, float z)
 {
-    if (!_current_display || !_current_display->renderer) {
+    if (!trans) {
         return;
     }
-    
-    SDL_Vertex verts[3] = {
-        {x1, y1, 0, 0, 0, 0},
-        {x2, y2, 0, 0, 0, 0},
-        {x3, y3, 0, 0, 0, 0}
-    };
-    SDL_RenderGeometry(_current_display->renderer, nullptr, verts, 3, nullptr, 0);
+
+    ALLEGRO_TRANSFORM t;
+    al_identity_transform(&t);
+    t.m[12] = x;
+    t.m[13] = y;
+    t.m[14] = z;
+
+    al_compose_transform(trans, &t);
 }
 
-void al_draw_polygon(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color, float thickness)
+void al_rotate_transform(ALLEGRO_TRANSFORM* trans, float angle)
 {
-    if (!vertices || vertex_count < 3) {
+    if (!trans) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    for (int i = 0; i < vertex_count; i++) {
-        const float* v1 = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + i * stride);
-        const float* v2 = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + ((i + 1) % vertex_count) * stride);
-        
-        SDL_RenderDrawLine(_current_display->renderer,
-            static_cast<int>(v1[0]), static_cast<int>(v1[1]),
-            static_cast<int>(v2[0]), static_cast<int>(v2[1]));
-    }
+
+    float c = cosf(angle);
+    float s = sinf(angle);
+
+    ALLEGRO_TRANSFORM r;
+    al_identity_transform(&r);
+    r.m[0] = c;
+    r.m[1] = s;
+    r.m[4] = -s;
+    r.m[5] = c;
+
+    al_compose_transform(trans, &r);
 }
 
-void al_draw_filled_polygon(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color)
+void al_scale_transform(ALLEGRO_TRANSFORM* trans, float sx, float sy, float sz)
 {
-    if (!vertices || vertex_count < 3) {
-        return;
-    }
-    
-    if (!_current_display || !_current_display->renderer) {
+    if (!trans) {
         return;
     }
-    
-    SDL_Vertex* verts = new SDL_Vertex[vertex_count];
-    int* indices = new int[vertex_count];
-    
-    for (int i = 0; i < vertex_count; i++) {
-        const float* v = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + i * stride);
-        verts[i] = {v[0], v[1], 0, 0, 0, 0};
-        indices[i] = i;
-    }
-    
-    SDL_RenderGeometry(_current_display->renderer, nullptr, verts, vertex_count, indices, vertex_count);
-    
-    delete[] verts;
-    delete[] indices;
+
+    ALLEGRO_TRANSFORM s;
+    al_identity_transform(&s);
+    s.m[0] = sx;
+    s.m[5] = sy;
+    s.m[10] = sz;
+
+    al_compose_transform(trans, &s);
 }
 
-void al_draw_polyline(const float* vertices, int vertex_count, int stride, ALLEGRO_COLOR color, float thickness, bool closed)
+void al_translate_transform_f(ALLEGRO_TRANSFORM* trans, float x, float y, float z)
 {
-    if (!vertices || vertex_count < 2) {
+    al_translate_transform(trans, x, y, z);
+}
+
+void al_rotate_transform_f(ALLEGRO_TRANSFORM* trans, float angle, float x, float y, float z)
+{
+    if (!trans) {
         return;
     }
-    
-    _set_render_color(color);
-    
-    for (int i = 0; i < vertex_count - 1; i++) {
-        const float* v1 = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + i * stride);
-        const float* v2 = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + (i + 1) * stride);
-        
-        SDL_RenderDrawLine(_current_display->renderer,
-            static_cast<int>(v1[0]), static_cast<int>(v1[1]),
-            static_cast<int>(v2[0]), static_cast<int>(v2[1]));
-    }
-    
-    if (closed && vertex_count > 2) {
-        const float* v1 = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices) + (vertex_count - 1) * stride);
-        const float* v2 = reinterpret_cast<const float*>(reinterpret_cast<const char*>(vertices));
-        
-        SDL_RenderDrawLine(_current_display->renderer,
-            static_cast<int>(v1[0]), static_cast<int>(v1[1]),
-            static_cast<int>(v2[0]), static_cast<int>(v2[1]));
+
+    if (x == 0 && y == 0 && z == 0) {
+        return;
     }
-}
 
-void al_draw_pixel(float x, float y, ALLEGRO_COLOR color)
-{
-    al_put_pixel(x, y, color);
+    float len = sqrtf(x * x + y * y + z * z);
+    x /= len;
+    y /= len;
+    z /= len;
+
+    float c = cosf(angle);
+    float s = sinf(angle);
+    float t = 1.0f - c;
+
+    ALLEGRO_TRANSFORM r;
+    al_identity_transform(&r);
+    r.m[0] = t * x * x + c;
+    r.m[1] = t * x * y + s * z;
+    r.m[2] = t * x * z - s * y;
+    r.m[4] = t * x * y - s * z;
+    r.m[5] = t * y * y + c;
+    r.m[6] = t * y * z + s * x;
+    r.m[8] = t * x * z + s * y;
+    r.m[9] = t * y * z - s * x;
+    r.m[10] = t * z * z + c;
+
+    al_compose_transform(trans, &r);
 }
 
-bool al_install_keyboard(void)
+void al_scale_transform_f(ALLEGRO_TRANSFORM* trans, float sx, float sy, float sz)
 {
-    if (_keyboard_installed) {
-        return true;
-    }
-    _keyboard_installed = true;
-    memset(_key, 0, sizeof(_key));
-    memset(_key_down_bits, 0, sizeof(_key_down_bits));
-    return true;
+    al_scale_transform(trans, sx, sy, sz);
 }
 
-void al_uninstall_keyboard(void)
+void al_set_blender(int op, int src, int dst)
 {
-    _keyboard_installed = false;
-    memset(_key, 0, sizeof(_key));
-    memset(_key_down_bits, 0, sizeof(_key_down_bits));
+    al_set_separate_blender(op, src, dst, op, src, dst);
 }
 
-bool al_is_keyboard_installed(void)
+void al_get_blender(int* op, int* src, int* dst)
 {
-    return _keyboard_installed;
+    if (op) *op = _blender_op;
+    if (src) *src = _blender_src;
+    if (dst) *dst = _blender_dst;
 }
 
-void al_get_keyboard_state(ALLEGRO_KEYBOARD_STATE* ret_state)
+/* Blenders using ALLEGRO_CONST_COLOR or ALLEGRO_INVERSE_CONST_COLOR are
+ * ignored and leave the current blender in place. */
+void al_set_separate_blender(int op, int src, int dst, int alpha_op, int src_alpha, int dst_alpha)
 {
-    if (!ret_state) {
+    if (!_blend_factor_supported(src) || !_blend_factor_supported(dst) ||
+        !_blend_factor_supported(src_alpha) || !_blend_factor_supported(dst_alpha)) {
         return;
     }
-    
-    const Uint8* sdl_keyboard = SDL_GetKeyboardState(NULL);
-    
-    memset(ret_state->__key_down__internal__, 0, sizeof(ret_state->__key_down__internal__));
-    
-    for (int i = 0; i < SDL_NUM_SCANCODES && i < 512; i++) {
-        if (sdl_keyboard[i]) {
-            _key[i] = 1;
-            _key_down_bits[i / 32] |= (1 << (i % 32));
-        } else {
-            _key[i] = 0;
-            _key_down_bits[i / 32] &= ~(1 << (i % 32));
-        }
+    if (op == _blender_op && src == _blender_src && dst == _blender_dst &&
+        alpha_op == _blender_alpha_op && src_alpha == _blender_alpha_src &&
+        dst_alpha == _blender_alpha_dst) {
+        return;
     }
     
-    memcpy(ret_state->__key_down__internal__, _key_down_bits, sizeof(_key_down_bits));
+    _flush_bitmap_batch();
+    _blender_mode_valid = false;
+    _soft_blender_valid = false;
+    _blender_op = op;
+    _blender_src = src;
+    _blender_dst = dst;
+    _blender_alpha_op = alpha_op;
+    _blender_alpha_src = src_alpha;
+    _blender_alpha_dst = dst_alpha;
 }
 
-bool al_key_down(const ALLEGRO_KEYBOARD_STATE* state, int keycode)
+void al_get_separate_blender(int* op, int* src, int* dst, int* alpha_op, int* src_alpha, int* dst_alpha)
 {
-    if (!state || keycode < 0 || keycode > ALLEGRO_KEY_MAX) {
-        return false;
-    }
-    return (state->__key_down__internal__[keycode / 32] & (1 << (keycode % 32))) != 0;
+    if (op) *op = _blender_op;
+    if (src) *src = _blender_src;
+    if (dst) *dst = _blender_dst;
+    if (alpha_op) *alpha_op = _blender_alpha_op;
+    if (src_alpha) *src_alpha = _blender_alpha_src;
+    if (dst_alpha) *dst_alpha = _blender_alpha_dst;
 }
 
-static const char* _keycode_names[] = {
-    "UNKNOWN", "ESCAPE", "1", "2", "3", "4", "5", "6", "7", "8",
-    "9", "0", "MINUS", "EQUALS", "BACKSPACE", "TAB", "Q", "W", "E", "R",
-    "T", "Y", "U", "I", "O", "P", "OPENBRACE", "CLOSEBRACE", "ENTER", "LCTRL",
-    "A", "S", "D", "F", "G", "H", "J", "K", "L", "SEMICOLON",
-    "QUOTE", "TILDE", "LSHIFT", "BACKSLASH", "Z", "X", "C", "V", "B", "N",
-    "M", "COMMA", "FULLSTOP", "SLASH", "RSHIFT", "PAD_ASTERISK", "LALT", "SPACE", "CAPSLOCK", "F1",
-    "F2", "F3", "F4", "F5", "F6", "F7", "F8", "F9", "F10", "NUMLOCK",
-    "SCROLLLOCK", "PAD_7", "PAD_8", "PAD_9", "PAD_MINUS", "PAD_4", "PAD_5", "PAD_6", "PAD_PLUS", "PAD_1",
-    "PAD_2", "PAD_3", "PAD_0", "PAD_DELETE", "F11", "F12", "PAD_ENTER", "RCTRL", "PAD_SLASH", "ALTGR",
-    "PAUSE", "HOME", "UP", "PGUP", "LEFT", "RIGHT", "END", "DOWN", "PGDN", "INSERT",
-    "DELETE", "LWIN", "RWIN", "MENU"
+/* Events live in a power-of-two ring indexed by free-running head and tail
+ * counters, so consuming never moves or copies the remaining events. The
+ * ring doubles when full. A queue with a fixed capacity drops further
+ * events once it holds max_events of them, whatever the ring's size. */
+static const unsigned int EVENT_QUEUE_INITIAL_SIZE = 64;
+
+/* The ring belongs to the thread consuming the queue. Events produced on
+ * any other thread (timer ticks, the pump thread, user event sources) are
+ * posted to a bounded lock-free ingress ring instead, Vyukov style:
+ * producers claim a cell by advancing ingress_tail with a CAS and publish
+ * it by bumping the cell's sequence number, and the consumer moves
+ * published cells into the ring at every queue entry point. An event
+ * posted to a full ingress is dropped. */
+static const unsigned int EVENT_INGRESS_SIZE = 1024;
+
+struct EventIngressCell {
+    SDL_atomic_t sequence;
+    ALLEGRO_EVENT event;
 };
 
-const char* al_keycode_to_name(int keycode)
-{
-    if (keycode >= 0 && keycode <= ALLEGRO_KEY_MAX && keycode < (int)(sizeof(_keycode_names) / sizeof(_keycode_names[0]))) {
-        return _keycode_names[keycode];
-    }
-    return "UNKNOWN";
-}
+/* What the consumer is blocked in, so a producer wakes it only when it is
+ * actually waiting, and at most once per wait. */
+enum {
+    EVENT_QUEUE_RUNNING,
+    EVENT_QUEUE_WAITING_COND,
+    EVENT_QUEUE_WAITING_SDL
+};
 
-bool al_can_set_keyboard_leds(void)
-{
-    return false;
-}
+struct ALLEGRO_EVENT_QUEUE {
+    std::vector<ALLEGRO_EVENT> events;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int max_events;
+    std::vector<ALLEGRO_EVENT_SOURCE*> sources;
+    EventIngressCell* ingress;
+    SDL_atomic_t ingress_tail;
+    unsigned int ingress_head;
+    SDL_atomic_t waiting;
+    SDL_mutex* wait_mutex;
+    SDL_cond* wait_cond;
+    std::vector<ALLEGRO_EVENT_SOURCE*> purged;
+    SDL_atomic_t purge_pending;
+};
 
-bool al_set_keyboard_leds(int leds)
-{
-    (void)leds;
-    return false;
-}
+/* The queues subscribed to a source, as an immutable snapshot. The source
+ * holds one reference and every emitter holds another while it posts, so
+ * a snapshot that has been swapped out stays valid until its last emitter
+ * lets go; retired marks it as waiting for that. */
+struct EventSubscribers {
+    SDL_atomic_t refcount;
+    SDL_atomic_t retired;
+    int count;
+    ALLEGRO_EVENT_QUEUE* queues[1];
+};
 
-void* al_get_keyboard_event_source(void)
-{
-    return nullptr;
-}
+/* ALLEGRO_EVENT_SOURCE is opaque padding holding the source's current
+ * subscriber snapshot; a zeroed source has none. Events are only delivered
+ * to those queues, and an SDL event whose source has no subscribers is
+ * dropped before it is translated. The spinlock is held only to swap the
+ * snapshot or to take a reference on it; posting and waking queues happen
+ * after it is released. */
+struct EventSourceData {
+    EventSubscribers* subscribers;
+    SDL_SpinLock lock;
+};
 
-static int _blender_op = ALLEGRO_ADD;
-static int _blender_src = ALLEGRO_ALPHA;
-static int _blender_dst = ALLEGRO_INVERSE_ALPHA;
-static int _blender_alpha_op = ALLEGRO_ADD;
-static int _blender_alpha_src = ALLEGRO_ALPHA;
-static int _blender_alpha_dst = ALLEGRO_INVERSE_ALPHA;
+static_assert(sizeof(EventSourceData) <= sizeof(ALLEGRO_EVENT_SOURCE),
+              "EventSourceData must fit in ALLEGRO_EVENT_SOURCE");
+static_assert(alignof(EventSourceData) <= alignof(ALLEGRO_EVENT_SOURCE),
+              "ALLEGRO_EVENT_SOURCE must be aligned for EventSourceData");
+
+/* User events emitted with a destructor share this descriptor; every queued
+ * copy holds a reference and the destructor runs when the last one goes. */
+struct ALLEGRO_USER_EVENT_DESCRIPTOR {
+    SDL_atomic_t refcount;
+    void (*dtor)(ALLEGRO_USER_EVENT* event);
+    ALLEGRO_USER_EVENT event;
+};
 
-void al_init_state(ALLEGRO_STATE* state, int flags)
-{
-    if (!state) {
-        return;
-    }
+/* A consumer on the main thread waits in SDL_WaitEventTimeout for OS
+ * events, with its queue in _sdl_waiter; every other waiter sleeps on its
+ * own queue's condition. A producer wakes the SDL waiter by pushing an SDL
+ * user event of this type naming the queue in data1. Any other thread that
+ * pulls it off SDL's queue pushes it back while that queue is still the
+ * SDL waiter, so the wakeup always reaches its queue. It translates to
+ * nothing. */
+static Uint32 _wake_event_type = 0;
+static void* _sdl_waiter = nullptr;
 
-    memset(state, 0, sizeof(ALLEGRO_STATE));
+/* Serializes subscriber updates; a writer that retires a snapshot waits
+ * on _subscribers_cond until the emitters still using it are done. */
+static SDL_mutex* _subscribers_mutex = nullptr;
+static SDL_cond* _subscribers_cond = nullptr;
 
-    if (flags & ALLEGRO_STATE_NEW_DISPLAY_FLAGS) {
-        state->new_display_flags = _new_display_flags;
-    }
-    if (flags & ALLEGRO_STATE_NEW_BITMAP_FLAGS) {
-        state->new_bitmap_flags = _new_bitmap_flags;
-    }
-    if (flags & ALLEGRO_STATE_NEW_BITMAP_FORMAT) {
-        state->new_bitmap_format = _new_bitmap_format;
-    }
-    if (flags & ALLEGRO_STATE_DISPLAY) {
-        state->current_display = _current_display;
-    }
-    if (flags & ALLEGRO_STATE_TARGET_BITMAP) {
-        state->target_bitmap = _target_bitmap;
-    }
-    if (flags & ALLEGRO_STATE_BLENDER) {
-        state->blender_op = _blender_op;
-        state->blender_src = _blender_src;
-        state->blender_dst = _blender_dst;
-        state->blender_alpha_op = _blender_alpha_op;
-        state->blender_alpha_src = _blender_alpha_src;
-        state->blender_alpha_dst = _blender_alpha_dst;
-    }
-    if (flags & ALLEGRO_STATE_TRANSFORM) {
-        memset(state->transform, 0, sizeof(state->transform));
-        state->transform[0] = 1.0f;
-        state->transform[5] = 1.0f;
-        state->transform[10] = 1.0f;
-        state->transform[15] = 1.0f;
-    }
+static EventSourceData* _event_source_data(ALLEGRO_EVENT_SOURCE* source)
+{
+    return reinterpret_cast<EventSourceData*>(source);
 }
 
-void al_store_state(ALLEGRO_STATE* state, int flags)
+/* The source's current subscribers with a reference taken, or null when
+ * nobody listens; pair with _release_subscribers. */
+static EventSubscribers* _acquire_subscribers(ALLEGRO_EVENT_SOURCE* source)
 {
-    al_init_state(state, flags);
+    if (!source) {
+        return nullptr;
+    }
+    EventSourceData* data = _event_source_data(source);
+    SDL_AtomicLock(&data->lock);
+    EventSubscribers* subscribers = data->subscribers;
+    if (subscribers) {
+        SDL_AtomicAdd(&subscribers->refcount, 1);
+    }
+    SDL_AtomicUnlock(&data->lock);
+    return subscribers;
 }
 
-void al_restore_state(ALLEGRO_STATE* state)
+/* Only the last emitter of a retired snapshot takes the mutex, to wake
+ * the writer waiting to free it. */
+static void _release_subscribers(EventSubscribers* subscribers)
 {
-    if (!state) {
-        return;
+    if (subscribers && SDL_AtomicAdd(&subscribers->refcount, -1) == 2 &&
+        SDL_AtomicGet(&subscribers->retired)) {
+        SDL_LockMutex(_subscribers_mutex);
+        SDL_CondBroadcast(_subscribers_cond);
+        SDL_UnlockMutex(_subscribers_mutex);
     }
+}
 
-    if (state->new_display_flags) {
-        _new_display_flags = state->new_display_flags;
-    }
-    if (state->new_bitmap_flags) {
-        _new_bitmap_flags = state->new_bitmap_flags;
+/* Publishes a snapshot with queue added to or removed from the source's
+ * subscribers, then frees the old one once no emitter uses it any more,
+ * so a queue is never posted to after it has been detached. */
+static bool _update_subscribers(ALLEGRO_EVENT_SOURCE* source, ALLEGRO_EVENT_QUEUE* queue, bool add)
+{
+    EventSourceData* data = _event_source_data(source);
+    SDL_LockMutex(_subscribers_mutex);
+    EventSubscribers* old = data->subscribers;
+    int count = old ? old->count : 0;
+    EventSubscribers* subscribers = static_cast<EventSubscribers*>(
+        malloc(sizeof(EventSubscribers) + count * sizeof(ALLEGRO_EVENT_QUEUE*)));
+    if (!subscribers) {
+        SDL_UnlockMutex(_subscribers_mutex);
+        return false;
     }
-    if (state->new_bitmap_format) {
-        _new_bitmap_format = state->new_bitmap_format;
+    SDL_AtomicSet(&subscribers->refcount, 1);
+    SDL_AtomicSet(&subscribers->retired, 0);
+    subscribers->count = 0;
+    for (int i = 0; i < count; i++) {
+        if (old->queues[i] != queue) {
+            subscribers->queues[subscribers->count++] = old->queues[i];
+        }
     }
-    if (state->current_display) {
-        _current_display = state->current_display;
+    if (add) {
+        subscribers->queues[subscribers->count++] = queue;
     }
-    if (state->target_bitmap) {
-        al_set_target_bitmap(state->target_bitmap);
+    if (subscribers->count == 0) {
+        free(subscribers);
+        subscribers = nullptr;
     }
-    if (state->blender_op) {
-        _blender_op = state->blender_op;
-        _blender_src = state->blender_src;
-        _blender_dst = state->blender_dst;
-        _blender_alpha_op = state->blender_alpha_op;
-        _blender_alpha_src = state->blender_alpha_src;
-        _blender_alpha_dst = state->blender_alpha_dst;
+
+    SDL_AtomicLock(&data->lock);
+    data->subscribers = subscribers;
+    SDL_AtomicUnlock(&data->lock);
+
+    if (old) {
+        SDL_AtomicSet(&old->retired, 1);
+        while (SDL_AtomicGet(&old->refcount) > 1) {
+            SDL_CondWait(_subscribers_cond, _subscribers_mutex);
+        }
+        free(old);
     }
+    SDL_UnlockMutex(_subscribers_mutex);
+    return true;
 }
 
-static ALLEGRO_TRANSFORM _current_transform;
-static bool _transform_initialized = false;
+static unsigned int _event_queue_count(const ALLEGRO_EVENT_QUEUE* queue)
+{
+    return queue->tail - queue->head;
+}
 
-void al_identity_transform(ALLEGRO_TRANSFORM* trans)
+static void _event_queue_grow(ALLEGRO_EVENT_QUEUE* queue)
 {
-    if (!trans) {
-        return;
+    unsigned int size = static_cast<unsigned int>(queue->events.size());
+    std::vector<ALLEGRO_EVENT> events(size ? size * 2 : EVENT_QUEUE_INITIAL_SIZE);
+    unsigned int count = _event_queue_count(queue);
+    for (unsigned int i = 0; i < count; i++) {
+        events[i] = queue->events[(queue->head + i) & (size - 1)];
     }
-    memset(trans->m, 0, sizeof(trans->m));
-    trans->m[0] = 1.0f;
-    trans->m[5] = 1.0f;
-    trans->m[10] = 1.0f;
-    trans->m[15] = 1.0f;
+    queue->events.swap(events);
+    queue->head = 0;
+    queue->tail = count;
 }
 
-void al_copy_transform(ALLEGRO_TRANSFORM* dest, const ALLEGRO_TRANSFORM* src)
+static void _retain_event(const ALLEGRO_EVENT* event)
 {
-    if (!dest || !src) {
-        return;
+    if (ALLEGRO_EVENT_TYPE_IS_USER(event->type) && event->user.__internal__descr) {
+        SDL_AtomicAdd(&event->user.__internal__descr->refcount, 1);
     }
-    memcpy(dest->m, src->m, sizeof(dest->m));
 }
 
-void al_use_transform(ALLEGRO_TRANSFORM* trans)
+static void _release_user_event(ALLEGRO_USER_EVENT_DESCRIPTOR* descr)
 {
-    if (!trans) {
-        return;
+    if (descr && SDL_AtomicAdd(&descr->refcount, -1) == 1) {
+        descr->dtor(&descr->event);
+        delete descr;
     }
-    al_copy_transform(&_current_transform, trans);
-    _transform_initialized = true;
 }
 
-ALLEGRO_TRANSFORM* al_get_current_transform(void)
+/* Drops the reference a discarded copy holds on its user event. */
+static void _release_event(const ALLEGRO_EVENT* event)
 {
-    if (!_transform_initialized) {
-        al_identity_transform(&_current_transform);
-        _transform_initialized = true;
+    if (ALLEGRO_EVENT_TYPE_IS_USER(event->type)) {
+        _release_user_event(event->user.__internal__descr);
     }
-    return &_current_transform;
 }
 
-void al_invert_transform(ALLEGRO_TRANSFORM* trans)
+static bool _event_queue_push(ALLEGRO_EVENT_QUEUE* queue, const ALLEGRO_EVENT* event)
 {
-    if (!trans) {
-        return;
+    unsigned int count = _event_queue_count(queue);
+    if (queue->max_events && count >= queue->max_events) {
+        _release_event(event);
+        return false;
     }
+    if (count == queue->events.size()) {
+        _event_queue_grow(queue);
+    }
+    unsigned int mask = static_cast<unsigned int>(queue->events.size()) - 1;
+    queue->events[queue->tail & mask] = *event;
+    queue->tail++;
+    return true;
+}
 
-    float m00 = trans->m[0], m01 = trans->m[1], m02 = trans->m[2], m03 = trans->m[3];
-    float m10 = trans->m[4], m11 = trans->m[5], m12 = trans->m[6], m13 = trans->m[7];
-    float m20 = trans->m[8], m21 = trans->m[9], m22 = trans->m[10], m23 = trans->m[11];
-    float m30 = trans->m[12], m31 = trans->m[13], m32 = trans->m[14], m33 = trans->m[15];
+/* Ingress positions and sequence numbers are free-running and compared
+ * modulo 2^32, so they are kept as unsigned while SDL stores them as int. */
+static unsigned int _atomic_get_unsigned(SDL_atomic_t* atomic)
+{
+    return static_cast<unsigned int>(SDL_AtomicGet(atomic));
+}
 
-    float det = m00 * (m11 * m22 * m33 + m12 * m23 * m31 + m13 * m21 * m32 - m13 * m22 * m31 - m12 * m21 * m33 - m11 * m23 * m32)
-              - m01 * (m10 * m22 * m33 + m12 * m23 * m30 + m13 * m20 * m32 - m13 * m22 * m30 - m12 * m20 * m33 - m10 * m23 * m32)
-              + m02 * (m10 * m21 * m33 + m11 * m23 * m30 + m13 * m20 * m31 - m13 * m21 * m30 - m11 * m20 * m33 - m10 * m23 * m31)
-              - m03 * (m10 * m21 * m32 + m11 * m22 * m30 + m12 * m20 * m31 - m12 * m21 * m30 - m11 * m20 * m32 - m10 * m22 * m31);
+static EventIngressCell* _event_ingress_cell(ALLEGRO_EVENT_QUEUE* queue, unsigned int pos)
+{
+    return &queue->ingress[pos & (EVENT_INGRESS_SIZE - 1)];
+}
 
-    if (fabsf(det) < 1e-10) {
-        return;
+/* Wakes the consumer if it is blocked; the CAS makes only the first
+ * producer after it went to sleep pay for the wakeup. */
+static void _wake_event_queue(ALLEGRO_EVENT_QUEUE* queue)
+{
+    if (SDL_AtomicCAS(&queue->waiting, EVENT_QUEUE_WAITING_COND, EVENT_QUEUE_RUNNING)) {
+        SDL_LockMutex(queue->wait_mutex);
+        SDL_CondSignal(queue->wait_cond);
+        SDL_UnlockMutex(queue->wait_mutex);
+    } else if (SDL_AtomicCAS(&queue->waiting, EVENT_QUEUE_WAITING_SDL, EVENT_QUEUE_RUNNING)) {
+        SDL_Event wake;
+        memset(&wake, 0, sizeof(wake));
+        wake.type = _wake_event_type;
+        wake.user.data1 = queue;
+        SDL_PushEvent(&wake);
     }
+}
 
-    float inv_det = 1.0f / det;
+/* Posts from any thread, claiming a cell with a CAS; fails when the
+ * ingress is full. Waking a sleeping consumer afterwards takes its wait
+ * mutex, or pushes an SDL event, only when it is actually asleep. */
+static bool _event_ingress_post(ALLEGRO_EVENT_QUEUE* queue, const ALLEGRO_EVENT* event)
+{
+    unsigned int pos = _atomic_get_unsigned(&queue->ingress_tail);
+    EventIngressCell* cell;
+    for (;;) {
+        cell = _event_ingress_cell(queue, pos);
+        int diff = static_cast<int>(_atomic_get_unsigned(&cell->sequence) - pos);
+        if (diff == 0) {
+            if (SDL_AtomicCAS(&queue->ingress_tail, static_cast<int>(pos), static_cast<int>(pos + 1))) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        }
+        pos = _atomic_get_unsigned(&queue->ingress_tail);
+    }
 
-    trans->m[0] = (m11 * m22 * m33 + m12 * m23 * m31 + m13 * m21 * m32 - m13 * m22 * m31 - m12 * m21 * m33 - m11 * m23 * m32) * inv_det;
-    trans->m[1] = (m01 * m22 * m33 + m02 * m23 * m31 + m03 * m21 * m32 - m01 * m23 * m32 - m02 * m21 * m33 - m03 * m22 * m31) * inv_det;
-    trans->m[2] = (m01 * m12 * m33 + m02 * m13 * m31 + m03 * m11 * m32 - m01 * m13 * m32 - m02 * m11 * m33 - m03 * m12 * m31) * inv_det;
-    trans->m[3] = (m01 * m13 * m22 + m02 * m11 * m23 + m03 * m12 * m21 - m01 * m12 * m23 - m02 * m13 * m21 - m03 * m11 * m22) * inv_det;
-    trans->m[4] = (m10 * m23 * m32 + m12 * m20 * m33 + m13 * m22 * m30 - m10 * m22 * m33 - m12 * m23 * m30 - m13 * m20 * m32) * inv_det;
-    trans->m[5] = (m00 * m22 * m33 + m02 * m23 * m30 + m03 * m20 * m32 - m00 * m23 * m32 - m02 * m20 * m33 - m03 * m22 * m30) * inv_det;
-    trans->m[6] = (m00 * m13 * m32 + m02 * m10 * m33 + m03 * m12 * m30 - m00 * m12 * m33 - m02 * m13 * m30 - m03 * m10 * m32) * inv_det;
-    trans->m[7] = (m00 * m12 * m23 + m02 * m13 * m20 + m03 * m10 * m22 - m00 * m13 * m22 - m02 * m10 * m23 - m03 * m12 * m20) * inv_det;
-    trans->m[8] = (m10 * m21 * m33 + m11 * m23 * m30 + m13 * m20 * m31 - m10 * m23 * m31 - m11 * m20 * m33 - m13 * m21 * m30) * inv_det;
-    trans->m[9] = (m00 * m23 * m31 + m01 * m20 * m33 + m03 * m21 * m30 - m00 * m21 * m33 - m01 * m23 * m30 - m03 * m20 * m31) * inv_det;
-    trans->m[10] = (m00 * m11 * m33 + m01 * m13 * m30 + m03 * m10 * m31 - m00 * m13 * m31 - m01 * m10 * m33 - m03 * m11 * m30) * inv_det;
-    trans->m[11] = (m00 * m13 * m21 + m01 * m10 * m23 + m03 * m11 * m20 - m00 * m11 * m23 - m01 * m13 * m20 - m03 * m10 * m21) * inv_det;
-    trans->m[12] = (m10 * m22 * m31 + m11 * m20 * m32 + m12 * m21 * m30 - m10 * m21 * m32 - m11 * m22 * m30 - m12 * m20 * m31) * inv_det;
-    trans->m[13] = (m00 * m21 * m32 + m01 * m22 * m30 + m02 * m20 * m31 - m00 * m22 * m31 - m01 * m20 * m32 - m02 * m21 * m30) * inv_det;
-    trans->m[14] = (m00 * m12 * m31 + m01 * m10 * m32 + m02 * m11 * m30 - m00 * m11 * m32 - m01 * m12 * m30 - m02 * m10 * m31) * inv_det;
-    trans->m[15] = (m00 * m11 * m22 + m01 * m12 * m20 + m02 * m10 * m21 - m00 * m12 * m21 - m01 * m10 * m22 - m02 * m11 * m20) * inv_det;
+    cell->event = *event;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&cell->sequence, static_cast<int>(pos + 1));
+    _wake_event_queue(queue);
+    return true;
 }
 
-int al_check_inverse(const ALLEGRO_TRANSFORM* trans)
+static bool _event_ingress_ready(ALLEGRO_EVENT_QUEUE* queue)
 {
-    if (!trans) {
-        return 0;
+    unsigned int pos = queue->ingress_head;
+    return _atomic_get_unsigned(&_event_ingress_cell(queue, pos)->sequence) == pos + 1;
+}
+
+/* Moves every published ingress event into the ring; consumer only. */
+static void _event_ingress_drain(ALLEGRO_EVENT_QUEUE* queue)
+{
+    while (_event_ingress_ready(queue)) {
+        unsigned int pos = queue->ingress_head;
+        EventIngressCell* cell = _event_ingress_cell(queue, pos);
+        SDL_MemoryBarrierAcquire();
+        _event_queue_push(queue, &cell->event);
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&cell->sequence, static_cast<int>(pos + EVENT_INGRESS_SIZE));
+        queue->ingress_head = pos + 1;
     }
+}
 
-    float det = trans->m[0] * (trans->m[5] * trans->m[10] * trans->m[15] + trans->m[6] * trans->m[11] * trans->m[13] + trans->m[7] * trans->m[9] * trans->m[14]
-                           - trans->m[7] * trans->m[10] * trans->m[13] - trans->m[6] * trans->m[9] * trans->m[15] - trans->m[5] * trans->m[11] * trans->m[14])
-              - trans->m[1] * (trans->m[4] * trans->m[10] * trans->m[15] + trans->m[6] * trans->m[11] * trans->m[12] + trans->m[7] * trans->m[9] * trans->m[14]
-                           - trans->m[7] * trans->m[10] * trans->m[12] - trans->m[6] * trans->m[9] * trans->m[15] - trans->m[4] * trans->m[11] * trans->m[14])
-              + trans->m[2] * (trans->m[4] * trans->m[9] * trans->m[15] + trans->m[5] * trans->m[11] * trans->m[12] + trans->m[7] * trans->m[8] * trans->m[13]
-                           - trans->m[7] * trans->m[9] * trans->m[12] - trans->m[5] * trans->m[8] * trans->m[15] - trans->m[4] * trans->m[11] * trans->m[13])
-              - trans->m[3] * (trans->m[4] * trans->m[9] * trans->m[14] + trans->m[5] * trans->m[10] * trans->m[12] + trans->m[6] * trans->m[8] * trans->m[13]
-                           - trans->m[6] * trans->m[9] * trans->m[12] - trans->m[5] * trans->m[8] * trans->m[14] - trans->m[4] * trans->m[10] * trans->m[13]);
+static const ALLEGRO_EVENT* _event_queue_front(const ALLEGRO_EVENT_QUEUE* queue)
+{
+    if (queue->head == queue->tail) {
+        return nullptr;
+    }
+    unsigned int mask = static_cast<unsigned int>(queue->events.size()) - 1;
+    return &queue->events[queue->head & mask];
+}
 
-    if (fabsf(det) < 1e-10) {
-        return 0;
+ALLEGRO_EVENT_QUEUE* al_create_event_queue(void)
+{
+    ALLEGRO_EVENT_QUEUE* queue = new ALLEGRO_EVENT_QUEUE;
+    if (!queue) {
+        return nullptr;
+    }
+    queue->head = 0;
+    queue->tail = 0;
+    queue->max_events = 0;
+    queue->ingress = new EventIngressCell[EVENT_INGRESS_SIZE];
+    for (unsigned int i = 0; i < EVENT_INGRESS_SIZE; i++) {
+        SDL_AtomicSet(&queue->ingress[i].sequence, static_cast<int>(i));
+    }
+    SDL_AtomicSet(&queue->ingress_tail, 0);
+    queue->ingress_head = 0;
+    SDL_AtomicSet(&queue->waiting, EVENT_QUEUE_RUNNING);
+    SDL_AtomicSet(&queue->purge_pending, 0);
+    queue->wait_mutex = SDL_CreateMutex();
+    queue->wait_cond = SDL_CreateCond();
+    if (!queue->wait_mutex || !queue->wait_cond) {
+        SDL_DestroyCond(queue->wait_cond);
+        SDL_DestroyMutex(queue->wait_mutex);
+        delete[] queue->ingress;
+        delete queue;
+        return nullptr;
     }
 
-    return 1;
+    if (!_wake_event_type) {
+        Uint32 type = SDL_RegisterEvents(1);
+        _wake_event_type = type != static_cast<Uint32>(-1) ? type : 0;
+    }
+    if (!_subscribers_mutex) {
+        _subscribers_mutex = SDL_CreateMutex();
+        _subscribers_cond = SDL_CreateCond();
+    }
+    if (!_event_main_thread) {
+        _event_main_thread = SDL_ThreadID();
+    }
+    return queue;
 }
 
-void al_transform_coordinates(const ALLEGRO_TRANSFORM* trans, float* x, float* y)
+void al_destroy_event_queue(ALLEGRO_EVENT_QUEUE* queue)
 {
-    if (!trans || !x || !y) {
+    if (!queue) {
         return;
     }
+    while (!queue->sources.empty()) {
+        al_unregister_event_source(queue, queue->sources.back());
+    }
+    al_flush_event_queue(queue);
+    SDL_DestroyCond(queue->wait_cond);
+    SDL_DestroyMutex(queue->wait_mutex);
+    delete[] queue->ingress;
+    delete queue;
+}
 
-    float x_val = *x;
-    float y_val = *y;
-    float w = trans->m[3] * x_val + trans->m[7] * y_val + trans->m[15];
-
-    if (fabsf(w) < 1e-10) {
-        w = 1.0f;
+bool al_set_event_queue_capacity(ALLEGRO_EVENT_QUEUE* queue, int max_events)
+{
+    if (!queue || max_events < 0) {
+        return false;
     }
+    
+    queue->max_events = static_cast<unsigned int>(max_events);
+    return true;
+}
 
-    *x = (trans->m[0] * x_val + trans->m[4] * y_val + trans->m[12]) / w;
-    *y = (trans->m[1] * x_val + trans->m[5] * y_val + trans->m[13]) / w;
+/* Delivers a copy of the event to every queue in a subscriber snapshot
+ * of the source and returns how many took it. consumer is the queue whose
+ * own thread is emitting, if any; only its ring is pushed to directly, and
+ * every other queue gets the event through its ingress. */
+static int _post_event(const EventSubscribers* subscribers, ALLEGRO_EVENT_SOURCE* source,
+                       ALLEGRO_EVENT* event, ALLEGRO_EVENT_QUEUE* consumer)
+{
+    event->source = source;
+    int delivered = 0;
+    for (int i = 0; i < subscribers->count; i++) {
+        ALLEGRO_EVENT_QUEUE* queue = subscribers->queues[i];
+        _retain_event(event);
+        if (queue == consumer) {
+            if (_event_queue_push(queue, event)) {
+                delivered++;
+            }
+        } else if (_event_ingress_post(queue, event)) {
+            delivered++;
+        } else {
+            _release_event(event);
+        }
+    }
+    return delivered;
 }
 
-void al_compose_transform(ALLEGRO_TRANSFORM* dest, const ALLEGRO_TRANSFORM* src)
+static int _emit_event(ALLEGRO_EVENT_SOURCE* source, ALLEGRO_EVENT* event,
+                       ALLEGRO_EVENT_QUEUE* consumer)
 {
-    if (!dest || !src) {
-        return;
+    EventSubscribers* subscribers = _acquire_subscribers(source);
+    if (!subscribers) {
+        return 0;
     }
+    int delivered = _post_event(subscribers, source, event, consumer);
+    _release_subscribers(subscribers);
+    return delivered;
+}
 
-    ALLEGRO_TRANSFORM result;
-    const float* a = dest->m;
-    const float* b = src->m;
-
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            result.m[i * 4 + j] = a[i * 4 + 0] * b[0 * 4 + j] +
-                                   a[i * 4 + 1] * b[1 * 4 + j] +
-                                   a[i * 4 + 2] * b[2 * 4 + j] +
-                                   a[i * 4 + 3] * b[3 * 4 + j];
+/* Removes the pending events of one source, keeping the rest in order;
+ * consumer only. */
+static void _event_queue_purge(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT_SOURCE* source)
+{
+    _event_ingress_drain(queue);
+    unsigned int mask = static_cast<unsigned int>(queue->events.size()) - 1;
+    unsigned int out = queue->head;
+    for (unsigned int i = queue->head; i != queue->tail; i++) {
+        const ALLEGRO_EVENT& event = queue->events[i & mask];
+        if (event.source != source) {
+            queue->events[out & mask] = event;
+            out++;
+        } else {
+            _release_event(&event);
         }
     }
+    queue->tail = out;
+}
 
-    memcpy(dest->m, result.m, sizeof(dest->m));
+/* Sources may be unregistered from any thread, so their events are
+ * purged by the consumer the next time it enters the queue. */
+static void _event_queue_defer_purge(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT_SOURCE* source)
+{
+    SDL_LockMutex(queue->wait_mutex);
+    queue->purged.push_back(source);
+    SDL_AtomicSet(&queue->purge_pending, 1);
+    SDL_UnlockMutex(queue->wait_mutex);
 }
 
-void al_translate_transform(ALLEGRO_TRANSFORM* trans, float x, float y, float z)
+static void _event_queue_apply_purges(ALLEGRO_EVENT_QUEUE* queue)
 {
-    if (!trans) {
+    if (!SDL_AtomicGet(&queue->purge_pending)) {
         return;
     }
+    std::vector<ALLEGRO_EVENT_SOURCE*> purged;
+    SDL_LockMutex(queue->wait_mutex);
+    purged.swap(queue->purged);
+    SDL_AtomicSet(&queue->purge_pending, 0);
+    SDL_UnlockMutex(queue->wait_mutex);
+    
+    for (size_t i = 0; i < purged.size(); i++) {
+        _event_queue_purge(queue, purged[i]);
+    }
+}
 
-    ALLEGRO_TRANSFORM t;
-    al_identity_transform(&t);
-    t.m[12] = x;
-    t.m[13] = y;
-    t.m[14] = z;
+/* SDL events are translated in one place, the pump, and delivered to the
+ * subscribed queues. Every queue entry point runs the pump first: on the
+ * main thread it moves OS events into SDL's queue, and on any thread it
+ * takes the events already there and translates them. When the pump
+ * thread is running only the main thread takes events, and hands them to
+ * the pump thread through _event_pump_handoff; the pump thread sleeps on
+ * _event_pump_cond, translates what it is given and posts through the
+ * ingress rings, and never calls into SDL's event loop itself. */
+static const int EVENT_PUMP_BATCH = 64;
 
-    al_compose_transform(trans, &t);
+static SDL_Thread* _event_pump_thread = nullptr;
+static bool _event_pump_stop = false;
+static SDL_mutex* _event_pump_mutex = nullptr;
+static SDL_cond* _event_pump_cond = nullptr;
+static std::vector<SDL_Event> _event_pump_handoff;
+
+static ALLEGRO_EVENT_SOURCE* _keyboard_source(const SDL_Event* event)
+{
+    (void)event;
+    return _keyboard_installed ? &_keyboard_event_source : nullptr;
 }
 
-void al_rotate_transform(ALLEGRO_TRANSFORM* trans, float angle)
+static ALLEGRO_EVENT_SOURCE* _mouse_source(const SDL_Event* event)
 {
-    if (!trans) {
-        return;
-    }
+    (void)event;
+    return _mouse_installed ? &_mouse_event_source : nullptr;
+}
 
-    float c = cosf(angle);
-    float s = sinf(angle);
+static ALLEGRO_EVENT_SOURCE* _joystick_source(const SDL_Event* event)
+{
+    (void)event;
+    return _joystick_installed ? &_joystick_event_source : nullptr;
+}
 
-    ALLEGRO_TRANSFORM r;
-    al_identity_transform(&r);
-    r.m[0] = c;
-    r.m[1] = s;
-    r.m[4] = -s;
-    r.m[5] = c;
+/* The display owning an SDL window; the caller holds _displays_lock. */
+static ALLEGRO_DISPLAY* _display_for_window(Uint32 window_id)
+{
+    for (size_t i = 0; i < _displays.size(); i++) {
+        if (_displays[i]->window_id == window_id) {
+            return _displays[i];
+        }
+    }
+    return nullptr;
+}
 
-    al_compose_transform(trans, &r);
+/* The window an input or window event happened in, 0 when it has none. */
+static Uint32 _event_window_id(const SDL_Event* event)
+{
+    switch (event->type) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            return event->key.windowID;
+        case SDL_TEXTINPUT:
+            return event->text.windowID;
+        case SDL_MOUSEMOTION:
+            return event->motion.windowID;
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            return event->button.windowID;
+        case SDL_MOUSEWHEEL:
+            return event->wheel.windowID;
+        case SDL_WINDOWEVENT:
+            return event->window.windowID;
+        default:
+            return 0;
+    }
+}
+
+/* Pointer crossings are mouse events; everything else about the window
+ * belongs to its display. */
+static ALLEGRO_EVENT_SOURCE* _window_source(const SDL_Event* event)
+{
+    if (event->window.event == SDL_WINDOWEVENT_ENTER || event->window.event == SDL_WINDOWEVENT_LEAVE) {
+        return _mouse_source(event);
+    }
+    ALLEGRO_DISPLAY* display = _display_for_window(event->window.windowID);
+    return display ? &display->event_source : nullptr;
+}
+
+/* The character a key without text input types, or -1 for keys that
+ * either type text, which arrives as SDL_TEXTINPUT, or type nothing. */
+static int _key_unichar(SDL_Keycode sym)
+{
+    switch (sym) {
+        case SDLK_RETURN:
+        case SDLK_KP_ENTER:
+            return '\r';
+        case SDLK_BACKSPACE:
+            return '\b';
+        case SDLK_TAB:
+            return '\t';
+        case SDLK_ESCAPE:
+            return 27;
+        case SDLK_DELETE:
+            return 127;
+        case SDLK_LEFT:
+        case SDLK_RIGHT:
+        case SDLK_UP:
+        case SDLK_DOWN:
+        case SDLK_HOME:
+        case SDLK_END:
+        case SDLK_PAGEUP:
+        case SDLK_PAGEDOWN:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/* Editing and navigation keys also type an ALLEGRO_EVENT_KEY_CHAR, since
+ * SDL sends no text for them. */
+static int _translate_key(const SDL_Event* sdl_event, ALLEGRO_EVENT* events)
+{
+    SDL_Keycode sym = sdl_event->key.keysym.sym;
+    events[0].type = sdl_event->type == SDL_KEYDOWN ? ALLEGRO_EVENT_KEY_DOWN : ALLEGRO_EVENT_KEY_UP;
+    events[0].keyboard.keycode = sym;
+    events[0].keyboard.unichar = 0;
+    events[0].keyboard.modifiers = sdl_event->key.keysym.mod;
+    
+    int unichar = _key_unichar(sym);
+    if (sdl_event->type != SDL_KEYDOWN || unichar < 0) {
+        return 1;
+    }
+    events[1].type = ALLEGRO_EVENT_KEY_CHAR;
+    events[1].keyboard.keycode = sym;
+    events[1].keyboard.unichar = unichar;
+    events[1].keyboard.modifiers = sdl_event->key.keysym.mod;
+    return 2;
+}
+
+/* Text input becomes one ALLEGRO_EVENT_KEY_CHAR per UTF-8 code point;
+ * a truncated sequence at the end is dropped. */
+static int _translate_text(const SDL_Event* sdl_event, ALLEGRO_EVENT* events)
+{
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(sdl_event->text.text);
+    int modifiers = SDL_GetModState();
+    int count = 0;
+    
+    for (int i = 0; i < SDL_TEXTINPUTEVENT_TEXT_SIZE && text[i];) {
+        int c = text[i];
+        int length = 1;
+        if (c >= 0xF0) {
+            c &= 0x07;
+            length = 4;
+        } else if (c >= 0xE0) {
+            c &= 0x0F;
+            length = 3;
+        } else if (c >= 0xC0) {
+            c &= 0x1F;
+            length = 2;
+        }
+        
+        int k = 1;
+        for (; k < length && i + k < SDL_TEXTINPUTEVENT_TEXT_SIZE && (text[i + k] & 0xC0) == 0x80; k++) {
+            c = (c << 6) | (text[i + k] & 0x3F);
+        }
+        i += k;
+        if (k < length) {
+            continue;
+        }
+        
+        events[count].type = ALLEGRO_EVENT_KEY_CHAR;
+        events[count].keyboard.keycode = 0;
+        events[count].keyboard.unichar = c;
+        events[count].keyboard.modifiers = modifiers;
+        count++;
+    }
+    return count;
 }
 
-void al_scale_transform(ALLEGRO_TRANSFORM* trans, float sx, float sy, float sz)
+static int _translate_mouse_motion(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
 {
-    if (!trans) {
-        return;
-    }
-
-    ALLEGRO_TRANSFORM s;
-    al_identity_transform(&s);
-    s.m[0] = sx;
-    s.m[5] = sy;
-    s.m[10] = sz;
-
-    al_compose_transform(trans, &s);
+    event->type = ALLEGRO_EVENT_MOUSE_AXES;
+    event->mouse.x = sdl_event->motion.x;
+    event->mouse.y = sdl_event->motion.y;
+    event->mouse.dx = sdl_event->motion.xrel;
+    event->mouse.dy = sdl_event->motion.yrel;
+    event->mouse.dz = 0;
+    event->mouse.dw = 0;
+    event->mouse.button = 0;
+    event->mouse.pressure = 0;
+    return 1;
 }
 
-void al_translate_transform_f(ALLEGRO_TRANSFORM* trans, float x, float y, float z)
+static int _translate_mouse_button(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
 {
-    al_translate_transform(trans, x, y, z);
+    event->type = sdl_event->type == SDL_MOUSEBUTTONDOWN ? ALLEGRO_EVENT_MOUSE_BUTTON_DOWN
+                                                         : ALLEGRO_EVENT_MOUSE_BUTTON_UP;
+    event->mouse.x = sdl_event->button.x;
+    event->mouse.y = sdl_event->button.y;
+    event->mouse.dx = 0;
+    event->mouse.dy = 0;
+    event->mouse.dz = 0;
+    event->mouse.dw = 0;
+    event->mouse.button = sdl_event->button.button;
+    event->mouse.pressure = sdl_event->type == SDL_MOUSEBUTTONDOWN ? 1.0f : 0.0f;
+    return 1;
 }
 
-void al_rotate_transform_f(ALLEGRO_TRANSFORM* trans, float angle, float x, float y, float z)
+static int _translate_mouse_wheel(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
 {
-    if (!trans) {
-        return;
+    int x, y;
+    SDL_GetMouseState(&x, &y);
+    event->type = ALLEGRO_EVENT_MOUSE_AXES;
+    event->mouse.x = x;
+    event->mouse.y = y;
+    event->mouse.dx = 0;
+    event->mouse.dy = 0;
+    event->mouse.dz = sdl_event->wheel.y;
+    event->mouse.dw = sdl_event->wheel.x;
+    event->mouse.button = 0;
+    event->mouse.pressure = 0;
+    return 1;
+}
+
+static int _translate_window(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
+{
+    switch (sdl_event->window.event) {
+        case SDL_WINDOWEVENT_RESIZED:
+            event->type = ALLEGRO_EVENT_DISPLAY_RESIZE;
+            event->display_expose.x = 0;
+            event->display_expose.y = 0;
+            event->display_expose.width = sdl_event->window.data1;
+            event->display_expose.height = sdl_event->window.data2;
+            return 1;
+        case SDL_WINDOWEVENT_EXPOSED:
+            event->type = ALLEGRO_EVENT_DISPLAY_EXPOSE;
+            event->display_expose.x = 0;
+            event->display_expose.y = 0;
+            event->display_expose.width = event->display ? event->display->width : 0;
+            event->display_expose.height = event->display ? event->display->height : 0;
+            return 1;
+        case SDL_WINDOWEVENT_CLOSE:
+            event->type = ALLEGRO_EVENT_DISPLAY_CLOSE;
+            return 1;
+        case SDL_WINDOWEVENT_FOCUS_LOST:
+            event->type = ALLEGRO_EVENT_DISPLAY_FOCUS_LOST;
+            return 1;
+        case SDL_WINDOWEVENT_FOCUS_GAINED:
+            event->type = ALLEGRO_EVENT_DISPLAY_FOCUS_GAINED;
+            return 1;
+        case SDL_WINDOWEVENT_ENTER:
+        case SDL_WINDOWEVENT_LEAVE: {
+            int x, y;
+            SDL_GetMouseState(&x, &y);
+            event->type = sdl_event->window.event == SDL_WINDOWEVENT_ENTER ? ALLEGRO_EVENT_MOUSE_ENTER_DISPLAY
+                                                                           : ALLEGRO_EVENT_MOUSE_LEAVE_DISPLAY;
+            memset(&event->mouse, 0, sizeof(event->mouse));
+            event->mouse.x = x;
+            event->mouse.y = y;
+            return 1;
+        }
+        default:
+            return 0;
     }
+}
 
-    if (x == 0 && y == 0 && z == 0) {
-        return;
+static int _translate_joy_axis(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
+{
+    if (sdl_event->jaxis.axis >= 6) {
+        return 0;
     }
+    memset(&event->joystick, 0, sizeof(event->joystick));
+    float* axes[6] = {
+        &event->joystick.x, &event->joystick.y, &event->joystick.z,
+        &event->joystick.rx, &event->joystick.ry, &event->joystick.rz
+    };
+    event->type = ALLEGRO_EVENT_JOYSTICK_AXIS;
+    event->display = nullptr;
+    event->joystick.id = sdl_event->jaxis.which;
+    *axes[sdl_event->jaxis.axis] = SDL_max(-1.0f, sdl_event->jaxis.value / 32767.0f);
+    return 1;
+}
 
-    float len = sqrtf(x * x + y * y + z * z);
-    x /= len;
-    y /= len;
-    z /= len;
+static int _translate_joy_button(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
+{
+    memset(&event->joystick, 0, sizeof(event->joystick));
+    event->type = sdl_event->type == SDL_JOYBUTTONDOWN ? ALLEGRO_EVENT_JOYSTICK_BUTTON_DOWN
+                                                       : ALLEGRO_EVENT_JOYSTICK_BUTTON_UP;
+    event->display = nullptr;
+    event->joystick.id = sdl_event->jbutton.which;
+    event->joystick.button[0] = sdl_event->jbutton.button;
+    return 1;
+}
 
-    float c = cosf(angle);
-    float s = sinf(angle);
-    float t = 1.0f - c;
+static int _translate_joy_device(const SDL_Event* sdl_event, ALLEGRO_EVENT* event)
+{
+    memset(&event->joystick, 0, sizeof(event->joystick));
+    event->type = ALLEGRO_EVENT_JOYSTICK_CONFIGURATION;
+    event->display = nullptr;
+    event->joystick.id = sdl_event->jdevice.which;
+    return 1;
+}
 
-    ALLEGRO_TRANSFORM r;
-    al_identity_transform(&r);
-    r.m[0] = t * x * x + c;
-    r.m[1] = t * x * y + s * z;
-    r.m[2] = t * x * z - s * y;
-    r.m[4] = t * x * y - s * z;
-    r.m[5] = t * y * y + c;
-    r.m[6] = t * y * z + s * x;
-    r.m[8] = t * x * z + s * y;
-    r.m[9] = t * y * z - s * x;
-    r.m[10] = t * z * z + c;
+struct EventTranslator {
+    Uint32 sdl_type;
+    ALLEGRO_EVENT_SOURCE* (*source)(const SDL_Event* event);
+    int (*translate)(const SDL_Event* sdl_event, ALLEGRO_EVENT* events);
+};
 
-    al_compose_transform(trans, &r);
-}
+/* Most SDL events translate to one event; text input can carry a code
+ * point per byte. */
+static const int EVENT_TRANSLATE_MAX = SDL_TEXTINPUTEVENT_TEXT_SIZE;
+
+/* Ordered by how often the events arrive, mouse motion first. */
+static const EventTranslator _event_translators[] = {
+    {SDL_MOUSEMOTION,     _mouse_source,    _translate_mouse_motion},
+    {SDL_KEYDOWN,         _keyboard_source, _translate_key},
+    {SDL_KEYUP,           _keyboard_source, _translate_key},
+    {SDL_TEXTINPUT,       _keyboard_source, _translate_text},
+    {SDL_MOUSEBUTTONDOWN, _mouse_source,    _translate_mouse_button},
+    {SDL_MOUSEBUTTONUP,   _mouse_source,    _translate_mouse_button},
+    {SDL_MOUSEWHEEL,      _mouse_source,    _translate_mouse_wheel},
+    {SDL_JOYAXISMOTION,   _joystick_source, _translate_joy_axis},
+    {SDL_JOYBUTTONDOWN,   _joystick_source, _translate_joy_button},
+    {SDL_JOYBUTTONUP,     _joystick_source, _translate_joy_button},
+    {SDL_JOYDEVICEADDED,  _joystick_source, _translate_joy_device},
+    {SDL_JOYDEVICEREMOVED, _joystick_source, _translate_joy_device},
+    {SDL_WINDOWEVENT,     _window_source,   _translate_window},
+};
 
-void al_scale_transform_f(ALLEGRO_TRANSFORM* trans, float sx, float sy, float sz)
+static const EventTranslator* _find_event_translator(Uint32 sdl_type)
 {
-    al_scale_transform(trans, sx, sy, sz);
+    for (size_t i = 0; i < sizeof(_event_translators) / sizeof(_event_translators[0]); i++) {
+        if (_event_translators[i].sdl_type == sdl_type) {
+            return &_event_translators[i];
+        }
+    }
+    return nullptr;
 }
 
-void al_set_blender(int op, int src, int dst)
+/* Translates one SDL event and delivers it to the queues subscribed to its
+ * source. Events nobody listens to are dropped untranslated. The display is
+ * the one owning the event's window, so several windows each get their
+ * own events; input without a window is credited to the current display. */
+static void _dispatch_sdl_event(const SDL_Event* sdl_event, ALLEGRO_EVENT_QUEUE* consumer)
 {
-    _blender_op = op;
-    _blender_src = src;
-    _blender_dst = dst;
-    _blender_alpha_op = op;
-    _blender_alpha_src = src;
-    _blender_alpha_dst = dst;
+    if (_wake_event_type && sdl_event->type == _wake_event_type) {
+        void* target = sdl_event->user.data1;
+        if (target && target != consumer && SDL_AtomicGetPtr(&_sdl_waiter) == target) {
+            SDL_Event wake = *sdl_event;
+            SDL_PushEvent(&wake);
+        }
+        return;
+    }
+    
+    const EventTranslator* translator = _find_event_translator(sdl_event->type);
+    if (!translator) {
+        return;
+    }
+    
+    /* The display lock covers only the lookups; a display is not freed
+     * while its event source still has the snapshot referenced here. */
+    SDL_AtomicLock(&_displays_lock);
+    ALLEGRO_EVENT_SOURCE* source = translator->source(sdl_event);
+    EventSubscribers* subscribers = _acquire_subscribers(source);
+    Uint32 window_id = _event_window_id(sdl_event);
+    ALLEGRO_DISPLAY* display = window_id ? _display_for_window(window_id) : _current_display;
+    SDL_AtomicUnlock(&_displays_lock);
+    if (!subscribers) {
+        return;
+    }
+
+    double timestamp = sdl_event->common.timestamp / 1000.0;
+    ALLEGRO_EVENT events[EVENT_TRANSLATE_MAX];
+    events[0].type = 0;
+    events[0].display = display;
+    int count = translator->translate(sdl_event, events);
+    for (int i = 0; i < count; i++) {
+        events[i].display = events[0].display;
+        events[i].timestamp = timestamp;
+        _post_event(subscribers, source, &events[i], consumer);
+    }
+    _release_subscribers(subscribers);
 }
 
-void al_get_blender(int* op, int* src, int* dst)
+/* Translates SDL events taken off SDL's queue, or hands them to the pump
+ * thread when it runs; only the main thread takes events then. */
+static void _deliver_sdl_events(const SDL_Event* events, int count, ALLEGRO_EVENT_QUEUE* consumer)
 {
-    if (op) *op = _blender_op;
-    if (src) *src = _blender_src;
-    if (dst) *dst = _blender_dst;
+    if (count <= 0) {
+        return;
+    }
+    if (_event_pump_thread) {
+        SDL_LockMutex(_event_pump_mutex);
+        _event_pump_handoff.insert(_event_pump_handoff.end(), events, events + count);
+        SDL_CondSignal(_event_pump_cond);
+        SDL_UnlockMutex(_event_pump_mutex);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        _dispatch_sdl_event(&events[i], consumer);
+    }
 }
 
-void al_set_separate_blender(int op, int src, int dst, int alpha_op, int src_alpha, int dst_alpha)
+static void _pump_events(ALLEGRO_EVENT_QUEUE* consumer)
 {
-    _blender_op = op;
-    _blender_src = src;
-    _blender_dst = dst;
-    _blender_alpha_op = alpha_op;
-    _blender_alpha_src = src_alpha;
-    _blender_alpha_dst = dst_alpha;
+    bool main_thread = SDL_ThreadID() == _event_main_thread;
+    if (main_thread) {
+        SDL_PumpEvents();
+    }
+    if (_event_pump_thread && !main_thread) {
+        return;
+    }
+    
+    SDL_Event events[EVENT_PUMP_BATCH];
+    int count;
+    do {
+        count = SDL_PeepEvents(events, EVENT_PUMP_BATCH, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT);
+        _deliver_sdl_events(events, count, consumer);
+    } while (count == EVENT_PUMP_BATCH);
 }
 
-void al_get_separate_blender(int* op, int* src, int* dst, int* alpha_op, int* src_alpha, int* dst_alpha)
+static int _event_pump_main(void* data)
 {
-    if (op) *op = _blender_op;
-    if (src) *src = _blender_src;
-    if (dst) *dst = _blender_dst;
-    if (alpha_op) *alpha_op = _blender_alpha_op;
-    if (src_alpha) *src_alpha = _blender_alpha_src;
-    if (dst_alpha) *dst_alpha = _blender_alpha_dst;
+    (void)data;
+    std::vector<SDL_Event> events;
+    for (;;) {
+        SDL_LockMutex(_event_pump_mutex);
+        while (_event_pump_handoff.empty() && !_event_pump_stop) {
+            SDL_CondWait(_event_pump_cond, _event_pump_mutex);
+        }
+        events.swap(_event_pump_handoff);
+        SDL_UnlockMutex(_event_pump_mutex);
+        if (events.empty()) {
+            break;
+        }
+        
+        for (size_t i = 0; i < events.size(); i++) {
+            _dispatch_sdl_event(&events[i], nullptr);
+        }
+        events.clear();
+    }
+    return 0;
 }
 
-struct ALLEGRO_EVENT_QUEUE {
-    std::vector<ALLEGRO_EVENT> events;
-    size_t read_index;
-};
-
-ALLEGRO_EVENT_QUEUE* al_create_event_queue(void)
+/* The pump thread is started and stopped from the main thread, the only
+ * one that feeds it; elsewhere both calls fail. */
+bool al_start_event_pump_thread(void)
 {
-    ALLEGRO_EVENT_QUEUE* queue = new ALLEGRO_EVENT_QUEUE;
-    if (!queue) {
-        return nullptr;
+    if (!_event_main_thread) {
+        _event_main_thread = SDL_ThreadID();
     }
-    queue->read_index = 0;
-    return queue;
+    if (SDL_ThreadID() != _event_main_thread) {
+        return false;
+    }
+    if (_event_pump_thread) {
+        return true;
+    }
+    if (!_event_pump_mutex) {
+        _event_pump_mutex = SDL_CreateMutex();
+        _event_pump_cond = SDL_CreateCond();
+        if (!_event_pump_mutex || !_event_pump_cond) {
+            SDL_DestroyCond(_event_pump_cond);
+            SDL_DestroyMutex(_event_pump_mutex);
+            _event_pump_cond = nullptr;
+            _event_pump_mutex = nullptr;
+            return false;
+        }
+    }
+    _event_pump_stop = false;
+    _event_pump_thread = SDL_CreateThread(_event_pump_main, "al_event_pump", nullptr);
+    return _event_pump_thread != nullptr;
 }
 
-void al_destroy_event_queue(ALLEGRO_EVENT_QUEUE* queue)
+/* The pump thread translates everything already handed to it before it
+ * exits. */
+void al_stop_event_pump_thread(void)
 {
-    if (!queue) {
+    if (!_event_pump_thread || SDL_ThreadID() != _event_main_thread) {
         return;
     }
-    delete queue;
+    SDL_LockMutex(_event_pump_mutex);
+    _event_pump_stop = true;
+    SDL_CondSignal(_event_pump_cond);
+    SDL_UnlockMutex(_event_pump_mutex);
+    SDL_WaitThread(_event_pump_thread, nullptr);
+    _event_pump_thread = nullptr;
+}
+
+/* Applies pending purges, collects what other threads posted to the
+ * queue and runs the pump. */
+static void _update_event_queue(ALLEGRO_EVENT_QUEUE* queue)
+{
+    _event_queue_apply_purges(queue);
+    _event_ingress_drain(queue);
+    _pump_events(queue);
+}
+
+/* Waits until the queue holds an event or timeout_ms passes; a negative
+ * timeout waits forever. On the main thread the caller sleeps in
+ * SDL_WaitEventTimeout as the SDL waiter and collects OS events for
+ * everyone. Any other thread never waits in SDL: events the main thread
+ * translates reach it through the ingress like everything else, so it
+ * sleeps on its queue's condition until a producer signals it. Either way
+ * the queue is flagged as waiting first and the ingress rechecked, so a
+ * post racing with going to sleep is never missed. */
+static bool _wait_for_queue(ALLEGRO_EVENT_QUEUE* queue, int timeout_ms)
+{
+    Uint32 start = SDL_GetTicks();
+    for (;;) {
+        _update_event_queue(queue);
+        if (queue->head != queue->tail) {
+            return true;
+        }
+        
+        int remaining = -1;
+        if (timeout_ms >= 0) {
+            remaining = SDL_max(0, timeout_ms - static_cast<int>(SDL_GetTicks() - start));
+        }
+        if (remaining == 0) {
+            return false;
+        }
+        
+        if (SDL_ThreadID() == _event_main_thread) {
+            SDL_Event sdl_event;
+            int got = 0;
+            SDL_AtomicSetPtr(&_sdl_waiter, queue);
+            SDL_AtomicSet(&queue->waiting, EVENT_QUEUE_WAITING_SDL);
+            if (!_event_ingress_ready(queue)) {
+                got = remaining < 0 ? SDL_WaitEvent(&sdl_event) : SDL_WaitEventTimeout(&sdl_event, remaining);
+            }
+            SDL_AtomicSet(&queue->waiting, EVENT_QUEUE_RUNNING);
+            SDL_AtomicSetPtr(&_sdl_waiter, nullptr);
+            if (got) {
+                _deliver_sdl_events(&sdl_event, 1, queue);
+            }
+            continue;
+        }
+        
+        SDL_LockMutex(queue->wait_mutex);
+        SDL_AtomicSet(&queue->waiting, EVENT_QUEUE_WAITING_COND);
+        if (!_event_ingress_ready(queue)) {
+            if (remaining < 0) {
+                SDL_CondWait(queue->wait_cond, queue->wait_mutex);
+            } else {
+                SDL_CondWaitTimeout(queue->wait_cond, queue->wait_mutex, static_cast<Uint32>(remaining));
+            }
+        }
+        SDL_AtomicSet(&queue->waiting, EVENT_QUEUE_RUNNING);
+        SDL_UnlockMutex(queue->wait_mutex);
+    }
 }
 
 bool al_is_event_queue_empty(ALLEGRO_EVENT_QUEUE* queue)
@@ -1865,25 +8705,24 @@ bool al_is_event_queue_empty(ALLEGRO_EVENT_QUEUE* queue)
     if (!queue) {
         return true;
     }
-    return queue->events.empty() || queue->read_index >= queue->events.size();
+    _update_event_queue(queue);
+    return queue->head == queue->tail;
 }
 
+/* A user event emitted with a destructor must be released with
+ * al_unref_user_event once the caller is done with it. */
 bool al_get_next_event(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event)
 {
     if (!queue || !event) {
         return false;
     }
-    if (queue->events.empty() || queue->read_index >= queue->events.size()) {
+    _update_event_queue(queue);
+    const ALLEGRO_EVENT* front = _event_queue_front(queue);
+    if (!front) {
         return false;
     }
-    *event = queue->events[queue->read_index];
-    queue->read_index++;
-    if (queue->read_index >= queue->events.size() / 2 && !queue->events.empty()) {
-        size_t remaining = queue->events.size() - queue->read_index;
-        std::vector<ALLEGRO_EVENT> new_events(queue->events.begin() + queue->read_index, queue->events.end());
-        queue->events = new_events;
-        queue->read_index = 0;
-    }
+    *event = *front;
+    queue->head++;
     return true;
 }
 
@@ -1892,10 +8731,12 @@ bool al_peek_event(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event)
     if (!queue || !event) {
         return false;
     }
-    if (queue->events.empty() || queue->read_index >= queue->events.size()) {
+    _update_event_queue(queue);
+    const ALLEGRO_EVENT* front = _event_queue_front(queue);
+    if (!front) {
         return false;
     }
-    *event = queue->events[queue->read_index];
+    *event = *front;
     return true;
 }
 
@@ -1904,8 +8745,11 @@ void al_drop_next_event(ALLEGRO_EVENT_QUEUE* queue)
     if (!queue) {
         return;
     }
-    if (!queue->events.empty() && queue->read_index < queue->events.size()) {
-        queue->read_index++;
+    _update_event_queue(queue);
+    const ALLEGRO_EVENT* front = _event_queue_front(queue);
+    if (front) {
+        _release_event(front);
+        queue->head++;
     }
 }
 
@@ -1914,94 +8758,36 @@ void al_flush_event_queue(ALLEGRO_EVENT_QUEUE* queue)
     if (!queue) {
         return;
     }
-    queue->events.clear();
-    queue->read_index = 0;
+    _update_event_queue(queue);
+    unsigned int mask = static_cast<unsigned int>(queue->events.size()) - 1;
+    for (unsigned int i = queue->head; i != queue->tail; i++) {
+        _release_event(&queue->events[i & mask]);
+    }
+    queue->head = 0;
+    queue->tail = 0;
 }
 
+/* A null event waits without removing the event from the queue. */
 void al_wait_for_event(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event)
 {
-    if (!queue || !event) {
+    if (!queue) {
         return;
     }
-    while (al_is_event_queue_empty(queue)) {
-        SDL_Event sdl_event;
-        if (SDL_WaitEvent(&sdl_event)) {
-            ALLEGRO_EVENT al_event;
-            al_event.type = 0;
-            al_event.display = _current_display;
-            al_event.timestamp = SDL_GetTicks() / 1000.0;
-            
-            if (sdl_event.type == SDL_KEYDOWN) {
-                al_event.type = ALLEGRO_EVENT_KEY_DOWN;
-                al_event.keyboard.keycode = sdl_event.key.keysym.sym;
-                al_event.keyboard.modifiers = sdl_event.key.keysym.mod;
-            } else if (sdl_event.type == SDL_KEYUP) {
-                al_event.type = ALLEGRO_EVENT_KEY_UP;
-                al_event.keyboard.keycode = sdl_event.key.keysym.sym;
-                al_event.keyboard.modifiers = sdl_event.key.keysym.mod;
-            } else if (sdl_event.type == SDL_MOUSEBUTTONDOWN) {
-                al_event.type = ALLEGRO_EVENT_MOUSE_BUTTON_DOWN;
-                al_event.mouse.button = sdl_event.button.button;
-                al_event.mouse.x = sdl_event.button.x;
-                al_event.mouse.y = sdl_event.button.y;
-            } else if (sdl_event.type == SDL_MOUSEBUTTONUP) {
-                al_event.type = ALLEGRO_EVENT_MOUSE_BUTTON_UP;
-                al_event.mouse.button = sdl_event.button.button;
-                al_event.mouse.x = sdl_event.button.x;
-                al_event.mouse.y = sdl_event.button.y;
-            } else if (sdl_event.type == SDL_MOUSEMOTION) {
-                al_event.type = ALLEGRO_EVENT_MOUSE_AXES;
-                al_event.mouse.x = sdl_event.motion.x;
-                al_event.mouse.y = sdl_event.motion.y;
-                al_event.mouse.dx = sdl_event.motion.xrel;
-                al_event.mouse.dy = sdl_event.motion.yrel;
-            } else if (sdl_event.type == SDL_WINDOWEVENT) {
-                if (sdl_event.window.event == SDL_WINDOWEVENT_RESIZED) {
-                    al_event.type = ALLEGRO_EVENT_DISPLAY_RESIZE;
-                    al_event.display_expose.width = sdl_event.window.data1;
-                    al_event.display_expose.height = sdl_event.window.data2;
-                } else if (sdl_event.window.event == SDL_WINDOWEVENT_CLOSE) {
-                    al_event.type = ALLEGRO_EVENT_DISPLAY_CLOSE;
-                }
-            }
-            
-            if (al_event.type != 0) {
-                queue->events.push_back(al_event);
-            }
-        }
+    _wait_for_queue(queue, -1);
+    if (event) {
+        al_get_next_event(queue, event);
     }
-    al_get_next_event(queue, event);
 }
 
 bool al_wait_for_event_timed(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event, float secs)
 {
-    if (!queue || !event) {
+    if (!queue) {
         return false;
     }
-    
-    if (!al_is_event_queue_empty(queue)) {
-        return al_get_next_event(queue, event);
-    }
-    
-    SDL_Event sdl_event;
-    int timeout_ms = static_cast<int>(secs * 1000);
-    if (SDL_WaitEventTimeout(&sdl_event, timeout_ms)) {
-        event->type = 0;
-        event->display = _current_display;
-        event->timestamp = SDL_GetTicks() / 1000.0;
-        
-        if (sdl_event.type == SDL_KEYDOWN) {
-            event->type = ALLEGRO_EVENT_KEY_DOWN;
-            event->keyboard.keycode = sdl_event.key.keysym.sym;
-        } else if (sdl_event.type == SDL_KEYUP) {
-            event->type = ALLEGRO_EVENT_KEY_UP;
-            event->keyboard.keycode = sdl_event.key.keysym.sym;
-        }
-        
-        return event->type != 0;
+    if (!_wait_for_queue(queue, static_cast<int>(SDL_max(secs, 0.0f) * 1000))) {
+        return false;
     }
-    
-    return false;
+    return !event || al_get_next_event(queue, event);
 }
 
 bool al_wait_for_event_until(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event, void* timeout)
@@ -2012,24 +8798,106 @@ bool al_wait_for_event_until(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT* event, v
 
 void al_init_event_source(ALLEGRO_EVENT_SOURCE* source)
 {
-    (void)source;
+    if (!source) {
+        return;
+    }
+    memset(source, 0, sizeof(*source));
 }
 
 void al_destroy_event_source(ALLEGRO_EVENT_SOURCE* source)
 {
-    (void)source;
+    if (!source) {
+        return;
+    }
+    
+    EventSourceData* data = _event_source_data(source);
+    while (data->subscribers) {
+        al_unregister_event_source(data->subscribers->queues[data->subscribers->count - 1], source);
+    }
+    memset(source, 0, sizeof(*source));
+}
+
+void al_init_user_event_source(ALLEGRO_EVENT_SOURCE* source)
+{
+    al_init_event_source(source);
+}
+
+void al_destroy_user_event_source(ALLEGRO_EVENT_SOURCE* source)
+{
+    al_destroy_event_source(source);
+}
+
+/* Safe to call from any thread: the event is posted through the ingress of
+ * each queue in the source's subscriber snapshot. With a destructor the
+ * event is reference counted, and dtor runs once every copy has been
+ * released. */
+bool al_emit_user_event(ALLEGRO_EVENT_SOURCE* source, ALLEGRO_EVENT* event,
+                        void (*dtor)(ALLEGRO_USER_EVENT* event))
+{
+    if (!source || !event || !ALLEGRO_EVENT_TYPE_IS_USER(event->type)) {
+        return false;
+    }
+    
+    ALLEGRO_USER_EVENT_DESCRIPTOR* descr = nullptr;
+    if (dtor) {
+        descr = new ALLEGRO_USER_EVENT_DESCRIPTOR;
+        SDL_AtomicSet(&descr->refcount, 1);
+        descr->dtor = dtor;
+        descr->event = event->user;
+        descr->event.__internal__descr = descr;
+    }
+    event->user.__internal__descr = descr;
+    event->timestamp = SDL_GetTicks() / 1000.0;
+    
+    bool delivered = _emit_event(source, event, nullptr) > 0;
+    _release_user_event(descr);
+    return delivered;
+}
+
+void al_unref_user_event(ALLEGRO_USER_EVENT* event)
+{
+    if (event) {
+        _release_user_event(event->__internal__descr);
+    }
 }
 
 void al_register_event_source(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT_SOURCE* source)
 {
-    (void)queue;
-    (void)source;
+    if (!queue || !source) {
+        return;
+    }
+    for (size_t i = 0; i < queue->sources.size(); i++) {
+        if (queue->sources[i] == source) {
+            return;
+        }
+    }
+    
+    if (_update_subscribers(source, queue, true)) {
+        queue->sources.push_back(source);
+    }
 }
 
+/* Also discards the source's events still pending in the queue, before
+ * the queue next returns an event. */
 void al_unregister_event_source(ALLEGRO_EVENT_QUEUE* queue, ALLEGRO_EVENT_SOURCE* source)
 {
-    (void)queue;
-    (void)source;
+    if (!queue || !source) {
+        return;
+    }
+    
+    bool found = false;
+    for (size_t i = 0; i < queue->sources.size(); i++) {
+        if (queue->sources[i] == source) {
+            queue->sources[i] = queue->sources.back();
+            queue->sources.pop_back();
+            found = true;
+            break;
+        }
+    }
+    if (found) {
+        _update_subscribers(source, queue, false);
+        _event_queue_defer_purge(queue, source);
+    }
 }
 
 bool al_install_mouse(void)
@@ -2072,9 +8940,9 @@ int remove_mouse(void)
     return 0;
 }
 
-void* al_get_mouse_event_source(void)
+ALLEGRO_EVENT_SOURCE* al_get_mouse_event_source(void)
 {
-    return nullptr;
+    return _mouse_installed ? &_mouse_event_source : nullptr;
 }
 
 void al_get_mouse_state(ALLEGRO_MOUSE_STATE* ret_state)
@@ -2427,9 +9295,9 @@ void al_get_joystick_state(ALLEGRO_JOYSTICK* joystick, ALLEGRO_JOYSTICK_STATE* r
     }
 }
 
-void* al_get_joystick_event_source(void)
+ALLEGRO_EVENT_SOURCE* al_get_joystick_event_source(void)
 {
-    return nullptr;
+    return _joystick_installed ? &_joystick_event_source : nullptr;
 }
 
 int install_joystick(void)
@@ -3800,32 +10668,81 @@ void al_stop_samples(void)
     Mix_HaltChannel(-1);
 }
 
-static bool _timer_installed = false;
-static std::vector<ALLEGRO_TIMER*> _timers;
+/* SDL_RemoveTimer does not wait for a callback that is already running,
+ * so callbacks reach their timer through a slot table rather than a
+ * pointer: the SDL parameter names a slot and the generation the timer had
+ * when it was started. A callback counts itself in _timer_callbacks before
+ * it looks at the slot. al_destroy_timer empties the slot, removes the SDL
+ * timer and then sleeps on _timer_done_cond until no callback is running,
+ * so nothing can reach the timer once it is freed. A callback that fires
+ * after al_stop_timer sees a newer generation and cancels itself. */
+static const int TIMER_SLOT_BITS = 10;
+static const int TIMER_MAX_SLOTS = 1 << TIMER_SLOT_BITS;
 
+static bool _timer_installed = false;
+static void* _timer_slots[TIMER_MAX_SLOTS];
+static SDL_atomic_t _timer_callbacks;
+static SDL_atomic_t _timer_destroy_waiting;
+static SDL_mutex* _timer_done_mutex = nullptr;
+static SDL_cond* _timer_done_cond = nullptr;
+
+/* count is written by SDL's timer thread and read from any other, so it
+ * is atomic and, like the SDL counter it lives in, 32 bits wide. */
 struct ALLEGRO_TIMER {
     double speed;
-    long long count;
+    SDL_atomic_t count;
     bool started;
-    bool should_stop;
-    SDL_Thread* thread;
+    int slot;
+    SDL_atomic_t generation;
     SDL_TimerID sdl_timer_id;
     ALLEGRO_EVENT_SOURCE event_source;
-    SDL_mutex* mutex;
 };
 
+static void* _timer_param(ALLEGRO_TIMER* timer)
+{
+    uintptr_t generation = static_cast<unsigned int>(SDL_AtomicGet(&timer->generation));
+    return reinterpret_cast<void*>((generation << TIMER_SLOT_BITS) | static_cast<uintptr_t>(timer->slot));
+}
+
+/* Only the last callback out takes the mutex, and only while a destroyer
+ * is waiting for it. */
+static void _timer_leave_callback(void)
+{
+    if (SDL_AtomicAdd(&_timer_callbacks, -1) == 1 && SDL_AtomicGet(&_timer_destroy_waiting)) {
+        SDL_LockMutex(_timer_done_mutex);
+        SDL_CondBroadcast(_timer_done_cond);
+        SDL_UnlockMutex(_timer_done_mutex);
+    }
+}
+
+static void _timer_wait_callbacks(void)
+{
+    SDL_LockMutex(_timer_done_mutex);
+    SDL_AtomicAdd(&_timer_destroy_waiting, 1);
+    while (SDL_AtomicGet(&_timer_callbacks) > 0) {
+        SDL_CondWait(_timer_done_cond, _timer_done_mutex);
+    }
+    SDL_AtomicAdd(&_timer_destroy_waiting, -1);
+    SDL_UnlockMutex(_timer_done_mutex);
+}
+
 static Uint32 timer_callback(Uint32 interval, void* param)
 {
-    ALLEGRO_TIMER* timer = static_cast<ALLEGRO_TIMER*>(param);
-    if (!timer) {
-        return 0;
+    SDL_AtomicAdd(&_timer_callbacks, 1);
+    uintptr_t slot = reinterpret_cast<uintptr_t>(param) & (TIMER_MAX_SLOTS - 1);
+    ALLEGRO_TIMER* timer = static_cast<ALLEGRO_TIMER*>(SDL_AtomicGetPtr(&_timer_slots[slot]));
+    if (timer && _timer_param(timer) == param) {
+        ALLEGRO_EVENT event;
+        event.type = ALLEGRO_EVENT_TIMER;
+        event.display = nullptr;
+        event.timestamp = SDL_GetTicks() / 1000.0;
+        event.timer.count = SDL_AtomicAdd(&timer->count, 1) + 1;
+        _emit_event(&timer->event_source, &event, nullptr);
+    } else {
+        interval = 0;
     }
-    
-    SDL_LockMutex(timer->mutex);
-    timer->count++;
-    SDL_UnlockMutex(timer->mutex);
-    
-    return static_cast<Uint32>(timer->speed * 1000.0);
+    _timer_leave_callback();
+    return interval;
 }
 
 bool al_install_timer(void)
@@ -3848,15 +10765,10 @@ void al_uninstall_timer(void)
         return;
     }
     
-    for (ALLEGRO_TIMER* timer : _timers) {
-        if (timer->started) {
-            al_stop_timer(timer);
-        }
-        al_destroy_timer(timer);
+    for (int i = 0; i < TIMER_MAX_SLOTS; i++) {
+        al_destroy_timer(static_cast<ALLEGRO_TIMER*>(SDL_AtomicGetPtr(&_timer_slots[i])));
     }
     
-    _timers.clear();
-    
     SDL_QuitSubSystem(SDL_INIT_TIMER);
     _timer_installed = false;
 }
@@ -3867,22 +10779,41 @@ ALLEGRO_TIMER* al_create_timer(double speed_secs)
         return nullptr;
     }
     
+    if (!_timer_done_mutex) {
+        _timer_done_mutex = SDL_CreateMutex();
+        _timer_done_cond = SDL_CreateCond();
+        if (!_timer_done_mutex || !_timer_done_cond) {
+            SDL_DestroyCond(_timer_done_cond);
+            SDL_DestroyMutex(_timer_done_mutex);
+            _timer_done_cond = nullptr;
+            _timer_done_mutex = nullptr;
+            return nullptr;
+        }
+    }
+    
     ALLEGRO_TIMER* timer = new ALLEGRO_TIMER;
     if (!timer) {
         return nullptr;
     }
     
     timer->speed = speed_secs;
-    timer->count = 0;
+    SDL_AtomicSet(&timer->count, 0);
     timer->started = false;
-    timer->should_stop = false;
-    timer->thread = nullptr;
+    SDL_AtomicSet(&timer->generation, 0);
     timer->sdl_timer_id = 0;
-    timer->mutex = SDL_CreateMutex();
-    
     al_init_event_source(&timer->event_source);
     
-    _timers.push_back(timer);
+    timer->slot = -1;
+    for (int i = 0; i < TIMER_MAX_SLOTS; i++) {
+        if (SDL_AtomicCASPtr(&_timer_slots[i], nullptr, timer)) {
+            timer->slot = i;
+            break;
+        }
+    }
+    if (timer->slot < 0) {
+        delete timer;
+        return nullptr;
+    }
     
     return timer;
 }
@@ -3893,23 +10824,11 @@ void al_destroy_timer(ALLEGRO_TIMER* timer)
         return;
     }
     
-    if (timer->started) {
-        al_stop_timer(timer);
-    }
-    
-    for (auto it = _timers.begin(); it != _timers.end(); ++it) {
-        if (*it == timer) {
-            _timers.erase(it);
-            break;
-        }
-    }
+    al_stop_timer(timer);
+    SDL_AtomicSetPtr(&_timer_slots[timer->slot], nullptr);
+    _timer_wait_callbacks();
     
     al_destroy_event_source(&timer->event_source);
-    
-    if (timer->mutex) {
-        SDL_DestroyMutex(timer->mutex);
-    }
-    
     delete timer;
 }
 
@@ -3920,14 +10839,13 @@ void al_start_timer(ALLEGRO_TIMER* timer)
     }
     
     timer->started = true;
-    timer->should_stop = false;
     
     Uint32 interval = static_cast<Uint32>(timer->speed * 1000.0);
     if (interval < 1) {
         interval = 1;
     }
     
-    timer->sdl_timer_id = SDL_AddTimer(interval, timer_callback, timer);
+    timer->sdl_timer_id = SDL_AddTimer(interval, timer_callback, _timer_param(timer));
 }
 
 void al_stop_timer(ALLEGRO_TIMER* timer)
@@ -3936,12 +10854,11 @@ void al_stop_timer(ALLEGRO_TIMER* timer)
         return;
     }
     
-    timer->should_stop = true;
-    
     if (timer->sdl_timer_id != 0) {
         SDL_RemoveTimer(timer->sdl_timer_id);
         timer->sdl_timer_id = 0;
     }
+    SDL_AtomicAdd(&timer->generation, 1);
     
     timer->started = false;
 }
@@ -3987,11 +10904,7 @@ long long al_get_timer_count(ALLEGRO_TIMER* timer)
         return 0;
     }
     
-    SDL_LockMutex(timer->mutex);
-    long long count = timer->count;
-    SDL_UnlockMutex(timer->mutex);
-    
-    return count;
+    return SDL_AtomicGet(&timer->count);
 }
 
 void al_set_timer_count(ALLEGRO_TIMER* timer, long long count)
@@ -4000,9 +10913,7 @@ void al_set_timer_count(ALLEGRO_TIMER* timer, long long count)
         return;
     }
     
-    SDL_LockMutex(timer->mutex);
-    timer->count = count;
-    SDL_UnlockMutex(timer->mutex);
+    SDL_AtomicSet(&timer->count, static_cast<int>(count));
 }
 
 void al_add_timer_count(ALLEGRO_TIMER* timer, long long diff)
@@ -4011,9 +10922,7 @@ void al_add_timer_count(ALLEGRO_TIMER* timer, long long diff)
         return;
     }
     
-    SDL_LockMutex(timer->mutex);
-    timer->count += diff;
-    SDL_UnlockMutex(timer->mutex);
+    SDL_AtomicAdd(&timer->count, static_cast<int>(diff));
 }
 
 ALLEGRO_EVENT_SOURCE* al_get_timer_event_source(ALLEGRO_TIMER* timer)
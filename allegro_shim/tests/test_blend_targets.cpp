@@ -0,0 +1,120 @@
+// Draws the same translucent rectangle onto a memory bitmap and a video
+// bitmap under each alpha blender, checking that the software rasterizer
+// and the renderer give the same pixels.
+
+#define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+#include <allegro5/allegro_display.h>
+#include <allegro5/allegro_color.h>
+#include <allegro5/allegro_bitmap.h>
+#include <allegro5/allegro_blender.h>
+#include <allegro5/allegro_draw.h>
+#include <cstdio>
+#include <cstdlib>
+
+static int _failures = 0;
+
+static void _check(bool condition, const char* what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        _failures++;
+    }
+}
+
+static ALLEGRO_BITMAP* _create_bitmap(int flags)
+{
+    int old_flags = al_get_new_bitmap_flags();
+    al_set_new_bitmap_flags(flags);
+    ALLEGRO_BITMAP* bitmap = al_create_bitmap(16, 16);
+    al_set_new_bitmap_flags(old_flags);
+    return bitmap;
+}
+
+/* Leaves a backdrop whose alpha is partly below one, so the alpha the
+ * blenders write is compared as well. */
+static void _draw_backdrop(ALLEGRO_BITMAP* bitmap)
+{
+    al_set_target_bitmap(bitmap);
+    al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+    al_clear_to_color(al_map_rgb(0, 64, 255));
+    al_draw_filled_rectangle(4, 4, 12, 12, al_map_rgba(255, 128, 0, 96));
+}
+
+static Uint32 _pixel(ALLEGRO_BITMAP* bitmap, int x, int y)
+{
+    ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ARGB_8888,
+                                                   ALLEGRO_LOCK_READONLY);
+    if (!region) {
+        return 0;
+    }
+    const Uint8* row = static_cast<const Uint8*>(region->data) + y * region->pitch;
+    Uint32 pixel = reinterpret_cast<const Uint32*>(row)[x];
+    al_unlock_bitmap(bitmap);
+    return pixel;
+}
+
+/* The renderer rounds differently from the span kernels, so channels may
+ * differ by one step. */
+static bool _same_color(Uint32 a, Uint32 b)
+{
+    for (int shift = 0; shift < 32; shift += 8) {
+        if (abs(static_cast<int>((a >> shift) & 0xFF) - static_cast<int>((b >> shift) & 0xFF)) > 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _compare(ALLEGRO_BITMAP* memory, ALLEGRO_BITMAP* video, int src, int dst, const char* what)
+{
+    _draw_backdrop(memory);
+    _draw_backdrop(video);
+    al_set_target_bitmap(memory);
+    al_set_blender(ALLEGRO_ADD, src, dst);
+    al_draw_filled_rectangle(2, 2, 10, 10, al_map_rgba(0, 255, 128, 160));
+    al_set_target_bitmap(video);
+    al_set_blender(ALLEGRO_ADD, src, dst);
+    al_draw_filled_rectangle(2, 2, 10, 10, al_map_rgba(0, 255, 128, 160));
+    
+    Uint32 m = _pixel(memory, 6, 6);
+    Uint32 v = _pixel(video, 6, 6);
+    if (!_same_color(m, v)) {
+        fprintf(stderr, "%s: memory %08X, video %08X\n", what, m, v);
+    }
+    _check(_same_color(m, v), what);
+}
+
+int main(void)
+{
+    SDL_SetMainReady();
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
+        return 1;
+    }
+    
+    ALLEGRO_DISPLAY* display = al_create_display(64, 64);
+    if (!display) {
+        fprintf(stderr, "al_create_display: %s\n", SDL_GetError());
+        return 1;
+    }
+    
+    ALLEGRO_BITMAP* memory = _create_bitmap(ALLEGRO_MEMORY_BITMAP);
+    ALLEGRO_BITMAP* video = _create_bitmap(ALLEGRO_VIDEO_BITMAP);
+    _check(memory && video, "create bitmaps");
+    if (!memory || !video) {
+        return 1;
+    }
+    
+    _compare(memory, video, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA, "ONE, INVERSE_ALPHA blender");
+    _compare(memory, video, ALLEGRO_ALPHA, ALLEGRO_INVERSE_ALPHA, "ALPHA, INVERSE_ALPHA blender");
+    _compare(memory, video, ALLEGRO_ONE, ALLEGRO_ONE, "ONE, ONE blender");
+    
+    al_destroy_bitmap(video);
+    al_destroy_bitmap(memory);
+    al_destroy_display(display);
+    SDL_Quit();
+    return _failures ? 1 : 0;
+}
@@ -0,0 +1,77 @@
+// Subscribes one queue to a timer and the keyboard and checks that their
+// events arrive with distinct, upstream Allegro type values.
+
+#define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+#include <allegro5/allegro_events.h>
+#include <allegro5/allegro_keyboard.h>
+#include <allegro5/allegro_timer.h>
+#include <cstdio>
+#include <cstring>
+
+static int _failures = 0;
+
+static void _check(bool condition, const char* what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        _failures++;
+    }
+}
+
+int main(void)
+{
+    SDL_SetMainReady();
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
+        return 1;
+    }
+    
+    _check(ALLEGRO_EVENT_TIMER == 30, "timer type is 30");
+    _check(ALLEGRO_EVENT_KEY_DOWN == 10, "key down type is 10");
+    
+    ALLEGRO_EVENT_QUEUE* queue = al_create_event_queue();
+    _check(queue != nullptr, "create queue");
+    _check(al_install_keyboard(), "install keyboard");
+    _check(al_install_timer(), "install timer");
+    ALLEGRO_TIMER* timer = al_create_timer(0.001);
+    _check(timer != nullptr, "create timer");
+    if (!queue || !timer) {
+        return 1;
+    }
+    
+    al_register_event_source(queue, al_get_keyboard_event_source());
+    al_register_event_source(queue, al_get_timer_event_source(timer));
+    
+    SDL_Event key;
+    memset(&key, 0, sizeof(key));
+    key.type = SDL_KEYDOWN;
+    key.key.state = SDL_PRESSED;
+    key.key.keysym.sym = SDLK_a;
+    SDL_PushEvent(&key);
+    al_start_timer(timer);
+    
+    bool got_key = false;
+    bool got_timer = false;
+    for (int i = 0; i < 100 && !(got_key && got_timer); i++) {
+        ALLEGRO_EVENT event;
+        if (!al_wait_for_event_timed(queue, &event, 0.1f)) {
+            continue;
+        }
+        if (event.type == ALLEGRO_EVENT_KEY_DOWN) {
+            _check(event.source == al_get_keyboard_event_source(), "key down from the keyboard");
+            got_key = true;
+        } else if (event.type == ALLEGRO_EVENT_TIMER) {
+            _check(event.source == al_get_timer_event_source(timer), "tick from the timer");
+            got_timer = true;
+        }
+    }
+    _check(got_key, "received a key down event");
+    _check(got_timer, "received a timer event");
+    
+    al_destroy_timer(timer);
+    al_destroy_event_queue(queue);
+    SDL_Quit();
+    return _failures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+// Locks a sub-bitmap of the current target while a clipping rectangle is
+// set, checking that readback and upload both use root-texture coordinates.
+
+#define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+#include <allegro5/allegro_display.h>
+#include <allegro5/allegro_color.h>
+#include <allegro5/allegro_bitmap.h>
+#include <cstdio>
+
+static int _failures = 0;
+
+static void _check(bool condition, const char* what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        _failures++;
+    }
+}
+
+static Uint32 _locked_pixel(const ALLEGRO_LOCKED_REGION* region, int x, int y)
+{
+    const Uint8* row = static_cast<const Uint8*>(region->data) + y * region->pitch;
+    return reinterpret_cast<const Uint32*>(row)[x];
+}
+
+int main(void)
+{
+    SDL_SetMainReady();
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
+        return 1;
+    }
+    
+    ALLEGRO_DISPLAY* display = al_create_display(64, 64);
+    if (!display) {
+        fprintf(stderr, "al_create_display: %s\n", SDL_GetError());
+        return 1;
+    }
+    
+    ALLEGRO_BITMAP* parent = al_create_bitmap(32, 32);
+    ALLEGRO_BITMAP* sub = al_create_sub_bitmap(parent, 8, 8, 16, 16);
+    _check(parent && sub, "create bitmaps");
+    if (!parent || !sub) {
+        return 1;
+    }
+    
+    al_set_target_bitmap(parent);
+    al_clear_to_color(al_map_rgb(0, 0, 0));
+    al_put_pixel(12, 10, al_map_rgb(255, 0, 0));
+    
+    /* The sub-bitmap viewport and a clip that excludes every pixel below
+     * are both in force while locking. */
+    al_set_target_bitmap(sub);
+    al_set_clipping_rectangle(0, 0, 2, 2);
+    
+    ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(sub, ALLEGRO_PIXEL_FORMAT_ARGB_8888,
+                                                   ALLEGRO_LOCK_READWRITE);
+    _check(region != nullptr, "lock sub-bitmap");
+    if (region) {
+        _check(_locked_pixel(region, 4, 2) == 0xFFFF0000, "read red pixel at sub (4, 2)");
+        _check(_locked_pixel(region, 0, 0) == 0xFF000000, "read black pixel at sub (0, 0)");
+        Uint8* row = static_cast<Uint8*>(region->data) + 6 * region->pitch;
+        reinterpret_cast<Uint32*>(row)[6] = 0xFF00FF00;
+        al_unlock_bitmap(sub);
+    }
+    
+    region = al_lock_bitmap(parent, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READONLY);
+    _check(region != nullptr, "lock parent");
+    if (region) {
+        _check(_locked_pixel(region, 14, 14) == 0xFF00FF00, "uploaded green pixel at parent (14, 14)");
+        _check(_locked_pixel(region, 12, 10) == 0xFFFF0000, "red pixel kept at parent (12, 10)");
+        _check(_locked_pixel(region, 6, 6) == 0xFF000000, "nothing written at parent (6, 6)");
+        al_unlock_bitmap(parent);
+    }
+    
+    al_destroy_bitmap(sub);
+    al_destroy_bitmap(parent);
+    al_destroy_display(display);
+    SDL_Quit();
+    return _failures ? 1 : 0;
+}